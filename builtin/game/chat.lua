@@ -1043,6 +1043,73 @@ core.register_chatcommand("status", {
 	end,
 })
 
+core.register_chatcommand("profiler_trace", {
+	params = "start | stop | save",
+	description = S("Record the engine profiler scopes of all threads, "
+		.. "or save them as a trace file"),
+	privs = {server=true},
+	func = function(name, param)
+		if param == "start" then
+			core.set_profiler_trace(true)
+			return true, S("Profiler trace started.")
+		elseif param == "stop" then
+			core.set_profiler_trace(false)
+			return true, S("Profiler trace stopped.")
+		elseif param == "save" then
+			local path = core.save_profiler_trace()
+			if not path then
+				return false, S("Failed to save the profiler trace.")
+			end
+			core.log("action", name .. " saved the profiler trace to " .. path)
+			return true, S("Profiler trace saved to @1", path)
+		end
+		return false, S("Invalid parameters (see /help profiler_trace).")
+	end,
+})
+
+local callback_stats_base = {}
+local callback_stats_since = core.get_us_time()
+
+core.register_chatcommand("callback_stats", {
+	params = S("[reset | <filter>]"),
+	description = S("Show the time spent in Lua callbacks by mod and "
+		.. "callback type, or reset it"),
+	privs = {server=true},
+	func = function(name, param)
+		local key = function(e) return e.mod .. " " .. e.callback end
+		if param == "reset" then
+			callback_stats_base = {}
+			for _, e in ipairs(core.get_callback_stats()) do
+				callback_stats_base[key(e)] = e
+			end
+			callback_stats_since = core.get_us_time()
+			return true, S("Callback statistics reset.")
+		end
+
+		local elapsed_us = math.max(core.get_us_time() - callback_stats_since, 1)
+		local list = {}
+		for _, e in ipairs(core.get_callback_stats()) do
+			local base = callback_stats_base[key(e)]
+			local calls = e.calls - (base and base.calls or 0)
+			local time_us = e.time_us - (base and base.time_us or 0)
+			if time_us > 0 and (param == "" or key(e):find(param, 1, true)) then
+				list[#list + 1] = {name = key(e), calls = calls, time_us = time_us}
+			end
+		end
+		table.sort(list, function(a, b) return a.time_us > b.time_us end)
+
+		local lines = {S("Time in Lua callbacks during the last @1 s:",
+			string.format("%.1f", elapsed_us / 1e6))}
+		for i = 1, math.min(#list, 20) do
+			local e = list[i]
+			lines[#lines + 1] = string.format("%-40s %9.1f ms %5.1f%% %8d calls %9.1f us/call",
+				e.name, e.time_us / 1e3, e.time_us / elapsed_us * 100, e.calls,
+				e.calls > 0 and e.time_us / e.calls or 0)
+		end
+		return true, table.concat(lines, "\n")
+	end,
+})
+
 local function get_time(timeofday)
 	local time = math.floor(timeofday * 1440)
 	local minute = time % 60
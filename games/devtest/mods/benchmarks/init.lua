@@ -114,4 +114,69 @@ minetest.register_chatcommand("bench_bulk_set_node", {
 	end,
 })
 
+minetest.register_chatcommand("bench_vmanip_buffer", {
+	params = "",
+	description = "Benchmark: Replace nodes in a VoxelManip with get_data/set_data and get_buffer",
+	func = function(name, param)
+		local player = minetest.get_player_by_name(name)
+		if not player then
+			return false, "No player."
+		end
+		local ppos = vector.round(player:get_pos())
+		local vm = minetest.get_voxel_manip(ppos:subtract(40), ppos:add(40))
+		local c_air = minetest.get_content_id("air")
+		local c_stone = minetest.get_content_id("mapgen_stone")
+
+		-- Swaps air and stone, so that every run changes the same nodes
+		local function swap_data()
+			local data = vm:get_data()
+			for i = 1, #data do
+				if data[i] == c_air then
+					data[i] = c_stone
+				elseif data[i] == c_stone then
+					data[i] = c_air
+				end
+			end
+			vm:set_data(data)
+		end
+		local function swap_buffer()
+			local buf = vm:get_buffer()
+			for i = 1, #buf do
+				local c = buf[i]
+				if c == c_air then
+					buf[i] = c_stone
+				elseif c == c_stone then
+					buf[i] = c_air
+				end
+			end
+		end
 
+		minetest.chat_send_player(name, "Benchmarking VoxelManip:get_buffer. Warming up ...")
+
+		swap_data()
+		swap_buffer()
+
+		minetest.chat_send_player(name, "Warming up finished, now benchmarking ...")
+
+		-- The VoxelManip is never written to the map
+		local start_time = minetest.get_us_time()
+		swap_data()
+		local middle_time = minetest.get_us_time()
+		swap_buffer()
+		local buffer_time = minetest.get_us_time()
+		-- The same swap, with unknown as temporary value
+		local buf = vm:get_buffer()
+		buf:replace(c_air, minetest.CONTENT_UNKNOWN)
+		buf:replace(c_stone, c_air)
+		buf:replace(minetest.CONTENT_UNKNOWN, c_stone)
+		local end_time = minetest.get_us_time()
+		local msg = string.format("Benchmark results (%d nodes): get_data/set_data loop: %.2f ms; " ..
+			"get_buffer loop: %.2f ms; get_buffer replace: %.2f ms",
+			#buf,
+			((middle_time - start_time)) / 1000,
+			((buffer_time - middle_time)) / 1000,
+			((end_time - buffer_time)) / 1000
+		)
+		return true, msg
+	end,
+})
@@ -166,3 +166,33 @@ local function test_userdata_passing2(cb, _, pos)
 	end, vm, pos)
 end
 unittests.register("test_userdata_passing2", test_userdata_passing2, {map=true, async=true})
+
+local function test_map_snapshot(cb, _, pos)
+	local snap = core.get_map_snapshot(pos, pos)
+	local expect = core.get_node(pos)
+	assert(deepequal(snap:get_node(pos), expect))
+	-- the snapshot is not affected by later changes to the map
+	core.swap_node(pos, {name = expect.name == "air" and "basenodes:stone" or "air"})
+	assert(deepequal(snap:get_node(pos), expect))
+	core.swap_node(pos, expect)
+
+	local emin, emax = snap:get_emerged_area()
+	local far = vector.add(emax, 1)
+	assert(snap:get_node_or_nil(far) == nil)
+	assert(snap:get_node(far).name == "ignore")
+
+	core.handle_async(function(snap_, pos_, emin_, emax_)
+		local area = VoxelArea(emin_, emax_)
+		local data = snap_:get_data()
+		return snap_:get_node(pos_), data[area:indexp(pos_)]
+	end, function(node, cid)
+		if not deepequal(expect, node) then
+			return cb("Node data mismatch")
+		end
+		if cid ~= core.get_content_id(expect.name) then
+			return cb("Content id mismatch")
+		end
+		cb()
+	end, snap, pos, emin, emax)
+end
+unittests.register("test_map_snapshot", test_map_snapshot, {map=true, async=true})
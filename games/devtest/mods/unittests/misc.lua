@@ -177,3 +177,71 @@ local function test_on_mapblocks_changed(cb, player, pos)
 	end
 end
 unittests.register("test_on_mapblocks_changed", test_on_mapblocks_changed, {map=true, async=true})
+
+local function test_vmanip_buffer(_, pos)
+	local vm = minetest.get_voxel_manip(pos, pos)
+	local emin, emax = vm:get_emerged_area()
+	local area = VoxelArea(emin, emax)
+
+	local buf = vm:get_buffer()
+	local data = vm:get_data()
+	assert(#buf == #data)
+	local i = area:indexp(pos)
+	assert(buf[i] == data[i])
+
+	local c_air = minetest.CONTENT_AIR
+	buf:fill(c_air)
+	assert(buf:replace(c_air, c_air + 1, pos, pos) == 1)
+	assert(vm:get_data()[i] == c_air + 1)
+	buf[i] = c_air
+	assert(buf:get(i) == c_air)
+
+	local param2 = vm:get_buffer("param2")
+	param2:set(i, 255)
+	assert(vm:get_param2_data()[i] == 255)
+	assert(not pcall(param2.set, param2, i, 256))
+	assert(not pcall(function() return buf[0] end))
+end
+unittests.register("test_vmanip_buffer", test_vmanip_buffer, {map=true})
+
+local function test_find_nodes_in_area_packed(_, pos)
+	local minp, maxp = pos:offset(-2, -2, -2), pos:offset(2, 2, 2)
+	local names = {"air", "ignore", "group:dig_immediate"}
+	local list, counts = minetest.find_nodes_in_area(minp, maxp, names)
+	local hashes, packed_counts = minetest.find_nodes_in_area(minp, maxp, names, false, true)
+	assert(#list == #hashes)
+	for i, p in ipairs(list) do
+		assert(minetest.hash_node_position(p) == hashes[i])
+	end
+	for name, count in pairs(counts) do
+		assert(packed_counts[name] == count)
+	end
+
+	local grouped = minetest.find_nodes_in_area(minp, maxp, names, true, true)
+	for name, group in pairs(grouped) do
+		assert(#group == counts[name])
+		local p = minetest.get_position_from_hash(group[1])
+		assert(minetest.get_node(p).name == name)
+	end
+end
+unittests.register("test_find_nodes_in_area_packed", test_find_nodes_in_area_packed, {map=true})
+
+local callback_stats_steps = 0
+minetest.register_globalstep(function()
+	callback_stats_steps = callback_stats_steps + 1
+end)
+
+local function test_callback_stats()
+	assert(callback_stats_steps > 0)
+	local found = false
+	for _, e in ipairs(minetest.get_callback_stats()) do
+		assert(type(e.mod) == "string" and type(e.callback) == "string")
+		assert(e.calls >= 0 and e.time_us >= 0)
+		if e.mod == "unittests" and e.callback == "environment_Step" then
+			assert(e.calls >= callback_stats_steps)
+			found = true
+		end
+	end
+	assert(found)
+end
+unittests.register("test_callback_stats", test_callback_stats, {map=true})
@@ -19,12 +19,129 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #pragma once
 
-#include <map>
+#include <cassert>
+#include <functional>
+#include <vector>
 #include "irrlichttypes.h"
 
 class TestClientActiveObjectMgr;
 class TestServerActiveObjectMgr;
 
+/*
+	Storage for active objects, indexed by their id.
+
+	Lookup goes through a flat array of slots, iteration walks a packed array
+	holding the objects in the order they were added. Iteration order is thus
+	deterministic and objects may be added or removed while iterating (#10985):
+	added objects are visited in the same pass, removed ones are skipped.
+	Removing leaves a hole in the packed array, which is closed once no
+	iteration is running anymore.
+*/
+template <typename T>
+class ActiveObjectList
+{
+public:
+	T *get(u16 id) const
+	{
+		return id < m_slots.size() ? m_slots[id].obj : nullptr;
+	}
+
+	// Pre-condition: the id of obj is not 0 and not used yet
+	void add(T *obj)
+	{
+		u16 id = obj->getId();
+		assert(id != 0 && !get(id));
+		if (id >= m_slots.size())
+			m_slots.resize((size_t)id + 1);
+		m_slots[id] = Slot{obj, (u32)m_packed.size()};
+		m_packed.push_back(obj);
+		m_count++;
+	}
+
+	// Returns the removed object, or nullptr if there was none
+	T *remove(u16 id)
+	{
+		T *obj = get(id);
+		if (!obj)
+			return nullptr;
+		m_packed[m_slots[id].index] = nullptr;
+		m_slots[id].obj = nullptr;
+		m_count--;
+		m_holes++;
+		compact();
+		return obj;
+	}
+
+	void clear()
+	{
+		assert(m_iterating == 0);
+		m_slots.clear();
+		m_packed.clear();
+		m_count = 0;
+		m_holes = 0;
+	}
+
+	size_t size() const { return m_count; }
+
+	// Relative position of the object in iteration order.
+	// Only comparable between calls that do not remove objects.
+	u32 getOrder(u16 id) const
+	{
+		assert(get(id));
+		return m_slots[id].index;
+	}
+
+	// Calls f(T *) for every object
+	template <typename F>
+	void forEach(F &&f)
+	{
+		IterationGuard guard(this);
+		// The array may grow while iterating
+		for (size_t i = 0; i < m_packed.size(); i++) {
+			if (T *obj = m_packed[i])
+				f(obj);
+		}
+	}
+
+private:
+	struct Slot {
+		T *obj = nullptr;
+		u32 index = 0; // into m_packed
+	};
+
+	struct IterationGuard {
+		IterationGuard(ActiveObjectList *list) : list(list) { list->m_iterating++; }
+		~IterationGuard()
+		{
+			list->m_iterating--;
+			list->compact();
+		}
+		ActiveObjectList *list;
+	};
+
+	// Closes the holes once they make up a significant part of the array
+	void compact()
+	{
+		if (m_iterating > 0 || m_holes < 16 || m_holes * 2 < m_packed.size())
+			return;
+		size_t n = 0;
+		for (T *obj : m_packed) {
+			if (!obj)
+				continue;
+			m_slots[obj->getId()].index = n;
+			m_packed[n++] = obj;
+		}
+		m_packed.resize(n);
+		m_holes = 0;
+	}
+
+	std::vector<Slot> m_slots;
+	std::vector<T *> m_packed;
+	size_t m_count = 0;
+	size_t m_holes = 0;
+	u32 m_iterating = 0;
+};
+
 template <typename T>
 class ActiveObjectMgr
 {
@@ -38,8 +155,7 @@ class ActiveObjectMgr
 
 	T *getActiveObject(u16 id)
 	{
-		auto n = m_active_objects.find(id);
-		return (n != m_active_objects.end() ? n->second : nullptr);
+		return m_active_objects.get(id);
 	}
 
 protected:
@@ -58,8 +174,8 @@ class ActiveObjectMgr
 
 	bool isFreeId(u16 id) const
 	{
-		return id != 0 && m_active_objects.find(id) == m_active_objects.end();
+		return id != 0 && !m_active_objects.get(id);
 	}
 
-	std::map<u16, T *> m_active_objects; // ordered to fix #10985 
+	ActiveObjectList<T> m_active_objects;
 };
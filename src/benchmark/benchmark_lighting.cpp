@@ -18,9 +18,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "benchmark_setup.h"
+#include <cmath>
 #include "voxelalgorithms.h"
 #include "dummygamedef.h"
 #include "dummymap.h"
+#include "noise.h"
 
 TEST_CASE("benchmark_lighting")
 {
@@ -84,3 +86,70 @@ TEST_CASE("benchmark_lighting")
 		});
 	};
 }
+
+TEST_CASE("benchmark_lighting_mapchunk")
+{
+	DummyGameDef gamedef;
+	NodeDefManager *ndef = gamedef.getWritableNodeDefManager();
+
+	content_t content_stone;
+	{
+		ContentFeatures f;
+		f.name = "stone";
+		content_stone = ndef->set(f.name, f);
+	}
+
+	content_t content_light;
+	{
+		ContentFeatures f;
+		f.name = "light";
+		f.param_type = CPT_LIGHT;
+		f.light_propagates = true;
+		f.light_source = 14;
+		content_light = ndef->set(f.name, f);
+	}
+
+	// A mapchunk with one block of neighbors on each side, like after mapgen
+	v3s16 bpmin(-3, -3, -3), bpmax(3, 3, 3);
+	DummyMap map(&gamedef, bpmin, bpmax);
+	MMVManip vm(&map);
+	vm.initialEmerge(bpmin + 1, bpmax - 1, false);
+
+	// Hilly terrain with caves and some lights in them
+	PseudoRandom pr(1234);
+	const VoxelArea &area = vm.m_area;
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++) {
+		s16 surface = 8 * std::sin(x * 0.1f) + 8 * std::cos(z * 0.13f);
+		for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++) {
+			bool cave = std::abs(y + 20 + 6 * std::sin(x * 0.2f + z * 0.05f)) < 3;
+			content_t c = y > surface || cave ? CONTENT_AIR : content_stone;
+			if (cave && pr.range(0, 200) == 0)
+				c = content_light;
+			vm.m_data[area.index(x, y, z)] = MapNode(c);
+		}
+	}
+	{
+		std::map<v3s16, MapBlock*> modified_blocks;
+		voxalgo::blit_back_with_light(&map, &vm, &modified_blocks);
+	}
+
+	BENCHMARK_ADVANCED("voxalgo::blit_back_with_light_80x80x80")(Catch::Benchmark::Chronometer meter) {
+		std::map<v3s16, MapBlock*> modified_blocks;
+		meter.measure([&] {
+			voxalgo::blit_back_with_light(&map, &vm, &modified_blocks);
+		});
+	};
+
+	BENCHMARK_ADVANCED("voxalgo::repair_block_light_125")(Catch::Benchmark::Chronometer meter) {
+		std::map<v3s16, MapBlock*> modified_blocks;
+		meter.measure([&] {
+			v3s16 bp;
+			for (bp.Z = bpmin.Z + 1; bp.Z < bpmax.Z; bp.Z++)
+			for (bp.Y = bpmin.Y + 1; bp.Y < bpmax.Y; bp.Y++)
+			for (bp.X = bpmin.X + 1; bp.X < bpmax.X; bp.X++)
+				voxalgo::repair_block_light(&map, map.getBlockNoCreateNoEx(bp),
+					&modified_blocks);
+		});
+	};
+}
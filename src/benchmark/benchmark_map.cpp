@@ -0,0 +1,66 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "benchmark_setup.h"
+#include "dummygamedef.h"
+#include "dummymap.h"
+#include "noise.h"
+
+TEST_CASE("benchmark_map")
+{
+	DummyGameDef gamedef;
+
+	// About what a player has loaded around them
+	v3s16 bpmin(-8, -2, -8), bpmax(7, 1, 7);
+	DummyMap map(&gamedef, bpmin, bpmax);
+	v3s16 pmin = bpmin * MAP_BLOCKSIZE;
+	v3s16 pmax = bpmax * MAP_BLOCKSIZE + MAP_BLOCKSIZE - 1;
+
+	std::vector<v3s16> random_pos(4096);
+	PseudoRandom pr(1234);
+	for (v3s16 &p : random_pos) {
+		p = v3s16(pr.range(pmin.X, pmax.X), pr.range(pmin.Y, pmax.Y),
+			pr.range(pmin.Z, pmax.Z));
+	}
+
+	BENCHMARK("getNode_random_4096") {
+		u32 sum = 0;
+		for (v3s16 p : random_pos)
+			sum += map.getNode(p).getContent();
+		return sum;
+	};
+
+	// Like most code that reads an area of the map node by node
+	BENCHMARK("getNode_coherent_32x32x32") {
+		u32 sum = 0;
+		v3s16 p;
+		for (p.Z = -16; p.Z < 16; p.Z++)
+		for (p.Y = -16; p.Y < 16; p.Y++)
+		for (p.X = -16; p.X < 16; p.X++)
+			sum += map.getNode(p).getContent();
+		return sum;
+	};
+
+	BENCHMARK("getBlockNoCreateNoEx_missing_4096") {
+		u32 found = 0;
+		for (v3s16 p : random_pos)
+			found += map.getBlockNoCreateNoEx(getNodeBlockPos(p) + v3s16(0, 100, 0)) != nullptr;
+		return found;
+	};
+}
@@ -0,0 +1,92 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "benchmark_setup.h"
+#include "database/database-regions.h"
+#include "database/database-sqlite3.h"
+#include "filesys.h"
+#include "util/numeric.h"
+#include <memory>
+#include <vector>
+
+// A cube of 8^3 blocks, i.e. what a player loads around themselves
+static const s16 cube_size = 8;
+// Roughly the size of a compressed block with some terrain in it
+static const size_t block_size = 2000;
+
+static std::vector<v3s16> get_positions()
+{
+	std::vector<v3s16> positions;
+	for (s16 z = 0; z < cube_size; z++)
+	for (s16 y = 0; y < cube_size; y++)
+	for (s16 x = 0; x < cube_size; x++)
+		positions.emplace_back(x - cube_size / 2, y, z);
+	return positions;
+}
+
+static void benchmark_database(const std::string &name, MapDatabase *db)
+{
+	const std::vector<v3s16> positions = get_positions();
+	std::string data(block_size, '\0');
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = myrand_range(0, 255);
+
+	BENCHMARK(name + "_save_512_blocks") {
+		db->beginSave();
+		for (v3s16 pos : positions)
+			db->saveBlock(pos, data);
+		db->endSave();
+	};
+
+	BENCHMARK(name + "_load_512_blocks") {
+		std::string block;
+		size_t total = 0;
+		for (v3s16 pos : positions) {
+			db->loadBlock(pos, &block);
+			total += block.size();
+		}
+		return total;
+	};
+
+	BENCHMARK(name + "_load_512_blocks_batched") {
+		std::vector<std::string> blocks;
+		db->loadBlocks(positions, &blocks);
+		return blocks.size();
+	};
+}
+
+TEST_CASE("benchmark_mapdatabase")
+{
+	const std::string dir = fs::TempPath() + DIR_DELIM "benchmark_mapdatabase";
+	fs::RecursiveDelete(dir);
+	fs::CreateAllDirs(dir);
+
+	{
+		auto db = std::make_unique<MapDatabaseSQLite3>(dir);
+		benchmark_database("sqlite3", db.get());
+	}
+#ifndef _WIN32
+	{
+		auto db = std::make_unique<MapDatabaseRegions>(dir);
+		benchmark_database("regions", db.get());
+	}
+#endif
+
+	fs::RecursiveDelete(dir);
+}
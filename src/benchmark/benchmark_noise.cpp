@@ -0,0 +1,55 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "benchmark_setup.h"
+#include "noise.h"
+
+static const char *simd_level_names[] = { "scalar", "sse2", "avx2" };
+
+// Default mapgen v7 parameters and sizes for a 80^3 chunk
+static const NoiseParams np_terrain_base(4, 70, v3f(600, 600, 600), 82341, 5, 0.6, 2.0);
+static const NoiseParams np_mountain(-0.6, 1, v3f(250, 350, 250), 5333, 5, 0.63, 2.0);
+static const NoiseParams np_ridge(0, 1, v3f(100, 100, 100), 6467, 4, 0.75, 2.0);
+
+TEST_CASE("benchmark_noise")
+{
+	Noise noise_terrain(&np_terrain_base, 0, 80, 80);
+	Noise noise_mountain(&np_mountain, 0, 80, 82, 80);
+	Noise noise_ridge(&np_ridge, 0, 80, 82, 80);
+
+	NoiseSimdLevel old_level = noise_simd_get();
+	NoiseSimdLevel supported = noise_simd_supported();
+	for (int i = NOISE_SIMD_NONE; i <= supported; i++) {
+		noise_simd_set((NoiseSimdLevel)i);
+		const std::string name = simd_level_names[i];
+
+		BENCHMARK("perlinMap2D_80x80_" + name) {
+			return noise_terrain.perlinMap2D(-80, 160)[0];
+		};
+
+		BENCHMARK("perlinMap3D_80x82x80_" + name) {
+			return noise_mountain.perlinMap3D(-80, -33, 160)[0];
+		};
+
+		BENCHMARK("perlinMap3D_ridge_80x82x80_" + name) {
+			return noise_ridge.perlinMap3D(-80, -33, 160)[0];
+		};
+	}
+	noise_simd_set(old_level);
+}
@@ -0,0 +1,67 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "benchmark_setup.h"
+#include "network/socket.h"
+#include <vector>
+
+// Each run sends this many datagrams over loopback and receives them again,
+// so packets per second = packet_count / measured time
+static const int packet_count = UDPSocket::MAX_BATCH_SIZE;
+static const int packet_size = 64;
+static const u16 port = 30004;
+
+TEST_CASE("benchmark_socket")
+{
+	UDPSocket socket(false);
+	socket.Bind(Address(0, 0, 0, 0, port));
+	socket.setTimeoutMs(100);
+
+	const Address destination(127, 0, 0, 1, port);
+	std::vector<u8> data(packet_size, 0x42);
+
+	BENCHMARK("loopback_64_packets_single") {
+		for (int i = 0; i < packet_count; i++)
+			socket.Send(destination, data.data(), packet_size);
+
+		u8 buffer[1500];
+		Address sender;
+		int received = 0;
+		while (received < packet_count &&
+				socket.Receive(sender, buffer, sizeof(buffer)) >= 0)
+			received++;
+		return received;
+	};
+
+	BENCHMARK("loopback_64_packets_batched") {
+		for (int i = 0; i < packet_count; i++)
+			socket.QueueSend(destination, data.data(), packet_size);
+		socket.FlushSend();
+
+		UDPSocket::ReceivedPacket packets[UDPSocket::MAX_BATCH_SIZE];
+		int received = 0;
+		while (received < packet_count) {
+			int count = socket.ReceiveBatch(packets, UDPSocket::MAX_BATCH_SIZE, 1500);
+			if (count == 0)
+				break;
+			received += count;
+		}
+		return received;
+	};
+}
@@ -28,11 +28,12 @@ namespace client
 void ActiveObjectMgr::clear()
 {
 	// delete active objects
-	for (auto &active_object : m_active_objects) {
-		delete active_object.second;
+	m_active_objects.forEach([&] (ClientActiveObject *obj) {
+		u16 id = obj->getId();
+		delete obj;
 		// Object must be marked as gone when children try to detach
-		active_object.second = nullptr;
-	}
+		m_active_objects.remove(id);
+	});
 	m_active_objects.clear();
 }
 
@@ -40,9 +41,7 @@ void ActiveObjectMgr::step(
 		float dtime, const std::function<void(ClientActiveObject *)> &f)
 {
 	g_profiler->avg("ActiveObjectMgr: CAO count [#]", m_active_objects.size());
-	for (auto &ao_it : m_active_objects) {
-		f(ao_it.second);
-	}
+	m_active_objects.forEach(f);
 }
 
 // clang-format off
@@ -69,7 +68,7 @@ bool ActiveObjectMgr::registerObject(ClientActiveObject *obj)
 	}
 	infostream << "Client::ActiveObjectMgr::registerObject(): "
 			<< "added (id=" << obj->getId() << ")" << std::endl;
-	m_active_objects[obj->getId()] = obj;
+	m_active_objects.add(obj);
 	return true;
 }
 
@@ -84,7 +83,7 @@ void ActiveObjectMgr::removeObject(u16 id)
 		return;
 	}
 
-	m_active_objects.erase(id);
+	m_active_objects.remove(id);
 
 	obj->removeFromScene(true);
 	delete obj;
@@ -95,16 +94,14 @@ void ActiveObjectMgr::getActiveObjects(const v3f &origin, f32 max_d,
 		std::vector<DistanceSortedActiveObject> &dest)
 {
 	f32 max_d2 = max_d * max_d;
-	for (auto &ao_it : m_active_objects) {
-		ClientActiveObject *obj = ao_it.second;
-
+	m_active_objects.forEach([&] (ClientActiveObject *obj) {
 		f32 d2 = (obj->getPosition() - origin).getLengthSQ();
 
 		if (d2 > max_d2)
-			continue;
+			return;
 
 		dest.emplace_back(obj, d2);
-	}
+	});
 }
 
 std::vector<DistanceSortedActiveObject> ActiveObjectMgr::getActiveSelectableObjects(const core::line3d<f32> &shootline)
@@ -113,12 +110,10 @@ std::vector<DistanceSortedActiveObject> ActiveObjectMgr::getActiveSelectableObje
 	f32 max_d = shootline.getLength();
 	v3f dir = shootline.getVector().normalize();
 
-	for (auto &ao_it : m_active_objects) {
-		ClientActiveObject *obj = ao_it.second;
-
+	m_active_objects.forEach([&] (ClientActiveObject *obj) {
 		aabb3f selection_box;
 		if (!obj->getSelectionBox(&selection_box))
-			continue;
+			return;
 
 		v3f obj_center = obj->getPosition() + selection_box.getCenter();
 		f32 obj_radius_sq = selection_box.getExtent().getLengthSQ() / 4;
@@ -128,15 +123,15 @@ std::vector<DistanceSortedActiveObject> ActiveObjectMgr::getActiveSelectableObje
 		f32 b_sq = c.getLengthSQ() - a * a;  // distance from shootline to obj_center, squared
 
 		if (b_sq > obj_radius_sq)
-			continue;
+			return;
 
 		// backward- and far-plane
 		f32 obj_radius = std::sqrt(obj_radius_sq);
 		if (a < -obj_radius || a > max_d + obj_radius)
-			continue;
+			return;
 
 		dest.emplace_back(obj, a);
-	}
+	});
 	return dest;
 }
 
@@ -18,9 +18,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "mesh_generator_thread.h"
+#include <algorithm>
 #include "settings.h"
 #include "profiler.h"
 #include "client.h"
+#include "camera.h"
 #include "mapblock.h"
 #include "map.h"
 #include "util/directiontables.h"
@@ -61,7 +63,8 @@ MeshUpdateQueue::~MeshUpdateQueue()
 {
 	MutexAutoLock lock(m_mutex);
 
-	for (QueuedMeshUpdate *q : m_queue) {
+	for (auto &it : m_queue) {
+		QueuedMeshUpdate *q = it.second;
 		for (auto block : q->map_blocks)
 			if (block)
 				block->refDrop();
@@ -69,31 +72,43 @@ MeshUpdateQueue::~MeshUpdateQueue()
 	}
 }
 
+u32 MeshUpdateQueue::getBucket(v3s16 mesh_position, bool urgent)
+{
+	if (urgent)
+		return 0;
+
+	Camera *camera = m_client->getCamera();
+	if (!camera)
+		return BUCKET_COUNT / 2;
+
+	v3s16 camera_block = getNodeBlockPos(floatToInt(camera->getPosition(), BS));
+	v3s16 d = mesh_position - camera_block;
+	u32 distance = std::max({std::abs(d.X), std::abs(d.Y), std::abs(d.Z)});
+	return 1 + std::min(distance / BUCKET_WIDTH, BUCKET_COUNT - 2);
+}
+
 bool MeshUpdateQueue::addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool urgent)
 {
 	MapBlock *main_block = map->getBlockNoCreateNoEx(p);
 	if (!main_block)
 		return false;
 
-	MutexAutoLock lock(m_mutex);
-
 	MeshGrid mesh_grid = m_client->getMeshGrid();
 
 	// Mesh is placed at the corner block of a chunk
 	// (where all coordinate are divisible by the chunk size)
 	v3s16 mesh_position(mesh_grid.getMeshPos(p));
-	/*
-		Mark the block as urgent if requested
-	*/
-	if (urgent)
-		m_urgents.insert(mesh_position);
+	u32 bucket = getBucket(mesh_position, urgent);
 
 	/*
 		Find if block is already in queue.
 		If it is, update the data and quit.
 	*/
-	for (QueuedMeshUpdate *q : m_queue) {
-		if (q->p == mesh_position) {
+	{
+		MutexAutoLock lock(m_mutex);
+		auto it = m_queue.find(mesh_position);
+		if (it != m_queue.end()) {
+			QueuedMeshUpdate *q = it->second;
 			// NOTE: We are not adding a new position to the queue, thus
 			//       refcount_from_queue stays the same.
 			if(ack_block_to_server)
@@ -101,6 +116,11 @@ bool MeshUpdateQueue::addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool
 			q->crack_level = m_client->getCrackLevel();
 			q->crack_pos = m_client->getCrackPos();
 			q->urgent |= urgent;
+			// Move it up if it became urgent
+			if (urgent && q->bucket != 0) {
+				m_buckets[0].splice(m_buckets[0].end(), m_buckets[q->bucket], q->bucket_pos);
+				q->bucket = 0;
+			}
 			v3s16 pos;
 			int i = 0;
 			for (pos.X = q->p.X - 1; pos.X <= q->p.X + mesh_grid.cell_size; pos.X++)
@@ -121,6 +141,7 @@ bool MeshUpdateQueue::addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool
 
 	/*
 		Make a list of blocks necessary for mesh generation and lock the blocks in memory.
+		Only this thread adds to the queue, so this can be done without the lock.
 	*/
 	std::vector<MapBlock *> map_blocks;
 	map_blocks.reserve((mesh_grid.cell_size+2)*(mesh_grid.cell_size+2)*(mesh_grid.cell_size+2));
@@ -145,7 +166,11 @@ bool MeshUpdateQueue::addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool
 	q->crack_pos = m_client->getCrackPos();
 	q->urgent = urgent;
 	q->map_blocks = std::move(map_blocks);
-	m_queue.push_back(q);
+	q->bucket = bucket;
+
+	MutexAutoLock lock(m_mutex);
+	m_queue[mesh_position] = q;
+	q->bucket_pos = m_buckets[bucket].insert(m_buckets[bucket].end(), q);
 
 	return true;
 }
@@ -158,20 +183,23 @@ QueuedMeshUpdate *MeshUpdateQueue::pop()
 	{
 		MutexAutoLock lock(m_mutex);
 
-		bool must_be_urgent = !m_urgents.empty();
-		for (std::vector<QueuedMeshUpdate*>::iterator i = m_queue.begin();
-				i != m_queue.end(); ++i) {
-			QueuedMeshUpdate *q = *i;
-			if (must_be_urgent && m_urgents.count(q->p) == 0)
-				continue;
-			// Make sure no two threads are processing the same mapblock, as that causes racing conditions
-			if (m_inflight_blocks.find(q->p) != m_inflight_blocks.end())
-				continue;
-			m_queue.erase(i);
-			m_urgents.erase(q->p);
-			m_inflight_blocks.insert(q->p);
-			result = q;
-			break;
+		for (u32 bucket = 0; bucket < BUCKET_COUNT && !result; bucket++) {
+			std::list<QueuedMeshUpdate *> &updates = m_buckets[bucket];
+			// Skips at most one update per mesh that is being generated
+			for (auto i = updates.begin(); i != updates.end(); ++i) {
+				QueuedMeshUpdate *q = *i;
+				// Make sure no two threads are processing the same mapblock, as that causes racing conditions
+				if (m_inflight_blocks.find(q->p) != m_inflight_blocks.end())
+					continue;
+				result = q;
+				updates.erase(i);
+				m_queue.erase(q->p);
+				m_inflight_blocks.insert(result->p);
+				break;
+			}
+			// Only urgent updates may be picked while there are urgent ones
+			if (bucket == 0 && !updates.empty())
+				break;
 		}
 	}
 
@@ -225,7 +253,7 @@ void MeshUpdateWorkerThread::doUpdate()
 	while ((q = m_queue_in->pop())) {
 		if (m_generation_interval)
 			sleep_ms(m_generation_interval);
-		ScopeProfiler sp(g_profiler, "Client: Mesh making (sum)");
+		PROFILER_SCOPE(sp, "Client: Mesh making (sum)", SPT_ADD);
 
 		MapBlockMesh *mesh_new = new MapBlockMesh(q->data, *m_camera_offset);
 
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include <ctime>
+#include <list>
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
@@ -39,6 +40,9 @@ struct QueuedMeshUpdate
 	MeshMakeData *data = nullptr; // This is generated in MeshUpdateQueue::pop()
 	std::vector<MapBlock *> map_blocks;
 	bool urgent = false;
+	// Bucket of the MeshUpdateQueue this is in, and its entry there
+	u32 bucket = 0;
+	std::list<QueuedMeshUpdate *>::iterator bucket_pos;
 
 	QueuedMeshUpdate() = default;
 	~QueuedMeshUpdate();
@@ -46,6 +50,15 @@ struct QueuedMeshUpdate
 
 /*
 	A thread-safe queue of mesh update tasks and a cache of MapBlock data
+
+	Updates are looked up by position in a hash map, so that repeated
+	requests for the same mesh are merged in constant time. The order in
+	which they are handed out is kept in buckets: urgent updates come first,
+	the others are sorted by their distance to the camera when queued.
+	Every queued update is in exactly one bucket list, which it can be
+	removed from or moved out of in constant time.
+	All operations hold the mutex only briefly, which lets many worker
+	threads share the queue.
 */
 class MeshUpdateQueue
 {
@@ -55,6 +68,11 @@ class MeshUpdateQueue
 		SKIP_UPDATE_IF_ALREADY_CACHED,
 	};
 
+	// Bucket 0 is for urgent updates, the others hold updates
+	// BUCKET_WIDTH blocks apart in distance from the camera
+	static constexpr u32 BUCKET_COUNT = 32;
+	static constexpr u32 BUCKET_WIDTH = 2;
+
 public:
 	MeshUpdateQueue(Client *client);
 
@@ -78,9 +96,13 @@ class MeshUpdateQueue
 	}
 
 private:
+	u32 getBucket(v3s16 mesh_position, bool urgent);
+
 	Client *m_client;
-	std::vector<QueuedMeshUpdate *> m_queue;
-	std::unordered_set<v3s16> m_urgents;
+	// Queued updates by mesh position
+	std::unordered_map<v3s16, QueuedMeshUpdate *> m_queue;
+	// Queued updates in the order they are to be processed
+	std::list<QueuedMeshUpdate *> m_buckets[BUCKET_COUNT];
 	std::unordered_set<v3s16> m_inflight_blocks;
 	std::mutex m_mutex;
 
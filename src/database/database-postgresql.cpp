@@ -34,6 +34,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "remoteplayer.h"
 #include "server/player_sao.h"
+#include "util/serialize.h"
 #include <cstdlib>
 
 Database_PostgreSQL::Database_PostgreSQL(const std::string &connect_string,
@@ -196,6 +197,16 @@ void MapDatabasePostgreSQL::initStatements()
 			"WHERE posX = $1::int4 AND posY = $2::int4 AND "
 			"posZ = $3::int4");
 
+	// unnest() with several arguments needs 9.4
+	if (getPGVersion() >= 90400) {
+		prepareStatement("read_blocks",
+			"SELECT q.i, b.data FROM "
+				"unnest($1::int4[], $2::int4[], $3::int4[]) "
+				"WITH ORDINALITY AS q(x, y, z, i) "
+				"JOIN blocks b ON b.posX = q.x AND b.posY = q.y AND "
+				"b.posZ = q.z");
+	}
+
 	if (getPGVersion() < 90500) {
 		prepareStatement("write_block_insert",
 			"INSERT INTO blocks (posX, posY, posZ, data) SELECT "
@@ -279,6 +290,44 @@ void MapDatabasePostgreSQL::loadBlock(const v3s16 &pos, std::string *block)
 	PQclear(results);
 }
 
+void MapDatabasePostgreSQL::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> *blocks)
+{
+	if (getPGVersion() < 90400) {
+		MapDatabase::loadBlocks(positions, blocks);
+		return;
+	}
+
+	verifyDatabase();
+
+	blocks->assign(positions.size(), std::string());
+	if (positions.empty())
+		return;
+
+	// Coordinates are passed as arrays in text format: {1,2,3}
+	std::string xs("{"), ys("{"), zs("{");
+	for (size_t i = 0; i < positions.size(); i++) {
+		const char *sep = i + 1 < positions.size() ? "," : "}";
+		xs.append(itos(positions[i].X)).append(sep);
+		ys.append(itos(positions[i].Y)).append(sep);
+		zs.append(itos(positions[i].Z)).append(sep);
+	}
+
+	const char *args[] = { xs.c_str(), ys.c_str(), zs.c_str() };
+
+	PGresult *results = execPrepared("read_blocks", ARRLEN(args), args, false);
+
+	int numrows = PQntuples(results);
+	for (int row = 0; row < numrows; ++row) {
+		// Binary result: the ordinality is a big-endian int8, starting at 1
+		s64 i = readS64((const u8 *)PQgetvalue(results, row, 0)) - 1;
+		if (i >= 0 && i < (s64)positions.size())
+			(*blocks)[i] = pg_to_string(results, row, 1);
+	}
+
+	PQclear(results);
+}
+
 bool MapDatabasePostgreSQL::deleteBlock(const v3s16 &pos)
 {
 	verifyDatabase();
@@ -0,0 +1,476 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "database-regions.h"
+
+#ifndef _WIN32
+
+#include <bitset>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "exceptions.h"
+#include "filesys.h"
+#include "log.h"
+#include "irrlicht_changes/printing.h"
+#include "util/numeric.h"
+#include "util/serialize.h"
+
+#define REGION_MAGIC "MTRG"
+#define REGION_VERSION 1
+
+static constexpr u32 BLOCKS_PER_REGION = MapDatabaseRegions::REGION_SIZE *
+	MapDatabaseRegions::REGION_SIZE * MapDatabaseRegions::REGION_SIZE;
+// u64 offset, u32 size
+static constexpr u32 INDEX_ENTRY_SIZE = 12;
+// Magic, version, 3 unused bytes, index
+static constexpr u32 HEADER_SIZE = 8 + BLOCKS_PER_REGION * INDEX_ENTRY_SIZE;
+
+// A region is compacted once it contains this much garbage and more garbage
+// than live data
+static constexpr u64 COMPACT_MIN_GARBAGE = 1024 * 1024;
+static constexpr size_t MAX_OPEN_REGIONS = 64;
+
+struct MapDatabaseRegions::Region
+{
+	struct IndexEntry {
+		u64 offset = 0;
+		u32 size = 0; // 0 = block does not exist
+	};
+
+	std::string path;
+	int fd = -1;
+	const u8 *map = nullptr;
+	size_t map_size = 0;
+	u64 file_size = 0;
+	// Bytes in the file not referenced by the index
+	u64 garbage = 0;
+	u64 last_use = 0;
+	IndexEntry index[BLOCKS_PER_REGION];
+	// Entries that differ from the index in the file
+	std::vector<u16> changed_entries;
+	std::bitset<BLOCKS_PER_REGION> changed;
+
+	// Every way out of getRegion() and compact() must release the file
+	~Region() { closeFile(); }
+
+	void setChanged(u16 i)
+	{
+		if (!changed[i]) {
+			changed[i] = true;
+			changed_entries.push_back(i);
+		}
+	}
+
+	void closeFile()
+	{
+		if (map)
+			munmap(const_cast<u8 *>(map), map_size);
+		map = nullptr;
+		map_size = 0;
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+};
+
+static void write_all(int fd, const void *data, size_t size, u64 offset,
+	const std::string &path)
+{
+	const u8 *p = reinterpret_cast<const u8 *>(data);
+	while (size > 0) {
+		ssize_t written = pwrite(fd, p, size, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			throw DatabaseException("Failed to write to region file " + path +
+				": " + strerror(errno));
+		}
+		p += written;
+		size -= written;
+		offset += written;
+	}
+}
+
+static int sync_file(int fd)
+{
+#ifdef __APPLE__
+	return fsync(fd);
+#else
+	return fdatasync(fd);
+#endif
+}
+
+// Makes a rename in the directory durable
+static int sync_dir(const std::string &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+	int ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+static u16 get_region_index(v3s16 pos, v3s16 *region_pos)
+{
+	v3s16 local;
+	getContainerPosWithOffset(pos, MapDatabaseRegions::REGION_SIZE,
+		*region_pos, local);
+	return local.X + MapDatabaseRegions::REGION_SIZE *
+		(local.Y + MapDatabaseRegions::REGION_SIZE * local.Z);
+}
+
+
+MapDatabaseRegions::MapDatabaseRegions(const std::string &savedir):
+	m_dir(savedir + DIR_DELIM + "map_regions")
+{
+	if (!fs::CreateAllDirs(m_dir))
+		throw DatabaseException("Failed to create directory " + m_dir);
+}
+
+MapDatabaseRegions::~MapDatabaseRegions()
+{
+	for (auto &it : m_regions) {
+		try {
+			if (m_dirty_regions.count(it.first) > 0)
+				syncRegion(it.second.get());
+		} catch (DatabaseException &e) {
+			errorstream << "MapDatabaseRegions: " << e.what() << std::endl;
+		}
+	}
+}
+
+std::string MapDatabaseRegions::getRegionPath(v3s16 region_pos) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "r.%d.%d.%d.mtr",
+		region_pos.X, region_pos.Y, region_pos.Z);
+	return m_dir + DIR_DELIM + name;
+}
+
+MapDatabaseRegions::Region *MapDatabaseRegions::getRegion(v3s16 region_pos,
+	bool create)
+{
+	auto it = m_regions.find(region_pos);
+	if (it != m_regions.end()) {
+		it->second->last_use = ++m_use_counter;
+		return it->second.get();
+	}
+
+	const std::string path = getRegionPath(region_pos);
+	int fd = open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0666);
+	if (fd < 0) {
+		if (errno == ENOENT && !create)
+			return nullptr;
+		throw DatabaseException("Failed to open region file " + path +
+			": " + strerror(errno));
+	}
+
+	auto region = std::make_unique<Region>();
+	region->path = path;
+	region->fd = fd;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		throw DatabaseException("Failed to stat region file " + path);
+
+	if (st.st_size == 0) {
+		// New region, write an empty index
+		std::string header(HEADER_SIZE, '\0');
+		memcpy(&header[0], REGION_MAGIC, 4);
+		header[4] = REGION_VERSION;
+		write_all(fd, header.data(), header.size(), 0, path);
+		region->file_size = HEADER_SIZE;
+	} else {
+		region->file_size = st.st_size;
+		if (region->file_size < HEADER_SIZE)
+			throw DatabaseException("Truncated region file " + path);
+		updateMapping(region.get());
+		if (memcmp(region->map, REGION_MAGIC, 4) != 0 ||
+				region->map[4] != REGION_VERSION)
+			throw DatabaseException("Invalid region file " + path);
+
+		u64 live = 0;
+		for (u32 i = 0; i < BLOCKS_PER_REGION; i++) {
+			const u8 *entry = region->map + 8 + i * INDEX_ENTRY_SIZE;
+			Region::IndexEntry &e = region->index[i];
+			e.offset = readU64(entry);
+			e.size = readU32(entry + 8);
+			if (e.size != 0 && (e.offset < HEADER_SIZE ||
+					e.offset + e.size > region->file_size)) {
+				errorstream << "MapDatabaseRegions: Ignoring invalid entry for "
+					<< "block " << (region_pos * REGION_SIZE) << " + " << i
+					<< " in " << path << std::endl;
+				e = Region::IndexEntry();
+			}
+			live += e.size;
+		}
+		region->garbage = region->file_size - HEADER_SIZE - live;
+	}
+
+	// Close the least recently used region if there are too many
+	if (m_regions.size() >= MAX_OPEN_REGIONS) {
+		auto lru = m_regions.begin();
+		for (auto it = m_regions.begin(); it != m_regions.end(); ++it) {
+			if (it->second->last_use < lru->second->last_use)
+				lru = it;
+		}
+		if (m_dirty_regions.count(lru->first) > 0) {
+			syncRegion(lru->second.get());
+			m_dirty_regions.erase(lru->first);
+		}
+		m_regions.erase(lru);
+	}
+
+	region->last_use = ++m_use_counter;
+	Region *ret = region.get();
+	m_regions[region_pos] = std::move(region);
+	return ret;
+}
+
+void MapDatabaseRegions::updateMapping(Region *region)
+{
+	if (region->map_size == region->file_size)
+		return;
+
+	if (region->map)
+		munmap(const_cast<u8 *>(region->map), region->map_size);
+	region->map = nullptr;
+	region->map_size = 0;
+
+	void *map = mmap(nullptr, region->file_size, PROT_READ, MAP_SHARED,
+		region->fd, 0);
+	if (map == MAP_FAILED)
+		throw DatabaseException("Failed to map region file " + region->path +
+			": " + strerror(errno));
+	region->map = reinterpret_cast<const u8 *>(map);
+	region->map_size = region->file_size;
+}
+
+void MapDatabaseRegions::syncRegion(Region *region)
+{
+	// The data must be on disk before any index entry points to it
+	if (sync_file(region->fd) != 0)
+		throw DatabaseException("Failed to sync region file " + region->path +
+			": " + strerror(errno));
+	if (region->changed_entries.empty())
+		return;
+
+	for (u16 index : region->changed_entries) {
+		u8 entry[INDEX_ENTRY_SIZE];
+		writeU64(entry, region->index[index].offset);
+		writeU32(entry + 8, region->index[index].size);
+		write_all(region->fd, entry, sizeof(entry), 8 + index * INDEX_ENTRY_SIZE,
+			region->path);
+	}
+	region->changed_entries.clear();
+	region->changed.reset();
+
+	if (sync_file(region->fd) != 0)
+		throw DatabaseException("Failed to sync region file " + region->path +
+			": " + strerror(errno));
+}
+
+bool MapDatabaseRegions::saveBlock(const v3s16 &pos, const std::string &data)
+{
+	v3s16 region_pos;
+	u16 index = get_region_index(pos, &region_pos);
+
+	// The index entry is written by endSave(), after the data was synced
+	Region *region;
+	try {
+		region = getRegion(region_pos, true);
+		write_all(region->fd, data.data(), data.size(), region->file_size,
+			region->path);
+	} catch (DatabaseException &e) {
+		errorstream << "MapDatabaseRegions: Failed to save block " << pos
+			<< ": " << e.what() << std::endl;
+		return false;
+	}
+
+	Region::IndexEntry &e = region->index[index];
+	region->garbage += e.size;
+	e.offset = region->file_size;
+	e.size = data.size();
+	region->file_size += data.size();
+	region->setChanged(index);
+
+	m_dirty_regions.insert(region_pos);
+	return true;
+}
+
+void MapDatabaseRegions::loadBlock(const v3s16 &pos, std::string *block)
+{
+	v3s16 region_pos;
+	u16 index = get_region_index(pos, &region_pos);
+	Region *region = getRegion(region_pos, false);
+	if (!region) {
+		block->clear();
+		return;
+	}
+
+	const Region::IndexEntry &e = region->index[index];
+	if (e.size == 0) {
+		block->clear();
+		return;
+	}
+
+	if (e.offset + e.size > region->map_size)
+		updateMapping(region);
+	block->assign(reinterpret_cast<const char *>(region->map + e.offset), e.size);
+}
+
+bool MapDatabaseRegions::deleteBlock(const v3s16 &pos)
+{
+	v3s16 region_pos;
+	u16 index = get_region_index(pos, &region_pos);
+	Region *region = getRegion(region_pos, false);
+	if (!region)
+		return true;
+
+	Region::IndexEntry &e = region->index[index];
+	if (e.size == 0)
+		return true;
+
+	region->garbage += e.size;
+	e = Region::IndexEntry();
+	region->setChanged(index);
+
+	m_dirty_regions.insert(region_pos);
+	return true;
+}
+
+void MapDatabaseRegions::listAllLoadableBlocks(std::vector<v3s16> &dst)
+{
+	for (const fs::DirListNode &node : fs::GetDirListing(m_dir)) {
+		if (node.dir)
+			continue;
+
+		int x, y, z;
+		char end;
+		if (sscanf(node.name.c_str(), "r.%d.%d.%d.mt%c", &x, &y, &z, &end) != 4 ||
+				end != 'r')
+			continue;
+		v3s16 region_pos(x, y, z);
+		// Reject names that don't round-trip, e.g. "r.1.2.3.mtr.tmp"
+		if (getRegionPath(region_pos) != m_dir + DIR_DELIM + node.name)
+			continue;
+
+		Region *region = getRegion(region_pos, false);
+		if (!region)
+			continue;
+		for (u32 i = 0; i < BLOCKS_PER_REGION; i++) {
+			if (region->index[i].size == 0)
+				continue;
+			v3s16 local(i % REGION_SIZE, (i / REGION_SIZE) % REGION_SIZE,
+				i / (REGION_SIZE * REGION_SIZE));
+			dst.push_back(region_pos * REGION_SIZE + local);
+		}
+	}
+}
+
+void MapDatabaseRegions::endSave()
+{
+	for (auto it = m_dirty_regions.begin(); it != m_dirty_regions.end();) {
+		auto region_it = m_regions.find(*it);
+		if (region_it != m_regions.end()) {
+			Region *region = region_it->second.get();
+			syncRegion(region);
+
+			u64 live = region->file_size - HEADER_SIZE - region->garbage;
+			if (region->garbage >= COMPACT_MIN_GARBAGE && region->garbage > live)
+				compact(region);
+		}
+		it = m_dirty_regions.erase(it);
+	}
+}
+
+void MapDatabaseRegions::compact(Region *region)
+{
+	const std::string &path = region->path;
+	const std::string tmp_path = path + ".tmp";
+
+	int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		errorstream << "MapDatabaseRegions: Failed to create " << tmp_path
+			<< ": " << strerror(errno) << std::endl;
+		return;
+	}
+
+	updateMapping(region);
+
+	// Blocks are written in index order, so neighbours end up next to
+	// each other in the file
+	Region::IndexEntry new_index[BLOCKS_PER_REGION];
+	std::string header(HEADER_SIZE, '\0');
+	memcpy(&header[0], REGION_MAGIC, 4);
+	header[4] = REGION_VERSION;
+	u64 offset = HEADER_SIZE;
+	try {
+		for (u32 i = 0; i < BLOCKS_PER_REGION; i++) {
+			const Region::IndexEntry &e = region->index[i];
+			if (e.size == 0)
+				continue;
+			write_all(fd, region->map + e.offset, e.size, offset, tmp_path);
+			new_index[i].offset = offset;
+			new_index[i].size = e.size;
+			offset += e.size;
+
+			u8 *entry = reinterpret_cast<u8 *>(&header[8 + i * INDEX_ENTRY_SIZE]);
+			writeU64(entry, new_index[i].offset);
+			writeU32(entry + 8, new_index[i].size);
+		}
+		write_all(fd, header.data(), header.size(), 0, tmp_path);
+	} catch (DatabaseException &e) {
+		errorstream << "MapDatabaseRegions: Failed to compact " << path
+			<< ": " << e.what() << std::endl;
+		close(fd);
+		unlink(tmp_path.c_str());
+		return;
+	}
+
+	if (sync_file(fd) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		errorstream << "MapDatabaseRegions: Failed to replace " << path
+			<< ": " << strerror(errno) << std::endl;
+		close(fd);
+		unlink(tmp_path.c_str());
+		return;
+	}
+	// Otherwise a crash could bring back the old file, or lose both
+	if (sync_dir(m_dir) != 0) {
+		errorstream << "MapDatabaseRegions: Failed to sync " << m_dir
+			<< ": " << strerror(errno) << std::endl;
+	}
+
+	verbosestream << "MapDatabaseRegions: Compacted " << path << " from "
+		<< region->file_size << " to " << offset << " bytes" << std::endl;
+
+	region->closeFile();
+	region->fd = fd;
+	region->file_size = offset;
+	region->garbage = 0;
+	memcpy(region->index, new_index, sizeof(new_index));
+}
+
+#endif // _WIN32
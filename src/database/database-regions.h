@@ -0,0 +1,88 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+// Uses mmap(), not available on Windows
+#ifndef _WIN32
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "database.h"
+
+/*
+	Map database made for MapBlocks: a region file holds a cube of
+	REGION_SIZE^3 blocks, starting with a fixed size index of
+	(offset, size) pairs followed by the block data.
+
+	Saving appends the data to the end of the file, the index entries are
+	only written at endSave(), after the data was synced. So the index in
+	the file always points to complete data. The old data stays in the file
+	as garbage until the region is compacted (at endSave(), once there is
+	enough of it).
+	Files are memory-mapped for reading, so loading blocks from a region that
+	was used recently (likely, as neighbouring blocks tend to be loaded
+	together) does not need any system call.
+
+	See doc/world_format.txt for the file format.
+	Not thread-safe.
+*/
+class MapDatabaseRegions : public MapDatabase
+{
+public:
+	static constexpr s16 REGION_SIZE = 16;
+
+	MapDatabaseRegions(const std::string &savedir);
+	~MapDatabaseRegions();
+
+	bool saveBlock(const v3s16 &pos, const std::string &data);
+	void loadBlock(const v3s16 &pos, std::string *block);
+	bool deleteBlock(const v3s16 &pos);
+	void listAllLoadableBlocks(std::vector<v3s16> &dst);
+
+	void beginSave() {}
+	// Syncs modified regions to disk and compacts them if needed.
+	// Throws DatabaseException on failure, the blocks saved since the last
+	// endSave() may then be lost.
+	void endSave();
+
+private:
+	struct Region;
+
+	// Returns nullptr if the region does not exist and create is false
+	Region *getRegion(v3s16 region_pos, bool create);
+	std::string getRegionPath(v3s16 region_pos) const;
+	// Maps the file again if it grew since the last time
+	void updateMapping(Region *region);
+	// Syncs the data and then writes the index entries that changed
+	void syncRegion(Region *region);
+	void compact(Region *region);
+
+	std::string m_dir;
+	// Open regions, the least recently used ones are closed when there
+	// are too many
+	std::unordered_map<v3s16, std::unique_ptr<Region>> m_regions;
+	std::unordered_set<v3s16> m_dirty_regions;
+	u64 m_use_counter = 0;
+};
+
+#endif // _WIN32
@@ -37,6 +37,7 @@ SQLite format specification:
 #include "irrlicht_changes/printing.h"
 #include "server/player_sao.h"
 
+#include <algorithm>
 #include <cassert>
 
 // When to print messages when the database is being held locked by another process
@@ -207,6 +208,7 @@ MapDatabaseSQLite3::MapDatabaseSQLite3(const std::string &savedir):
 MapDatabaseSQLite3::~MapDatabaseSQLite3()
 {
 	FINALIZE_STATEMENT(m_stmt_read)
+	FINALIZE_STATEMENT(m_stmt_read_many)
 	FINALIZE_STATEMENT(m_stmt_write)
 	FINALIZE_STATEMENT(m_stmt_list)
 	FINALIZE_STATEMENT(m_stmt_delete)
@@ -229,6 +231,9 @@ void MapDatabaseSQLite3::createDatabase()
 void MapDatabaseSQLite3::initStatements()
 {
 	PREPARE_STATEMENT(read, "SELECT `data` FROM `blocks` WHERE `pos` = ? LIMIT 1");
+	// READ_MANY_COUNT parameters
+	PREPARE_STATEMENT(read_many, "SELECT `pos`, `data` FROM `blocks` WHERE `pos` IN "
+		"(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
 	PREPARE_STATEMENT(write, "REPLACE INTO `blocks` (`pos`, `data`) VALUES (?, ?)");
 	PREPARE_STATEMENT(delete, "DELETE FROM `blocks` WHERE `pos` = ?");
 	PREPARE_STATEMENT(list, "SELECT `pos` FROM `blocks`");
@@ -296,6 +301,38 @@ void MapDatabaseSQLite3::loadBlock(const v3s16 &pos, std::string *block)
 	sqlite3_reset(m_stmt_read);
 }
 
+void MapDatabaseSQLite3::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> *blocks)
+{
+	verifyDatabase();
+
+	blocks->assign(positions.size(), std::string());
+
+	for (size_t start = 0; start < positions.size(); start += READ_MANY_COUNT) {
+		size_t end = std::min(start + READ_MANY_COUNT, positions.size());
+
+		// Unused parameters repeat the first position of the batch
+		for (size_t i = 0; i < READ_MANY_COUNT; i++) {
+			size_t idx = start + i < end ? start + i : start;
+			bindPos(m_stmt_read_many, positions[idx], i + 1);
+		}
+
+		while (sqlite3_step(m_stmt_read_many) == SQLITE_ROW) {
+			s64 pos = sqlite3_column_int64(m_stmt_read_many, 0);
+			const char *data = (const char *) sqlite3_column_blob(m_stmt_read_many, 1);
+			size_t len = sqlite3_column_bytes(m_stmt_read_many, 1);
+			if (!data)
+				continue;
+
+			for (size_t i = start; i < end; i++) {
+				if (getBlockAsInteger(positions[i]) == pos)
+					(*blocks)[i].assign(data, len);
+			}
+		}
+		sqlite3_reset(m_stmt_read_many);
+	}
+}
+
 void MapDatabaseSQLite3::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
 	verifyDatabase();
@@ -148,6 +148,8 @@ class MapDatabaseSQLite3 : private Database_SQLite3, public MapDatabase
 
 	bool saveBlock(const v3s16 &pos, const std::string &data);
 	void loadBlock(const v3s16 &pos, std::string *block);
+	void loadBlocks(const std::vector<v3s16> &positions,
+			std::vector<std::string> *blocks);
 	bool deleteBlock(const v3s16 &pos);
 	void listAllLoadableBlocks(std::vector<v3s16> &dst);
 
@@ -160,8 +162,12 @@ class MapDatabaseSQLite3 : private Database_SQLite3, public MapDatabase
 private:
 	void bindPos(sqlite3_stmt *stmt, const v3s16 &pos, int index = 1);
 
+	// Number of positions queried at once by m_stmt_read_many
+	static constexpr size_t READ_MANY_COUNT = 16;
+
 	// Map
 	sqlite3_stmt *m_stmt_read = nullptr;
+	sqlite3_stmt *m_stmt_read_many = nullptr;
 	sqlite3_stmt *m_stmt_write = nullptr;
 	sqlite3_stmt *m_stmt_list = nullptr;
 	sqlite3_stmt *m_stmt_delete = nullptr;
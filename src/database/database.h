@@ -42,6 +42,11 @@ class MapDatabase : public Database
 
 	virtual bool saveBlock(const v3s16 &pos, const std::string &data) = 0;
 	virtual void loadBlock(const v3s16 &pos, std::string *block) = 0;
+	// Loads many blocks at once, (*blocks)[i] is set to the data of
+	// positions[i] or left empty if it does not exist.
+	// The default implementation calls loadBlock() for each position.
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+			std::vector<std::string> *blocks);
 	virtual bool deleteBlock(const v3s16 &pos) = 0;
 
 	static s64 getBlockAsInteger(const v3s16 &pos);
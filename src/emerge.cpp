@@ -22,11 +22,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "emerge.h"
 
 #include <iostream>
-#include <queue>
+#include <deque>
+#include <unordered_map>
 
 #include "util/container.h"
 #include "util/thread.h"
 #include "threading/event.h"
+#include "threading/thread_pool.h"
 
 #include "config.h"
 #include "constants.h"
@@ -46,6 +48,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "voxel.h"
 
+// Number of queued blocks an emerge thread reads from the database at once
+#define EMERGE_READ_BATCH_SIZE 16
+
 class EmergeThread : public Thread {
 public:
 	bool enable_mapgen_debug_info;
@@ -75,12 +80,21 @@ class EmergeThread : public Thread {
 	Mapgen *m_mapgen;
 
 	Event m_queue_event;
-	std::queue<v3s16> m_block_queue;
+	std::deque<v3s16> m_block_queue;
+
+	// Data of blocks at the front of the queue, read from the database
+	// together by prefetchBlocks(). Empty if the block is not on disk.
+	std::unordered_map<v3s16, std::string> m_prefetched;
+	// Map block removal count from before m_prefetched was read
+	u64 m_prefetch_removal_count = 0;
 
 	bool popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata);
 
 	EmergeAction getBlockOrStartGen(
 		const v3s16 &pos, bool allow_gen, MapBlock **block, BlockMakeData *data);
+	void prefetchBlocks(const v3s16 &pos, u64 removal_count);
+	// Must be called with the env lock held
+	EmergeAction startGen(const v3s16 &pos, bool allow_gen, BlockMakeData *data);
 	MapBlock *finishGen(v3s16 pos, BlockMakeData *bmdata,
 		std::map<v3s16, MapBlock *> *modified_blocks);
 
@@ -126,13 +140,14 @@ EmergeParams::~EmergeParams()
 EmergeParams::EmergeParams(EmergeManager *parent, const BiomeGen *biomegen,
 	const BiomeManager *biomemgr,
 	const OreManager *oremgr, const DecorationManager *decomgr,
-	const SchematicManager *schemmgr) :
+	const SchematicManager *schemmgr, ThreadPool *mapgen_pool) :
 	ndef(parent->ndef),
 	enable_mapgen_debug_info(parent->enable_mapgen_debug_info),
 	gen_notify_on(parent->gen_notify_on),
 	gen_notify_on_deco_ids(&parent->gen_notify_on_deco_ids),
 	biomemgr(biomemgr->clone()), oremgr(oremgr->clone()),
-	decomgr(decomgr->clone()), schemmgr(schemmgr->clone())
+	decomgr(decomgr->clone()), schemmgr(schemmgr->clone()),
+	mapgen_pool(mapgen_pool)
 {
 	this->biomegen = biomegen->clone(this->biomemgr);
 }
@@ -195,6 +210,9 @@ EmergeManager::EmergeManager(Server *server, MetricsBackend *mb)
 		m_threads.push_back(new EmergeThread(server, i));
 
 	infostream << "EmergeManager: using " << nthreads << " threads" << std::endl;
+
+	m_mapgen_pool = std::make_unique<ThreadPool>("MapgenHelper",
+			ThreadPool::defaultThreadCount("mapgen_threads"));
 }
 
 
@@ -264,7 +282,7 @@ void EmergeManager::initMapgens(MapgenParams *params)
 
 	for (u32 i = 0; i != m_threads.size(); i++) {
 		EmergeParams *p = new EmergeParams(this, biomegen,
-			biomemgr, oremgr, decomgr, schemmgr);
+			biomemgr, oremgr, decomgr, schemmgr, m_mapgen_pool.get());
 		infostream << "EmergeManager: Created params " << p
 			<< " for thread " << i << std::endl;
 		m_mapgens.push_back(Mapgen::createMapgen(params->mgtype, params, p));
@@ -534,7 +552,7 @@ void EmergeThread::signal()
 
 bool EmergeThread::pushBlock(const v3s16 &pos)
 {
-	m_block_queue.push(pos);
+	m_block_queue.push_back(pos);
 	return true;
 }
 
@@ -548,7 +566,7 @@ void EmergeThread::cancelPendingItems()
 		v3s16 pos;
 
 		pos = m_block_queue.front();
-		m_block_queue.pop();
+		m_block_queue.pop_front();
 
 		m_emerge->popBlockEmergeData(pos, &bedata);
 
@@ -582,7 +600,7 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata)
 		return false;
 
 	*pos = m_block_queue.front();
-	m_block_queue.pop();
+	m_block_queue.pop_front();
 
 	m_emerge->popBlockEmergeData(*pos, bedata);
 
@@ -593,20 +611,84 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata)
 EmergeAction EmergeThread::getBlockOrStartGen(
 	const v3s16 &pos, bool allow_gen, MapBlock **block, BlockMakeData *bmdata)
 {
+	u64 removal_count;
+	{
+		MutexAutoLock envlock(m_server->m_env_mutex);
+
+		// 1). Attempt to fetch block from memory
+		*block = m_map->getBlockNoCreateNoEx(pos);
+		if (*block) {
+			if ((*block)->isGenerated())
+				return EMERGE_FROM_MEMORY;
+			return startGen(pos, allow_gen, bmdata);
+		}
+		removal_count = m_map->getBlockRemovalCount();
+	}
+
+	// 2). Attempt to load block from disk if it was not in the memory.
+	// Reading and deserializing happens without the env lock, only inserting
+	// the result into the map needs it.
+	auto it = m_prefetched.find(pos);
+	if (it == m_prefetched.end()) {
+		prefetchBlocks(pos, removal_count);
+		it = m_prefetched.find(pos);
+	}
+	std::string blob = std::move(it->second);
+	m_prefetched.erase(it);
+	// The data is as old as the batch it was read in
+	removal_count = m_prefetch_removal_count;
+
+	bool need_lock = false;
+	std::unique_ptr<MapBlock> decoded;
+	if (!blob.empty())
+		decoded = m_map->decodeBlock(pos, blob, &need_lock);
+
 	MutexAutoLock envlock(m_server->m_env_mutex);
 
-	// 1). Attempt to fetch block from memory
 	*block = m_map->getBlockNoCreateNoEx(pos);
-	if (*block) {
-		if ((*block)->isGenerated())
-			return EMERGE_FROM_MEMORY;
-	} else {
-		// 2). Attempt to load block from disk if it was not in the memory
-		*block = m_map->loadBlock(pos);
-		if (*block && (*block)->isGenerated())
-			return EMERGE_FROM_DISK;
+	if (!*block) {
+		// If blocks were unloaded in the meantime, this block could have been
+		// loaded, modified and saved again, so what we read may be outdated.
+		if (need_lock || m_map->getBlockRemovalCount() != removal_count)
+			*block = m_map->loadBlock(pos);
+		else if (decoded)
+			*block = m_map->insertDecodedBlock(std::move(decoded));
 	}
+	if (*block && (*block)->isGenerated())
+		return EMERGE_FROM_DISK;
+
+	return startGen(pos, allow_gen, bmdata);
+}
 
+
+void EmergeThread::prefetchBlocks(const v3s16 &pos, u64 removal_count)
+{
+	// Requests usually come in runs of neighbouring blocks (e.g. around
+	// players), so read the blocks queued after this one along with it.
+	std::vector<v3s16> positions{pos};
+	{
+		MutexAutoLock queuelock(m_emerge->m_queue_mutex);
+		for (auto it = m_block_queue.begin(); it != m_block_queue.end() &&
+				positions.size() < EMERGE_READ_BATCH_SIZE; ++it)
+			positions.push_back(*it);
+	}
+
+	std::vector<std::string> blobs;
+	{
+		PROFILER_SCOPE(sp, "EmergeThread: read blocks", SPT_AVG);
+		m_map->readBlocks(positions, &blobs);
+	}
+
+	m_prefetched.clear();
+	for (size_t i = 0; i < positions.size(); i++)
+		m_prefetched[positions[i]] = std::move(blobs[i]);
+	m_prefetch_removal_count = removal_count;
+}
+
+
+EmergeAction EmergeThread::startGen(
+	const v3s16 &pos, bool allow_gen, BlockMakeData *bmdata)
+{
 	// 3). Attempt to start generation
 	if (allow_gen && m_map->initBlockMake(pos, bmdata))
 		return EMERGE_GENERATED;
@@ -620,8 +702,7 @@ MapBlock *EmergeThread::finishGen(v3s16 pos, BlockMakeData *bmdata,
 	std::map<v3s16, MapBlock *> *modified_blocks)
 {
 	MutexAutoLock envlock(m_server->m_env_mutex);
-	ScopeProfiler sp(g_profiler,
-		"EmergeThread: after Mapgen::makeChunk", SPT_AVG);
+	PROFILER_SCOPE(sp, "EmergeThread: after Mapgen::makeChunk", SPT_AVG);
 
 	/*
 		Perform post-processing on blocks (invalidate lighting, queue liquid
@@ -707,8 +788,7 @@ void *EmergeThread::run()
 		action = getBlockOrStartGen(pos, allow_gen, &block, &bmdata);
 		if (action == EMERGE_GENERATED) {
 			{
-				ScopeProfiler sp(g_profiler,
-					"EmergeThread: Mapgen::makeChunk", SPT_AVG);
+				PROFILER_SCOPE(sp, "EmergeThread: Mapgen::makeChunk", SPT_AVG);
 
 				m_mapgen->makeChunk(&bmdata);
 			}
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include <map>
+#include <memory>
 #include <mutex>
 #include "network/networkprotocol.h"
 #include "irr_v3d.h"
@@ -46,6 +47,7 @@ class DecorationManager;
 class SchematicManager;
 class Server;
 class ModApiMapgen;
+class ThreadPool;
 
 // Structure containing inputs/outputs for chunk generation
 struct BlockMakeData {
@@ -114,11 +116,13 @@ class EmergeParams {
 	DecorationManager *decomgr;
 	SchematicManager *schemmgr;
 
+	ThreadPool *mapgen_pool; // shared
+
 private:
 	EmergeParams(EmergeManager *parent, const BiomeGen *biomegen,
 		const BiomeManager *biomemgr,
 		const OreManager *oremgr, const DecorationManager *decomgr,
-		const SchematicManager *schemmgr);
+		const SchematicManager *schemmgr, ThreadPool *mapgen_pool);
 };
 
 class EmergeManager {
@@ -217,6 +221,9 @@ class EmergeManager {
 	DecorationManager *decomgr;
 	SchematicManager *schemmgr;
 
+	// Helper threads for the mapgens, shared by all emerge threads
+	std::unique_ptr<ThreadPool> m_mapgen_pool;
+
 	// Requires m_queue_mutex held
 	EmergeThread *getOptimalThread();
 
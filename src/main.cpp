@@ -41,6 +41,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "porting.h"
 #include "network/socket.h"
 #include "mapblock.h"
+#include "profiler.h"
 #if USE_CURSES
 	#include "terminal_chat_console.h"
 #endif
@@ -371,6 +372,8 @@ static void set_allowed_options(OptionList *allowed_options)
 			_("Feature an interactive terminal (Only works when using minetestserver or with --server)"))));
 	allowed_options->insert(std::make_pair("recompress", ValueSpec(VALUETYPE_FLAG,
 			_("Recompress the blocks of the given map database."))));
+	allowed_options->insert(std::make_pair("pregenerate", ValueSpec(VALUETYPE_STRING,
+			_("Generate the map between two node positions \"(x1,y1,z1) (x2,y2,z2)\" and exit (Only works when using minetestserver or with --server)"))));
 #ifndef SERVER
 	allowed_options->insert(std::make_pair("speedtests", ValueSpec(VALUETYPE_FLAG,
 			_("Run speed tests"))));
@@ -687,6 +690,8 @@ static bool init_common(const Settings &cmd_args, int argc, char *argv[])
 
 	init_log_streams(cmd_args);
 
+	g_profiler->setTraceEnabled(g_settings->getBool("profiler_trace"));
+
 	// Initialize random seed
 	srand(time(0));
 	mysrand(time(0));
@@ -702,6 +707,14 @@ static bool init_common(const Settings &cmd_args, int argc, char *argv[])
 
 static void uninit_common()
 {
+	if (g_profiler->isTraceEnabled()) {
+		std::ostringstream os;
+		g_profiler->writeTrace(os);
+		std::string path = porting::path_user + DIR_DELIM + "profiler_trace.json";
+		if (fs::safeWriteToFile(path, os.str()))
+			actionstream << "Profiler trace saved to " << path << std::endl;
+	}
+
 	httpfetch_cleanup();
 
 	sockets_cleanup();
@@ -1080,6 +1093,9 @@ static bool run_dedicated_server(const GameParams &game_params, const Settings &
 	if (cmd_args.getFlag("recompress"))
 		return recompress_map_database(game_params, cmd_args, bind_addr);
 
+	if (cmd_args.exists("pregenerate"))
+		return Server::pregenerateMap(game_params, cmd_args, bind_addr);
+
 	if (cmd_args.exists("terminal")) {
 #if USE_CURSES
 		bool name_ok = true;
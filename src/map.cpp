@@ -41,13 +41,18 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapgen/mg_biome.h"
 #include "config.h"
 #include "server.h"
+#include "server/blockwriter.h"
+#include "threading/mutex_auto_lock.h"
 #include "database/database.h"
 #include "database/database-dummy.h"
+#include "database/database-regions.h"
 #include "database/database-sqlite3.h"
 #include "script/scripting_server.h"
 #include "irrlicht_changes/printing.h"
+#include <atomic>
 #include <deque>
 #include <queue>
+#include <unordered_set>
 #if USE_LEVELDB
 #include "database/database-leveldb.h"
 #endif
@@ -63,8 +68,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	Map
 */
 
+// Source of Map::m_block_index_gen values
+static std::atomic<u64> g_block_index_gen(0);
+
 Map::Map(IGameDef *gamedef):
 	m_gamedef(gamedef),
+	m_block_index_gen(++g_block_index_gen),
 	m_nodedef(gamedef->ndef())
 {
 }
@@ -124,14 +133,38 @@ MapSector *Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock *Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector *sector = getSectorNoGenerate(p2d);
-	if (!sector)
-		return nullptr;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
+	// Last result of this thread. Valid as long as the generation matches,
+	// which also tells apart different maps.
+	thread_local struct {
+		u64 gen = 0;
+		v3s16 p;
+		MapBlock *block;
+	} cache;
+
+	if (cache.gen == m_block_index_gen && cache.p == p3d)
+		return cache.block;
+
+	MapBlock *block = m_block_index.find(p3d);
+	cache.gen = m_block_index_gen;
+	cache.p = p3d;
+	cache.block = block;
 	return block;
 }
 
+void Map::indexBlock(MapBlock *block)
+{
+	m_block_index.insert(block->getPos(), block);
+	m_block_index_gen = ++g_block_index_gen;
+}
+
+void Map::unindexBlock(MapBlock *block)
+{
+	bool erased = m_block_index.erase(block->getPos());
+	assert(erased);
+	(void)erased;
+	m_block_index_gen = ++g_block_index_gen;
+}
+
 MapBlock *Map::getBlockNoCreate(v3s16 p3d)
 {
 	MapBlock *block = getBlockNoCreateNoEx(p3d);
@@ -433,6 +466,7 @@ void Map::timerUpdate(float dtime, float unload_timeout, s32 max_loaded_blocks,
 
 	endSave();
 	const auto end_time = porting::getTimeUs();
+	m_block_removal_count += deleted_blocks_count;
 
 	reportMetrics(end_time - start_time, saved_blocks_count, block_count_all);
 
@@ -504,10 +538,22 @@ class LiquidSystem {
 		m_nodedef = map->getNodeDefManager();
 	}
 
+	// Looks up the block at blockpos and its neighbors for getNode()
+	void cacheBlocks(v3s16 blockpos)
+	{
+		m_cache_center = blockpos;
+		v3s16 d;
+		for (d.Z = -1; d.Z <= 1; d.Z++)
+		for (d.Y = -1; d.Y <= 1; d.Y++)
+		for (d.X = -1; d.X <= 1; d.X++)
+			m_block_cache[cacheIndex(d)] = m_map->getBlockNoCreateNoEx(blockpos + d);
+		m_cache_valid = true;
+	}
+
 	void enterNode(const v3s16& p0, UniqueQueue<v3s16>& transforming_liquid)
 	{
 		for(u16 i = 0; i < CNT_DIRS; ++ i) p[i] = p0 + liquid_7dirs[i];
-		for(u16 i = 0; i < CNT_DIRS; ++ i) n[i] = m_map->getNode(p[i]);
+		for(u16 i = 0; i < CNT_DIRS; ++ i) n[i] = getNode(p[i]);
 		for(u16 i = 0; i < CNT_DIRS; ++ i) n_old[i] = n[i];
 		for(u16 i = 0; i < CNT_DIRS; ++ i) d[i] = &m_nodedef->get(n[i]);
 		for(u16 i = 0; i < CNT_DIRS; ++ i) d_old[i] = d[i];
@@ -539,6 +585,8 @@ class LiquidSystem {
 
 			if(d[i]->isLiquid() && d_old[i]->floodable &&
 					n_old[i].getContent() != CONTENT_AIR) {
+				// The callback may load or remove blocks
+				m_cache_valid = false;
 				if (env->getScriptIface()->node_on_flood(p[i], n_old[i], n[i]))
 					continue;
 			}
@@ -594,6 +642,24 @@ class LiquidSystem {
 		CNT_DIRS = 7,
 	};
 
+	static inline int cacheIndex(v3s16 d)
+	{
+		return (d.Z + 1) * 9 + (d.Y + 1) * 3 + (d.X + 1);
+	}
+
+	MapNode getNode(v3s16 p)
+	{
+		v3s16 blockpos = getNodeBlockPos(p);
+		v3s16 d = blockpos - m_cache_center;
+		if (!m_cache_valid || d.X < -1 || d.X > 1 || d.Y < -1 || d.Y > 1 ||
+				d.Z < -1 || d.Z > 1)
+			return m_map->getNode(p);
+		MapBlock *block = m_block_cache[cacheIndex(d)];
+		if (!block)
+			return {CONTENT_IGNORE};
+		return block->getNodeNoCheck(p - blockpos * MAP_BLOCKSIZE);
+	}
+
 	bool isLiquid(const ContentFeatures *d)
 	{
 		return d->isLiquid() &&
@@ -643,10 +709,10 @@ class LiquidSystem {
 		v3s16 pi = p[0];
 		for(u8 i = 0; i < liquid_level; ++i) {
 			pi += dir;
-			auto n1 = m_map->getNode(pi);
+			auto n1 = getNode(pi);
 			auto& d1 = m_map->getNodeDefManager()->get(n1);
 			if(d1.floodable || isLiquid(&d1)) {
-				auto n2 = m_map->getNode(pi + v3s16(0, -1, 0));
+				auto n2 = getNode(pi + v3s16(0, -1, 0));
 				auto& d2 = m_map->getNodeDefManager()->get(n2);
 				if(d2.floodable || isLiquid(&d2)) {
 					return i;
@@ -861,6 +927,11 @@ class LiquidSystem {
 	ServerMap *m_map;
 	const NodeDefManager *m_nodedef;
 
+	// Blocks around m_cache_center, see cacheIndex()
+	MapBlock *m_block_cache[27];
+	v3s16 m_cache_center;
+	bool m_cache_valid = false;
+
 	v3s16 p[CNT_DIRS];
 	MapNode n[CNT_DIRS];
 	MapNode n_old[CNT_DIRS];
@@ -873,23 +944,87 @@ class LiquidSystem {
 void ServerMap::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks,
 		ServerEnvironment *env)
 {
+	const u64 start_time = porting::getTimeUs();
 	std::vector<std::pair<v3s16, MapNode>> changed_nodes;
 
-	int cnt_nodes = m_transforming_liquid.size();
-
-	actionstream << "transformLiquids " << cnt_nodes << std::endl;
-	for (int i = 0; i < cnt_nodes && m_transforming_liquid.size() > 0; ++i) {
+	/*
+		Take the nodes that were queued before this step, starting with the
+		ones left over from the previous step, and group them by block so
+		that each batch works on the same few blocks.
+	*/
+	struct LiquidBatch {
+		v3s16 blockpos;
+		std::vector<v3s16> nodes;
+	};
+	std::vector<LiquidBatch> batches;
+	std::unordered_map<v3s16, size_t> batch_of_block;
+	std::unordered_set<v3s16> taken;
+	auto take = [&] (v3s16 p) {
+		if (!taken.insert(p).second)
+			return;
+		v3s16 blockpos = getNodeBlockPos(p);
+		auto it = batch_of_block.emplace(blockpos, batches.size()).first;
+		if (it->second == batches.size())
+			batches.push_back({blockpos, {}});
+		batches[it->second].nodes.push_back(p);
+	};
 
-		LiquidSystem liquidSystem(this);
-		auto p0 = m_transforming_liquid.front();
+	for (v3s16 p : m_liquid_deferred)
+		take(p);
+	m_liquid_deferred.clear();
+	for (u32 n = m_transforming_liquid.size(); n > 0 &&
+			taken.size() < m_liquid_loop_max; n--) {
+		take(m_transforming_liquid.front());
 		m_transforming_liquid.pop_front();
+	}
+
+	/*
+		Process batch by batch until the time is up
+	*/
+	LiquidSystem liquid_system(this);
+	size_t batch_i = 0;
+	u32 transformed = 0;
+	for (; batch_i < batches.size(); batch_i++) {
+		if (batch_i > 0 && m_liquid_time_budget_us > 0 &&
+				porting::getTimeUs() - start_time >= m_liquid_time_budget_us)
+			break;
+		const LiquidBatch &batch = batches[batch_i];
+		liquid_system.cacheBlocks(batch.blockpos);
+		for (v3s16 p0 : batch.nodes) {
+			liquid_system.enterNode(p0, m_transforming_liquid);
+			liquid_system.writeChangedNodes(env, modified_blocks, changed_nodes,
+					m_gamedef);
+		}
+		transformed += batch.nodes.size();
+	}
 
-		liquidSystem.enterNode(p0, m_transforming_liquid);
-		liquidSystem.writeChangedNodes(env, modified_blocks, changed_nodes,
-				m_gamedef);
+	// The rest is done first in the next step
+	for (; batch_i < batches.size(); batch_i++) {
+		const std::vector<v3s16> &nodes = batches[batch_i].nodes;
+		m_liquid_deferred.insert(m_liquid_deferred.end(), nodes.begin(), nodes.end());
 	}
+
 	env->getScriptIface()->on_liquid_transformed(changed_nodes);
 	voxalgo::update_lighting_nodes(this, changed_nodes, modified_blocks);
+
+	/*
+		Metrics
+	*/
+	const u64 end_time = porting::getTimeUs();
+	if (m_liquid_deferred.empty())
+		m_liquid_behind_since = 0;
+	else if (m_liquid_behind_since == 0)
+		m_liquid_behind_since = end_time;
+	m_liquid_queue_gauge->set(getTransformingLiquidCount());
+	m_liquid_lag_gauge->set(m_liquid_behind_since == 0 ? 0 :
+			(end_time - m_liquid_behind_since) / 1000000.0);
+	m_liquid_transformed_counter->increment(transformed);
+	m_liquid_time_counter->increment(end_time - start_time);
+}
+
+u32 ServerMap::getTransformingLiquidCount() const
+{
+	return m_transforming_liquid.size() + m_liquid_deferred.size();
 }
 
 
@@ -1235,9 +1370,26 @@ ServerMap::ServerMap(const std::string &savedir, IGameDef *gamedef,
 		"minetest_map_saved_blocks", "Number of blocks saved");
 	m_loaded_blocks_gauge = mb->addGauge(
 		"minetest_map_loaded_blocks", "Number of loaded blocks");
+	m_liquid_queue_gauge = mb->addGauge(
+		"minetest_liquid_queue_length", "Number of liquid nodes waiting for an update");
+	m_liquid_lag_gauge = mb->addGauge(
+		"minetest_liquid_lag", "Time since the liquid updates fell behind (in seconds)");
+	m_liquid_transformed_counter = mb->addCounter(
+		"minetest_liquid_transformed_nodes", "Number of liquid node updates");
+	m_liquid_time_counter = mb->addCounter(
+		"minetest_liquid_transform_time", "Time spent updating liquids (in microseconds)");
+
+	m_liquid_loop_max = g_settings->getU32("liquid_loop_max");
+	m_liquid_time_budget_us = (u64)g_settings->getU32("liquid_time_budget") * 1000;
 
 	m_map_compression_level = rangelim(g_settings->getS16("map_compression_level_disk"), -1, 9);
 
+	const u32 save_queue_size = g_settings->getU32("map_save_queue_size");
+	if (save_queue_size > 0) {
+		m_block_writer = std::make_unique<BlockWriter>(dbase, m_db_mutex,
+			m_map_compression_level, (size_t)save_queue_size * 1024 * 1024, mb);
+	}
+
 	try {
 		// If directory exists, check contents and load if possible
 		if (fs::PathExists(m_savedir)) {
@@ -1298,6 +1450,9 @@ ServerMap::~ServerMap()
 				<<", exception: "<<e.what()<<std::endl;
 	}
 
+	// Write out what is still queued
+	m_block_writer.reset();
+
 	/*
 		Close database if it was opened
 	*/
@@ -1689,8 +1844,21 @@ void ServerMap::save(ModifiedState save_level)
 	reportMetrics(end_time - start_time, block_count, block_count_all);
 }
 
+bool ServerMap::flushSaves()
+{
+	if (m_block_writer && !m_block_writer->flush()) {
+		errorstream << "ServerMap: Some saved blocks could not be written to "
+			"the map database" << std::endl;
+		return false;
+	}
+	return true;
+}
+
 void ServerMap::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
+	flushSaves();
+
+	MutexAutoLock lock(m_db_mutex);
 	dbase->listAllLoadableBlocks(dst);
 	if (dbase_ro)
 		dbase_ro->listAllLoadableBlocks(dst);
@@ -1720,6 +1888,10 @@ MapDatabase *ServerMap::createDatabase(
 		return new MapDatabaseSQLite3(savedir);
 	if (name == "dummy")
 		return new Database_Dummy();
+	#ifndef _WIN32
+	if (name == "regions")
+		return new MapDatabaseRegions(savedir);
+	#endif
 	#if USE_LEVELDB
 	if (name == "leveldb")
 		return new Database_LevelDB(savedir);
@@ -1741,17 +1913,35 @@ MapDatabase *ServerMap::createDatabase(
 
 void ServerMap::beginSave()
 {
-	dbase->beginSave();
+	// The block writer uses transactions of its own
+	if (!m_block_writer) {
+		MutexAutoLock lock(m_db_mutex);
+		dbase->beginSave();
+	}
 }
 
 void ServerMap::endSave()
 {
-	dbase->endSave();
+	if (!m_block_writer) {
+		MutexAutoLock lock(m_db_mutex);
+		dbase->endSave();
+	}
 }
 
 bool ServerMap::saveBlock(MapBlock *block)
 {
-	return saveBlock(block, dbase, m_map_compression_level);
+	if (!m_block_writer) {
+		MutexAutoLock lock(m_db_mutex);
+		return saveBlock(block, dbase, m_map_compression_level);
+	}
+
+	// Only take a copy here, compressing and writing happens in the background
+	std::ostringstream os(std::ios_base::binary);
+	block->serializeUncompressed(os, SER_FMT_VER_HIGHEST_WRITE, true);
+	m_block_writer->push(block->getPos(), os.str());
+
+	block->resetModified();
+	return true;
 }
 
 bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db, int compression_level)
@@ -1777,18 +1967,52 @@ bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db, int compression_leve
 	return ret;
 }
 
-void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load)
+void ServerMap::readBlock(v3s16 blockpos, std::string *blob)
 {
-	try {
-		std::istringstream is(*blob, std::ios_base::binary);
+	// Blocks waiting to be written are newer than what is in the database
+	if (m_block_writer && m_block_writer->get(blockpos, blob))
+		return;
+
+	MutexAutoLock lock(m_db_mutex);
+	dbase->loadBlock(blockpos, blob);
+	if (blob->empty() && dbase_ro)
+		dbase_ro->loadBlock(blockpos, blob);
+}
+
+bool ServerMap::deSerializeBlock(MapBlock *block, const std::string &blob,
+		bool allocate_ids)
+{
+	PROFILER_SCOPE(sp, "ServerMap: deSer block", SPT_AVG);
+
+	std::istringstream is(blob, std::ios_base::binary);
 
-		u8 version = SER_FMT_VER_INVALID;
-		is.read((char*)&version, 1);
+	u8 version = SER_FMT_VER_INVALID;
+	is.read((char*)&version, 1);
+
+	if(is.fail())
+		throw SerializationError("ServerMap::loadBlock(): Failed"
+				" to read MapBlock version");
+
+	{
+		// Only looks up node ids, which is safe to do concurrently
+		std::shared_lock<std::shared_mutex> lock(m_node_ids_mutex);
+		if (block->deSerialize(is, version, true, false))
+			return true;
+	}
+	if (!allocate_ids)
+		return false;
 
-		if(is.fail())
-			throw SerializationError("ServerMap::loadBlock(): Failed"
-					" to read MapBlock version");
+	// The block contains unknown node names, start over and allocate ids
+	std::unique_lock<std::shared_mutex> lock(m_node_ids_mutex);
+	is.clear();
+	is.seekg(1);
+	block->deSerialize(is, version, true, true);
+	return true;
+}
 
+void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load)
+{
+	try {
 		MapBlock *block = nullptr;
 		std::unique_ptr<MapBlock> block_created_new;
 		block = sector->getBlockNoCreateNoEx(p3d.Y);
@@ -1797,11 +2021,8 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 			block = block_created_new.get();
 		}
 
-		{
-		ScopeProfiler sp(g_profiler, "ServerMap: deSer block", SPT_AVG);
 		// Read basic data
-		block->deSerialize(is, version, true);
-		}
+		deSerializeBlock(block, *blob, true);
 
 		// If it's a new block, insert it to the map
 		if (block_created_new) {
@@ -1842,44 +2063,130 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 
 MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 {
-	ScopeProfiler sp(g_profiler, "ServerMap: load block", SPT_AVG);
+	PROFILER_SCOPE(sp, "ServerMap: load block", SPT_AVG);
 	bool created_new = (getBlockNoCreateNoEx(blockpos) == NULL);
 
 	v2s16 p2d(blockpos.X, blockpos.Z);
 
 	std::string ret;
-	dbase->loadBlock(blockpos, &ret);
-	if (!ret.empty()) {
-		loadBlock(&ret, blockpos, createSector(p2d), false);
-	} else if (dbase_ro) {
-		dbase_ro->loadBlock(blockpos, &ret);
-		if (!ret.empty()) {
-			loadBlock(&ret, blockpos, createSector(p2d), false);
-		}
-	} else {
+	readBlock(blockpos, &ret);
+	if (ret.empty())
 		return NULL;
-	}
+	loadBlock(&ret, blockpos, createSector(p2d), false);
 
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
-	if (created_new && (block != NULL)) {
-		std::map<v3s16, MapBlock*> modified_blocks;
-		// Fix lighting if necessary
-		voxalgo::update_block_border_lighting(this, block, modified_blocks);
-		if (!modified_blocks.empty()) {
-			//Modified lighting, send event
-			MapEditEvent event;
-			event.type = MEET_OTHER;
-			event.setModifiedBlocks(modified_blocks);
-			dispatchEvent(event);
+	if (created_new && (block != NULL))
+		updateLoadedBlockLighting(block);
+	return block;
+}
+
+void ServerMap::readBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> *blobs)
+{
+	blobs->assign(positions.size(), std::string());
+
+	// Blocks waiting to be written are newer than what is in the database
+	std::vector<v3s16> db_positions;
+	std::vector<size_t> db_indices;
+	for (size_t i = 0; i < positions.size(); i++) {
+		if (m_block_writer && m_block_writer->get(positions[i], &(*blobs)[i]))
+			continue;
+		db_positions.push_back(positions[i]);
+		db_indices.push_back(i);
+	}
+	if (db_positions.empty())
+		return;
+
+	MutexAutoLock lock(m_db_mutex);
+	std::vector<std::string> db_blobs;
+	dbase->loadBlocks(db_positions, &db_blobs);
+	for (size_t i = 0; i < db_indices.size(); i++)
+		(*blobs)[db_indices[i]] = std::move(db_blobs[i]);
+
+	if (!dbase_ro)
+		return;
+
+	db_positions.clear();
+	std::vector<size_t> ro_indices;
+	for (size_t i : db_indices) {
+		if ((*blobs)[i].empty()) {
+			db_positions.push_back(positions[i]);
+			ro_indices.push_back(i);
 		}
 	}
-	return block;
+	if (db_positions.empty())
+		return;
+
+	dbase_ro->loadBlocks(db_positions, &db_blobs);
+	for (size_t i = 0; i < ro_indices.size(); i++)
+		(*blobs)[ro_indices[i]] = std::move(db_blobs[i]);
+}
+
+std::unique_ptr<MapBlock> ServerMap::decodeBlock(v3s16 blockpos,
+		const std::string &blob, bool *need_lock)
+{
+	PROFILER_SCOPE(sp, "ServerMap: decode block", SPT_AVG);
+	*need_lock = false;
+
+	if (blob.empty())
+		return nullptr;
+
+	auto block = std::make_unique<MapBlock>(this, blockpos, m_gamedef);
+	try {
+		if (deSerializeBlock(block.get(), blob, false))
+			return block;
+	} catch (SerializationError &e) {
+		// Leave the error handling to loadBlock()
+	}
+	*need_lock = true;
+	return nullptr;
+}
+
+MapBlock *ServerMap::insertDecodedBlock(std::unique_ptr<MapBlock> block)
+{
+	v3s16 blockpos = block->getPos();
+	MapBlock *existing = getBlockNoCreateNoEx(blockpos);
+	if (existing)
+		return existing;
+
+	MapSector *sector = createSector(v2s16(blockpos.X, blockpos.Z));
+	MapBlock *ret = block.get();
+	sector->insertBlock(std::move(block));
+	ReflowScan scanner(this, m_emerge->ndef);
+	scanner.scan(ret, &m_transforming_liquid);
+
+	// We just loaded it from, so it's up-to-date.
+	ret->resetModified();
+
+	updateLoadedBlockLighting(ret);
+	return ret;
+}
+
+void ServerMap::updateLoadedBlockLighting(MapBlock *block)
+{
+	std::map<v3s16, MapBlock*> modified_blocks;
+	// Fix lighting if necessary
+	voxalgo::update_block_border_lighting(this, block, modified_blocks);
+	if (!modified_blocks.empty()) {
+		//Modified lighting, send event
+		MapEditEvent event;
+		event.type = MEET_OTHER;
+		event.setModifiedBlocks(modified_blocks);
+		dispatchEvent(event);
+	}
 }
 
 bool ServerMap::deleteBlock(v3s16 blockpos)
 {
-	if (!dbase->deleteBlock(blockpos))
-		return false;
+	// A pending write would bring the block back
+	if (m_block_writer)
+		m_block_writer->discard(blockpos);
+
+	{
+		MutexAutoLock lock(m_db_mutex);
+		if (!dbase->deleteBlock(blockpos))
+			return false;
+	}
 
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
 	if (block) {
@@ -1890,6 +2197,7 @@ bool ServerMap::deleteBlock(v3s16 blockpos)
 		// It may not be safe to delete the block from memory at the moment
 		// (pointers to it could still be in use)
 		m_detached_blocks.push_back(sector->detachBlock(block));
+		m_block_removal_count++;
 	}
 
 	return true;
@@ -24,9 +24,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <map>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 
 #include "irrlichttypes_bloated.h"
 #include "mapblock.h"
+#include "mapblockindex.h"
 #include "mapnode.h"
 #include "constants.h"
 #include "voxel.h"
@@ -40,6 +44,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 class Settings;
 class MapDatabase;
+class BlockWriter;
 class ClientMap;
 class MapSector;
 class ServerMapSector;
@@ -225,6 +230,13 @@ class Map /*: public NodeContainer*/
 	*/
 	void unloadUnreferencedBlocks(std::vector<v3s16> *unloaded_blocks=NULL);
 
+	/*
+		Incremented whenever blocks are removed from memory, so that code
+		working without the env lock can detect that a block it did not see
+		in memory may have been loaded, modified and unloaded in the meantime.
+	*/
+	u64 getBlockRemovalCount() const { return m_block_removal_count; }
+
 	// Deletes sectors and their blocks from memory
 	// Takes cache into account
 	// If deleted sector is in sector cache, clears cache
@@ -317,9 +329,17 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache = nullptr;
 	v2s16 m_sector_cache_p;
 
+	// All blocks of all sectors by position, kept up to date by MapSector
+	MapBlockIndex m_block_index;
+	// Changes whenever m_block_index does, to invalidate the per-thread
+	// lookup caches in getBlockNoCreateNoEx(). Unique across all maps.
+	u64 m_block_index_gen;
+
 	// This stores the properties of the nodes on the map.
 	const NodeDefManager *m_nodedef;
 
+	u64 m_block_removal_count = 0;
+
 	// Can be implemented by child class
 	virtual void reportMetrics(u64 save_time_us, u32 saved_blocks, u32 all_blocks) {}
 
@@ -328,6 +348,12 @@ class Map /*: public NodeContainer*/
 	bool isOccluded(const v3s16 &pos_camera, const v3s16 &pos_target,
 		float step, float stepfac, float start_offset, float end_offset,
 		u32 needed_count);
+
+private:
+	friend class MapSector;
+	// Called by MapSector when a block is added to or removed from it
+	void indexBlock(MapBlock *block);
+	void unindexBlock(MapBlock *block);
 };
 
 /*
@@ -401,6 +427,9 @@ class ServerMap : public Map
 	void endSave() override;
 
 	void save(ModifiedState save_level) override;
+	// Waits until the saved blocks are written to the map database.
+	// Returns false if some of them could not be written.
+	bool flushSaves();
 	void listAllLoadableBlocks(std::vector<v3s16> &dst);
 	void listAllLoadedBlocks(std::vector<v3s16> &dst);
 
@@ -412,6 +441,26 @@ class ServerMap : public Map
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
+	/*
+		Loading in two steps, so that reading and deserializing the block
+		(the slow part) doesn't have to happen with the env lock held.
+
+		readBlocks() reads the data of several blocks with one database
+		query, blobs[i] is left empty if positions[i] does not exist.
+		decodeBlock() deserializes one of them. need_lock is set if the block
+		has to be loaded with loadBlock() instead, i.e. if it contains unknown
+		node names or is invalid.
+		Both can be called from any thread without the env lock.
+
+		insertDecodedBlock() needs the env lock. If the block is already
+		in memory that one is returned and the decoded one discarded.
+	*/
+	void readBlocks(const std::vector<v3s16> &positions,
+			std::vector<std::string> *blobs);
+	std::unique_ptr<MapBlock> decodeBlock(v3s16 blockpos, const std::string &blob,
+			bool *need_lock);
+	MapBlock *insertDecodedBlock(std::unique_ptr<MapBlock> block);
+
 	// Blocks are removed from the map but not deleted from memory until
 	// deleteDetachedBlocks() is called, since pointers to them may still exist
 	// when deleteBlock() is called.
@@ -444,6 +493,8 @@ class ServerMap : public Map
 			ServerEnvironment *env);
 
 	void transforming_liquid_add(v3s16 p);
+	// Number of liquid nodes waiting for an update
+	u32 getTransformingLiquidCount() const;
 
 	MapSettingsManager settings_mgr;
 
@@ -454,6 +505,14 @@ class ServerMap : public Map
 private:
 	friend class ModApiMapgen; // for m_transforming_liquid
 
+	// Reads the block from the block writer or the databases
+	void readBlock(v3s16 blockpos, std::string *blob);
+	// Deserializes blob (as stored in the database) into block. Returns false
+	// if ids had to be allocated for unknown node names but allocate_ids is false.
+	bool deSerializeBlock(MapBlock *block, const std::string &blob, bool allocate_ids);
+	// Fixes the lighting at the borders of a block that was just loaded
+	void updateLoadedBlockLighting(MapBlock *block);
+
 	// Emerge manager
 	EmergeManager *m_emerge;
 
@@ -469,10 +528,12 @@ class ServerMap : public Map
 
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
-	f32 m_transforming_liquid_loop_count_multiplier = 1.0f;
-	u32 m_unprocessed_count = 0;
-	u64 m_inc_trending_up_start_time = 0; // milliseconds
-	bool m_queue_size_timer_started = false;
+	// Nodes that did not fit into the time budget of the last step
+	std::vector<v3s16> m_liquid_deferred;
+	// When m_liquid_deferred became non-empty (in microseconds), or 0
+	u64 m_liquid_behind_since = 0;
+	u32 m_liquid_loop_max;
+	u64 m_liquid_time_budget_us;
 
 	/*
 		Metadata is re-written on disk only if this is true.
@@ -481,11 +542,22 @@ class ServerMap : public Map
 	bool m_map_metadata_changed = true;
 	MapDatabase *dbase = nullptr;
 	MapDatabase *dbase_ro = nullptr;
+	// Must be held for accessing dbase and dbase_ro
+	std::mutex m_db_mutex;
+	// Shared while deserializing blocks, exclusive while allocating ids for
+	// unknown node names in the node definitions
+	std::shared_mutex m_node_ids_mutex;
+	// Compresses and writes saved blocks in the background, may be null
+	std::unique_ptr<BlockWriter> m_block_writer;
 
 	// Map metrics
 	MetricGaugePtr m_loaded_blocks_gauge;
 	MetricCounterPtr m_save_time_counter;
 	MetricCounterPtr m_save_count_counter;
+	MetricGaugePtr m_liquid_queue_gauge;
+	MetricGaugePtr m_liquid_lag_gauge;
+	MetricCounterPtr m_liquid_transformed_counter;
+	MetricCounterPtr m_liquid_time_counter;
 };
 
 
@@ -19,6 +19,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "mapblock.h"
 
+#include <algorithm>
+#include <atomic>
 #include <sstream>
 #include "map.h"
 #include "light.h"
@@ -66,11 +68,14 @@ static const char *modified_reason_strings[] = {
 	MapBlock
 */
 
+static std::atomic<u32> s_next_instance_id(0);
+
 MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef):
 		m_parent(parent),
 		m_pos(pos),
 		m_pos_relative(pos * MAP_BLOCKSIZE),
-		m_gamedef(gamedef)
+		m_gamedef(gamedef),
+		m_change_stamp((u64)s_next_instance_id.fetch_add(1) << 32)
 {
 	reallocate();
 }
@@ -201,6 +206,68 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+	invalidateContentCounts();
+}
+
+const MapBlock::ContentCounts *MapBlock::getContentCounts()
+{
+	if (m_content_counts_state == CONTENT_COUNTS_INVALID) {
+		m_content_counts.clear();
+		m_content_counts_state = CONTENT_COUNTS_VALID;
+		// Nodes of the same type tend to come in runs
+		content_t last_c = CONTENT_IGNORE;
+		size_t last_i = 0;
+		for (u32 i = 0; i < nodecount; i++) {
+			content_t c = data[i].getContent();
+			if (!m_content_counts.empty() && c == last_c) {
+				m_content_counts[last_i].second++;
+				continue;
+			}
+			auto it = std::find_if(m_content_counts.begin(), m_content_counts.end(),
+				[c] (const std::pair<content_t, u16> &e) { return e.first == c; });
+			if (it == m_content_counts.end()) {
+				if (m_content_counts.size() >= MAX_INDEXED_CONTENTS) {
+					m_content_counts_state = CONTENT_COUNTS_TOO_MANY;
+					m_content_counts.clear();
+					break;
+				}
+				m_content_counts.emplace_back(c, 0);
+				it = m_content_counts.end() - 1;
+			}
+			it->second++;
+			last_c = c;
+			last_i = it - m_content_counts.begin();
+		}
+	}
+
+	if (m_content_counts_state == CONTENT_COUNTS_TOO_MANY)
+		return nullptr;
+	return &m_content_counts;
+}
+
+void MapBlock::changeContentCount(content_t old_c, content_t new_c)
+{
+	auto find = [this] (content_t c) {
+		return std::find_if(m_content_counts.begin(), m_content_counts.end(),
+			[c] (const std::pair<content_t, u16> &e) { return e.first == c; });
+	};
+
+	auto it = find(old_c);
+	assert(it != m_content_counts.end());
+	if (--it->second == 0) {
+		*it = m_content_counts.back();
+		m_content_counts.pop_back();
+	}
+
+	it = find(new_c);
+	if (it != m_content_counts.end()) {
+		it->second++;
+	} else if (m_content_counts.size() < MAX_INDEXED_CONTENTS) {
+		m_content_counts.emplace_back(new_c, 1);
+	} else {
+		// Let getContentCounts() sort it out
+		invalidateContentCounts();
+	}
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -308,10 +375,11 @@ static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 }
 
 // Correct ids in the block to match nodedef based on names.
-// Unknown ones are added to nodedef.
+// Unknown ones are added to nodedef, unless allocate_ids is false, in which
+// case false is returned as soon as one is encountered.
 // Will not update itself to match id-name pairs in nodedef.
-static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
-		IGameDef *gamedef)
+static bool correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
+		IGameDef *gamedef, bool allocate_ids)
 {
 	const NodeDefManager *nodedef = gamedef->ndef();
 	// This means the block contains incorrect ids, and we contain
@@ -345,6 +413,8 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 
 		content_t global_id;
 		if (!nodedef->getId(name, global_id)) {
+			if (!allocate_ids)
+				return false;
 			global_id = gamedef->allocateUnknownNodeId(name);
 			if (global_id == CONTENT_IGNORE) {
 				unallocatable_contents.insert(name);
@@ -370,9 +440,23 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 				<< "Could not allocate global id for node name \""
 				<< node_name << "\"" << std::endl;
 	}
+	return true;
 }
 
 void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int compression_level)
+{
+	serializeImpl(os_compressed, version, disk, compression_level, true);
+}
+
+void MapBlock::serializeUncompressed(std::ostream &os, u8 version, bool disk)
+{
+	FATAL_ERROR_IF(version < 29, "Serialization version error");
+
+	serializeImpl(os, version, disk, 0, false);
+}
+
+void MapBlock::serializeImpl(std::ostream &os_compressed, u8 version, bool disk,
+		int compression_level, bool compress_whole)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -380,7 +464,7 @@ void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int
 	FATAL_ERROR_IF(version < SER_FMT_VER_LOWEST_WRITE, "Serialization version error");
 
 	std::ostringstream os_raw(std::ios_base::binary);
-	std::ostream &os = version >= 29 ? os_raw : os_compressed;
+	std::ostream &os = (version >= 29 && compress_whole) ? os_raw : os_compressed;
 
 	// First byte
 	u8 flags = 0;
@@ -472,7 +556,7 @@ void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int
 		}
 	}
 
-	if (version >= 29) {
+	if (version >= 29 && compress_whole) {
 		// now compress the whole thing
 		compress(os_raw.str(), os_compressed, version, compression_level);
 	}
@@ -483,7 +567,8 @@ void MapBlock::serializeNetworkSpecific(std::ostream &os)
 	writeU8(os, 2); // version
 }
 
-void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
+bool MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk,
+		bool allocate_ids)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -491,11 +576,12 @@ void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
 	TRACESTREAM(<<"MapBlock::deSerialize "<<getPos()<<std::endl);
 
 	m_day_night_differs_expired = false;
+	m_change_stamp++;
+	invalidateContentCounts();
 
 	if(version <= 21)
 	{
-		deSerialize_pre22(in_compressed, version, disk);
-		return;
+		return deSerialize_pre22(in_compressed, version, disk, allocate_ids);
 	}
 
 	// Decompress the whole block (version >= 29)
@@ -609,7 +695,8 @@ void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
 		}
 
 		// Dynamically re-set ids based on node names
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		if (!correctBlockNodeIds(&nimap, data, m_gamedef, allocate_ids))
+			return false;
 
 		if(version >= 25){
 			TRACESTREAM(<<"MapBlock::deSerialize "<<getPos()
@@ -620,6 +707,7 @@ void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
 
 	TRACESTREAM(<<"MapBlock::deSerialize "<<getPos()
 			<<": Done."<<std::endl);
+	return true;
 }
 
 void MapBlock::deSerializeNetworkSpecific(std::istream &is)
@@ -660,7 +748,8 @@ u32 MapBlock::clearObjects()
 	Legacy serialization
 */
 
-void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
+bool MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk,
+		bool allocate_ids)
 {
 	// Initialize default flags
 	is_underground = false;
@@ -792,7 +881,7 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 			if(count != 0){
 				warningstream<<"MapBlock::deSerialize_pre22(): "
 						<<"Ignoring stuff coming at and after MBOs"<<std::endl;
-				return;
+				return true;
 			}
 		}
 
@@ -819,7 +908,8 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 		} else {
 			content_mapnode_get_name_id_mapping(&nimap);
 		}
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		if (!correctBlockNodeIds(&nimap, data, m_gamedef, allocate_ids))
+			return false;
 	}
 
 	// Legacy data changes
@@ -859,6 +949,7 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 			data[i].setParam2(dir_new_format);
 		}
 	}
+	return true;
 }
 
 /*
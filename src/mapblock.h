@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include <set>
+#include <vector>
 #include "irr_v3d.h"
 #include "mapnode.h"
 #include "exceptions.h"
@@ -102,11 +103,14 @@ class MapBlock
 	{
 		for (u32 i = 0; i < nodecount; i++)
 			data[i] = MapNode(CONTENT_IGNORE);
+		invalidateContentCounts();
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_REALLOCATE);
 	}
 
+	// Note: the content index is reset, as the caller may modify the data
 	MapNode* getData()
 	{
+		invalidateContentCounts();
 		return data;
 	}
 
@@ -124,7 +128,7 @@ class MapBlock
 			m_modified_reason |= reason;
 		}
 		if (mod == MOD_STATE_WRITE_NEEDED)
-			contents_cached = false;
+			m_change_stamp++;
 	}
 
 	inline u32 getModified()
@@ -139,6 +143,14 @@ class MapBlock
 
 	std::string getModifiedReasonString();
 
+	// Changes every time the block data is modified (see raiseModified).
+	// Unique among all MapBlock instances, so it can be used to tell whether
+	// data derived from a block (e.g. its serialization) is still up to date.
+	inline u64 getChangeStamp() const
+	{
+		return m_change_stamp;
+	}
+
 	inline void resetModified()
 	{
 		m_modified = MOD_STATE_CLEAN;
@@ -276,7 +288,9 @@ class MapBlock
 		if (!isValidPosition(x, y, z))
 			throw InvalidPositionException();
 
-		data[z * zstride + y * ystride + x] = n;
+		MapNode &old = data[z * zstride + y * ystride + x];
+		updateContentCount(old.getContent(), n.getContent());
+		old = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE);
 	}
 
@@ -301,7 +315,9 @@ class MapBlock
 
 	inline void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode n)
 	{
-		data[z * zstride + y * ystride + x] = n;
+		MapNode &old = data[z * zstride + y * ystride + x];
+		updateContentCount(old.getContent(), n.getContent());
+		old = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE_NO_CHECK);
 	}
 
@@ -321,6 +337,17 @@ class MapBlock
 	// Copies data from VoxelManipulator getPosRelative()
 	void copyFrom(VoxelManipulator &dst);
 
+	////
+	//// Content index
+	////
+
+	typedef std::vector<std::pair<content_t, u16>> ContentCounts;
+
+	// Returns the content types present in the block and their node counts,
+	// or nullptr if there are too many different ones to keep track of.
+	// Kept up to date by setNode(), rebuilt on demand after bulk changes.
+	const ContentCounts *getContentCounts();
+
 	// Update day-night lighting difference flag.
 	// Sets m_day_night_differs to appropriate value.
 	// These methods don't care about neighboring blocks.
@@ -439,9 +466,18 @@ class MapBlock
 	// Set disk to true for on-disk format, false for over-the-network format
 	// Precondition: version >= SER_FMT_VER_LOWEST_WRITE
 	void serialize(std::ostream &result, u8 version, bool disk, int compression_level);
+	// Same as serialize(), but leaves out the compression of the whole block
+	// so that it can be done later with compress(), e.g. on another thread.
+	// Precondition: version >= 29
+	void serializeUncompressed(std::ostream &result, u8 version, bool disk);
 	// If disk == true: In addition to doing other things, will add
-	// unknown blocks from id-name mapping to wndef
-	void deSerialize(std::istream &is, u8 version, bool disk);
+	// unknown blocks from id-name mapping to wndef.
+	// With allocate_ids == false the node definitions are only read (so this
+	// can run concurrently to other readers) and false is returned if a node
+	// name without id is encountered. The block is left in an undefined state
+	// then and has to be deserialized again.
+	bool deSerialize(std::istream &is, u8 version, bool disk,
+			bool allocate_ids = true);
 
 	void serializeNetworkSpecific(std::ostream &os);
 	void deSerializeNetworkSpecific(std::istream &is);
@@ -455,7 +491,24 @@ class MapBlock
 		Private methods
 	*/
 
-	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
+	bool deSerialize_pre22(std::istream &is, u8 version, bool disk,
+			bool allocate_ids);
+
+	void serializeImpl(std::ostream &result, u8 version, bool disk,
+			int compression_level, bool compress_whole);
+
+	inline void invalidateContentCounts()
+	{
+		m_content_counts_state = CONTENT_COUNTS_INVALID;
+	}
+
+	inline void updateContentCount(content_t old_c, content_t new_c)
+	{
+		if (m_content_counts_state == CONTENT_COUNTS_VALID && old_c != new_c)
+			changeContentCount(old_c, new_c);
+	}
+
+	void changeContentCount(content_t old_c, content_t new_c);
 
 public:
 	/*
@@ -474,13 +527,6 @@ class MapBlock
 
 	static const u32 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
 
-	//// ABM optimizations ////
-	// Cache of content types
-	std::unordered_set<content_t> contents;
-	// True if content types are cached
-	bool contents_cached = false;
-	// True if we never want to cache content types for this block
-	bool do_not_cache_contents = false;
 	// marks the sides which are opaque: 00+Z-Z+Y-Y+X-X
 	u8 solid_sides {0};
 
@@ -512,6 +558,12 @@ class MapBlock
 	u32 m_modified = MOD_STATE_WRITE_NEEDED;
 	u32 m_modified_reason = MOD_REASON_INITIAL;
 
+	/*
+		Upper 32 bits: unique instance id, lower 32 bits: modification count.
+		See getChangeStamp().
+	*/
+	u64 m_change_stamp;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
@@ -558,6 +610,19 @@ class MapBlock
 	*/
 	int m_refcount = 0;
 
+	/*
+		Content index, see getContentCounts().
+		Blocks with more different contents than this are not indexed,
+		since looking them up would not be cheaper than scanning the nodes.
+	*/
+	static const size_t MAX_INDEXED_CONTENTS = 64;
+	enum : u8 {
+		CONTENT_COUNTS_INVALID,
+		CONTENT_COUNTS_VALID,
+		CONTENT_COUNTS_TOO_MANY,
+	} m_content_counts_state = CONTENT_COUNTS_INVALID;
+	ContentCounts m_content_counts;
+
 	MapNode data[nodecount];
 	NodeTimerList m_node_timers;
 };
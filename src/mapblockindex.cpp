@@ -0,0 +1,102 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapblockindex.h"
+#include <algorithm>
+#include <cassert>
+
+// Smallest table that is allocated, in slots
+static constexpr size_t MIN_CAPACITY = 64;
+
+void MapBlockIndex::insert(v3s16 p, MapBlock *block)
+{
+	assert(block);
+	// Keep the load factor at or below 1/2 so probe sequences stay short
+	if ((m_size + 1) * 2 > m_slots.size())
+		rehash(std::max(MIN_CAPACITY, m_slots.size() * 2));
+
+	const u64 key = packKey(p);
+	size_t i = hashKey(key) & m_mask;
+	while (m_slots[i].block) {
+		assert(m_slots[i].key != key);
+		i = (i + 1) & m_mask;
+	}
+	m_slots[i] = {key, block};
+	m_size++;
+}
+
+bool MapBlockIndex::erase(v3s16 p)
+{
+	if (m_slots.empty())
+		return false;
+
+	const u64 key = packKey(p);
+	size_t i = hashKey(key) & m_mask;
+	for (;; i = (i + 1) & m_mask) {
+		if (!m_slots[i].block)
+			return false;
+		if (m_slots[i].key == key)
+			break;
+	}
+
+	// Shift back the entries that would become unreachable through the hole
+	for (size_t j = (i + 1) & m_mask; m_slots[j].block; j = (j + 1) & m_mask) {
+		size_t home = hashKey(m_slots[j].key) & m_mask;
+		// Can the entry at j move to i without ending up before its home slot?
+		bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+		if (movable) {
+			m_slots[i] = m_slots[j];
+			i = j;
+		}
+	}
+	m_slots[i].block = nullptr;
+	m_size--;
+
+	// Give memory back after mass unloading
+	if (m_slots.size() > MIN_CAPACITY && m_size * 8 < m_slots.size())
+		rehash(m_slots.size() / 2);
+
+	return true;
+}
+
+void MapBlockIndex::clear()
+{
+	m_slots.clear();
+	m_slots.shrink_to_fit();
+	m_mask = 0;
+	m_size = 0;
+}
+
+void MapBlockIndex::rehash(size_t capacity)
+{
+	assert((capacity & (capacity - 1)) == 0);
+
+	std::vector<Slot> old(capacity, Slot{0, nullptr});
+	old.swap(m_slots);
+	m_mask = capacity - 1;
+
+	for (const Slot &slot : old) {
+		if (!slot.block)
+			continue;
+		size_t i = hashKey(slot.key) & m_mask;
+		while (m_slots[i].block)
+			i = (i + 1) & m_mask;
+		m_slots[i] = slot;
+	}
+}
@@ -0,0 +1,84 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irrlichttypes.h"
+#include "irr_v3d.h"
+#include <vector>
+
+class MapBlock;
+
+/*
+	Flat hash table from block position to MapBlock, used by Map to find a
+	block with a single lookup instead of going through the sectors.
+
+	Open addressing with linear probing. A slot is empty if its block is
+	nullptr; erasing shifts the following entries back, so there are no
+	tombstones. The index does not own the blocks.
+*/
+class MapBlockIndex
+{
+public:
+	MapBlockIndex() = default;
+
+	MapBlock *find(v3s16 p) const
+	{
+		if (m_slots.empty())
+			return nullptr;
+		const u64 key = packKey(p);
+		for (size_t i = hashKey(key) & m_mask;; i = (i + 1) & m_mask) {
+			const Slot &slot = m_slots[i];
+			if (!slot.block || slot.key == key)
+				return slot.block;
+		}
+	}
+
+	// Pre-condition: no block is indexed at the position of block
+	void insert(v3s16 p, MapBlock *block);
+	// Returns false if nothing was indexed at p
+	bool erase(v3s16 p);
+	void clear();
+
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+
+private:
+	struct Slot {
+		u64 key;
+		MapBlock *block;
+	};
+
+	static inline u64 packKey(v3s16 p)
+	{
+		return (u64)(u16)p.X | (u64)(u16)p.Y << 16 | (u64)(u16)p.Z << 32;
+	}
+
+	static inline size_t hashKey(u64 key)
+	{
+		// Fibonacci hashing, the high bits are the best mixed
+		return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	void rehash(size_t capacity);
+
+	std::vector<Slot> m_slots;
+	size_t m_mask = 0;
+	size_t m_size = 0;
+};
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h"
 #include "util/string.h"
 #include "util/container.h"
+#include <functional>
 #include <utility>
 
 #define MAPGEN_DEFAULT MAPGEN_V7
@@ -58,6 +59,7 @@ class VoxelManipulator;
 struct BlockMakeData;
 class VoxelArea;
 class Map;
+class ThreadPool;
 
 enum MapgenObject {
 	MGOBJ_VMANIP,
@@ -167,6 +169,9 @@ class Mapgen {
 	// might be NULL while m_emerge->biomegen is not.
 	EmergeParams *m_emerge = nullptr;
 	const NodeDefManager *ndef = nullptr;
+	// Shared by all mapgens, used to split up the work on a single chunk.
+	// May be nullptr.
+	ThreadPool *thread_pool = nullptr;
 
 	u32 blockseed;
 	s16 *heightmap = nullptr;
@@ -193,6 +198,10 @@ class Mapgen {
 
 	void updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nmax);
 
+	// Calls func(i) for every i in [0, count), spread over the thread pool if
+	// there is one. The calls must not depend on each other.
+	void runParallel(size_t count, const std::function<void(size_t)> &func);
+
 	/**
 	 * Set light in entire area to fixed value.
 	 * @param light Light value (contains both banks)
@@ -454,7 +454,8 @@ int MapgenCarpathian::generateTerrain()
 	noise_hills->perlinMap2D(node_min.X, node_min.Z);
 	noise_ridge_mnt->perlinMap2D(node_min.X, node_min.Z);
 	noise_step_mnt->perlinMap2D(node_min.X, node_min.Z);
-	noise_mnt_var->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
+	noise_mnt_var->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			nullptr, thread_pool);
 
 	if (spflags & MGCARPATHIAN_RIVERS)
 		noise_rivers->perlinMap2D(node_min.X, node_min.Z);
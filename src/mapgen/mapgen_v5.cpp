@@ -289,7 +289,8 @@ int MapgenV5::generateBaseTerrain()
 
 	noise_factor->perlinMap2D(node_min.X, node_min.Z);
 	noise_height->perlinMap2D(node_min.X, node_min.Z);
-	noise_ground->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
+	noise_ground->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			nullptr, thread_pool);
 
 	for (s16 z=node_min.Z; z<=node_max.Z; z++) {
 		for (s16 y=node_min.Y - 1; y<=node_max.Y + 1; y++) {
@@ -496,7 +496,8 @@ int MapgenV7::generateTerrain()
 
 	if (spflags & MGV7_MOUNTAINS) {
 		noise_mount_height->perlinMap2D(node_min.X, node_min.Z);
-		noise_mountain->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
+		noise_mountain->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			nullptr, thread_pool);
 	}
 
 	//// Floatlands
@@ -512,7 +513,8 @@ int MapgenV7::generateTerrain()
 			node_max.Y >= floatland_ymin && node_min.Y <= floatland_ymax) {
 		gen_floatlands = true;
 		// Calculate noise for floatland generation
-		noise_floatland->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
+		noise_floatland->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			nullptr, thread_pool);
 
 		// Cache floatland noise offset values, for floatland tapering
 		for (s16 y = node_min.Y - 1; y <= node_max.Y + 1; y++, cache_index++) {
@@ -533,7 +535,8 @@ int MapgenV7::generateTerrain()
 	bool gen_rivers = (spflags & MGV7_RIDGES) && node_max.Y >= water_level - 16 &&
 		!gen_floatlands;
 	if (gen_rivers) {
-		noise_ridge->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
+		noise_ridge->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			nullptr, thread_pool);
 		noise_ridge_uwater->perlinMap2D(node_min.X, node_min.Z);
 	}
 
@@ -355,7 +355,8 @@ int MapgenValleys::generateTerrain()
 	noise_valley_depth->perlinMap2D(node_min.X, node_min.Z);
 	noise_valley_profile->perlinMap2D(node_min.X, node_min.Z);
 
-	noise_inter_valley_fill->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
+	noise_inter_valley_fill->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			nullptr, thread_pool);
 
 	const v3s16 &em = vm->m_area.getExtent();
 	s16 surface_max_y = -MAX_MAP_GENERATION_LIMIT;
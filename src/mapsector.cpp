@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "mapsector.h"
 #include "exceptions.h"
+#include "map.h"
 #include "mapblock.h"
 #include "serialization.h"
 
@@ -40,6 +41,8 @@ void MapSector::deleteBlocks()
 	m_block_cache = nullptr;
 
 	// Delete all blocks
+	for (auto &block : m_blocks)
+		m_parent->unindexBlock(block.second.get());
 	m_blocks.clear();
 }
 
@@ -82,6 +85,7 @@ MapBlock *MapSector::createBlankBlock(s16 y)
 	MapBlock *block = block_u.get();
 
 	m_blocks[y] = std::move(block_u);
+	m_parent->indexBlock(block);
 
 	return block;
 }
@@ -99,6 +103,7 @@ void MapSector::insertBlock(std::unique_ptr<MapBlock> block)
 	assert(p2d == m_pos);
 
 	// Insert into container
+	m_parent->indexBlock(block.get());
 	m_blocks[block_y] = std::move(block);
 }
 
@@ -121,6 +126,7 @@ std::unique_ptr<MapBlock> MapSector::detachBlock(MapBlock *block)
 	std::unique_ptr<MapBlock> ret = std::move(it->second);
 	assert(ret.get() == block);
 	m_blocks.erase(it);
+	m_parent->unindexBlock(block);
 
 	// Mark as removed
 	block->makeOrphan();
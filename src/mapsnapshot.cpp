@@ -0,0 +1,56 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapsnapshot.h"
+#include "map.h"
+#include "mapblock.h"
+
+MapSnapshot::MapSnapshot(Map *map, v3s16 blockpos_min, v3s16 blockpos_max,
+		bool load) :
+	m_area(blockpos_min * MAP_BLOCKSIZE,
+		(blockpos_max + 1) * MAP_BLOCKSIZE - v3s16(1, 1, 1)),
+	m_block_area(blockpos_min, blockpos_max),
+	m_data(m_area.getVolume(), MapNode(CONTENT_IGNORE)),
+	m_block_exists(m_block_area.getVolume(), false)
+{
+	assert(map);
+
+	for (s16 z = blockpos_min.Z; z <= blockpos_max.Z; z++)
+	for (s16 y = blockpos_min.Y; y <= blockpos_max.Y; y++)
+	for (s16 x = blockpos_min.X; x <= blockpos_max.X; x++) {
+		v3s16 bp(x, y, z);
+		MapBlock *block = map->getBlockNoCreateNoEx(bp);
+		if (!block && load && !blockpos_over_max_limit(bp))
+			block = map->emergeBlock(bp, false);
+		if (!block)
+			continue;
+
+		// Copy row by row; the rows of a block are contiguous in m_data too
+		v3s16 relpos = block->getPosRelative();
+		for (s16 rz = 0; rz < MAP_BLOCKSIZE; rz++)
+		for (s16 ry = 0; ry < MAP_BLOCKSIZE; ry++) {
+			u32 i = m_area.index(relpos + v3s16(0, ry, rz));
+			for (s16 rx = 0; rx < MAP_BLOCKSIZE; rx++)
+				m_data[i + rx] = block->getNodeNoCheck(rx, ry, rz);
+		}
+
+		m_block_exists[m_block_area.index(bp)] = true;
+		m_block_count++;
+	}
+}
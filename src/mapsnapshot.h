@@ -0,0 +1,82 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irr_v3d.h"
+#include "constants.h"
+#include "mapnode.h"
+#include "voxel.h"
+#include "util/basic_macros.h"
+#include "util/numeric.h"
+#include <vector>
+
+class Map;
+
+/*
+	Read-only copy of the nodes of a range of MapBlocks.
+
+	The snapshot does not reference the map once it is taken, so it can be
+	shared between threads (e.g. handed to async jobs) without locking.
+	Blocks that were not in the map are filled with CONTENT_IGNORE.
+*/
+class MapSnapshot
+{
+public:
+	// Copies the blocks blockpos_min..blockpos_max from map.
+	// If load is true, blocks that are not in memory are loaded from disk,
+	// but never generated.
+	MapSnapshot(Map *map, v3s16 blockpos_min, v3s16 blockpos_max,
+		bool load = true);
+
+	DISABLE_CLASS_COPY(MapSnapshot)
+
+	// Area of the snapshot in nodes. Indices into getData() are relative to it.
+	const VoxelArea &getArea() const { return m_area; }
+	const MapNode *getData() const { return m_data.data(); }
+
+	MapNode getNode(v3s16 p, bool *is_valid_position = nullptr) const
+	{
+		if (!m_area.contains(p) || !blockExists(getContainerPos(p, MAP_BLOCKSIZE))) {
+			if (is_valid_position)
+				*is_valid_position = false;
+			return MapNode(CONTENT_IGNORE);
+		}
+		if (is_valid_position)
+			*is_valid_position = true;
+		return m_data[m_area.index(p)];
+	}
+
+	bool blockExists(v3s16 blockpos) const
+	{
+		if (!m_block_area.contains(blockpos))
+			return false;
+		return m_block_exists[m_block_area.index(blockpos)];
+	}
+
+	// Number of blocks that had data in the map
+	u32 getBlockCount() const { return m_block_count; }
+
+private:
+	VoxelArea m_area;
+	VoxelArea m_block_area;
+	std::vector<MapNode> m_data;
+	std::vector<bool> m_block_exists;
+	u32 m_block_count = 0;
+};
@@ -87,6 +87,10 @@ void Client::handleCommand_Hello(NetworkPacket* pkt)
 	m_server_ser_ver = serialization_ver;
 	m_proto_ver = proto_ver;
 
+	// Small packets to the server may now be bundled into one datagram
+	if (m_proto_ver >= 43)
+		m_con->SetPeerCoalescing(PEER_ID_SERVER, true);
+
 	//TODO verify that username_legacy matches sent username, only
 	// differs in casing (make both uppercase and compare)
 	// This is only necessary though when we actually want to add casing support
@@ -1318,7 +1318,7 @@ PeerHelper Connection::getPeerNoEx(session_t peer_id)
 }
 
 /* find peer_id for address */
-u16 Connection::lookupPeer(Address& sender)
+u16 Connection::lookupPeer(const Address &sender)
 {
 	MutexAutoLock peerlock(m_peers_mutex);
 	std::map<u16, Peer*>::iterator j;
@@ -1496,6 +1496,17 @@ Address Connection::GetPeerAddress(session_t peer_id)
 	return peer_address;
 }
 
+void Connection::SetPeerCoalescing(session_t peer_id, bool enable)
+{
+	PeerHelper peer = getPeerNoEx(peer_id);
+	if (!peer)
+		return;
+
+	UDPPeer *udp_peer = dynamic_cast<UDPPeer *>(&peer);
+	if (udp_peer)
+		udp_peer->setCoalescing(enable);
+}
+
 float Connection::getPeerStat(session_t peer_id, rtt_stat_type type)
 {
 	PeerHelper peer = getPeerNoEx(peer_id);
@@ -1538,7 +1549,7 @@ float Connection::getLocalStat(rate_stat_type type)
 	return retval;
 }
 
-u16 Connection::createPeer(Address& sender, MTProtocols protocol, int fd)
+u16 Connection::createPeer(const Address &sender, MTProtocols protocol, int fd)
 {
 	// Somebody wants to make a new connection
 
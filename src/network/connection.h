@@ -118,6 +118,26 @@ with a buffer in the receiving and transmitting end.
 */
 //#define TYPE_RELIABLE 3
 #define RELIABLE_HEADER_SIZE 3
+
+/*
+COALESCED: Several packets of any other type bundled into one datagram to
+save on per-datagram overhead. Only sent to peers that announced support
+for it (see Connection::SetPeerCoalescing).
+- When processed, each contained packet is processed as if it had arrived
+  in a datagram of its own with the given channel. Reliable packets are
+  still acknowledged one by one.
+	Header (1 byte):
+	[0] u8 type
+	Followed by any number of entries (3 byte header each):
+	[0] u8 channel
+	[1] u16 size
+	[3] u8[size] packet data (without base header)
+*/
+//#define TYPE_COALESCED 4
+#define COALESCED_HEADER_SIZE 1
+#define COALESCED_ENTRY_HEADER_SIZE 3
+/* upper bound for coalesced datagrams: IPv6 minimum MTU minus IP and UDP headers */
+#define COALESCED_MAX_SIZE 1232
 #define SEQNUM_INITIAL 65500
 #define SEQNUM_MAX 65535
 
@@ -140,6 +160,7 @@ enum PacketType : u8 {
 	PACKET_TYPE_ORIGINAL = 1,
 	PACKET_TYPE_SPLIT = 2,
 	PACKET_TYPE_RELIABLE = 3,
+	PACKET_TYPE_COALESCED = 4,
 	PACKET_TYPE_MAX
 };
 
@@ -639,6 +660,12 @@ class UDPPeer : public Peer
 
 	void setResendTimeout(float timeout)
 		{ MutexAutoLock lock(m_exclusive_access_mutex); resend_timeout = timeout; }
+
+	bool getCoalescing()
+		{ MutexAutoLock lock(m_exclusive_access_mutex); return m_coalescing; }
+
+	void setCoalescing(bool enable)
+		{ MutexAutoLock lock(m_exclusive_access_mutex); m_coalescing = enable; }
 	bool Ping(float dtime,SharedBuffer<u8>& data);
 
 	Channel channels[CHANNEL_COUNT];
@@ -647,6 +674,9 @@ class UDPPeer : public Peer
 	// This is changed dynamically
 	float resend_timeout = 0.5;
 
+	// Whether the peer understands PACKET_TYPE_COALESCED
+	bool m_coalescing = false;
+
 	bool processReliableSendCommand(
 					ConnectionCommandPtr &c_ptr,
 					unsigned int max_packet_size);
@@ -724,12 +754,15 @@ class Connection
 	u32 GetProtocolID() const { return m_protocol_id; };
 	const std::string getDesc();
 	void DisconnectPeer(session_t peer_id);
+	// Allow bundling several packets into one datagram. Only enable this
+	// once the peer is known to support it (protocol version 43+).
+	void SetPeerCoalescing(session_t peer_id, bool enable);
 
 protected:
 	PeerHelper getPeerNoEx(session_t peer_id);
-	u16   lookupPeer(Address& sender);
+	u16   lookupPeer(const Address &sender);
 
-	u16 createPeer(Address& sender, MTProtocols protocol, int fd);
+	u16 createPeer(const Address &sender, MTProtocols protocol, int fd);
 	UDPPeer*  createServerPeer(Address& sender);
 	bool deletePeer(session_t peer_id, bool timeout);
 
@@ -123,6 +123,16 @@ void *ConnectionSendThread::run()
 		/* send queued packets */
 		sendPackets(dtime);
 
+		/* send out whatever was bundled during this iteration */
+		flushCoalesced();
+
+		/* hand all datagrams of this iteration to the system at once */
+		u32 failed = m_connection->m_udpSocket.FlushSend();
+		if (failed > 0) {
+			LOG(derr_con << m_connection->getDesc()
+				<< "Connection: failed to send " << failed << " packets" << std::endl);
+		}
+
 		END_DEBUG_EXCEPTION_HANDLER
 	}
 
@@ -237,7 +247,7 @@ void ConnectionSendThread::runTimeouts(float dtime)
 					<< ", seqnum=" << seqnum
 					<< std::endl);
 
-				rawSend(k.get());
+				rawSend(udpPeer, k.get());
 
 				// do not handle rtt here as we can't decide if this packet was
 				// lost or really takes more time to transmit
@@ -273,10 +283,10 @@ void ConnectionSendThread::runTimeouts(float dtime)
 void ConnectionSendThread::rawSend(const BufferedPacket *p)
 {
 	try {
-		m_connection->m_udpSocket.Send(p->address, p->data, p->size());
+		m_connection->m_udpSocket.QueueSend(p->address, p->data, p->size());
 		LOG(dout_con << m_connection->getDesc()
 			<< " rawSend: " << p->size()
-			<< " bytes sent" << std::endl);
+			<< " bytes queued" << std::endl);
 	} catch (SendFailedException &e) {
 		LOG(derr_con << m_connection->getDesc()
 			<< "Connection::rawSend(): SendFailedException: "
@@ -284,7 +294,79 @@ void ConnectionSendThread::rawSend(const BufferedPacket *p)
 	}
 }
 
-void ConnectionSendThread::sendAsPacketReliable(BufferedPacketPtr &p, Channel *channel)
+void ConnectionSendThread::rawSend(UDPPeer *peer, const BufferedPacket *p)
+{
+	const u32 inner_size = p->size() - BASE_HEADER_SIZE;
+	const u32 entry_size = COALESCED_ENTRY_HEADER_SIZE + inner_size;
+
+	if (!peer->getCoalescing() || BASE_HEADER_SIZE + COALESCED_HEADER_SIZE +
+			entry_size > COALESCED_MAX_SIZE) {
+		rawSend(p);
+		return;
+	}
+
+	CoalescedPacket &packet = m_coalesced[peer->id];
+	if (packet.count > 0 && packet.data.size() + entry_size > COALESCED_MAX_SIZE)
+		flushCoalesced(packet);
+
+	if (packet.count == 0) {
+		packet.address = p->address;
+		// Reuse the base header of the first packet, channel is per entry
+		packet.data.assign(p->data, p->data + BASE_HEADER_SIZE);
+		writeU8(&packet.data[6], 0);
+		packet.data.push_back(PACKET_TYPE_COALESCED);
+	}
+
+	const size_t offset = packet.data.size();
+	packet.data.resize(offset + entry_size);
+	writeU8(&packet.data[offset], readChannel(p->data));
+	writeU16(&packet.data[offset + 1], inner_size);
+	memcpy(&packet.data[offset + COALESCED_ENTRY_HEADER_SIZE],
+		p->data + BASE_HEADER_SIZE, inner_size);
+	packet.count++;
+}
+
+void ConnectionSendThread::flushCoalesced()
+{
+	for (auto it = m_coalesced.begin(); it != m_coalesced.end();) {
+		// Forget peers that had nothing to send since the last flush
+		if (it->second.count == 0) {
+			it = m_coalesced.erase(it);
+			continue;
+		}
+		flushCoalesced(it->second);
+		++it;
+	}
+}
+
+void ConnectionSendThread::flushCoalesced(CoalescedPacket &packet)
+{
+	std::vector<u8> &data = packet.data;
+	if (packet.count == 1) {
+		// Nothing to bundle it with, send the packet as it was
+		const u8 channelnum = data[BASE_HEADER_SIZE + COALESCED_HEADER_SIZE];
+		data.erase(data.begin() + BASE_HEADER_SIZE, data.begin() +
+			BASE_HEADER_SIZE + COALESCED_HEADER_SIZE + COALESCED_ENTRY_HEADER_SIZE);
+		writeU8(&data[6], channelnum);
+	}
+
+	try {
+		m_connection->m_udpSocket.QueueSend(packet.address, data.data(), data.size());
+		LOG(dout_con << m_connection->getDesc()
+			<< " flushCoalesced: " << packet.count << " packets in "
+			<< data.size() << " bytes queued" << std::endl);
+	} catch (SendFailedException &e) {
+		LOG(derr_con << m_connection->getDesc()
+			<< "Connection::flushCoalesced(): SendFailedException: "
+			<< packet.address.serializeString() << std::endl);
+	}
+
+	data.clear();
+	packet.count = 0;
+}
+
+void ConnectionSendThread::sendAsPacketReliable(UDPPeer *peer, BufferedPacketPtr &p,
+	Channel *channel)
 {
 	try {
 		p->absolute_send_time = porting::getTimeMs();
@@ -300,7 +382,7 @@ void ConnectionSendThread::sendAsPacketReliable(BufferedPacketPtr &p, Channel *c
 	}
 
 	// Send the packet
-	rawSend(p.get());
+	rawSend(peer, p.get());
 }
 
 bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
@@ -313,7 +395,8 @@ bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
 			<< "packet for non existent peer_id: " << peer_id << std::endl);
 		return false;
 	}
-	Channel *channel = &(dynamic_cast<UDPPeer *>(&peer)->channels[channelnum]);
+	UDPPeer *udp_peer = dynamic_cast<UDPPeer *>(&peer);
+	Channel *channel = &udp_peer->channels[channelnum];
 
 	if (reliable) {
 		bool have_seqnum = false;
@@ -337,7 +420,7 @@ bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
 				<< " INFO: sending a reliable packet to peer_id " << peer_id
 				<< " channel: " << (u32)channelnum
 				<< " seqnum: " << seqnum << std::endl);
-			sendAsPacketReliable(p, channel);
+			sendAsPacketReliable(udp_peer, p, channel);
 			return true;
 		}
 
@@ -357,7 +440,7 @@ bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
 			channelnum);
 
 		// Send the packet
-		rawSend(p.get());
+		rawSend(udp_peer, p.get());
 		return true;
 	}
 
@@ -697,7 +780,7 @@ void ConnectionSendThread::sendPackets(float dtime)
 					<< ", seqnum: " << p->getSeqnum()
 					<< std::endl);
 
-				sendAsPacketReliable(p, &channel);
+				sendAsPacketReliable(udpPeer, p, &channel);
 				peer->m_increment_packets_remaining--;
 			}
 		}
@@ -783,12 +866,6 @@ void *ConnectionReceiveThread::run()
 	ThreadIdentifier);
 	PROFILE(ThreadIdentifier << "ConnectionReceive: [" << m_connection->getDesc() << "]");
 
-	// use IPv6 minimum allowed MTU as receive buffer size as this is
-	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
-	// infrastructure
-	const unsigned int packet_maxsize = 1500;
-	SharedBuffer<u8> packetdata(packet_maxsize);
-
 	bool packet_queued = true;
 
 #ifdef DEBUG_CONNECTION_KBPS
@@ -809,7 +886,7 @@ void *ConnectionReceiveThread::run()
 #endif
 
 		/* receive packets */
-		receive(packetdata, packet_queued);
+		receive(packet_queued);
 
 #ifdef DEBUG_CONNECTION_KBPS
 		debug_print_timer += dtime;
@@ -869,8 +946,7 @@ void *ConnectionReceiveThread::run()
 }
 
 // Receive packets from the network and buffers and create ConnectionEvents
-void ConnectionReceiveThread::receive(SharedBuffer<u8> &packetdata,
-		bool &packet_queued)
+void ConnectionReceiveThread::receive(bool &packet_queued)
 {
 	try {
 		// First, see if there any buffered packets we can process now
@@ -890,119 +966,169 @@ void ConnectionReceiveThread::receive(SharedBuffer<u8> &packetdata,
 			}
 			packet_queued = false;
 		}
+	}
+	catch (InvalidIncomingDataException &e) {
+	}
 
-		// Call Receive() to wait for incoming data
-		Address sender;
-		s32 received_size = m_connection->m_udpSocket.Receive(sender,
-			*packetdata, packetdata.getSize());
-		if (received_size < 0)
-			return;
+	// use IPv6 minimum allowed MTU as receive buffer size as this is
+	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
+	// infrastructure
+	const int packet_maxsize = 1500;
 
-		if ((received_size < BASE_HEADER_SIZE) ||
-				(readU32(&packetdata[0]) != m_connection->GetProtocolID())) {
-			LOG(derr_con << m_connection->getDesc()
-				<< "Receive(): Invalid incoming packet, "
-				<< "size: " << received_size
-				<< ", protocol: "
-				<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
-				<< std::endl);
-			return;
+	// Wait for incoming data, then take everything that arrived at once
+	UDPSocket::ReceivedPacket packets[UDPSocket::MAX_BATCH_SIZE];
+	int count = m_connection->m_udpSocket.ReceiveBatch(packets,
+		UDPSocket::MAX_BATCH_SIZE, packet_maxsize);
+
+	for (int i = 0; i < count; i++) {
+		try {
+			receiveDatagram(packets[i].sender, packets[i].data, packets[i].size,
+				packet_queued);
+		}
+		catch (InvalidIncomingDataException &e) {
 		}
+	}
+}
 
-		session_t peer_id = readPeerId(*packetdata);
-		u8 channelnum = readChannel(*packetdata);
+// Handles one datagram received from the network
+void ConnectionReceiveThread::receiveDatagram(const Address &sender,
+		const u8 *packetdata, s32 received_size, bool &packet_queued)
+{
+	if ((received_size < BASE_HEADER_SIZE) ||
+			(readU32(&packetdata[0]) != m_connection->GetProtocolID())) {
+		LOG(derr_con << m_connection->getDesc()
+			<< "Receive(): Invalid incoming packet, "
+			<< "size: " << received_size
+			<< ", protocol: "
+			<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
+			<< std::endl);
+		return;
+	}
 
-		if (channelnum > CHANNEL_COUNT - 1) {
-			LOG(derr_con << m_connection->getDesc()
-				<< "Receive(): Invalid channel " << (u32)channelnum << std::endl);
-			return;
-		}
+	session_t peer_id = readPeerId(packetdata);
+	u8 channelnum = readChannel(packetdata);
 
-		/* Try to identify peer by sender address (may happen on join) */
-		if (peer_id == PEER_ID_INEXISTENT) {
-			peer_id = m_connection->lookupPeer(sender);
-			// We do not have to remind the peer of its
-			// peer id as the CONTROLTYPE_SET_PEER_ID
-			// command was sent reliably.
-		}
+	if (channelnum > CHANNEL_COUNT - 1) {
+		LOG(derr_con << m_connection->getDesc()
+			<< "Receive(): Invalid channel " << (u32)channelnum << std::endl);
+		return;
+	}
 
-		if (peer_id == PEER_ID_INEXISTENT) {
-			/* Ignore it if we are a client */
-			if (m_connection->ConnectedToServer())
-				return;
-			/* The peer was not found in our lists. Add it. */
-			peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
-		}
+	/* Try to identify peer by sender address (may happen on join) */
+	if (peer_id == PEER_ID_INEXISTENT) {
+		peer_id = m_connection->lookupPeer(sender);
+		// We do not have to remind the peer of its
+		// peer id as the CONTROLTYPE_SET_PEER_ID
+		// command was sent reliably.
+	}
 
-		PeerHelper peer = m_connection->getPeerNoEx(peer_id);
-		if (!peer) {
-			LOG(dout_con << m_connection->getDesc()
-				<< " got packet from unknown peer_id: "
-				<< peer_id << " Ignoring." << std::endl);
+	if (peer_id == PEER_ID_INEXISTENT) {
+		/* Ignore it if we are a client */
+		if (m_connection->ConnectedToServer())
 			return;
-		}
+		/* The peer was not found in our lists. Add it. */
+		peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
+	}
 
-		// Validate peer address
+	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
+	if (!peer) {
+		LOG(dout_con << m_connection->getDesc()
+			<< " got packet from unknown peer_id: "
+			<< peer_id << " Ignoring." << std::endl);
+		return;
+	}
 
-		Address peer_address;
-		if (peer->getAddress(MTP_UDP, peer_address)) {
-			if (peer_address != sender) {
-				LOG(derr_con << m_connection->getDesc()
-					<< " Peer " << peer_id << " sending from different address."
-					" Ignoring." << std::endl);
-				return;
-			}
-		} else {
+	// Validate peer address
+
+	Address peer_address;
+	if (peer->getAddress(MTP_UDP, peer_address)) {
+		if (peer_address != sender) {
 			LOG(derr_con << m_connection->getDesc()
-				<< " Peer " << peer_id << " doesn't have an address?!"
+				<< " Peer " << peer_id << " sending from different address."
 				" Ignoring." << std::endl);
 			return;
 		}
+	} else {
+		LOG(derr_con << m_connection->getDesc()
+			<< " Peer " << peer_id << " doesn't have an address?!"
+			" Ignoring." << std::endl);
+		return;
+	}
 
-		peer->ResetTimeout();
+	peer->ResetTimeout();
 
-		Channel *channel = nullptr;
-		if (dynamic_cast<UDPPeer *>(&peer)) {
-			channel = &dynamic_cast<UDPPeer *>(&peer)->channels[channelnum];
-		} else {
-			LOG(derr_con << m_connection->getDesc()
-				<< "Receive(): peer_id=" << peer_id << " isn't an UDPPeer?!"
-				" Ignoring." << std::endl);
-			return;
-		}
+	UDPPeer *udp_peer = dynamic_cast<UDPPeer *>(&peer);
+	Channel *channel = nullptr;
+	if (udp_peer) {
+		channel = &udp_peer->channels[channelnum];
+	} else {
+		LOG(derr_con << m_connection->getDesc()
+			<< "Receive(): peer_id=" << peer_id << " isn't an UDPPeer?!"
+			" Ignoring." << std::endl);
+		return;
+	}
+
+	channel->UpdateBytesReceived(received_size);
 
-		channel->UpdateBytesReceived(received_size);
+	// Throw the received packet to channel->processPacket()
 
-		// Throw the received packet to channel->processPacket()
+	if (received_size > BASE_HEADER_SIZE &&
+			packetdata[BASE_HEADER_SIZE] == PACKET_TYPE_COALESCED) {
+		// Several packets in one datagram, handle each as if it came alone
+		u32 offset = BASE_HEADER_SIZE + COALESCED_HEADER_SIZE;
+		while (offset + COALESCED_ENTRY_HEADER_SIZE <= (u32)received_size) {
+			const u8 entry_channelnum = readU8(&packetdata[offset]);
+			const u16 size = readU16(&packetdata[offset + 1]);
+			offset += COALESCED_ENTRY_HEADER_SIZE;
 
+			if (entry_channelnum > CHANNEL_COUNT - 1 || size == 0 ||
+					offset + size > (u32)received_size) {
+				LOG(derr_con << m_connection->getDesc()
+					<< "Receive(): Invalid coalesced packet entry, channel "
+					<< (u32)entry_channelnum << ", size " << size << std::endl);
+				break;
+			}
+
+			SharedBuffer<u8> entrydata(size);
+			memcpy(*entrydata, &packetdata[offset], size);
+			offset += size;
+
+			processReceived(&udp_peer->channels[entry_channelnum], entrydata,
+				peer_id, entry_channelnum);
+		}
+	} else {
 		// Make a new SharedBuffer from the data without the base headers
 		SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
 		memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
 			strippeddata.getSize());
 
-		try {
-			// Process it (the result is some data with no headers made by us)
-			SharedBuffer<u8> resultdata = processPacket
-				(channel, strippeddata, peer_id, channelnum, false);
+		processReceived(channel, strippeddata, peer_id, channelnum);
+	}
 
-			LOG(dout_con << m_connection->getDesc()
-				<< " ProcessPacket from peer_id: " << peer_id
-				<< ", channel: " << (u32)channelnum << ", returned "
-				<< resultdata.getSize() << " bytes" << std::endl);
+	/* Every time we receive a packet it can happen that a previously
+	 * buffered packet is now ready to process. */
+	packet_queued = true;
+}
 
-			m_connection->putEvent(ConnectionEvent::dataReceived(peer_id, resultdata));
-		}
-		catch (ProcessedSilentlyException &e) {
-		}
-		catch (ProcessedQueued &e) {
-			// we set it to true anyway (see below)
-		}
+void ConnectionReceiveThread::processReceived(Channel *channel,
+	const SharedBuffer<u8> &packetdata, session_t peer_id, u8 channelnum)
+{
+	try {
+		// Process it (the result is some data with no headers made by us)
+		SharedBuffer<u8> resultdata = processPacket
+			(channel, packetdata, peer_id, channelnum, false);
+
+		LOG(dout_con << m_connection->getDesc()
+			<< " ProcessPacket from peer_id: " << peer_id
+			<< ", channel: " << (u32)channelnum << ", returned "
+			<< resultdata.getSize() << " bytes" << std::endl);
 
-		/* Every time we receive a packet it can happen that a previously
-		 * buffered packet is now ready to process. */
-		packet_queued = true;
+		m_connection->putEvent(ConnectionEvent::dataReceived(peer_id, resultdata));
 	}
-	catch (InvalidIncomingDataException &e) {
+	catch (ProcessedSilentlyException &e) {
+	}
+	catch (ProcessedQueued &e) {
+		// the caller marks buffered packets for processing anyway
 	}
 }
 
@@ -1099,6 +1225,7 @@ const ConnectionReceiveThread::PacketTypeHandler
 	{&ConnectionReceiveThread::handlePacketType_Original},
 	{&ConnectionReceiveThread::handlePacketType_Split},
 	{&ConnectionReceiveThread::handlePacketType_Reliable},
+	{&ConnectionReceiveThread::handlePacketType_Coalesced},
 };
 
 SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Control(Channel *channel,
@@ -1247,6 +1374,13 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Split(Channel *channe
 	FATAL_ERROR("Invalid execution point");
 }
 
+SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Coalesced(Channel *channel,
+	const SharedBuffer<u8> &packetdata, Peer *peer, u8 channelnum, bool reliable)
+{
+	// Coalesced packets are unpacked in receive(), they can't be nested
+	throw InvalidIncomingDataException("Found nested coalesced packets");
+}
+
 SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Reliable(Channel *channel,
 	const SharedBuffer<u8> &packetdata, Peer *peer, u8 channelnum, bool reliable)
 {
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include <cassert>
+#include <unordered_map>
 #include "threading/thread.h"
 #include "connection.h"
 
@@ -71,6 +72,10 @@ class ConnectionSendThread : public Thread
 private:
 	void runTimeouts(float dtime);
 	void rawSend(const BufferedPacket *p);
+	// Like rawSend, but may bundle the packet with others for the same peer
+	void rawSend(UDPPeer *peer, const BufferedPacket *p);
+	// Sends out everything bundled by rawSend
+	void flushCoalesced();
 	bool rawSendAsPacket(session_t peer_id, u8 channelnum,
 			const SharedBuffer<u8> &data, bool reliable);
 
@@ -90,7 +95,7 @@ class ConnectionSendThread : public Thread
 	void sendAsPacket(session_t peer_id, u8 channelnum, const SharedBuffer<u8> &data,
 			bool ack = false);
 
-	void sendAsPacketReliable(BufferedPacketPtr &p, Channel *channel);
+	void sendAsPacketReliable(UDPPeer *peer, BufferedPacketPtr &p, Channel *channel);
 
 	bool packetsQueued();
 
@@ -104,6 +109,15 @@ class ConnectionSendThread : public Thread
 	unsigned int m_max_commands_per_iteration = 1;
 	unsigned int m_max_data_packets_per_iteration;
 	unsigned int m_max_packets_requeued = 256;
+
+	// Datagram being filled with packets for one peer (PACKET_TYPE_COALESCED)
+	struct CoalescedPacket {
+		Address address;
+		std::vector<u8> data;
+		u32 count = 0;
+	};
+	std::unordered_map<session_t, CoalescedPacket> m_coalesced;
+	void flushCoalesced(CoalescedPacket &packet);
 };
 
 class ConnectionReceiveThread : public Thread
@@ -120,7 +134,13 @@ class ConnectionReceiveThread : public Thread
 	}
 
 private:
-	void receive(SharedBuffer<u8> &packetdata, bool &packet_queued);
+	void receive(bool &packet_queued);
+	void receiveDatagram(const Address &sender, const u8 *packetdata,
+			s32 received_size, bool &packet_queued);
+
+	// Processes one packet (base header stripped) and queues the result
+	void processReceived(Channel *channel, const SharedBuffer<u8> &packetdata,
+			session_t peer_id, u8 channelnum);
 
 	// Returns next data from a buffer if possible
 	// If found, returns true; if not, false.
@@ -154,6 +174,9 @@ class ConnectionReceiveThread : public Thread
 	SharedBuffer<u8> handlePacketType_Reliable(Channel *channel,
 			const SharedBuffer<u8> &packetdata, Peer *peer, u8 channelnum,
 			bool reliable);
+	SharedBuffer<u8> handlePacketType_Coalesced(Channel *channel,
+			const SharedBuffer<u8> &packetdata, Peer *peer, u8 channelnum,
+			bool reliable);
 
 	struct PacketTypeHandler
 	{
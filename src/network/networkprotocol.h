@@ -219,6 +219,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		"start_time" added to TOCLIENT_PLAY_SOUND
 		place_param2 type change u8 -> optional<u8>
     Add an alternative liquid system.
+		PACKET_TYPE_COALESCED added to the connection layer, used once
+		TOCLIENT_HELLO agreed on this version
 		[scheduled bump for 5.8.0]
 */
 
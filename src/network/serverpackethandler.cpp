@@ -157,6 +157,10 @@ void Server::handleCommand_Init(NetworkPacket* pkt)
 		return;
 	}
 
+	// Small packets to this client may now be bundled into one datagram
+	if (net_proto_version >= 43)
+		m_con->SetPeerCoalescing(peer_id, true);
+
 	/*
 		Validate player name
 	*/
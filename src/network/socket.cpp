@@ -50,6 +50,11 @@ typedef int socklen_t;
 #define SOCKET_ERR_STR(e) strerror(e)
 #endif
 
+#ifdef __linux__
+// recvmmsg() and sendmmsg()
+#define HAVE_MMSG 1
+#endif
+
 // Set to true to enable verbose debug output
 bool socket_enable_debug_output = false; // yuck
 
@@ -75,6 +80,39 @@ void sockets_cleanup()
 #endif
 }
 
+// Fills in a socket address for `address`, returns its length
+static socklen_t makeSockaddr(const Address &address, struct sockaddr_storage &result)
+{
+	memset(&result, 0, sizeof(result));
+	if (address.getFamily() == AF_INET6) {
+		auto *addr6 = reinterpret_cast<struct sockaddr_in6 *>(&result);
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_addr = address.getAddress6();
+		addr6->sin6_port = htons(address.getPort());
+		return sizeof(struct sockaddr_in6);
+	}
+
+	auto *addr4 = reinterpret_cast<struct sockaddr_in *>(&result);
+	addr4->sin_family = AF_INET;
+	addr4->sin_addr = address.getAddress();
+	addr4->sin_port = htons(address.getPort());
+	return sizeof(struct sockaddr_in);
+}
+
+// Converts a socket address filled in by the system
+static Address makeAddress(const struct sockaddr_storage &address)
+{
+	if (address.ss_family == AF_INET6) {
+		const auto *addr6 = reinterpret_cast<const struct sockaddr_in6 *>(&address);
+		const auto *bytes = reinterpret_cast<const IPv6AddressBytes *>
+			(addr6->sin6_addr.s6_addr);
+		return Address(bytes, ntohs(addr6->sin6_port));
+	}
+
+	const auto *addr4 = reinterpret_cast<const struct sockaddr_in *>(&address);
+	return Address(ntohl(addr4->sin_addr.s_addr), ntohs(addr4->sin_port));
+}
+
 /*
 	UDPSocket
 */
@@ -225,24 +263,11 @@ void UDPSocket::Send(const Address &destination, const void *data, int size)
 	if (destination.getFamily() != m_addr_family)
 		throw SendFailedException("Address family mismatch");
 
-	int sent;
-	if (m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address = {};
-		address.sin6_family = AF_INET6;
-		address.sin6_addr = destination.getAddress6();
-		address.sin6_port = htons(destination.getPort());
+	struct sockaddr_storage address;
+	socklen_t address_len = makeSockaddr(destination, address);
 
-		sent = sendto(m_handle, (const char *)data, size, 0,
-				(struct sockaddr *)&address, sizeof(struct sockaddr_in6));
-	} else {
-		struct sockaddr_in address = {};
-		address.sin_family = AF_INET;
-		address.sin_addr = destination.getAddress();
-		address.sin_port = htons(destination.getPort());
-
-		sent = sendto(m_handle, (const char *)data, size, 0,
-				(struct sockaddr *)&address, sizeof(struct sockaddr_in));
-	}
+	int sent = sendto(m_handle, (const char *)data, size, 0,
+			(struct sockaddr *)&address, address_len);
 
 	if (sent != size)
 		throw SendFailedException("Failed to send packet");
@@ -254,61 +279,192 @@ int UDPSocket::Receive(Address &sender, void *data, int size)
 	if (!WaitData(m_timeout_ms))
 		return -1;
 
-	int received;
-	if (m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address;
-		memset(&address, 0, sizeof(address));
-		socklen_t address_len = sizeof(address);
+	return receiveNoWait(sender, data, size);
+}
 
-		received = recvfrom(m_handle, (char *)data, size, 0,
-				(struct sockaddr *)&address, &address_len);
+int UDPSocket::receiveNoWait(Address &sender, void *data, int size)
+{
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	socklen_t address_len = sizeof(address);
 
-		if (received < 0)
-			return -1;
+	int received = recvfrom(m_handle, (char *)data, size, 0,
+			(struct sockaddr *)&address, &address_len);
 
-		u16 address_port = ntohs(address.sin6_port);
-		const auto *bytes = reinterpret_cast<IPv6AddressBytes*>
-			(address.sin6_addr.s6_addr);
-		sender = Address(bytes, address_port);
-	} else {
-		struct sockaddr_in address;
-		memset(&address, 0, sizeof(address));
+	if (received < 0)
+		return -1;
 
-		socklen_t address_len = sizeof(address);
+	sender = makeAddress(address);
 
-		received = recvfrom(m_handle, (char *)data, size, 0,
-				(struct sockaddr *)&address, &address_len);
+	if (socket_enable_debug_output)
+		printReceived(sender, data, received);
 
-		if (received < 0)
-			return -1;
+	return received;
+}
 
-		u32 address_ip = ntohl(address.sin_addr.s_addr);
-		u16 address_port = ntohs(address.sin_port);
+void UDPSocket::printReceived(const Address &sender, const void *data, int received)
+{
+	// Print packet sender and size
+	tracestream << (int)m_handle << " <- ";
+	sender.print(tracestream);
+	tracestream << ", size=" << received;
+
+	// Print packet contents
+	tracestream << ", data=";
+	for (int i = 0; i < received && i < 20; i++) {
+		if (i % 2 == 0)
+			tracestream << " ";
+		unsigned int a = ((const unsigned char *)data)[i];
+		tracestream << std::hex << std::setw(2) << std::setfill('0') << a;
+	}
+	if (received > 20)
+		tracestream << "...";
 
-		sender = Address(address_ip, address_port);
+	tracestream << std::endl;
+}
+
+int UDPSocket::ReceiveBatch(ReceivedPacket *packets, int max_count, int max_size)
+{
+	max_count = MYMIN(max_count, MAX_BATCH_SIZE);
+	m_recv_buffer.resize((size_t)max_count * max_size);
+
+	// Return on timeout
+	if (!WaitData(m_timeout_ms))
+		return 0;
+
+#ifdef HAVE_MMSG
+	if (!m_batch_unsupported.load(std::memory_order_relaxed)) {
+		struct mmsghdr msgs[MAX_BATCH_SIZE];
+		struct iovec iovs[MAX_BATCH_SIZE];
+		struct sockaddr_storage addresses[MAX_BATCH_SIZE];
+
+		memset(msgs, 0, sizeof(msgs[0]) * max_count);
+		for (int i = 0; i < max_count; i++) {
+			iovs[i].iov_base = &m_recv_buffer[(size_t)i * max_size];
+			iovs[i].iov_len = max_size;
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int count = recvmmsg(m_handle, msgs, max_count, MSG_DONTWAIT, nullptr);
+		if (count >= 0) {
+			for (int i = 0; i < count; i++) {
+				ReceivedPacket &packet = packets[i];
+				packet.sender = makeAddress(addresses[i]);
+				packet.data = (const u8 *)iovs[i].iov_base;
+				packet.size = msgs[i].msg_len;
+
+				if (socket_enable_debug_output)
+					printReceived(packet.sender, packet.data, packet.size);
+			}
+			return count;
+		}
+
+		if (LAST_SOCKET_ERR() != ENOSYS)
+			return 0;
+
+		// Kernel too old, don't try again
+		m_batch_unsupported.store(true, std::memory_order_relaxed);
 	}
+#endif
 
-	if (socket_enable_debug_output) {
-		// Print packet sender and size
-		tracestream << (int)m_handle << " <- ";
-		sender.print(tracestream);
-		tracestream << ", size=" << received;
+	int count = 0;
+	do {
+		ReceivedPacket &packet = packets[count];
+		u8 *data = &m_recv_buffer[(size_t)count * max_size];
+		int received = receiveNoWait(packet.sender, data, max_size);
+		if (received < 0)
+			break;
 
-		// Print packet contents
-		tracestream << ", data=";
-		for (int i = 0; i < received && i < 20; i++) {
-			if (i % 2 == 0)
-				tracestream << " ";
-			unsigned int a = ((const unsigned char *)data)[i];
-			tracestream << std::hex << std::setw(2) << std::setfill('0') << a;
+		packet.data = data;
+		packet.size = received;
+		count++;
+	} while (count < max_count && WaitData(0));
+
+	return count;
+}
+
+void UDPSocket::QueueSend(const Address &destination, const void *data, int size)
+{
+	if (destination.getFamily() != m_addr_family)
+		throw SendFailedException("Address family mismatch");
+
+	if (m_send_queue.size() >= MAX_BATCH_SIZE)
+		m_send_failed += flushSendQueue();
+
+	size_t offset = m_send_buffer.size();
+	m_send_buffer.resize(offset + size);
+	memcpy(&m_send_buffer[offset], data, size);
+	m_send_queue.push_back({destination, offset, size});
+}
+
+u32 UDPSocket::FlushSend()
+{
+	u32 failed = m_send_failed + flushSendQueue();
+	m_send_failed = 0;
+	return failed;
+}
+
+u32 UDPSocket::flushSendQueue()
+{
+	const size_t count = m_send_queue.size();
+	size_t sent = 0;
+	u32 failed = 0;
+
+#ifdef HAVE_MMSG
+	// Send() takes care of debug output and simulated packet loss
+	if (!m_batch_unsupported.load(std::memory_order_relaxed) && !INTERNET_SIMULATOR && !socket_enable_debug_output) {
+		struct mmsghdr msgs[MAX_BATCH_SIZE];
+		struct iovec iovs[MAX_BATCH_SIZE];
+		struct sockaddr_storage addresses[MAX_BATCH_SIZE];
+
+		memset(msgs, 0, sizeof(msgs[0]) * count);
+		for (size_t i = 0; i < count; i++) {
+			const QueuedPacket &packet = m_send_queue[i];
+			iovs[i].iov_base = &m_send_buffer[packet.offset];
+			iovs[i].iov_len = packet.size;
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = makeSockaddr(packet.destination, addresses[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
 		}
-		if (received > 20)
-			tracestream << "...";
 
-		tracestream << std::endl;
+		while (sent < count) {
+			int ret = sendmmsg(m_handle, &msgs[sent], count - sent, 0);
+			if (ret > 0) {
+				sent += ret;
+				continue;
+			}
+
+			int e = LAST_SOCKET_ERR();
+			if (ret < 0 && e == EINTR)
+				continue;
+			if (ret < 0 && e == ENOSYS) {
+				// Kernel too old, don't try again
+				m_batch_unsupported.store(true, std::memory_order_relaxed);
+				break;
+			}
+			// The first remaining datagram could not be sent, skip it
+			failed++;
+			sent++;
+		}
 	}
+#endif
 
-	return received;
+	for (; sent < count; sent++) {
+		const QueuedPacket &packet = m_send_queue[sent];
+		try {
+			Send(packet.destination, &m_send_buffer[packet.offset], packet.size);
+		} catch (SendFailedException &e) {
+			failed++;
+		}
+	}
+
+	m_send_queue.clear();
+	m_send_buffer.clear();
+	return failed;
 }
 
 int UDPSocket::GetHandle()
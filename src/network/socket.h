@@ -19,8 +19,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #pragma once
 
+#include <atomic>
 #include <ostream>
 #include <cstring>
+#include <vector>
 #include "address.h"
 #include "irrlichttypes.h"
 #include "networkexceptions.h"
@@ -49,8 +51,53 @@ class UDPSocket
 	// Returns true if there is data, false if timeout occurred
 	bool WaitData(int timeout_ms);
 
+	/*
+		Batched I/O: uses recvmmsg()/sendmmsg() where available, otherwise
+		one Send()/Receive() per datagram. Buffers are reused between calls.
+		Sending and receiving may happen on different threads, but each of
+		them from only one thread at a time.
+	*/
+
+	struct ReceivedPacket {
+		Address sender;
+		const u8 *data; // valid until the next ReceiveBatch() call
+		int size;
+	};
+
+	// Waits for data like Receive(), then returns up to max_count datagrams
+	// of up to max_size bytes each. Returns 0 if there is no data.
+	int ReceiveBatch(ReceivedPacket *packets, int max_count, int max_size);
+
+	// Copies the datagram into the send queue; it is sent by FlushSend(),
+	// or right away if the queue is full.
+	void QueueSend(const Address &destination, const void *data, int size);
+	// Sends all queued datagrams, returns how many of them failed
+	u32 FlushSend();
+
+	static constexpr int MAX_BATCH_SIZE = 64;
+
 private:
+	int receiveNoWait(Address &sender, void *data, int size);
+	void printReceived(const Address &sender, const void *data, int received);
+	u32 flushSendQueue();
+
 	int m_handle;
 	int m_timeout_ms;
 	int m_addr_family;
+
+	// Set if the batched system calls turned out to be unavailable.
+	// Sending and receiving may happen on different threads.
+	std::atomic<bool> m_batch_unsupported{false};
+
+	std::vector<u8> m_recv_buffer;
+
+	struct QueuedPacket {
+		Address destination;
+		size_t offset;
+		int size;
+	};
+	std::vector<QueuedPacket> m_send_queue;
+	std::vector<u8> m_send_buffer;
+	// Failures while flushing a full queue, reported by the next FlushSend()
+	u32 m_send_failed = 0;
 };
@@ -31,6 +31,18 @@
 #include "util/numeric.h"
 #include "util/string.h"
 #include "exceptions.h"
+#include "threading/thread_pool.h"
+#include <atomic>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+	#define NOISE_HAVE_SSE2 1
+	#include <emmintrin.h>
+	// Needs function level target attributes and runtime CPU detection
+	#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		#define NOISE_HAVE_AVX2 1
+		#include <immintrin.h>
+	#endif
+#endif
 
 #define NOISE_MAGIC_X    1619
 #define NOISE_MAGIC_Y    31337
@@ -347,6 +359,400 @@ float NoisePerlin3D(const NoiseParams *np, float x, float y, float z, s32 seed)
 }
 
 
+///////////////////////// [ Map kernels ] ////////////////////////////
+
+/*
+ * The inner loops of the Noise map functions, in one version per instruction
+ * set. The vector versions do exactly the same operations in the same order as
+ * the scalar ones, so that the results are identical.
+ */
+
+// Interpolates one row of a 2D gradient map. row0 and row1 are the lattice
+// rows above and below, xi the lattice column and xu the weight of each point.
+static void interpRow2D_scalar(float *out, u32 n,
+	const float *row0, const float *row1,
+	const u32 *xi, const float *xu, float yv)
+{
+	for (u32 i = 0; i != n; i++) {
+		u32 x = xi[i];
+		float u = linearInterpolation(row0[x], row0[x + 1], xu[i]);
+		float v = linearInterpolation(row1[x], row1[x + 1], xu[i]);
+		out[i] = linearInterpolation(u, v, yv);
+	}
+}
+
+// Same for 3D, rYZ is the lattice row at (noisey + Y, noisez + Z)
+static void interpRow3D_scalar(float *out, u32 n,
+	const float *r00, const float *r10, const float *r01, const float *r11,
+	const u32 *xi, const float *xu, float yv, float zv)
+{
+	for (u32 i = 0; i != n; i++) {
+		u32 x = xi[i];
+		out[i] = triLinearInterpolation(
+			r00[x], r00[x + 1], r10[x], r10[x + 1],
+			r01[x], r01[x + 1], r11[x], r11[x + 1],
+			xu[i], yv, zv, false);
+	}
+}
+
+static void accumulate_scalar(float *result, const float *grad, float g,
+	size_t n, bool absvalue)
+{
+	if (absvalue) {
+		for (size_t i = 0; i != n; i++)
+			result[i] += g * std::fabs(grad[i]);
+	} else {
+		for (size_t i = 0; i != n; i++)
+			result[i] += g * grad[i];
+	}
+}
+
+static void accumulatePersist_scalar(float *result, const float *grad,
+	float *gmap, const float *persistence_map, size_t n, bool absvalue)
+{
+	if (absvalue) {
+		for (size_t i = 0; i != n; i++) {
+			result[i] += gmap[i] * std::fabs(grad[i]);
+			gmap[i] *= persistence_map[i];
+		}
+	} else {
+		for (size_t i = 0; i != n; i++) {
+			result[i] += gmap[i] * grad[i];
+			gmap[i] *= persistence_map[i];
+		}
+	}
+}
+
+static void scaleOffset_scalar(float *result, size_t n, float scale, float offset)
+{
+	for (size_t i = 0; i != n; i++)
+		result[i] = result[i] * scale + offset;
+}
+
+#if NOISE_HAVE_SSE2
+
+static inline __m128 lerp_sse2(__m128 v0, __m128 v1, __m128 t)
+{
+	return _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), t));
+}
+
+static inline __m128 abs_sse2(__m128 v)
+{
+	return _mm_and_ps(v, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+}
+
+// Loads the lattice values of 4 points. When they are all in the same lattice
+// cell, which is the common case with larger spreads, a single load is enough.
+static inline __m128 gather_sse2(const float *row, const u32 *x, bool same_cell)
+{
+	if (same_cell)
+		return _mm_set1_ps(row[x[0]]);
+	return _mm_setr_ps(row[x[0]], row[x[1]], row[x[2]], row[x[3]]);
+}
+
+static void interpRow2D_sse2(float *out, u32 n,
+	const float *row0, const float *row1,
+	const u32 *xi, const float *xu, float yv)
+{
+	const __m128 y = _mm_set1_ps(yv);
+	u32 i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const u32 *x = &xi[i];
+		bool same = x[0] == x[3];
+		__m128 t = _mm_loadu_ps(&xu[i]);
+		__m128 u = lerp_sse2(gather_sse2(row0, x, same),
+			gather_sse2(row0 + 1, x, same), t);
+		__m128 v = lerp_sse2(gather_sse2(row1, x, same),
+			gather_sse2(row1 + 1, x, same), t);
+		_mm_storeu_ps(&out[i], lerp_sse2(u, v, y));
+	}
+	interpRow2D_scalar(out + i, n - i, row0, row1, xi + i, xu + i, yv);
+}
+
+static void interpRow3D_sse2(float *out, u32 n,
+	const float *r00, const float *r10, const float *r01, const float *r11,
+	const u32 *xi, const float *xu, float yv, float zv)
+{
+	const __m128 y = _mm_set1_ps(yv);
+	const __m128 z = _mm_set1_ps(zv);
+	u32 i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const u32 *x = &xi[i];
+		bool same = x[0] == x[3];
+		__m128 t = _mm_loadu_ps(&xu[i]);
+		__m128 u = lerp_sse2(
+			lerp_sse2(gather_sse2(r00, x, same), gather_sse2(r00 + 1, x, same), t),
+			lerp_sse2(gather_sse2(r10, x, same), gather_sse2(r10 + 1, x, same), t),
+			y);
+		__m128 v = lerp_sse2(
+			lerp_sse2(gather_sse2(r01, x, same), gather_sse2(r01 + 1, x, same), t),
+			lerp_sse2(gather_sse2(r11, x, same), gather_sse2(r11 + 1, x, same), t),
+			y);
+		_mm_storeu_ps(&out[i], lerp_sse2(u, v, z));
+	}
+	interpRow3D_scalar(out + i, n - i, r00, r10, r01, r11, xi + i, xu + i, yv, zv);
+}
+
+static void accumulate_sse2(float *result, const float *grad, float g,
+	size_t n, bool absvalue)
+{
+	const __m128 vg = _mm_set1_ps(g);
+	size_t i = 0;
+	if (absvalue) {
+		for (; i + 4 <= n; i += 4) {
+			__m128 d = _mm_mul_ps(vg, abs_sse2(_mm_loadu_ps(&grad[i])));
+			_mm_storeu_ps(&result[i], _mm_add_ps(_mm_loadu_ps(&result[i]), d));
+		}
+	} else {
+		for (; i + 4 <= n; i += 4) {
+			__m128 d = _mm_mul_ps(vg, _mm_loadu_ps(&grad[i]));
+			_mm_storeu_ps(&result[i], _mm_add_ps(_mm_loadu_ps(&result[i]), d));
+		}
+	}
+	accumulate_scalar(result + i, grad + i, g, n - i, absvalue);
+}
+
+static void accumulatePersist_sse2(float *result, const float *grad,
+	float *gmap, const float *persistence_map, size_t n, bool absvalue)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 d = _mm_loadu_ps(&grad[i]);
+		if (absvalue)
+			d = abs_sse2(d);
+		__m128 gm = _mm_loadu_ps(&gmap[i]);
+		_mm_storeu_ps(&result[i],
+			_mm_add_ps(_mm_loadu_ps(&result[i]), _mm_mul_ps(gm, d)));
+		_mm_storeu_ps(&gmap[i],
+			_mm_mul_ps(gm, _mm_loadu_ps(&persistence_map[i])));
+	}
+	accumulatePersist_scalar(result + i, grad + i, gmap + i,
+		persistence_map + i, n - i, absvalue);
+}
+
+static void scaleOffset_sse2(float *result, size_t n, float scale, float offset)
+{
+	const __m128 s = _mm_set1_ps(scale);
+	const __m128 o = _mm_set1_ps(offset);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(&result[i]), s);
+		_mm_storeu_ps(&result[i], _mm_add_ps(r, o));
+	}
+	scaleOffset_scalar(result + i, n - i, scale, offset);
+}
+
+#endif // NOISE_HAVE_SSE2
+
+#if NOISE_HAVE_AVX2
+
+// FMA is deliberately not enabled, it would change the results.
+// The kernels clear the upper register halves themselves before calling the
+// scalar code, as GCC does not do it before tail calls.
+#define NOISE_AVX2 __attribute__((target("avx2")))
+
+NOISE_AVX2 static inline __m256 lerp_avx2(__m256 v0, __m256 v1, __m256 t)
+{
+	return _mm256_add_ps(v0, _mm256_mul_ps(_mm256_sub_ps(v1, v0), t));
+}
+
+NOISE_AVX2 static inline __m256 abs_avx2(__m256 v)
+{
+	return _mm256_and_ps(v, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+}
+
+NOISE_AVX2 static inline __m256 gather_avx2(const float *row, const u32 *x,
+	bool same_cell)
+{
+	if (same_cell)
+		return _mm256_set1_ps(row[x[0]]);
+	// Not vgatherdps, which is slow on many CPUs, particularly with the
+	// microcode mitigations for CVE-2022-40982 (Downfall)
+	return _mm256_setr_ps(row[x[0]], row[x[1]], row[x[2]], row[x[3]],
+		row[x[4]], row[x[5]], row[x[6]], row[x[7]]);
+}
+
+NOISE_AVX2 static void interpRow2D_avx2(float *out, u32 n,
+	const float *row0, const float *row1,
+	const u32 *xi, const float *xu, float yv)
+{
+	const __m256 y = _mm256_set1_ps(yv);
+	u32 i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const u32 *x = &xi[i];
+		bool same = x[0] == x[7];
+		__m256 t = _mm256_loadu_ps(&xu[i]);
+		__m256 u = lerp_avx2(gather_avx2(row0, x, same),
+			gather_avx2(row0 + 1, x, same), t);
+		__m256 v = lerp_avx2(gather_avx2(row1, x, same),
+			gather_avx2(row1 + 1, x, same), t);
+		_mm256_storeu_ps(&out[i], lerp_avx2(u, v, y));
+	}
+	_mm256_zeroupper();
+	interpRow2D_scalar(out + i, n - i, row0, row1, xi + i, xu + i, yv);
+}
+
+NOISE_AVX2 static void interpRow3D_avx2(float *out, u32 n,
+	const float *r00, const float *r10, const float *r01, const float *r11,
+	const u32 *xi, const float *xu, float yv, float zv)
+{
+	const __m256 y = _mm256_set1_ps(yv);
+	const __m256 z = _mm256_set1_ps(zv);
+	u32 i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const u32 *x = &xi[i];
+		bool same = x[0] == x[7];
+		__m256 t = _mm256_loadu_ps(&xu[i]);
+		__m256 u = lerp_avx2(
+			lerp_avx2(gather_avx2(r00, x, same), gather_avx2(r00 + 1, x, same), t),
+			lerp_avx2(gather_avx2(r10, x, same), gather_avx2(r10 + 1, x, same), t),
+			y);
+		__m256 v = lerp_avx2(
+			lerp_avx2(gather_avx2(r01, x, same), gather_avx2(r01 + 1, x, same), t),
+			lerp_avx2(gather_avx2(r11, x, same), gather_avx2(r11 + 1, x, same), t),
+			y);
+		_mm256_storeu_ps(&out[i], lerp_avx2(u, v, z));
+	}
+	_mm256_zeroupper();
+	interpRow3D_scalar(out + i, n - i, r00, r10, r01, r11, xi + i, xu + i, yv, zv);
+}
+
+NOISE_AVX2 static void accumulate_avx2(float *result, const float *grad,
+	float g, size_t n, bool absvalue)
+{
+	const __m256 vg = _mm256_set1_ps(g);
+	size_t i = 0;
+	if (absvalue) {
+		for (; i + 8 <= n; i += 8) {
+			__m256 d = _mm256_mul_ps(vg, abs_avx2(_mm256_loadu_ps(&grad[i])));
+			_mm256_storeu_ps(&result[i], _mm256_add_ps(_mm256_loadu_ps(&result[i]), d));
+		}
+	} else {
+		for (; i + 8 <= n; i += 8) {
+			__m256 d = _mm256_mul_ps(vg, _mm256_loadu_ps(&grad[i]));
+			_mm256_storeu_ps(&result[i], _mm256_add_ps(_mm256_loadu_ps(&result[i]), d));
+		}
+	}
+	_mm256_zeroupper();
+	accumulate_scalar(result + i, grad + i, g, n - i, absvalue);
+}
+
+NOISE_AVX2 static void accumulatePersist_avx2(float *result, const float *grad,
+	float *gmap, const float *persistence_map, size_t n, bool absvalue)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 d = _mm256_loadu_ps(&grad[i]);
+		if (absvalue)
+			d = abs_avx2(d);
+		__m256 gm = _mm256_loadu_ps(&gmap[i]);
+		_mm256_storeu_ps(&result[i],
+			_mm256_add_ps(_mm256_loadu_ps(&result[i]), _mm256_mul_ps(gm, d)));
+		_mm256_storeu_ps(&gmap[i],
+			_mm256_mul_ps(gm, _mm256_loadu_ps(&persistence_map[i])));
+	}
+	_mm256_zeroupper();
+	accumulatePersist_scalar(result + i, grad + i, gmap + i,
+		persistence_map + i, n - i, absvalue);
+}
+
+NOISE_AVX2 static void scaleOffset_avx2(float *result, size_t n, float scale,
+	float offset)
+{
+	const __m256 s = _mm256_set1_ps(scale);
+	const __m256 o = _mm256_set1_ps(offset);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 r = _mm256_mul_ps(_mm256_loadu_ps(&result[i]), s);
+		_mm256_storeu_ps(&result[i], _mm256_add_ps(r, o));
+	}
+	_mm256_zeroupper();
+	scaleOffset_scalar(result + i, n - i, scale, offset);
+}
+
+#undef NOISE_AVX2
+
+#endif // NOISE_HAVE_AVX2
+
+struct NoiseKernels {
+	NoiseSimdLevel level;
+	void (*interpRow2D)(float *out, u32 n,
+		const float *row0, const float *row1,
+		const u32 *xi, const float *xu, float yv);
+	void (*interpRow3D)(float *out, u32 n,
+		const float *r00, const float *r10, const float *r01, const float *r11,
+		const u32 *xi, const float *xu, float yv, float zv);
+	void (*accumulate)(float *result, const float *grad, float g,
+		size_t n, bool absvalue);
+	void (*accumulatePersist)(float *result, const float *grad,
+		float *gmap, const float *persistence_map, size_t n, bool absvalue);
+	void (*scaleOffset)(float *result, size_t n, float scale, float offset);
+};
+
+#define NOISE_KERNELS(level, suffix) { level, \
+	interpRow2D_##suffix, interpRow3D_##suffix, accumulate_##suffix, \
+	accumulatePersist_##suffix, scaleOffset_##suffix }
+
+static const NoiseKernels noise_kernels[] = {
+	NOISE_KERNELS(NOISE_SIMD_NONE, scalar),
+#if NOISE_HAVE_SSE2
+	NOISE_KERNELS(NOISE_SIMD_SSE2, sse2),
+#endif
+#if NOISE_HAVE_AVX2
+	NOISE_KERNELS(NOISE_SIMD_AVX2, avx2),
+#endif
+};
+
+#undef NOISE_KERNELS
+
+static std::atomic<const NoiseKernels *> current_noise_kernels(nullptr);
+
+
+NoiseSimdLevel noise_simd_supported()
+{
+#if NOISE_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return NOISE_SIMD_AVX2;
+#endif
+#if NOISE_HAVE_SSE2
+	return NOISE_SIMD_SSE2;
+#else
+	return NOISE_SIMD_NONE;
+#endif
+}
+
+
+static const NoiseKernels *get_noise_kernels()
+{
+	const NoiseKernels *kernels =
+		current_noise_kernels.load(std::memory_order_relaxed);
+	if (!kernels) {
+		noise_simd_set(noise_simd_supported());
+		kernels = current_noise_kernels.load(std::memory_order_relaxed);
+	}
+	return kernels;
+}
+
+
+NoiseSimdLevel noise_simd_get()
+{
+	return get_noise_kernels()->level;
+}
+
+
+NoiseSimdLevel noise_simd_set(NoiseSimdLevel level)
+{
+	level = MYMIN(level, noise_simd_supported());
+	// Levels that aren't compiled in are also not supported, so this finds it
+	for (const NoiseKernels &kernels : noise_kernels) {
+		if (kernels.level == level)
+			current_noise_kernels.store(&kernels, std::memory_order_relaxed);
+	}
+	return level;
+}
+
+
 Noise::Noise(const NoiseParams *np_, s32 seed, u32 sx, u32 sy, u32 sz)
 {
 	np = *np_;
@@ -365,6 +771,8 @@ Noise::~Noise()
 	delete[] persist_buf;
 	delete[] noise_buf;
 	delete[] result;
+	delete[] interp_lattice_buf;
+	delete[] interp_weight_buf;
 }
 
 
@@ -383,12 +791,16 @@ void Noise::allocBuffers()
 	delete[] gradient_buf;
 	delete[] persist_buf;
 	delete[] result;
+	delete[] interp_lattice_buf;
+	delete[] interp_weight_buf;
 
 	try {
 		size_t bufsize = sx * sy * sz;
 		this->persist_buf  = NULL;
 		this->gradient_buf = new float[bufsize];
 		this->result       = new float[bufsize];
+		this->interp_lattice_buf = new u32[sx + sy + sz];
+		this->interp_weight_buf  = new float[sx + sy + sz];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
@@ -464,6 +876,29 @@ void Noise::resizeNoiseBuf(bool is3d)
 }
 
 
+/*
+ * Calculates the lattice index and (eased) interpolation weight of count
+ * positions along one axis, starting at weight t.
+ * The weights are stepped the same way regardless of how a map is split up for
+ * the calculation, so that the results don't depend on it.
+ */
+static void calcInterpAxis(u32 *lattice, float *weights, u32 count,
+	float t, float step, bool eased)
+{
+	u32 n = 0;
+	for (u32 i = 0; i != count; i++) {
+		lattice[i] = n;
+		weights[i] = eased ? easeCurve(t) : t;
+
+		t += step;
+		if (t >= 1.0) {
+			t -= 1.0;
+			n++;
+		}
+	}
+}
+
+
 /*
  * NB:  This algorithm is not optimal in terms of space complexity.  The entire
  * integer lattice of noise points could be done as 2 lines instead, and for 3D,
@@ -481,8 +916,8 @@ void Noise::gradientMap2D(
 		float step_x, float step_y,
 		s32 seed)
 {
-	float v00, v01, v10, v11, u, v, orig_u;
-	u32 index, i, j, noisex, noisey;
+	float u, v;
+	u32 index, i, j;
 	u32 nlx, nly;
 	s32 x0, y0;
 
@@ -491,7 +926,6 @@ void Noise::gradientMap2D(
 	y0 = std::floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
 	//calculate noise point lattice
 	nlx = (u32)(u + sx * step_x) + 2;
@@ -501,37 +935,19 @@ void Noise::gradientMap2D(
 		for (i = 0; i != nlx; i++)
 			noise_buf[index++] = noise2d(x0 + i, y0 + j, seed);
 
-	//calculate interpolations
-	index  = 0;
-	noisey = 0;
-	for (j = 0; j != sy; j++) {
-		v00 = noise_buf[idx(0, noisey)];
-		v10 = noise_buf[idx(1, noisey)];
-		v01 = noise_buf[idx(0, noisey + 1)];
-		v11 = noise_buf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			gradient_buf[index++] =
-				biLinearInterpolation(v00, v10, v01, v11, u, v, eased);
-
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noise_buf[idx(noisex + 1, noisey)];
-				v11 = noise_buf[idx(noisex + 1, noisey + 1)];
-			}
-		}
+	//calculate lattice positions and weights
+	u32 *noisex = interp_lattice_buf, *noisey = noisex + sx;
+	float *weight_x = interp_weight_buf, *weight_y = weight_x + sx;
+	calcInterpAxis(noisex, weight_x, sx, u, step_x, eased);
+	calcInterpAxis(noisey, weight_y, sy, v, step_y, eased);
 
-		v += step_y;
-		if (v >= 1.0) {
-			v -= 1.0;
-			noisey++;
-		}
+	//calculate interpolations
+	const NoiseKernels *kernels = get_noise_kernels();
+	index = 0;
+	for (j = 0; j != sy; j++, index += sx) {
+		kernels->interpRow2D(&gradient_buf[index], sx,
+			&noise_buf[idx(0, noisey[j])], &noise_buf[idx(0, noisey[j] + 1)],
+			noisex, weight_x, weight_y[j]);
 	}
 }
 #undef idx
@@ -541,13 +957,10 @@ void Noise::gradientMap2D(
 void Noise::gradientMap3D(
 		float x, float y, float z,
 		float step_x, float step_y, float step_z,
-		s32 seed)
+		s32 seed, ThreadPool *pool)
 {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	u32 index, i, j, k, noisex, noisey, noisez;
-	u32 nlx, nly, nlz;
+	float u, v, w;
+	u32 index, nlx, nly, nlz;
 	s32 x0, y0, z0;
 
 	bool eased = np.flags & NOISE_FLAG_EASED;
@@ -558,72 +971,44 @@ void Noise::gradientMap3D(
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
-	orig_v = v;
 
 	//calculate noise point lattice
 	nlx = (u32)(u + sx * step_x) + 2;
 	nly = (u32)(v + sy * step_y) + 2;
 	nlz = (u32)(w + sz * step_z) + 2;
 	index = 0;
-	for (k = 0; k != nlz; k++)
-		for (j = 0; j != nly; j++)
-			for (i = 0; i != nlx; i++)
+	for (u32 k = 0; k != nlz; k++)
+		for (u32 j = 0; j != nly; j++)
+			for (u32 i = 0; i != nlx; i++)
 				noise_buf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
 
-	//calculate interpolations
-	index  = 0;
-	noisey = 0;
-	noisez = 0;
-	for (k = 0; k != sz; k++) {
-		v = orig_v;
-		noisey = 0;
-		for (j = 0; j != sy; j++) {
-			v000 = noise_buf[idx(0, noisey,     noisez)];
-			v100 = noise_buf[idx(1, noisey,     noisez)];
-			v010 = noise_buf[idx(0, noisey + 1, noisez)];
-			v110 = noise_buf[idx(1, noisey + 1, noisez)];
-			v001 = noise_buf[idx(0, noisey,     noisez + 1)];
-			v101 = noise_buf[idx(1, noisey,     noisez + 1)];
-			v011 = noise_buf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noise_buf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				gradient_buf[index++] = triLinearInterpolation(
-					v000, v100, v010, v110,
-					v001, v101, v011, v111,
-					u, v, w,
-					eased);
-
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noise_buf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noise_buf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noise_buf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noise_buf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
-			}
-
-			v += step_y;
-			if (v >= 1.0) {
-				v -= 1.0;
-				noisey++;
-			}
+	//calculate lattice positions and weights
+	u32 *noisex = interp_lattice_buf, *noisey = noisex + sx, *noisez = noisey + sy;
+	float *weight_x = interp_weight_buf, *weight_y = weight_x + sx,
+		*weight_z = weight_y + sy;
+	calcInterpAxis(noisex, weight_x, sx, u, step_x, eased);
+	calcInterpAxis(noisey, weight_y, sy, v, step_y, eased);
+	calcInterpAxis(noisez, weight_z, sz, w, step_z, eased);
+
+	//calculate interpolations, one Z slice at a time
+	const NoiseKernels *kernels = get_noise_kernels();
+	auto interp_slice = [&] (size_t k) {
+		float *out = &gradient_buf[k * sy * sx];
+		for (u32 j = 0; j != sy; j++, out += sx) {
+			kernels->interpRow3D(out, sx,
+				&noise_buf[idx(0, noisey[j],     noisez[k])],
+				&noise_buf[idx(0, noisey[j] + 1, noisez[k])],
+				&noise_buf[idx(0, noisey[j],     noisez[k] + 1)],
+				&noise_buf[idx(0, noisey[j] + 1, noisez[k] + 1)],
+				noisex, weight_x, weight_y[j], weight_z[k]);
 		}
+	};
 
-		w += step_z;
-		if (w >= 1.0) {
-			w -= 1.0;
-			noisez++;
-		}
+	if (pool) {
+		pool->run(sz, interp_slice);
+	} else {
+		for (u32 k = 0; k != sz; k++)
+			interp_slice(k);
 	}
 }
 #undef idx
@@ -657,16 +1042,15 @@ float *Noise::perlinMap2D(float x, float y, float *persistence_map)
 		g *= np.persist;
 	}
 
-	if (std::fabs(np.offset - 0.f) > 0.00001 || std::fabs(np.scale - 1.f) > 0.00001) {
-		for (size_t i = 0; i != bufsize; i++)
-			result[i] = result[i] * np.scale + np.offset;
-	}
+	if (std::fabs(np.offset - 0.f) > 0.00001 || std::fabs(np.scale - 1.f) > 0.00001)
+		get_noise_kernels()->scaleOffset(result, bufsize, np.scale, np.offset);
 
 	return result;
 }
 
 
-float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map)
+float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map,
+	ThreadPool *pool)
 {
 	float f = 1.0, g = 1.0;
 	size_t bufsize = sx * sy * sz;
@@ -687,47 +1071,44 @@ float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map)
 	for (size_t oct = 0; oct < np.octaves; oct++) {
 		gradientMap3D(x * f, y * f, z * f,
 			f / np.spread.X, f / np.spread.Y, f / np.spread.Z,
-			seed + np.seed + oct);
+			seed + np.seed + oct, pool);
 
-		updateResults(g, persist_buf, persistence_map, bufsize);
+		updateResults(g, persist_buf, persistence_map, bufsize, pool);
 
 		f *= np.lacunarity;
 		g *= np.persist;
 	}
 
-	if (std::fabs(np.offset - 0.f) > 0.00001 || std::fabs(np.scale - 1.f) > 0.00001) {
-		for (size_t i = 0; i != bufsize; i++)
-			result[i] = result[i] * np.scale + np.offset;
-	}
+	if (std::fabs(np.offset - 0.f) > 0.00001 || std::fabs(np.scale - 1.f) > 0.00001)
+		get_noise_kernels()->scaleOffset(result, bufsize, np.scale, np.offset);
 
 	return result;
 }
 
 
 void Noise::updateResults(float g, float *gmap,
-	const float *persistence_map, size_t bufsize)
+	const float *persistence_map, size_t bufsize, ThreadPool *pool)
 {
-	// This looks very ugly, but it is 50-70% faster than having
-	// conditional statements inside the loop
-	if (np.flags & NOISE_FLAG_ABSVALUE) {
+	const NoiseKernels *kernels = get_noise_kernels();
+	bool absvalue = np.flags & NOISE_FLAG_ABSVALUE;
+
+	auto update_range = [&] (size_t start, size_t end) {
 		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
-				result[i] += gmap[i] * std::fabs(gradient_buf[i]);
-				gmap[i] *= persistence_map[i];
-			}
+			kernels->accumulatePersist(result + start, gradient_buf + start,
+				gmap + start, persistence_map + start, end - start, absvalue);
 		} else {
-			for (size_t i = 0; i != bufsize; i++)
-				result[i] += g * std::fabs(gradient_buf[i]);
+			kernels->accumulate(result + start, gradient_buf + start, g,
+				end - start, absvalue);
 		}
+	};
+
+	if (pool) {
+		// Split into one piece per Z slice, like gradientMap3D
+		const size_t slice = sx * sy;
+		pool->run(bufsize / slice, [&] (size_t k) {
+			update_range(k * slice, (k + 1) * slice);
+		});
 	} else {
-		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
-				result[i] += gmap[i] * gradient_buf[i];
-				gmap[i] *= persistence_map[i];
-			}
-		} else {
-			for (size_t i = 0; i != bufsize; i++)
-				result[i] += g * gradient_buf[i];
-		}
+		update_range(0, bufsize);
 	}
 }
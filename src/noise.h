@@ -36,6 +36,8 @@
 #undef RANDOM_MAX
 #endif
 
+class ThreadPool;
+
 extern FlagDesc flagdesc_noiseparams[];
 
 // Note: this class is not polymorphic so that its high level of
@@ -157,13 +159,16 @@ class Noise {
 		float x, float y,
 		float step_x, float step_y,
 		s32 seed);
+	// pool: if given, the map is split up into Z slices that are calculated
+	// in parallel. The results are the same either way.
 	void gradientMap3D(
 		float x, float y, float z,
 		float step_x, float step_y, float step_z,
-		s32 seed);
+		s32 seed, ThreadPool *pool = nullptr);
 
 	float *perlinMap2D(float x, float y, float *persistence_map=NULL);
-	float *perlinMap3D(float x, float y, float z, float *persistence_map=NULL);
+	float *perlinMap3D(float x, float y, float z, float *persistence_map=NULL,
+		ThreadPool *pool=nullptr);
 
 	inline float *perlinMap2D_PO(float x, float xoff, float y, float yoff,
 		float *persistence_map=NULL)
@@ -175,23 +180,47 @@ class Noise {
 	}
 
 	inline float *perlinMap3D_PO(float x, float xoff, float y, float yoff,
-		float z, float zoff, float *persistence_map=NULL)
+		float z, float zoff, float *persistence_map=NULL,
+		ThreadPool *pool=nullptr)
 	{
 		return perlinMap3D(
 			x + xoff * np.spread.X,
 			y + yoff * np.spread.Y,
 			z + zoff * np.spread.Z,
-			persistence_map);
+			persistence_map, pool);
 	}
 
 private:
 	void allocBuffers();
 	void resizeNoiseBuf(bool is3d);
 	void updateResults(float g, float *gmap, const float *persistence_map,
-			size_t bufsize);
+			size_t bufsize, ThreadPool *pool = nullptr);
 
+	// Lattice index and (eased) interpolation weight of every X, Y and Z
+	// position, in this order. Calculated once per gradient map.
+	u32 *interp_lattice_buf = nullptr;
+	float *interp_weight_buf = nullptr;
 };
 
+/*
+	Instruction set used for the interpolation and octave accumulation loops
+	of the Noise map functions. The best one supported by the CPU is picked
+	on first use. All of them give the same results as long as the compiler
+	does not contract the scalar code into fused multiply-adds.
+*/
+enum NoiseSimdLevel {
+	NOISE_SIMD_NONE,
+	NOISE_SIMD_SSE2,
+	NOISE_SIMD_AVX2,
+};
+
+// Best level that is supported by this build and CPU
+NoiseSimdLevel noise_simd_supported();
+NoiseSimdLevel noise_simd_get();
+// Lower levels can be forced for testing, unsupported ones are clamped to
+// noise_simd_supported(). Returns the level that is now used.
+NoiseSimdLevel noise_simd_set(NoiseSimdLevel level);
+
 float NoisePerlin2D(const NoiseParams *np, float x, float y, s32 seed);
 float NoisePerlin3D(const NoiseParams *np, float x, float y, float z, s32 seed);
 
@@ -18,54 +18,122 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "profiler.h"
+#include <algorithm>
+#include <iomanip>
 #include "porting.h"
+#include "log.h"
+#include "util/serialize.h"
 
 static Profiler main_profiler;
 Profiler *g_profiler = &main_profiler;
+
+// Interned scopes per profiler
+static constexpr size_t MAX_SCOPES = 2048;
+static_assert(MAX_SCOPES < Profiler::SCOPE_NONE, "scope ids overflow");
+// Traced scopes kept per thread, must be a power of two
+static constexpr u64 TRACE_SIZE = 1 << 16;
+// Longest duration that fits into a trace event, in nanoseconds
+static constexpr u64 TRACE_MAX_DURATION = (1ULL << 40) - 1;
+
+static std::atomic<u64> g_profiler_id {0};
+
+/*
+	Written only by the thread it belongs to, except for the atomic
+	exchanges in Profiler::collectScopes().
+*/
+struct Profiler::ThreadData
+{
+	struct ScopeStats {
+		std::atomic<u64> sum_ns {0};
+		std::atomic<u64> max_ns {0};
+		std::atomic<u32> count {0};
+	};
+
+	struct TraceEvent {
+		// Relative to Profiler::m_start_time_ns
+		std::atomic<u64> start_ns {0};
+		// Duration << 24 | depth << 16 | scope id
+		std::atomic<u64> packed {0};
+	};
+
+	~ThreadData()
+	{
+		delete[] trace.load();
+	}
+
+	std::string name;
+	u32 id = 0;
+	// Set when the thread no longer uses this profiler
+	std::atomic<bool> exited {false};
+	// Nesting depth of the running scopes
+	u8 depth = 0;
+	ScopeStats stats[MAX_SCOPES];
+
+	// Allocated when tracing is enabled for the first time.
+	// trace_head counts the events that were written completely, the event
+	// at trace_head may be being written.
+	std::atomic<TraceEvent *> trace {nullptr};
+	std::atomic<u64> trace_head {0};
+};
+
+namespace {
+
+struct ThreadHandle
+{
+	~ThreadHandle()
+	{
+		if (data)
+			data->exited = true;
+	}
+
+	u64 profiler_id = 0;
+	std::shared_ptr<Profiler::ThreadData> data;
+};
+
+// The profiler used last by this thread
+thread_local ThreadHandle t_thread;
+
+}
+
 ScopeProfiler::ScopeProfiler(
 		Profiler *profiler, const std::string &name, ScopeProfilerType type) :
-		m_profiler(profiler),
-		m_name(name), m_type(type)
+		ScopeProfiler(profiler, profiler ?
+				profiler->internScope(name, type) : Profiler::SCOPE_NONE)
 {
-	m_name.append(" [ms]");
-	if (m_profiler)
-		m_timer = new TimeTaker(m_name, nullptr, PRECISION_MILLI);
 }
 
-ScopeProfiler::~ScopeProfiler()
+ScopeProfiler::ScopeProfiler(Profiler *profiler, ProfilerScopeId id) :
+		m_profiler(profiler), m_id(id)
 {
-	if (!m_timer)
+	if (!m_profiler || m_id == Profiler::SCOPE_NONE)
 		return;
+	m_thread = m_profiler->beginScope();
+	m_start_ns = porting::getTimeNs();
+}
 
-	float duration_ms = m_timer->stop(true);
-	float duration = duration_ms;
-	if (m_profiler) {
-		switch (m_type) {
-		case SPT_ADD:
-			m_profiler->add(m_name, duration);
-			break;
-		case SPT_AVG:
-			m_profiler->avg(m_name, duration);
-			break;
-		case SPT_GRAPH_ADD:
-			m_profiler->graphAdd(m_name, duration);
-			break;
-		case SPT_MAX:
-			m_profiler->max(m_name, duration);
-			break;
-		}
-	}
-	delete m_timer;
+ScopeProfiler::~ScopeProfiler()
+{
+	if (m_thread)
+		m_profiler->endScope(m_thread, m_id, m_start_ns);
 }
 
-Profiler::Profiler()
+Profiler::Profiler() :
+	m_id(++g_profiler_id),
+	m_start_time_ns(porting::getTimeNs())
 {
 	m_start_time = porting::getTimeMs();
 }
 
+Profiler::~Profiler() = default;
+
 void Profiler::add(const std::string &name, float value)
 {
 	MutexAutoLock lock(m_mutex);
+	addLocked(name, value);
+}
+
+void Profiler::addLocked(const std::string &name, float value)
+{
 	{
 		/* No average shall have been used; mark add/max used as -2 */
 		std::map<std::string, int>::iterator n = m_avgcounts.find(name);
@@ -89,6 +157,11 @@ void Profiler::add(const std::string &name, float value)
 void Profiler::max(const std::string &name, float value)
 {
 	MutexAutoLock lock(m_mutex);
+	maxLocked(name, value);
+}
+
+void Profiler::maxLocked(const std::string &name, float value)
+{
 	{
 		/* No average shall have been used; mark add/max used as -2 */
 		auto n = m_avgcounts.find(name);
@@ -112,16 +185,23 @@ void Profiler::max(const std::string &name, float value)
 void Profiler::avg(const std::string &name, float value)
 {
 	MutexAutoLock lock(m_mutex);
-	int &count = m_avgcounts[name];
+	avgLocked(name, value, 1);
+}
 
-	assert(count != -2);
-	count = MYMAX(count, 0) + 1;
+void Profiler::avgLocked(const std::string &name, float value, int count)
+{
+	int &avgcount = m_avgcounts[name];
+
+	assert(avgcount != -2);
+	avgcount = MYMAX(avgcount, 0) + count;
 	m_data[name] += value;
 }
 
 void Profiler::clear()
 {
 	MutexAutoLock lock(m_mutex);
+	// Drop what the threads recorded until now
+	collectScopes();
 	for (auto &it : m_data) {
 		it.second = 0;
 	}
@@ -129,8 +209,238 @@ void Profiler::clear()
 	m_start_time = porting::getTimeMs();
 }
 
-float Profiler::getValue(const std::string &name) const
+ProfilerScopeId Profiler::internScope(const std::string &name, ScopeProfilerType type)
 {
+	MutexAutoLock lock(m_scopes_mutex);
+	auto it = m_scope_ids.find({name, type});
+	if (it != m_scope_ids.end())
+		return it->second;
+
+	if (m_scopes.size() >= MAX_SCOPES) {
+		if (!m_scopes_full) {
+			warningstream << "Profiler: too many scopes, not recording \""
+				<< name << "\" and further new ones" << std::endl;
+			m_scopes_full = true;
+		}
+		return SCOPE_NONE;
+	}
+
+	ProfilerScopeId id = m_scopes.size();
+	m_scopes.push_back({name + " [ms]", name, type});
+	m_scope_ids.emplace(std::make_pair(name, type), id);
+	return id;
+}
+
+Profiler::ThreadData *Profiler::getThreadData()
+{
+	ThreadHandle &handle = t_thread;
+	if (handle.profiler_id == m_id)
+		return handle.data.get();
+
+	// The thread switched profilers (only happens in the unit tests), it
+	// gets a new ThreadData if it comes back to the previous one
+	if (handle.data)
+		handle.data->exited = true;
+
+	auto data = std::make_shared<ThreadData>();
+	data->name = g_logger.getThreadName();
+	{
+		MutexAutoLock lock(m_threads_mutex);
+		data->id = m_next_thread_id++;
+		if (isTraceEnabled())
+			data->trace = new ThreadData::TraceEvent[TRACE_SIZE];
+		m_threads.push_back(data);
+	}
+	handle.profiler_id = m_id;
+	handle.data = std::move(data);
+	return handle.data.get();
+}
+
+Profiler::ThreadData *Profiler::beginScope()
+{
+	ThreadData *thread = getThreadData();
+	thread->depth++;
+	return thread;
+}
+
+void Profiler::endScope(ThreadData *thread, ProfilerScopeId id, u64 start_ns)
+{
+	const u64 duration = porting::getTimeNs() - start_ns;
+	thread->depth--;
+
+	ThreadData::ScopeStats &stats = thread->stats[id];
+	stats.sum_ns.fetch_add(duration, std::memory_order_relaxed);
+	u64 max = stats.max_ns.load(std::memory_order_relaxed);
+	while (duration > max && !stats.max_ns.compare_exchange_weak(max, duration,
+			std::memory_order_relaxed))
+		;
+	stats.count.fetch_add(1, std::memory_order_release);
+
+	if (!isTraceEnabled())
+		return;
+	ThreadData::TraceEvent *trace = thread->trace.load(std::memory_order_acquire);
+	if (!trace)
+		return;
+
+	// Write the event, then publish it, see writeTrace(). The fence orders
+	// the publication of the previous event before the writes to the slot.
+	const u64 head = thread->trace_head.load(std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	ThreadData::TraceEvent &event = trace[head & (TRACE_SIZE - 1)];
+	event.start_ns.store(start_ns - m_start_time_ns, std::memory_order_relaxed);
+	event.packed.store(std::min(duration, TRACE_MAX_DURATION) << 24 |
+			(u64)thread->depth << 16 | id, std::memory_order_relaxed);
+	thread->trace_head.store(head + 1, std::memory_order_release);
+}
+
+void Profiler::collectScopes()
+{
+	std::vector<std::shared_ptr<ThreadData>> threads;
+	{
+		MutexAutoLock lock(m_threads_mutex);
+		threads = m_threads;
+	}
+
+	std::vector<std::shared_ptr<ThreadData>> exited;
+	{
+		MutexAutoLock lock(m_scopes_mutex);
+		const size_t scope_count = m_scopes.size();
+		for (const auto &thread : threads) {
+			if (thread->exited.load(std::memory_order_acquire))
+				exited.push_back(thread);
+
+			for (size_t i = 0; i < scope_count; i++) {
+				ThreadData::ScopeStats &stats = thread->stats[i];
+				u32 count = stats.count.exchange(0, std::memory_order_acquire);
+				if (count == 0)
+					continue;
+				float sum_ms = stats.sum_ns.exchange(0, std::memory_order_relaxed) / 1e6f;
+				float max_ms = stats.max_ns.exchange(0, std::memory_order_relaxed) / 1e6f;
+
+				const Scope &scope = m_scopes[i];
+				switch (scope.type) {
+				case SPT_ADD:
+					addLocked(scope.name, sum_ms);
+					break;
+				case SPT_AVG:
+					avgLocked(scope.name, sum_ms, count);
+					break;
+				case SPT_GRAPH_ADD:
+					m_graphvalues[scope.name] += sum_ms;
+					break;
+				case SPT_MAX:
+					maxLocked(scope.name, max_ms);
+					break;
+				}
+			}
+		}
+	}
+
+	// Forget the threads that are gone, unless their trace is still needed
+	if (!exited.empty() && !isTraceEnabled()) {
+		MutexAutoLock lock(m_threads_mutex);
+		for (const auto &thread : exited) {
+			auto it = std::find(m_threads.begin(), m_threads.end(), thread);
+			if (it != m_threads.end())
+				m_threads.erase(it);
+		}
+	}
+}
+
+void Profiler::setTraceEnabled(bool enabled)
+{
+	MutexAutoLock lock(m_threads_mutex);
+	if (enabled) {
+		for (const auto &thread : m_threads) {
+			if (!thread->trace.load())
+				thread->trace.store(new ThreadData::TraceEvent[TRACE_SIZE],
+						std::memory_order_release);
+		}
+	}
+	m_trace_enabled.store(enabled);
+}
+
+void Profiler::writeTrace(std::ostream &os)
+{
+	std::vector<std::shared_ptr<ThreadData>> threads;
+	{
+		MutexAutoLock lock(m_threads_mutex);
+		threads = m_threads;
+	}
+	std::vector<std::string> names;
+	{
+		MutexAutoLock lock(m_scopes_mutex);
+		for (const Scope &scope : m_scopes)
+			names.push_back(serializeJsonString(scope.trace_name));
+	}
+
+	// Timestamps are in microseconds
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(3);
+
+	os << "{\"traceEvents\":[\n";
+	bool first = true;
+	auto separator = [&] () -> std::ostream & {
+		if (!first)
+			os << ",\n";
+		first = false;
+		return os;
+	};
+
+	std::vector<std::pair<u64, u64>> events;
+	for (const auto &thread : threads) {
+		separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+			<< thread->id << ",\"args\":{\"name\":"
+			<< serializeJsonString(thread->name) << "}}";
+
+		ThreadData::TraceEvent *trace = thread->trace.load(std::memory_order_acquire);
+		if (!trace)
+			continue;
+
+		/*
+			The thread keeps on recording while its events are copied.
+			Events before trace_head are complete, but any event that the
+			thread wrote in the meantime (including the one at the new
+			trace_head) may have overwritten an old one.
+		*/
+		const u64 end = thread->trace_head.load(std::memory_order_acquire);
+		const u64 begin = end > TRACE_SIZE ? end - TRACE_SIZE : 0;
+		events.clear();
+		for (u64 i = begin; i < end; i++) {
+			const ThreadData::TraceEvent &event = trace[i & (TRACE_SIZE - 1)];
+			events.emplace_back(event.start_ns.load(std::memory_order_relaxed),
+					event.packed.load(std::memory_order_relaxed));
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		const u64 new_head = thread->trace_head.load(std::memory_order_relaxed);
+
+		for (u64 i = begin; i < end; i++) {
+			if (i + TRACE_SIZE <= new_head)
+				continue;
+			const auto &event = events[i - begin];
+			ProfilerScopeId id = event.second & 0xFFFF;
+			if (id >= names.size())
+				continue;
+			separator() << "{\"name\":" << names[id]
+				<< ",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread->id
+				<< ",\"ts\":" << event.first / 1000.0
+				<< ",\"dur\":" << (event.second >> 24) / 1000.0
+				<< ",\"args\":{\"depth\":" << ((event.second >> 16) & 0xFF) << "}}";
+		}
+	}
+	os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+	os.flags(flags);
+	os.precision(precision);
+}
+
+float Profiler::getValue(const std::string &name)
+{
+	MutexAutoLock lock(m_mutex);
+	collectScopes();
+
 	auto numerator = m_data.find(name);
 	if (numerator == m_data.end())
 		return 0.f;
@@ -190,6 +500,7 @@ int Profiler::print(std::ostream &o, u32 page, u32 pagecount)
 void Profiler::getPage(GraphValues &o, u32 page, u32 pagecount)
 {
 	MutexAutoLock lock(m_mutex);
+	collectScopes();
 
 	u32 minindex, maxindex;
 	paging(m_data.size(), page, pagecount, minindex, maxindex);
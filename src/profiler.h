@@ -20,10 +20,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include "irrlichttypes.h"
+#include <atomic>
 #include <cassert>
 #include <string>
 #include <map>
+#include <memory>
 #include <ostream>
+#include <vector>
 
 #include "threading/mutex_auto_lock.h"
 #include "util/timetaker.h"
@@ -33,24 +36,58 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 class Profiler;
 extern Profiler *g_profiler;
 
+enum ScopeProfilerType{
+	SPT_ADD,
+	SPT_AVG,
+	SPT_GRAPH_ADD,
+	SPT_MAX
+};
+
+// Index of a scope name interned with Profiler::internScope()
+typedef u16 ProfilerScopeId;
+
 /*
 	Time profiler
+
+	Values can be added by name, which takes a lock, or timed with
+	ScopeProfiler. Scopes with an interned id are recorded without locking
+	into buffers owned by the calling thread. These are merged into the
+	named values whenever the profiler is read. If tracing is enabled, each
+	thread additionally keeps its most recent scopes in a ring buffer, which
+	can be exported with writeTrace().
 */
 
 class Profiler
 {
 public:
 	Profiler();
+	~Profiler();
 
 	void add(const std::string &name, float value);
 	void avg(const std::string &name, float value);
 	void max(const std::string &name, float value);
 	void clear();
 
-	float getValue(const std::string &name) const;
+	float getValue(const std::string &name);
 	int getAvgCount(const std::string &name) const;
 	u64 getElapsedMs() const;
 
+	// Returns the id of the scope with the given name and type, or
+	// SCOPE_NONE if there are too many scopes already
+	ProfilerScopeId internScope(const std::string &name, ScopeProfilerType type);
+	static constexpr ProfilerScopeId SCOPE_NONE = U16_MAX;
+
+	struct ThreadData;
+
+	// Used by ScopeProfiler. The ThreadData belongs to the calling thread.
+	ThreadData *beginScope();
+	void endScope(ThreadData *thread, ProfilerScopeId id, u64 start_ns);
+
+	void setTraceEnabled(bool enabled);
+	bool isTraceEnabled() const { return m_trace_enabled.load(std::memory_order_relaxed); }
+	// Writes the traced scopes of all threads in the Chrome trace event format
+	void writeTrace(std::ostream &os);
+
 	typedef std::map<std::string, float> GraphValues;
 
 	// Returns the line count
@@ -71,6 +108,7 @@ class Profiler
 	void graphGet(GraphValues &result)
 	{
 		MutexAutoLock lock(m_mutex);
+		collectScopes();
 		result = m_graphvalues;
 		m_graphvalues.clear();
 	}
@@ -83,18 +121,42 @@ class Profiler
 	}
 
 private:
+	struct Scope {
+		// Name of the value, with the unit appended
+		std::string name;
+		std::string trace_name;
+		ScopeProfilerType type;
+	};
+
+	ThreadData *getThreadData();
+	// Moves the values recorded by the threads into m_data,
+	// m_mutex must be locked
+	void collectScopes();
+	void addLocked(const std::string &name, float value);
+	void avgLocked(const std::string &name, float value, int count);
+	void maxLocked(const std::string &name, float value);
+
 	std::mutex m_mutex;
 	std::map<std::string, float> m_data;
 	std::map<std::string, int> m_avgcounts;
 	std::map<std::string, float> m_graphvalues;
 	u64 m_start_time;
-};
 
-enum ScopeProfilerType{
-	SPT_ADD,
-	SPT_AVG,
-	SPT_GRAPH_ADD,
-	SPT_MAX
+	// Unique among all profilers ever created, for the thread-local lookup
+	const u64 m_id;
+	// Reference point of the trace timestamps
+	const u64 m_start_time_ns;
+	std::atomic<bool> m_trace_enabled {false};
+
+	// Interned scopes, only ever appended to
+	std::mutex m_scopes_mutex;
+	std::vector<Scope> m_scopes;
+	bool m_scopes_full = false;
+	std::map<std::pair<std::string, ScopeProfilerType>, ProfilerScopeId> m_scope_ids;
+
+	std::mutex m_threads_mutex;
+	std::vector<std::shared_ptr<ThreadData>> m_threads;
+	u32 m_next_thread_id = 1;
 };
 
 class ScopeProfiler
@@ -102,10 +164,19 @@ class ScopeProfiler
 public:
 	ScopeProfiler(Profiler *profiler, const std::string &name,
 			ScopeProfilerType type = SPT_ADD);
+	// Lock-free, for use with an id interned beforehand, see PROFILER_SCOPE
+	ScopeProfiler(Profiler *profiler, ProfilerScopeId id);
 	~ScopeProfiler();
 private:
 	Profiler *m_profiler = nullptr;
-	std::string m_name;
-	TimeTaker *m_timer = nullptr;
-	enum ScopeProfilerType m_type;
+	Profiler::ThreadData *m_thread = nullptr;
+	ProfilerScopeId m_id = Profiler::SCOPE_NONE;
+	u64 m_start_ns = 0;
 };
+
+// Interns the scope name once per call site. Use this on hot paths instead of
+// passing the name to ScopeProfiler, which looks it up on every call.
+#define PROFILER_SCOPE(var, name, type) \
+	static const ProfilerScopeId var##_scope_id = \
+			g_profiler->internScope((name), (type)); \
+	ScopeProfiler var(g_profiler, var##_scope_id)
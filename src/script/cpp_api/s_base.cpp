@@ -42,6 +42,7 @@ extern "C" {
 #endif
 }
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdarg>
 #include "script/common/c_content.h"
@@ -80,6 +81,11 @@ ScriptApiBase::ScriptApiBase(ScriptingType type):
 	m_lock_recursion_count = 0;
 #endif
 
+	// Time in a callback before any origin is set is charged to builtin,
+	// "??" takes the mods that don't fit into the accounting
+	m_callback_mod_names = {BUILTIN_MOD_NAME, "??"};
+	m_callback_mod_ids = {{BUILTIN_MOD_NAME, 0}, {"??", 1}};
+
 	m_luastack = luaL_newstate();
 	FATAL_ERROR_IF(!m_luastack, "luaL_newstate() failed");
 
@@ -387,6 +393,7 @@ void ScriptApiBase::stackDump(std::ostream &o)
 void ScriptApiBase::setOriginDirect(const char *origin)
 {
 	m_last_run_mod = origin ? origin : "??";
+	onOriginChanged();
 }
 
 void ScriptApiBase::setOriginFromTableRaw(int index, const char *fxn)
@@ -394,6 +401,88 @@ void ScriptApiBase::setOriginFromTableRaw(int index, const char *fxn)
 	lua_State *L = getStack();
 	m_last_run_mod = lua_istable(L, index) ?
 		getstringfield_default(L, index, "mod_origin", "") : "";
+	onOriginChanged();
+}
+
+/*
+	Callback accounting
+*/
+
+static constexpr size_t MAX_CALLBACK_MODS = 4096;
+
+u32 ScriptApiBase::beginCallback(const char *callback)
+{
+	u64 now_us = porting::getTimeUs();
+	chargeCallbackTime(now_us);
+
+	auto it = m_callback_ids.find(callback);
+	if (it == m_callback_ids.end()) {
+		// The same name can be at different addresses
+		auto name_it = std::find(m_callback_names.begin(),
+				m_callback_names.end(), callback);
+		u16 id = name_it - m_callback_names.begin();
+		if (name_it == m_callback_names.end())
+			m_callback_names.emplace_back(callback);
+		it = m_callback_ids.emplace(callback, id).first;
+	}
+
+	u32 outer = m_callback_current;
+	m_callback_current = (u32)it->second << 16;
+	return outer;
+}
+
+void ScriptApiBase::endCallback(u32 outer)
+{
+	chargeCallbackTime(porting::getTimeUs());
+	m_callback_current = outer;
+}
+
+void ScriptApiBase::onOriginChanged()
+{
+	if (m_callback_current == CALLBACK_NONE)
+		return;
+
+	chargeCallbackTime(porting::getTimeUs());
+
+	auto it = m_callback_mod_ids.find(m_last_run_mod);
+	if (it == m_callback_mod_ids.end()) {
+		// Mods can set any origin, so put a limit on the number of names
+		if (m_callback_mod_names.size() >= MAX_CALLBACK_MODS) {
+			it = m_callback_mod_ids.find("??");
+		} else {
+			u16 id = m_callback_mod_names.size();
+			m_callback_mod_names.push_back(m_last_run_mod);
+			it = m_callback_mod_ids.emplace(m_last_run_mod, id).first;
+		}
+	}
+
+	// Every origin change in a callback starts a call of a mod's function
+	m_callback_current = (m_callback_current & 0xFFFF0000) | it->second;
+	m_callback_accounts[m_callback_current].calls++;
+}
+
+void ScriptApiBase::chargeCallbackTime(u64 now_us)
+{
+	if (m_callback_current != CALLBACK_NONE)
+		m_callback_accounts[m_callback_current].time_us += now_us - m_callback_since_us;
+	m_callback_since_us = now_us;
+}
+
+std::vector<ScriptApiBase::CallbackStats> ScriptApiBase::getCallbackStats()
+{
+	RecursiveMutexAutoLock lock(m_luastackmutex);
+	// Include the running callbacks up to now
+	chargeCallbackTime(porting::getTimeUs());
+
+	std::vector<CallbackStats> stats;
+	stats.reserve(m_callback_accounts.size());
+	for (const auto &it : m_callback_accounts) {
+		u16 callback = it.first >> 16;
+		u16 mod = it.first & 0xFFFF;
+		stats.push_back({m_callback_mod_names[mod], m_callback_names[callback],
+			it.second.calls, it.second.time_us});
+	}
+	return stats;
 }
 
 /*
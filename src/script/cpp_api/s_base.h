@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <thread>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 #include "common/helper.h"
 #include "util/basic_macros.h"
 
@@ -108,6 +109,23 @@ class ScriptApiBase : protected LuaHelper {
 	Client* getClient();
 #endif
 
+	// Time spent running Lua from one engine callback type for one mod
+	struct CallbackStats {
+		std::string mod;
+		std::string callback;
+		u64 calls;
+		u64 time_us;
+	};
+	// Returns the accumulated time of all mods and callback types
+	std::vector<CallbackStats> getCallbackStats();
+
+	// Charges the time spent in Lua until the matching endCallback() to
+	// the given callback type and the mods that the origin is set to.
+	// Use ScriptCallbackScope instead of calling these directly.
+	// The callback name must be a string literal.
+	u32 beginCallback(const char *callback);
+	void endCallback(u32 outer);
+
 	// IMPORTANT: these cannot be used for any security-related uses, they exist
 	// only to enrich error messages
 	const std::string &getOrigin() { return m_last_run_mod; }
@@ -173,6 +191,29 @@ class ScriptApiBase : protected LuaHelper {
 private:
 	static int luaPanic(lua_State *L);
 
+	// Called after m_last_run_mod was changed
+	void onOriginChanged();
+	void chargeCallbackTime(u64 now_us);
+
+	/*
+		Callback accounting. Callback types and mods are interned into ids,
+		so that switching between them only costs a few hash lookups.
+		An account key is callback id << 16 | mod id.
+	*/
+	struct CallbackAccount {
+		u64 calls = 0;
+		u64 time_us = 0;
+	};
+	std::unordered_map<const char *, u16> m_callback_ids;
+	std::vector<std::string> m_callback_names;
+	std::unordered_map<std::string, u16> m_callback_mod_ids;
+	std::vector<std::string> m_callback_mod_names;
+	std::unordered_map<u32, CallbackAccount> m_callback_accounts;
+	static constexpr u32 CALLBACK_NONE = U32_MAX;
+	// Account the time is currently charged to, or CALLBACK_NONE
+	u32 m_callback_current = CALLBACK_NONE;
+	u64 m_callback_since_us = 0;
+
 	lua_State      *m_luastack = nullptr;
 
 	IGameDef       *m_gamedef = nullptr;
@@ -182,3 +223,23 @@ class ScriptApiBase : protected LuaHelper {
 #endif
 	ScriptingType  m_type;
 };
+
+/*
+	Charges the time spent in Lua within the scope to a callback type, see
+	ScriptApiBase::beginCallback(). Scopes can be nested, the time of the
+	inner scopes is not charged to the outer ones.
+*/
+class ScriptCallbackScope
+{
+public:
+	ScriptCallbackScope(ScriptApiBase *script, const char *callback) :
+		m_script(script), m_outer(script->beginCallback(callback))
+	{}
+	~ScriptCallbackScope() { m_script->endCallback(m_outer); }
+
+	DISABLE_CLASS_COPY(ScriptCallbackScope);
+
+private:
+	ScriptApiBase *m_script;
+	u32 m_outer;
+};
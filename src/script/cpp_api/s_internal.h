@@ -80,6 +80,7 @@ class LockChecker {
 		RecursiveMutexAutoLock scriptlock(this->m_luastackmutex);              \
 		SCRIPTAPI_LOCK_CHECK;                                                  \
 		realityCheck();                                                        \
+		ScriptCallbackScope callback_scope(this, __FUNCTION__);                \
 		lua_State *L = getStack();                                             \
 		assert(lua_checkstack(L, 20));                                         \
 		StackUnroller stack_unroller(L);
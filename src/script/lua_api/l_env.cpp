@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <algorithm>
 #include "lua_api/l_env.h"
 #include "lua_api/l_internal.h"
+#include "lua_api/l_mapsnapshot.h"
 #include "lua_api/l_nodemeta.h"
 #include "lua_api/l_nodetimer.h"
 #include "lua_api/l_noise.h"
@@ -29,6 +30,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "scripting_server.h"
 #include "environment.h"
 #include "mapblock.h"
+#include "mapsnapshot.h"
 #include "server.h"
 #include "nodedef.h"
 #include "daynightratio.h"
@@ -70,6 +72,7 @@ void LuaABM::trigger(ServerEnvironment *env, v3s16 p, MapNode n,
 {
 	ServerScripting *scriptIface = env->getScriptIface();
 	scriptIface->realityCheck();
+	ScriptCallbackScope callback_scope(scriptIface, "abm_trigger");
 
 	lua_State *L = scriptIface->getStack();
 	sanity_check(lua_checkstack(L, 20));
@@ -114,6 +117,7 @@ void LuaLBM::trigger(ServerEnvironment *env, v3s16 p,
 {
 	ServerScripting *scriptIface = env->getScriptIface();
 	scriptIface->realityCheck();
+	ScriptCallbackScope callback_scope(scriptIface, "lbm_trigger");
 
 	lua_State *L = scriptIface->getStack();
 	sanity_check(lua_checkstack(L, 20));
@@ -874,10 +878,107 @@ void ModApiEnvBase::checkArea(v3s16 &minp, v3s16 &maxp)
 #undef CLAMP
 }
 
+namespace {
+
+/*
+	Dense lookup table from content id to position in a filter list, so
+	testing a node does not need to search the list.
+*/
+class ContentFilter
+{
+public:
+	ContentFilter(const std::vector<content_t> &filter)
+	{
+		if (filter.empty())
+			return;
+		m_index.resize(*std::max_element(filter.begin(), filter.end()) + 1, 0);
+		// The first occurrence wins, like std::find
+		for (u32 i = filter.size(); i-- != 0;)
+			m_index[filter[i]] = i + 1;
+	}
+
+	// Returns the index of c in the filter list plus one, or 0 if not in it
+	inline u32 lookup(content_t c) const
+	{
+		return c < m_index.size() ? m_index[c] : 0;
+	}
+
+private:
+	std::vector<u32> m_index;
+};
+
+/*
+	Calls found(p, filter index + 1) for each node in the area that passes
+	the filter. Iterates block by block in the order of
+	Map::forEachNodeInArea and skips the blocks whose content index shows
+	that there is nothing to find.
+*/
 template <typename F>
+void findMatchesInArea(Map &map, v3s16 minp, v3s16 maxp,
+		const ContentFilter &filter, F &&found)
+{
+	const u32 ignore_index = filter.lookup(CONTENT_IGNORE);
+	v3s16 bpmin = getNodeBlockPos(minp);
+	v3s16 bpmax = getNodeBlockPos(maxp);
+	for (s16 bz = bpmin.Z; bz <= bpmax.Z; bz++)
+	for (s16 bx = bpmin.X; bx <= bpmax.X; bx++)
+	for (s16 by = bpmin.Y; by <= bpmax.Y; by++) {
+		v3s16 bp(bx, by, bz);
+		MapBlock *block = map.getBlockNoCreateNoEx(bp);
+		if (!block && !ignore_index)
+			continue;
+
+		if (block) {
+			const MapBlock::ContentCounts *counts = block->getContentCounts();
+			if (counts && std::none_of(counts->begin(), counts->end(),
+					[&] (const std::pair<content_t, u16> &e) {
+						return filter.lookup(e.first) != 0;
+					}))
+				continue;
+		}
+
+		v3s16 basep = bp * MAP_BLOCKSIZE;
+		v3s16 rmin(
+			rangelim(minp.X - basep.X, 0, MAP_BLOCKSIZE - 1),
+			rangelim(minp.Y - basep.Y, 0, MAP_BLOCKSIZE - 1),
+			rangelim(minp.Z - basep.Z, 0, MAP_BLOCKSIZE - 1));
+		v3s16 rmax(
+			rangelim(maxp.X - basep.X, 0, MAP_BLOCKSIZE - 1),
+			rangelim(maxp.Y - basep.Y, 0, MAP_BLOCKSIZE - 1),
+			rangelim(maxp.Z - basep.Z, 0, MAP_BLOCKSIZE - 1));
+		v3s16 r;
+		for (r.Z = rmin.Z; r.Z <= rmax.Z; r.Z++)
+		for (r.Y = rmin.Y; r.Y <= rmax.Y; r.Y++)
+		for (r.X = rmin.X; r.X <= rmax.X; r.X++) {
+			// Nodes of blocks that are not loaded read as ignore
+			u32 index = block ?
+					filter.lookup(block->getNodeNoCheck(r).getContent()) :
+					ignore_index;
+			if (index)
+				found(basep + r, index);
+		}
+	}
+}
+
+inline void push_found_pos(lua_State *L, v3s16 p, bool packed)
+{
+	if (packed) {
+		// Same as minetest.hash_node_position, exact in a double
+		lua_pushnumber(L, ((double)(p.Z + 0x8000) * 0x10000 +
+			(p.Y + 0x8000)) * 0x10000 + (p.X + 0x8000));
+	} else {
+		push_v3s16(L, p);
+	}
+}
+
+}
+
 int ModApiEnvBase::findNodesInArea(lua_State *L, const NodeDefManager *ndef,
-		const std::vector<content_t> &filter, bool grouped, F &&iterate)
+		Map &map, v3s16 minp, v3s16 maxp,
+		const std::vector<content_t> &filter, bool grouped, bool packed)
 {
+	const ContentFilter content_filter(filter);
+
 	if (grouped) {
 		// create the table we will be returning
 		lua_createtable(L, 0, filter.size());
@@ -889,20 +990,17 @@ int ModApiEnvBase::findNodesInArea(lua_State *L, const NodeDefManager *ndef,
 		for (u32 i = 0; i < filter.size(); i++)
 			lua_newtable(L);
 
-		iterate([&](v3s16 p, MapNode n) -> bool {
-			content_t c = n.getContent();
-
-			auto it = std::find(filter.begin(), filter.end(), c);
-			if (it != filter.end()) {
-				// Calculate index of the table and append the position
-				u32 filt_index = it - filter.begin();
-				push_v3s16(L, p);
-				lua_rawseti(L, base + 1 + filt_index, ++idx[filt_index]);
-			}
-
-			return true;
+		findMatchesInArea(map, minp, maxp, content_filter,
+				[&](v3s16 p, u32 index) {
+			// Append the position to the table of the filter
+			u32 filt_index = index - 1;
+			push_found_pos(L, p, packed);
+			lua_rawseti(L, base + 1 + filt_index, ++idx[filt_index]);
 		});
 
+		if (filter.empty())
+			return 1;
+
 		// last filter table is at top of stack
 		u32 i = filter.size() - 1;
 		do {
@@ -923,19 +1021,11 @@ int ModApiEnvBase::findNodesInArea(lua_State *L, const NodeDefManager *ndef,
 
 		lua_newtable(L);
 		u32 i = 0;
-		iterate([&](v3s16 p, MapNode n) -> bool {
-			content_t c = n.getContent();
-
-			auto it = std::find(filter.begin(), filter.end(), c);
-			if (it != filter.end()) {
-				push_v3s16(L, p);
-				lua_rawseti(L, -2, ++i);
-
-				u32 filt_index = it - filter.begin();
-				individual_count[filt_index]++;
-			}
-
-			return true;
+		findMatchesInArea(map, minp, maxp, content_filter,
+				[&](v3s16 p, u32 index) {
+			push_found_pos(L, p, packed);
+			lua_rawseti(L, -2, ++i);
+			individual_count[index - 1]++;
 		});
 
 		lua_createtable(L, 0, filter.size());
@@ -947,7 +1037,7 @@ int ModApiEnvBase::findNodesInArea(lua_State *L, const NodeDefManager *ndef,
 	}
 }
 
-// find_nodes_in_area(minp, maxp, nodenames, [grouped])
+// find_nodes_in_area(minp, maxp, nodenames, [grouped], [packed])
 int ModApiEnv::l_find_nodes_in_area(lua_State *L)
 {
 	GET_PLAIN_ENV_PTR;
@@ -972,11 +1062,9 @@ int ModApiEnv::l_find_nodes_in_area(lua_State *L)
 	collectNodeIds(L, 3, ndef, filter);
 
 	bool grouped = lua_isboolean(L, 4) && readParam<bool>(L, 4);
+	bool packed = lua_isboolean(L, 5) && readParam<bool>(L, 5);
 
-	auto iterate = [&] (auto &&callback) {
-		map.forEachNodeInArea(minp, maxp, callback);
-	};
-	return findNodesInArea(L, ndef, filter, grouped, iterate);
+	return findNodesInArea(L, ndef, map, minp, maxp, filter, grouped, packed);
 }
 
 template <typename F>
@@ -1091,6 +1179,22 @@ int ModApiEnv::l_get_voxel_manip(lua_State *L)
 	return LuaVoxelManip::create_object(L);
 }
 
+// get_map_snapshot(pos1, pos2)
+int ModApiEnv::l_get_map_snapshot(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	v3s16 minp = check_v3s16(L, 1);
+	v3s16 maxp = check_v3s16(L, 2);
+	sortBoxVerticies(minp, maxp);
+	checkArea(minp, maxp);
+
+	auto snapshot = std::make_shared<MapSnapshot>(&env->getMap(),
+		getNodeBlockPos(minp), getNodeBlockPos(maxp));
+	LuaMapSnapshot::create(L, std::move(snapshot));
+	return 1;
+}
+
 // clear_objects([options])
 // clear all objects in the environment
 // where options = {mode = "full" or "quick"}
@@ -1476,6 +1580,7 @@ void ModApiEnv::Initialize(lua_State *L, int top)
 	API_FCT(get_perlin);
 	API_FCT(get_perlin_map);
 	API_FCT(get_voxel_manip);
+	API_FCT(get_map_snapshot);
 	API_FCT(clear_objects);
 	API_FCT(spawn_tree);
 	API_FCT(find_path);
@@ -37,12 +37,11 @@ class ModApiEnvBase : public ModApiBase {
 	static int findNodeNear(lua_State *L, v3s16 pos, int radius,
 		const std::vector<content_t> &filter, int start_radius, F &&getNode);
 
-	// F must be (G callback) -> void
-	// with G being (v3s16 p, MapNode n) -> bool
-	// and behave like Map::forEachNodeInArea
-	template <typename F>
-	static int findNodesInArea(lua_State *L,  const NodeDefManager *ndef,
-		const std::vector<content_t> &filter, bool grouped, F &&iterate);
+	// If packed is true, positions are returned as position hashes
+	// (see minetest.hash_node_position) instead of tables
+	static int findNodesInArea(lua_State *L, const NodeDefManager *ndef,
+		Map &map, v3s16 minp, v3s16 maxp,
+		const std::vector<content_t> &filter, bool grouped, bool packed);
 
 	// F must be (v3s16 pos) -> MapNode
 	template <typename F>
@@ -198,6 +197,10 @@ class ModApiEnv : public ModApiEnvBase {
 	// returns world-specific voxel manipulator
 	static int l_get_voxel_manip(lua_State *L);
 
+	// get_map_snapshot(pos1, pos2)
+	// returns a read-only copy of the blocks containing the area
+	static int l_get_map_snapshot(lua_State *L);
+
 	// clear_objects()
 	// clear all objects in the environment
 	static int l_clear_objects(lua_State *L);
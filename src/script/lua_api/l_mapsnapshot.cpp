@@ -0,0 +1,185 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "lua_api/l_mapsnapshot.h"
+#include "lua_api/l_internal.h"
+#include "common/c_content.h"
+#include "common/c_converter.h"
+#include "common/c_packer.h"
+#include "mapsnapshot.h"
+
+/*
+	The snapshot is never modified after it was taken, so none of these
+	need the map lock and all of them work in the async environment.
+*/
+
+// Pushes one value per node of the snapshot to a flat array, reusing the
+// table at buffer_idx if there is one
+template <typename F>
+static void push_snapshot_data(lua_State *L, const MapSnapshot &snapshot,
+	int buffer_idx, F get_value)
+{
+	const MapNode *data = snapshot.getData();
+	u32 volume = snapshot.getArea().getVolume();
+
+	if (lua_istable(L, buffer_idx))
+		lua_pushvalue(L, buffer_idx);
+	else
+		lua_createtable(L, volume, 0);
+
+	for (u32 i = 0; i != volume; i++) {
+		lua_pushinteger(L, get_value(data[i]));
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+// garbage collector
+int LuaMapSnapshot::gc_object(lua_State *L)
+{
+	LuaMapSnapshot *o = *(LuaMapSnapshot **)(lua_touserdata(L, 1));
+	delete o;
+
+	return 0;
+}
+
+// get_node(self, pos)
+int LuaMapSnapshot::l_get_node(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaMapSnapshot *o = checkObject<LuaMapSnapshot>(L, 1);
+	v3s16 pos = check_v3s16(L, 2);
+
+	pushnode(L, o->m_snapshot->getNode(pos));
+	return 1;
+}
+
+// get_node_or_nil(self, pos)
+int LuaMapSnapshot::l_get_node_or_nil(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaMapSnapshot *o = checkObject<LuaMapSnapshot>(L, 1);
+	v3s16 pos = check_v3s16(L, 2);
+
+	bool pos_ok;
+	MapNode n = o->m_snapshot->getNode(pos, &pos_ok);
+	if (pos_ok)
+		pushnode(L, n);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+// get_emerged_area(self)
+int LuaMapSnapshot::l_get_emerged_area(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaMapSnapshot *o = checkObject<LuaMapSnapshot>(L, 1);
+	const VoxelArea &area = o->m_snapshot->getArea();
+
+	push_v3s16(L, area.MinEdge);
+	push_v3s16(L, area.MaxEdge);
+	return 2;
+}
+
+// get_data(self, [buffer])
+int LuaMapSnapshot::l_get_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaMapSnapshot *o = checkObject<LuaMapSnapshot>(L, 1);
+	push_snapshot_data(L, *o->m_snapshot, 2,
+		[] (const MapNode &n) { return n.getContent(); });
+	return 1;
+}
+
+// get_light_data(self, [buffer])
+int LuaMapSnapshot::l_get_light_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaMapSnapshot *o = checkObject<LuaMapSnapshot>(L, 1);
+	push_snapshot_data(L, *o->m_snapshot, 2,
+		[] (const MapNode &n) { return n.param1; });
+	return 1;
+}
+
+// get_param2_data(self, [buffer])
+int LuaMapSnapshot::l_get_param2_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaMapSnapshot *o = checkObject<LuaMapSnapshot>(L, 1);
+	push_snapshot_data(L, *o->m_snapshot, 2,
+		[] (const MapNode &n) { return n.param2; });
+	return 1;
+}
+
+LuaMapSnapshot::LuaMapSnapshot(std::shared_ptr<const MapSnapshot> snapshot) :
+	m_snapshot(std::move(snapshot))
+{
+}
+
+void LuaMapSnapshot::create(lua_State *L, std::shared_ptr<const MapSnapshot> snapshot)
+{
+	LuaMapSnapshot *o = new LuaMapSnapshot(std::move(snapshot));
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+}
+
+void *LuaMapSnapshot::packIn(lua_State *L, int idx)
+{
+	LuaMapSnapshot *o = checkObject<LuaMapSnapshot>(L, idx);
+
+	// Only the reference is copied, not the nodes
+	return new std::shared_ptr<const MapSnapshot>(o->m_snapshot);
+}
+
+void LuaMapSnapshot::packOut(lua_State *L, void *ptr)
+{
+	auto *snapshot = reinterpret_cast<std::shared_ptr<const MapSnapshot>*>(ptr);
+	if (L)
+		create(L, std::move(*snapshot));
+	delete snapshot;
+}
+
+void LuaMapSnapshot::Register(lua_State *L)
+{
+	static const luaL_Reg metamethods[] = {
+		{"__gc", gc_object},
+		{0, 0}
+	};
+	registerClass(L, className, methods, metamethods);
+
+	script_register_packer(L, className, packIn, packOut);
+}
+
+const char LuaMapSnapshot::className[] = "MapSnapshot";
+const luaL_Reg LuaMapSnapshot::methods[] = {
+	luamethod(LuaMapSnapshot, get_node),
+	luamethod(LuaMapSnapshot, get_node_or_nil),
+	luamethod(LuaMapSnapshot, get_emerged_area),
+	luamethod(LuaMapSnapshot, get_data),
+	luamethod(LuaMapSnapshot, get_light_data),
+	luamethod(LuaMapSnapshot, get_param2_data),
+	{0,0}
+};
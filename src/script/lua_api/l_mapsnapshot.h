@@ -0,0 +1,61 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "lua_api/l_base.h"
+#include <memory>
+
+class MapSnapshot;
+
+/*
+  MapSnapshot
+
+  Read-only view of a MapSnapshot. Copies of the object (e.g. passed to
+  async jobs) share the same snapshot.
+ */
+class LuaMapSnapshot : public ModApiBase
+{
+private:
+	std::shared_ptr<const MapSnapshot> m_snapshot;
+
+	static const luaL_Reg methods[];
+
+	static int gc_object(lua_State *L);
+
+	static int l_get_node(lua_State *L);
+	static int l_get_node_or_nil(lua_State *L);
+	static int l_get_emerged_area(lua_State *L);
+	static int l_get_data(lua_State *L);
+	static int l_get_light_data(lua_State *L);
+	static int l_get_param2_data(lua_State *L);
+
+public:
+	LuaMapSnapshot(std::shared_ptr<const MapSnapshot> snapshot);
+
+	// Creates a LuaMapSnapshot and leaves it on top of stack
+	static void create(lua_State *L, std::shared_ptr<const MapSnapshot> snapshot);
+
+	static void *packIn(lua_State *L, int idx);
+	static void packOut(lua_State *L, void *ptr);
+
+	static void Register(lua_State *L);
+
+	static const char className[];
+};
@@ -29,6 +29,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "remoteplayer.h"
 #include "log.h"
+#include "filesys.h"
+#include "profiler.h"
 #include <algorithm>
 
 // request_shutdown()
@@ -661,6 +663,50 @@ int ModApiServer::l_serialize_roundtrip(lua_State *L)
 	return 1;
 }
 
+// set_profiler_trace(enabled)
+int ModApiServer::l_set_profiler_trace(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	g_profiler->setTraceEnabled(readParam<bool>(L, 1));
+	return 0;
+}
+
+// save_profiler_trace() -> path or nil
+int ModApiServer::l_save_profiler_trace(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	std::ostringstream os;
+	g_profiler->writeTrace(os);
+
+	std::string path = getServer(L)->getWorldPath() + DIR_DELIM + "profiler_trace.json";
+	if (!fs::safeWriteToFile(path, os.str()))
+		return 0;
+	lua_pushstring(L, path.c_str());
+	return 1;
+}
+
+// get_callback_stats() -> list of {mod=, callback=, calls=, time_us=}
+int ModApiServer::l_get_callback_stats(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	std::vector<ScriptApiBase::CallbackStats> stats =
+			getScriptApiBase(L)->getCallbackStats();
+
+	lua_createtable(L, stats.size(), 0);
+	int i = 0;
+	for (const auto &it : stats) {
+		lua_createtable(L, 0, 4);
+		setstringfield(L, -1, "mod", it.mod);
+		setstringfield(L, -1, "callback", it.callback);
+		lua_pushnumber(L, it.calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushnumber(L, it.time_us);
+		lua_setfield(L, -2, "time_us");
+		lua_rawseti(L, -2, ++i);
+	}
+	return 1;
+}
+
 void ModApiServer::Initialize(lua_State *L, int top)
 {
 	API_FCT(request_shutdown);
@@ -700,6 +746,10 @@ void ModApiServer::Initialize(lua_State *L, int top)
 	API_FCT(do_async_callback);
 	API_FCT(register_async_dofile);
 	API_FCT(serialize_roundtrip);
+
+	API_FCT(set_profiler_trace);
+	API_FCT(save_profiler_trace);
+	API_FCT(get_callback_stats);
 }
 
 void ModApiServer::InitializeAsync(lua_State *L, int top)
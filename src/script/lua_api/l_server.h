@@ -121,6 +121,15 @@ class ModApiServer : public ModApiBase
 	// serialize_roundtrip(obj)
 	static int l_serialize_roundtrip(lua_State *L);
 
+	// set_profiler_trace(enabled)
+	static int l_set_profiler_trace(lua_State *L);
+
+	// save_profiler_trace() -> path or nil
+	static int l_save_profiler_trace(lua_State *L);
+
+	// get_callback_stats() -> list of {mod=, callback=, calls=, time_us=}
+	static int l_get_callback_stats(lua_State *L);
+
 public:
 	static void Initialize(lua_State *L, int top);
 	static void InitializeAsync(lua_State *L, int top);
@@ -344,6 +344,25 @@ int LuaVoxelManip::l_get_emerged_area(lua_State *L)
 	return 2;
 }
 
+// get_buffer(self, [field])
+int LuaVoxelManip::l_get_buffer(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	checkObject<LuaVoxelManip>(L, 1);
+	std::string field = lua_isnoneornil(L, 2) ? "content" : readParam<std::string>(L, 2);
+
+	if (field == "content")
+		LuaVoxelManipBuffer::create(L, 1, LuaVoxelManipBuffer::FIELD_CONTENT);
+	else if (field == "light")
+		LuaVoxelManipBuffer::create(L, 1, LuaVoxelManipBuffer::FIELD_LIGHT);
+	else if (field == "param2")
+		LuaVoxelManipBuffer::create(L, 1, LuaVoxelManipBuffer::FIELD_PARAM2);
+	else
+		throw LuaError("VoxelManip:get_buffer: unknown field \"" + field + "\"");
+	return 1;
+}
+
 LuaVoxelManip::LuaVoxelManip(MMVManip *mmvm, bool is_mg_vm) :
 	is_mapgen_vm(is_mg_vm),
 	vm(mmvm)
@@ -452,5 +471,223 @@ const luaL_Reg LuaVoxelManip::methods[] = {
 	luamethod(LuaVoxelManip, set_param2_data),
 	luamethod(LuaVoxelManip, was_modified),
 	luamethod(LuaVoxelManip, get_emerged_area),
+	luamethod(LuaVoxelManip, get_buffer),
+	{0,0}
+};
+
+/*
+  VoxelManipBuffer
+ */
+
+LuaVoxelManipBuffer::LuaVoxelManipBuffer(LuaVoxelManip *vm, int vm_ref, Field field) :
+	m_vm(vm),
+	m_vm_ref(vm_ref),
+	m_field(field)
+{
+}
+
+void LuaVoxelManipBuffer::create(lua_State *L, int vm_idx, Field field)
+{
+	LuaVoxelManip *vm = checkObject<LuaVoxelManip>(L, vm_idx);
+	lua_pushvalue(L, vm_idx);
+	int vm_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	LuaVoxelManipBuffer *o = new LuaVoxelManipBuffer(vm, vm_ref, field);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+}
+
+int LuaVoxelManipBuffer::gc_object(lua_State *L)
+{
+	LuaVoxelManipBuffer *o = *(LuaVoxelManipBuffer **)(lua_touserdata(L, 1));
+	luaL_unref(L, LUA_REGISTRYINDEX, o->m_vm_ref);
+	delete o;
+
+	return 0;
+}
+
+/*
+	The VoxelManip may be re-read with a different area at any time, so
+	the data pointer and the volume are never cached.
+*/
+
+inline u32 LuaVoxelManipBuffer::getValue(u32 i) const
+{
+	const MapNode &n = m_vm->vm->m_data[i];
+	switch (m_field) {
+	case FIELD_CONTENT:
+		return n.getContent();
+	case FIELD_LIGHT:
+		return n.param1;
+	default:
+		return n.param2;
+	}
+}
+
+inline void LuaVoxelManipBuffer::setValue(u32 i, u32 value)
+{
+	MapNode &n = m_vm->vm->m_data[i];
+	switch (m_field) {
+	case FIELD_CONTENT:
+		n.setContent(value);
+		break;
+	case FIELD_LIGHT:
+		n.param1 = value;
+		break;
+	default:
+		n.param2 = value;
+		break;
+	}
+}
+
+u32 LuaVoxelManipBuffer::checkIndex(lua_State *L, int idx) const
+{
+	lua_Integer i = luaL_checkinteger(L, idx);
+	if (i < 1 || i > m_vm->vm->m_area.getVolume())
+		throw LuaError("VoxelManipBuffer: index " + std::to_string(i) +
+			" out of range");
+	return i - 1;
+}
+
+u32 LuaVoxelManipBuffer::checkValue(lua_State *L, int idx) const
+{
+	lua_Integer value = luaL_checkinteger(L, idx);
+	lua_Integer max = m_field == FIELD_CONTENT ? U16_MAX : U8_MAX;
+	if (value < 0 || value > max)
+		throw LuaError("VoxelManipBuffer: value " + std::to_string(value) +
+			" out of range");
+	return value;
+}
+
+VoxelArea LuaVoxelManipBuffer::readArea(lua_State *L, int idx) const
+{
+	const VoxelArea &vm_area = m_vm->vm->m_area;
+	if (lua_isnoneornil(L, idx))
+		return vm_area;
+	v3s16 minp = check_v3s16(L, idx);
+	v3s16 maxp = check_v3s16(L, idx + 1);
+	sortBoxVerticies(minp, maxp);
+	return vm_area.intersect(VoxelArea(minp, maxp));
+}
+
+// Numeric keys index the data, everything else the methods
+int LuaVoxelManipBuffer::mt_index(lua_State *L)
+{
+	if (lua_type(L, 2) != LUA_TNUMBER) {
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		return 1;
+	}
+	return l_get(L);
+}
+
+int LuaVoxelManipBuffer::mt_newindex(lua_State *L)
+{
+	return l_set(L);
+}
+
+int LuaVoxelManipBuffer::mt_len(lua_State *L)
+{
+	LuaVoxelManipBuffer *o = checkObject<LuaVoxelManipBuffer>(L, 1);
+	lua_pushinteger(L, o->m_vm->vm->m_area.getVolume());
+	return 1;
+}
+
+// get(self, i)
+int LuaVoxelManipBuffer::l_get(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipBuffer *o = checkObject<LuaVoxelManipBuffer>(L, 1);
+	u32 i = o->checkIndex(L, 2);
+	lua_pushinteger(L, o->getValue(i));
+	return 1;
+}
+
+// set(self, i, value)
+int LuaVoxelManipBuffer::l_set(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipBuffer *o = checkObject<LuaVoxelManipBuffer>(L, 1);
+	u32 i = o->checkIndex(L, 2);
+	o->setValue(i, o->checkValue(L, 3));
+	return 0;
+}
+
+// fill(self, value, [minp, maxp])
+int LuaVoxelManipBuffer::l_fill(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipBuffer *o = checkObject<LuaVoxelManipBuffer>(L, 1);
+	u32 value = o->checkValue(L, 2);
+	VoxelArea area = o->readArea(L, 3);
+	if (area.hasEmptyExtent())
+		return 0;
+
+	const VoxelArea &vm_area = o->m_vm->vm->m_area;
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++) {
+		u32 i = vm_area.index(area.MinEdge.X, y, z);
+		for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++, i++)
+			o->setValue(i, value);
+	}
+	return 0;
+}
+
+// replace(self, old_value, new_value, [minp, maxp])
+int LuaVoxelManipBuffer::l_replace(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipBuffer *o = checkObject<LuaVoxelManipBuffer>(L, 1);
+	u32 old_value = o->checkValue(L, 2);
+	u32 new_value = o->checkValue(L, 3);
+	VoxelArea area = o->readArea(L, 4);
+
+	u32 count = 0;
+	if (!area.hasEmptyExtent()) {
+		const VoxelArea &vm_area = o->m_vm->vm->m_area;
+		for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+		for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++) {
+			u32 i = vm_area.index(area.MinEdge.X, y, z);
+			for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++, i++) {
+				if (o->getValue(i) == old_value) {
+					o->setValue(i, new_value);
+					count++;
+				}
+			}
+		}
+	}
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+void LuaVoxelManipBuffer::Register(lua_State *L)
+{
+	static const luaL_Reg metamethods[] = {
+		{"__gc", gc_object},
+		{"__newindex", mt_newindex},
+		{"__len", mt_len},
+		{0, 0}
+	};
+	registerClass(L, className, methods, metamethods);
+
+	// Replace the method table with mt_index, which falls back to it
+	luaL_getmetatable(L, className);
+	lua_getfield(L, -1, "__index");
+	lua_pushcclosure(L, mt_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
+
+const char LuaVoxelManipBuffer::className[] = "VoxelManipBuffer";
+const luaL_Reg LuaVoxelManipBuffer::methods[] = {
+	luamethod(LuaVoxelManipBuffer, get),
+	luamethod(LuaVoxelManipBuffer, set),
+	luamethod(LuaVoxelManipBuffer, fill),
+	luamethod(LuaVoxelManipBuffer, replace),
 	{0,0}
 };
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irr_v3d.h"
 #include "lua_api/l_base.h"
+#include "voxel.h"
 
 class Map;
 class MapBlock;
@@ -60,6 +61,8 @@ class LuaVoxelManip : public ModApiBase
 	static int l_was_modified(lua_State *L);
 	static int l_get_emerged_area(lua_State *L);
 
+	static int l_get_buffer(lua_State *L);
+
 public:
 	MMVManip *vm = nullptr;
 
@@ -81,3 +84,54 @@ class LuaVoxelManip : public ModApiBase
 
 	static const char className[];
 };
+
+/*
+  VoxelManipBuffer
+
+  Reads and writes one field of the nodes of a VoxelManip in place,
+  without copying them to a table.
+ */
+class LuaVoxelManipBuffer : public ModApiBase
+{
+public:
+	enum Field : u8 {
+		FIELD_CONTENT,
+		FIELD_LIGHT,
+		FIELD_PARAM2,
+	};
+
+private:
+	LuaVoxelManip *m_vm;
+	// Keeps the VoxelManip alive
+	int m_vm_ref;
+	Field m_field;
+
+	static const luaL_Reg methods[];
+
+	static int gc_object(lua_State *L);
+	static int mt_index(lua_State *L);
+	static int mt_newindex(lua_State *L);
+	static int mt_len(lua_State *L);
+
+	static int l_get(lua_State *L);
+	static int l_set(lua_State *L);
+	static int l_fill(lua_State *L);
+	static int l_replace(lua_State *L);
+
+	u32 getValue(u32 i) const;
+	void setValue(u32 i, u32 value);
+	u32 checkIndex(lua_State *L, int idx) const;
+	u32 checkValue(lua_State *L, int idx) const;
+	// Area of the optional (minp, maxp) at idx, clipped to the VoxelManip
+	VoxelArea readArea(lua_State *L, int idx) const;
+
+public:
+	LuaVoxelManipBuffer(LuaVoxelManip *vm, int vm_ref, Field field);
+
+	// Creates a buffer for the VoxelManip at vm_idx and leaves it on top of stack
+	static void create(lua_State *L, int vm_idx, Field field);
+
+	static void Register(lua_State *L);
+
+	static const char className[];
+};
@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "server.h"
+#include <cstdio>
 #include <iostream>
 #include <queue>
 #include <algorithm>
@@ -65,6 +66,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "remoteplayer.h"
 #include "server/player_sao.h"
 #include "server/serverinventorymgr.h"
+#include "server/serializedblockcache.h"
+#include "threading/thread_pool.h"
 #include "translation.h"
 #include "database/database-sqlite3.h"
 #if USE_POSTGRESQL
@@ -307,6 +310,15 @@ Server::Server(
 			"Number of map edit events");
 
 	m_lag_gauge->set(g_settings->getFloat("dedicated_server_step"));
+
+	const u32 block_cache_size = g_settings->getU32("block_send_cache_size");
+	if (block_cache_size > 0) {
+		m_block_cache = std::make_unique<SerializedBlockCache>(
+				(size_t)block_cache_size * 1024 * 1024, m_metrics_backend.get());
+	}
+
+	m_block_send_pool = std::make_unique<ThreadPool>("BlockSend",
+			ThreadPool::defaultThreadCount("block_send_threads"));
 }
 
 Server::~Server()
@@ -653,6 +665,10 @@ void Server::AsyncRunStep(bool initial_step)
 		m_env->step(dtime);
 	}
 
+	static const float callback_metrics_dtime = 5.0f;
+	if (m_callback_metrics_interval.step(dtime, callback_metrics_dtime))
+		updateCallbackMetrics();
+
 	static const float map_timer_and_unload_dtime = 2.92;
 	if(m_map_timer_and_unload_interval.step(dtime, map_timer_and_unload_dtime))
 	{
@@ -701,6 +717,8 @@ void Server::AsyncRunStep(bool initial_step)
 
 		std::map<v3s16, MapBlock*> modified_blocks;
 		m_env->getServerMap().transformLiquids(modified_blocks, m_env);
+		g_profiler->avg("Server: liquid queue length",
+			m_env->getServerMap().getTransformingLiquidCount());
 
 		if (!modified_blocks.empty()) {
 			MapEditEvent event;
@@ -1317,6 +1335,35 @@ const ClientDynamicInfo *Server::getClientDynamicInfo(session_t peer_id)
 	return &client->getDynamicInfo();
 }
 
+void Server::updateCallbackMetrics()
+{
+	if (!m_script)
+		return;
+
+	for (const auto &stats : m_script->getCallbackStats()) {
+		auto key = std::make_pair(stats.mod, stats.callback);
+		auto it = m_callback_metrics.find(key);
+		if (it == m_callback_metrics.end()) {
+			CallbackMetrics metrics;
+			metrics.calls = m_metrics_backend->addCounter(
+					"minetest_lua_callback_calls",
+					"Number of Lua callbacks run, by mod and callback type",
+					{{"mod", stats.mod}, {"callback", stats.callback}});
+			metrics.time = m_metrics_backend->addCounter(
+					"minetest_lua_callback_seconds",
+					"Time spent in Lua callbacks, by mod and callback type",
+					{{"mod", stats.mod}, {"callback", stats.callback}});
+			it = m_callback_metrics.emplace(key, metrics).first;
+		}
+
+		CallbackMetrics &metrics = it->second;
+		metrics.calls->increment(stats.calls - metrics.last_calls);
+		metrics.time->increment((stats.time_us - metrics.last_time_us) / 1e6);
+		metrics.last_calls = stats.calls;
+		metrics.last_time_us = stats.time_us;
+	}
+}
+
 void Server::handlePeerChanges()
 {
 	while(!m_peer_change_queue.empty())
@@ -2395,100 +2442,183 @@ void Server::SendBlockNoLock(session_t peer_id, MapBlock *block, u8 ver,
 		u16 net_proto_version, SerializedBlockCache *cache)
 {
 	thread_local const int net_compression_level = rangelim(g_settings->getS16("map_compression_level_net"), -1, 9);
-	std::string s, *sptr = nullptr;
+	std::string s;
 
-	if (cache) {
-		auto it = cache->find({block->getPos(), ver});
-		if (it != cache->end())
-			sptr = &it->second;
+	if (cache && cache->get(block, ver, s)) {
+		SendBlockData(peer_id, block->getPos(), s);
+		return;
 	}
 
 	// Serialize the block in the right format
-	if (!sptr) {
-		std::ostringstream os(std::ios_base::binary);
-		block->serialize(os, ver, false, net_compression_level);
-		block->serializeNetworkSpecific(os);
-		s = os.str();
-		sptr = &s;
-	}
+	std::ostringstream os(std::ios_base::binary);
+	block->serialize(os, ver, false, net_compression_level);
+	block->serializeNetworkSpecific(os);
+	s = os.str();
 
-	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + sptr->size(), peer_id);
-	pkt << block->getPos();
-	pkt.putRawString(*sptr);
-	Send(&pkt);
+	SendBlockData(peer_id, block->getPos(), s);
 
 	// Store away in cache
-	if (cache && sptr == &s)
-		(*cache)[{block->getPos(), ver}] = std::move(s);
+	if (cache)
+		cache->insert(block->getPos(), ver, block->getChangeStamp(), std::move(s));
+}
+
+void Server::SendBlockData(session_t peer_id, v3s16 pos, const std::string &data)
+{
+	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + data.size(), peer_id);
+	pkt << pos;
+	pkt.putRawString(data);
+	Send(&pkt);
 }
 
 void Server::SendBlocks(float dtime)
 {
-	MutexAutoLock envlock(m_env_mutex);
-	//TODO check if one big lock could be faster then multiple small ones
+	thread_local const int net_compression_level = rangelim(g_settings->getS16("map_compression_level_net"), -1, 9);
 
-	std::vector<PrioritySortedBlockTransfer> queue;
+	// A block serialization, possibly shared by multiple clients
+	struct BlockData {
+		v3s16 pos;
+		u8 ver;
+		u64 change_stamp;
+		// Raw (uncompressed) data while `compress` is set, final data after
+		std::string data;
+		// Network specific part that is appended after compression
+		std::string suffix;
+		bool compress = false;
+		bool from_cache = false;
+	};
+	// A block to send to a client, in order of priority
+	struct BlockSend {
+		session_t peer_id;
+		size_t data_index;
+	};
+	struct BlockDataKeyHash {
+		size_t operator()(const std::pair<v3s16, u8> &p) const {
+			return std::hash<v3s16>()(p.first) ^ p.second;
+		}
+	};
 
-	u32 total_sending = 0, unique_clients = 0;
+	std::vector<BlockData> block_data;
+	std::vector<BlockSend> sends;
 
 	{
-		ScopeProfiler sp2(g_profiler, "Server::SendBlocks(): Collect list");
+		MutexAutoLock envlock(m_env_mutex);
+		//TODO check if one big lock could be faster then multiple small ones
 
-		std::vector<session_t> clients = m_clients.getClientIDs();
+		std::vector<PrioritySortedBlockTransfer> queue;
 
-		ClientInterface::AutoLock clientlock(m_clients);
-		for (const session_t client_id : clients) {
-			RemoteClient *client = m_clients.lockedGetClientNoEx(client_id, CS_Active);
+		u32 total_sending = 0;
 
-			if (!client)
-				continue;
+		{
+			ScopeProfiler sp2(g_profiler, "Server::SendBlocks(): Collect list");
+
+			std::vector<session_t> clients = m_clients.getClientIDs();
 
-			total_sending += client->getSendingCount();
-			const auto old_count = queue.size();
-			client->GetNextBlocks(m_env,m_emerge, dtime, queue);
-			unique_clients += queue.size() > old_count ? 1 : 0;
+			ClientInterface::AutoLock clientlock(m_clients);
+			for (const session_t client_id : clients) {
+				RemoteClient *client = m_clients.lockedGetClientNoEx(client_id, CS_Active);
+
+				if (!client)
+					continue;
+
+				total_sending += client->getSendingCount();
+				client->GetNextBlocks(m_env,m_emerge, dtime, queue);
+			}
 		}
-	}
 
-	// Sort.
-	// Lowest priority number comes first.
-	// Lowest is most important.
-	std::sort(queue.begin(), queue.end());
+		// Sort.
+		// Lowest priority number comes first.
+		// Lowest is most important.
+		std::sort(queue.begin(), queue.end());
 
-	ClientInterface::AutoLock clientlock(m_clients);
+		ClientInterface::AutoLock clientlock(m_clients);
 
-	// Maximal total count calculation
-	// The per-client block sends is halved with the maximal online users
-	u32 max_blocks_to_send = (m_env->getPlayerCount() + g_settings->getU32("max_users")) *
-		g_settings->getU32("max_simultaneous_block_sends_per_client") / 4 + 1;
+		// Maximal total count calculation
+		// The per-client block sends is halved with the maximal online users
+		u32 max_blocks_to_send = (m_env->getPlayerCount() + g_settings->getU32("max_users")) *
+			g_settings->getU32("max_simultaneous_block_sends_per_client") / 4 + 1;
 
-	ScopeProfiler sp(g_profiler, "Server::SendBlocks(): Send to clients");
-	Map &map = m_env->getMap();
+		ScopeProfiler sp(g_profiler, "Server::SendBlocks(): Snapshot blocks");
+		Map &map = m_env->getMap();
 
-	SerializedBlockCache cache, *cache_ptr = nullptr;
-	if (unique_clients > 1) {
-		// caching is pointless with a single client
-		cache_ptr = &cache;
-	}
+		// Blocks requested by multiple clients in this call are serialized once
+		std::unordered_map<std::pair<v3s16, u8>, size_t, BlockDataKeyHash> data_index;
 
-	for (const PrioritySortedBlockTransfer &block_to_send : queue) {
-		if (total_sending >= max_blocks_to_send)
-			break;
+		for (const PrioritySortedBlockTransfer &block_to_send : queue) {
+			if (total_sending >= max_blocks_to_send)
+				break;
 
-		MapBlock *block = map.getBlockNoCreateNoEx(block_to_send.pos);
-		if (!block)
-			continue;
+			MapBlock *block = map.getBlockNoCreateNoEx(block_to_send.pos);
+			if (!block)
+				continue;
 
-		RemoteClient *client = m_clients.lockedGetClientNoEx(block_to_send.peer_id,
-				CS_Active);
-		if (!client)
-			continue;
+			RemoteClient *client = m_clients.lockedGetClientNoEx(block_to_send.peer_id,
+					CS_Active);
+			if (!client)
+				continue;
 
-		SendBlockNoLock(block_to_send.peer_id, block, client->serialization_version,
-				client->net_proto_version, cache_ptr);
+			const u8 ver = client->serialization_version;
+			auto it = data_index.find({block_to_send.pos, ver});
+			if (it == data_index.end()) {
+				block_data.emplace_back();
+				BlockData &bd = block_data.back();
+				bd.pos = block_to_send.pos;
+				bd.ver = ver;
+				bd.change_stamp = block->getChangeStamp();
+
+				if (m_block_cache && m_block_cache->get(block, ver, bd.data)) {
+					bd.from_cache = true;
+				} else {
+					std::ostringstream os(std::ios_base::binary);
+					if (ver >= 29) {
+						// Compression is done below, without holding the env lock
+						block->serializeUncompressed(os, ver, false);
+						bd.compress = true;
+						std::ostringstream os_suffix(std::ios_base::binary);
+						block->serializeNetworkSpecific(os_suffix);
+						bd.suffix = os_suffix.str();
+					} else {
+						block->serialize(os, ver, false, net_compression_level);
+						block->serializeNetworkSpecific(os);
+					}
+					bd.data = os.str();
+				}
+				it = data_index.emplace(std::make_pair(bd.pos, ver),
+						block_data.size() - 1).first;
+			}
 
-		client->SentBlock(block_to_send.pos);
-		total_sending++;
+			sends.push_back({block_to_send.peer_id, it->second});
+			client->SentBlock(block_to_send.pos);
+			total_sending++;
+		}
+	}
+
+	if (sends.empty())
+		return;
+
+	{
+		ScopeProfiler sp(g_profiler, "Server::SendBlocks(): Compress");
+		m_block_send_pool->run(block_data.size(), [&] (size_t i) {
+			BlockData &bd = block_data[i];
+			if (!bd.compress)
+				return;
+			std::ostringstream os(std::ios_base::binary);
+			compress(bd.data, os, bd.ver, net_compression_level);
+			os << bd.suffix;
+			bd.data = os.str();
+		});
+	}
+
+	ScopeProfiler sp(g_profiler, "Server::SendBlocks(): Send to clients");
+	for (const BlockSend &send : sends) {
+		const BlockData &bd = block_data[send.data_index];
+		SendBlockData(send.peer_id, bd.pos, bd.data);
+	}
+
+	if (m_block_cache) {
+		for (BlockData &bd : block_data) {
+			if (!bd.from_cache)
+				m_block_cache->insert(bd.pos, bd.ver, bd.change_stamp, std::move(bd.data));
+		}
 	}
 }
 
@@ -2503,7 +2633,7 @@ bool Server::SendBlock(session_t peer_id, const v3s16 &blockpos)
 	if (!client || client->isBlockSent(blockpos))
 		return false;
 	SendBlockNoLock(peer_id, block, client->serialization_version,
-			client->net_proto_version);
+			client->net_proto_version, m_block_cache.get());
 
 	return true;
 }
@@ -4165,3 +4295,273 @@ bool Server::migrateModStorageDatabase(const GameParams &game_params, const Sett
 
 	return succeeded;
 }
+
+namespace {
+
+struct PregenerateState {
+	v3s16 chunk_min;
+	v3s16 chunk_count;
+	s16 chunksize;
+
+	std::mutex mutex;
+	std::vector<bool> done;
+	u32 completed = 0;
+	u32 generated = 0;
+	u32 existing = 0;
+	u32 errors = 0;
+
+	u32 getIndex(v3s16 blockpos) const
+	{
+		v3s16 c = (EmergeManager::getContainingChunk(blockpos, chunksize) -
+			chunk_min) / chunksize;
+		return ((u32)c.Z * chunk_count.Y + c.Y) * chunk_count.X + c.X;
+	}
+
+	v3s16 getChunkPos(u32 index) const
+	{
+		v3s16 c(index % chunk_count.X,
+			(index / chunk_count.X) % chunk_count.Y,
+			index / chunk_count.X / chunk_count.Y);
+		return chunk_min + c * chunksize;
+	}
+};
+
+void pregenerate_callback(v3s16 blockpos, EmergeAction action, void *param)
+{
+	auto *state = reinterpret_cast<PregenerateState *>(param);
+
+	MutexAutoLock lock(state->mutex);
+	state->completed++;
+	if (action == EMERGE_GENERATED)
+		state->generated++;
+	else if (action == EMERGE_FROM_MEMORY || action == EMERGE_FROM_DISK)
+		state->existing++;
+	else if (action == EMERGE_ERRORED)
+		state->errors++;
+	// Failed mapchunks are not done, a resumed run tries them again
+	if (action == EMERGE_GENERATED || action == EMERGE_FROM_MEMORY ||
+			action == EMERGE_FROM_DISK)
+		state->done[state->getIndex(blockpos)] = true;
+}
+
+}
+
+bool Server::pregenerateMap(const GameParams &game_params, const Settings &cmd_args,
+		const Address &bind_addr)
+{
+	const std::string area = cmd_args.get("pregenerate");
+	v3s16 minp, maxp;
+	{
+		int v[6];
+		if (std::sscanf(area.c_str(), " ( %d , %d , %d ) ( %d , %d , %d )",
+				&v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6) {
+			errorstream << "Invalid area \"" << area << "\" for --pregenerate, "
+				"expected \"(x1,y1,z1) (x2,y2,z2)\"" << std::endl;
+			return false;
+		}
+		for (int &c : v)
+			c = rangelim(c, -MAX_MAP_GENERATION_LIMIT, MAX_MAP_GENERATION_LIMIT);
+		minp = v3s16(v[0], v[1], v[2]);
+		maxp = v3s16(v[3], v[4], v[5]);
+		sortBoxVerticies(minp, maxp);
+	}
+
+	// Nothing else needs the CPUs, so unless configured otherwise use all of
+	// them for emerging
+	g_settings->setDefault("num_emerge_threads",
+		itos(Thread::getNumberOfProcessors()));
+
+	// Must outlive the server, pending emerges are cancelled on shutdown
+	PregenerateState state;
+
+	Server server(game_params.world_path, game_params.game_spec, false,
+		bind_addr, false);
+	try {
+		server.init();
+	} catch (const ModError &e) {
+		errorstream << "ModError: " << e.what() << std::endl;
+		return false;
+	} catch (const ServerError &e) {
+		errorstream << "ServerError: " << e.what() << std::endl;
+		return false;
+	}
+
+	ServerMap &map = server.m_env->getServerMap();
+	EmergeManager *emerge = server.m_emerge;
+
+	// Generating one block generates its whole mapchunk, so request one block
+	// of every mapchunk the area touches
+	const s16 max_limit_bp = MAX_MAP_GENERATION_LIMIT / MAP_BLOCKSIZE;
+	v3s16 bpmin = getNodeBlockPos(minp);
+	v3s16 bpmax = getNodeBlockPos(maxp);
+	bpmin.X = MYMAX(bpmin.X, -max_limit_bp);
+	bpmin.Y = MYMAX(bpmin.Y, -max_limit_bp);
+	bpmin.Z = MYMAX(bpmin.Z, -max_limit_bp);
+
+	state.chunksize = emerge->mgparams->chunksize;
+	state.chunk_min = EmergeManager::getContainingChunk(bpmin, state.chunksize);
+	state.chunk_count = (EmergeManager::getContainingChunk(bpmax, state.chunksize) -
+		state.chunk_min) / state.chunksize + v3s16(1, 1, 1);
+	const u32 total = (u32)state.chunk_count.X * state.chunk_count.Y *
+		state.chunk_count.Z;
+	state.done.resize(total);
+
+	/*
+		Progress is saved as the number of mapchunks (in the order they are
+		requested in) that are done and saved. It is only valid for the same
+		area, a different one starts from the beginning.
+	*/
+	std::ostringstream area_oss;
+	area_oss << minp << " " << maxp;
+	const std::string progress_path = game_params.world_path + DIR_DELIM +
+		"pregenerate.txt";
+	u32 start = 0;
+	{
+		Settings progress;
+		if (progress.readConfigFile(progress_path.c_str()) &&
+				progress.get("area") == area_oss.str()) {
+			start = MYMIN(progress.getU32("chunks_done"), total);
+			actionstream << "Resuming pregeneration after " << start
+				<< " of " << total << " mapchunks" << std::endl;
+		}
+	}
+	auto save_progress = [&] (u32 chunks_done) {
+		Settings progress;
+		progress.set("area", area_oss.str());
+		progress.setU64("chunks_done", chunks_done);
+		if (!progress.updateConfigFile(progress_path.c_str()))
+			errorstream << "Failed to write " << progress_path << std::endl;
+	};
+	for (u32 i = 0; i < start; i++)
+		state.done[i] = true;
+
+	actionstream << "Pregenerating " << minp << " to " << maxp << ", "
+		<< total << " mapchunks" << std::endl;
+
+	emerge->startThreads();
+
+	// Enough to keep all emerge threads busy, but keeps the progress
+	// (and the memory use) close to the requested order
+	const u32 max_in_flight = 4 * MYMAX(1, Thread::getNumberOfProcessors());
+	// Generated blocks are saved when they get unloaded, they are only kept
+	// for a bit so that neighbouring mapchunks don't have to load them again
+	const float unload_timeout = 10.0f;
+	const float save_interval = g_settings->getFloat("server_map_save_interval");
+	const u32 blocks_per_chunk = (u32)state.chunksize * state.chunksize *
+		state.chunksize;
+
+	bool &kill = *porting::signal_handler_killstatus();
+	const u64 start_time = porting::getTimeMs();
+	u64 last_step_time = start_time;
+	u64 last_save_time = start_time;
+	u32 next = start;
+	u32 chunks_done = start;
+
+	auto update_chunks_done = [&] () {
+		while (chunks_done < total && state.done[chunks_done])
+			chunks_done++;
+	};
+
+	// Every requested mapchunk calls back once, also when it failed
+	u32 completed = 0;
+	while (start + completed < total && !kill) {
+		u32 generated;
+		{
+			MutexAutoLock lock(state.mutex);
+			update_chunks_done();
+			completed = state.completed;
+			generated = state.generated;
+		}
+
+		while (next < total && next - start - completed < max_in_flight) {
+			v3s16 p = state.getChunkPos(next++);
+			p.X = MYMAX(p.X, bpmin.X);
+			p.Y = MYMAX(p.Y, bpmin.Y);
+			p.Z = MYMAX(p.Z, bpmin.Z);
+			emerge->enqueueBlockEmergeEx(p, PEER_ID_INEXISTENT,
+				BLOCK_EMERGE_ALLOW_GEN | BLOCK_EMERGE_FORCE_QUEUE,
+				pregenerate_callback, &state);
+		}
+
+		sleep_ms(100);
+
+		const u64 now = porting::getTimeMs();
+		if (now - last_step_time < 1000)
+			continue;
+		const float dtime = (now - last_step_time) / 1000.0f;
+		last_step_time = now;
+
+		const bool save = (now - last_save_time) / 1000.0f >= save_interval;
+		{
+			MutexAutoLock envlock(server.m_env_mutex);
+
+			// Let the liquids queued by the mapgens settle, like the server would
+			std::map<v3s16, MapBlock *> modified_blocks;
+			map.transformLiquids(modified_blocks, server.m_env);
+
+			map.timerUpdate(dtime, unload_timeout, -1);
+
+			if (save)
+				map.save(MOD_STATE_WRITE_NEEDED);
+
+			// Nobody is connected and AsyncRunStep() doesn't run, so the
+			// map edit events of the mapgens would pile up forever
+			while (!server.m_unsent_map_edit_queue.empty()) {
+				delete server.m_unsent_map_edit_queue.front();
+				server.m_unsent_map_edit_queue.pop();
+			}
+		}
+		map.step();
+
+		// The progress may only be saved once the blocks are in the database
+		if (save) {
+			if (map.flushSaves())
+				save_progress(chunks_done);
+			last_save_time = now;
+		}
+
+		// Mapchunks that already existed are not counted, they cost nothing
+		const float elapsed = (now - start_time) / 1000.0f;
+		std::cerr << " Generated " << (start + completed) << " of " << total
+			<< " mapchunks, " << (100.0f * (start + completed) / total)
+			<< "% completed, " << (u32)(generated * blocks_per_chunk / elapsed)
+			<< " blocks/s\r" << std::flush;
+	}
+	std::cerr << std::endl;
+
+	// Emerges still in the queue get cancelled when the server shuts down,
+	// the progress only counts mapchunks that are done
+	{
+		MutexAutoLock envlock(server.m_env_mutex);
+		map.save(MOD_STATE_WRITE_NEEDED);
+	}
+	const bool saved = map.flushSaves();
+	{
+		MutexAutoLock lock(state.mutex);
+		update_chunks_done();
+	}
+
+	if (chunks_done < total) {
+		if (saved)
+			save_progress(chunks_done);
+		if (state.errors > 0) {
+			errorstream << state.errors << " mapchunks could not be generated"
+				<< std::endl;
+		}
+		actionstream << "Pregeneration stopped after " << chunks_done
+			<< " of " << total << " mapchunks, run again with the same area "
+			"to resume" << std::endl;
+		return false;
+	}
+	// Keep the last progress that is known to be saved for the next run
+	if (!saved)
+		return false;
+
+	if (fs::PathExists(progress_path))
+		fs::DeleteSingleFileOrEmptyDirectory(progress_path);
+	const float elapsed = (porting::getTimeMs() - start_time) / 1000.0f;
+	actionstream << "Pregeneration done: " << state.generated
+		<< " mapchunks generated, " << state.existing
+		<< " already existed, took " << elapsed << "s" << std::endl;
+	return true;
+}
@@ -72,6 +72,8 @@ struct Lighting;
 class ServerThread;
 class ServerModManager;
 class ServerInventoryManager;
+class SerializedBlockCache;
+class ThreadPool;
 struct PackedValue;
 struct ParticleParameters;
 struct ParticleSpawnerParameters;
@@ -383,6 +385,11 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	static bool migrateModStorageDatabase(const GameParams &game_params,
 			const Settings &cmd_args);
 
+	// Generates the area given by --pregenerate without starting the network
+	// or stepping the environment. Can be resumed after being interrupted.
+	static bool pregenerateMap(const GameParams &game_params,
+			const Settings &cmd_args, const Address &bind_addr);
+
 	// Lua files registered for init of async env, pair of modname + path
 	std::vector<std::pair<std::string, std::string>> m_async_init_files;
 
@@ -422,15 +429,6 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 		std::unordered_set<session_t> waiting_players;
 	};
 
-	// The standard library does not implement std::hash for pairs so we have this:
-	struct SBCHash {
-		size_t operator() (const std::pair<v3s16, u16> &p) const {
-			return std::hash<v3s16>()(p.first) ^ p.second;
-		}
-	};
-
-	typedef std::unordered_map<std::pair<v3s16, u16>, std::string, SBCHash> SerializedBlockCache;
-
 	void init();
 
 	void SendMovement(session_t peer_id);
@@ -490,11 +488,12 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			float far_d_nodes = 100);
 
 	// Environment and Connection must be locked when called
-	// `cache` may only be very short lived! (invalidation not handeled)
 	void SendBlockNoLock(session_t peer_id, MapBlock *block, u8 ver,
 		u16 net_proto_version, SerializedBlockCache *cache = nullptr);
+	void SendBlockData(session_t peer_id, v3s16 pos, const std::string &data);
 
 	// Sends blocks to clients (locks env and con on its own)
+	// The blocks are compressed in parallel after releasing the env lock
 	void SendBlocks(float dtime);
 
 	bool addMediaFile(const std::string &filename, const std::string &filepath,
@@ -554,6 +553,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	PlayerSAO *emergePlayer(const char *name, session_t peer_id, u16 proto_version);
 
 	void handlePeerChanges();
+	// Exports the Lua callback accounting of the scripting to the metrics
+	void updateCallbackMetrics();
 
 	/*
 		Variables
@@ -711,6 +712,11 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Inventory manager
 	std::unique_ptr<ServerInventoryManager> m_inventory_mgr;
 
+	// Network serializations of recently sent blocks, nullptr if disabled
+	std::unique_ptr<SerializedBlockCache> m_block_cache;
+	// Compresses blocks for SendBlocks()
+	std::unique_ptr<ThreadPool> m_block_send_pool;
+
 	// Global server metrics backend
 	std::unique_ptr<MetricsBackend> m_metrics_backend;
 
@@ -723,6 +729,16 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	MetricCounterPtr m_packet_recv_counter;
 	MetricCounterPtr m_packet_recv_processed_counter;
 	MetricCounterPtr m_map_edit_event_counter;
+
+	// Lua callback time by mod and callback type, see updateCallbackMetrics()
+	struct CallbackMetrics {
+		MetricCounterPtr calls;
+		MetricCounterPtr time;
+		u64 last_calls = 0;
+		u64 last_time_us = 0;
+	};
+	std::map<std::pair<std::string, std::string>, CallbackMetrics> m_callback_metrics;
+	IntervalLimiter m_callback_metrics_interval;
 };
 
 /*
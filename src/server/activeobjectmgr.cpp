@@ -17,7 +17,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <algorithm>
+#include <cmath>
 #include <log.h>
+#include "constants.h"
 #include "mapblock.h"
 #include "profiler.h"
 #include "activeobjectmgr.h"
@@ -29,12 +32,18 @@ void ActiveObjectMgr::clear(const std::function<bool(ServerActiveObject *, u16)>
 {
 	// make a defensive copy in case the
 	// passed callback changes the set of active objects
-	auto cloned_map(m_active_objects);
+	std::vector<u16> ids;
+	ids.reserve(m_active_objects.size());
+	m_active_objects.forEach([&] (ServerActiveObject *obj) {
+		ids.push_back(obj->getId());
+	});
 
-	for (auto &it : cloned_map) {
-		if (cb(it.second, it.first)) {
+	for (u16 id : ids) {
+		ServerActiveObject *obj = m_active_objects.get(id);
+		if (obj && cb(obj, id)) {
 			// Remove reference from m_active_objects
-			m_active_objects.erase(it.first);
+			m_active_objects.remove(id);
+			removeFromSpatialIndex(id);
 		}
 	}
 }
@@ -43,9 +52,7 @@ void ActiveObjectMgr::step(
 		float dtime, const std::function<void(ServerActiveObject *)> &f)
 {
 	g_profiler->avg("ActiveObjectMgr: SAO count [#]", m_active_objects.size());
-	for (auto &ao_it : m_active_objects) {
-		f(ao_it.second);
-	}
+	m_active_objects.forEach(f);
 }
 
 // clang-format off
@@ -85,7 +92,8 @@ bool ActiveObjectMgr::registerObject(ServerActiveObject *obj)
 		return false;
 	}
 
-	m_active_objects[obj->getId()] = obj;
+	m_active_objects.add(obj);
+	addToSpatialIndex(obj);
 
 	verbosestream << "Server::ActiveObjectMgr::addActiveObjectRaw(): "
 			<< "Added id=" << obj->getId() << "; there are now "
@@ -104,18 +112,116 @@ void ActiveObjectMgr::removeObject(u16 id)
 		return;
 	}
 
-	m_active_objects.erase(id);
+	m_active_objects.remove(id);
+	removeFromSpatialIndex(id);
 	delete obj;
 }
 
+void ActiveObjectMgr::updateObjectPosition(ServerActiveObject *obj)
+{
+	u16 id = obj->getId();
+	auto it = m_object_cells.find(id);
+	// Objects that are not (yet) registered are not indexed
+	if (it == m_object_cells.end() || getActiveObject(id) != obj)
+		return;
+
+	v3s16 cell = getCellPos(obj->getBasePosition());
+	if (cell == it->second)
+		return;
+
+	auto &old_ids = m_spatial_index[it->second];
+	old_ids.erase(std::find(old_ids.begin(), old_ids.end(), id));
+	if (old_ids.empty())
+		m_spatial_index.erase(it->second);
+
+	m_spatial_index[cell].push_back(id);
+	it->second = cell;
+}
+
+static inline s16 getCellCoord(f32 v)
+{
+	v = std::floor(v / (MAP_BLOCKSIZE * BS));
+	// Written this way to also catch NaN
+	if (!(v > S16_MIN))
+		return S16_MIN;
+	return v < S16_MAX ? (s16)v : S16_MAX;
+}
+
+v3s16 ActiveObjectMgr::getCellPos(const v3f &pos)
+{
+	return v3s16(getCellCoord(pos.X), getCellCoord(pos.Y), getCellCoord(pos.Z));
+}
+
+void ActiveObjectMgr::addToSpatialIndex(ServerActiveObject *obj)
+{
+	v3s16 cell = getCellPos(obj->getBasePosition());
+	m_spatial_index[cell].push_back(obj->getId());
+	m_object_cells[obj->getId()] = cell;
+	if (obj->getType() == ACTIVEOBJECT_TYPE_PLAYER)
+		m_player_ids.insert(obj->getId());
+}
+
+void ActiveObjectMgr::removeFromSpatialIndex(u16 id)
+{
+	auto it = m_object_cells.find(id);
+	if (it == m_object_cells.end())
+		return;
+
+	auto cell_it = m_spatial_index.find(it->second);
+	if (cell_it != m_spatial_index.end()) {
+		auto &ids = cell_it->second;
+		ids.erase(std::find(ids.begin(), ids.end(), id));
+		if (ids.empty())
+			m_spatial_index.erase(cell_it);
+	}
+	m_object_cells.erase(it);
+	m_player_ids.erase(id);
+}
+
+void ActiveObjectMgr::collectCandidates(const aabb3f &box,
+		std::vector<ServerActiveObject *> &result)
+{
+	v3s16 cmin = getCellPos(box.MinEdge);
+	v3s16 cmax = getCellPos(box.MaxEdge);
+	u64 volume = (u64)(cmax.X - cmin.X + 1) * (cmax.Y - cmin.Y + 1) *
+			(cmax.Z - cmin.Z + 1);
+
+	if (volume > m_active_objects.size()) {
+		m_active_objects.forEach([&] (ServerActiveObject *obj) {
+			result.push_back(obj);
+		});
+		return;
+	}
+
+	size_t start = result.size();
+	for (s32 z = cmin.Z; z <= cmax.Z; z++)
+	for (s32 y = cmin.Y; y <= cmax.Y; y++)
+	for (s32 x = cmin.X; x <= cmax.X; x++) {
+		auto cell_it = m_spatial_index.find(v3s16(x, y, z));
+		if (cell_it == m_spatial_index.end())
+			continue;
+		for (u16 id : cell_it->second)
+			result.push_back(m_active_objects.get(id));
+	}
+
+	// Keep the same order as a full scan
+	std::sort(result.begin() + start, result.end(),
+		[this] (ServerActiveObject *a, ServerActiveObject *b) {
+			return m_active_objects.getOrder(a->getId()) <
+					m_active_objects.getOrder(b->getId());
+		});
+}
+
 // clang-format on
 void ActiveObjectMgr::getObjectsInsideRadius(const v3f &pos, float radius,
 		std::vector<ServerActiveObject *> &result,
 		std::function<bool(ServerActiveObject *obj)> include_obj_cb)
 {
+	std::vector<ServerActiveObject *> candidates;
+	collectCandidates(aabb3f(pos - radius, pos + radius), candidates);
+
 	float r2 = radius * radius;
-	for (auto &activeObject : m_active_objects) {
-		ServerActiveObject *obj = activeObject.second;
+	for (ServerActiveObject *obj : candidates) {
 		const v3f &objectpos = obj->getBasePosition();
 		if (objectpos.getDistanceFromSQ(pos) > r2)
 			continue;
@@ -129,8 +235,10 @@ void ActiveObjectMgr::getObjectsInArea(const aabb3f &box,
 		std::vector<ServerActiveObject *> &result,
 		std::function<bool(ServerActiveObject *obj)> include_obj_cb)
 {
-	for (auto &activeObject : m_active_objects) {
-		ServerActiveObject *obj = activeObject.second;
+	std::vector<ServerActiveObject *> candidates;
+	collectCandidates(box, candidates);
+
+	for (ServerActiveObject *obj : candidates) {
 		const v3f &objectpos = obj->getBasePosition();
 		if (!box.isPointInside(objectpos))
 			continue;
@@ -151,13 +259,25 @@ void ActiveObjectMgr::getAddedActiveObjectsAroundPos(const v3f &player_pos, f32
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for (auto &ao_it : m_active_objects) {
-		u16 id = ao_it.first;
+	std::vector<ServerActiveObject *> candidates;
+	f32 search_radius = player_radius != 0 ? std::max(radius, player_radius) : radius;
+	collectCandidates(aabb3f(player_pos - search_radius, player_pos + search_radius),
+			candidates);
+	if (player_radius == 0 && !m_player_ids.empty()) {
+		// Players are wanted at any distance
+		for (u16 id : m_player_ids)
+			candidates.push_back(m_active_objects.get(id));
+		std::sort(candidates.begin(), candidates.end(),
+			[this] (ServerActiveObject *a, ServerActiveObject *b) {
+				return m_active_objects.getOrder(a->getId()) <
+						m_active_objects.getOrder(b->getId());
+			});
+		candidates.erase(std::unique(candidates.begin(), candidates.end()),
+				candidates.end());
+	}
 
-		// Get object
-		ServerActiveObject *object = ao_it.second;
-		if (!object)
-			continue;
+	for (ServerActiveObject *object : candidates) {
+		u16 id = object->getId();
 
 		if (object->isGone())
 			continue;
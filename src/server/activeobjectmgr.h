@@ -20,6 +20,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include <functional>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include "../activeobjectmgr.h"
 #include "serveractiveobject.h"
@@ -45,5 +47,29 @@ class ActiveObjectMgr : public ::ActiveObjectMgr<ServerActiveObject>
 	void getAddedActiveObjectsAroundPos(const v3f &player_pos, f32 radius,
 			f32 player_radius, std::set<u16> &current_objects,
 			std::queue<u16> &added_objects);
+
+	// Must be called after the base position of a registered object changed
+	void updateObjectPosition(ServerActiveObject *obj);
+
+private:
+	static v3s16 getCellPos(const v3f &pos);
+
+	void addToSpatialIndex(ServerActiveObject *obj);
+	void removeFromSpatialIndex(u16 id);
+
+	// Appends the objects that may be inside of box to result, in iteration
+	// order. Falls back to all objects if that is cheaper than visiting cells.
+	void collectCandidates(const aabb3f &box,
+			std::vector<ServerActiveObject *> &result);
+
+	/*
+		Spatial index: objects are sorted into cells of one MapBlock size,
+		so that area queries do not have to look at every object.
+	*/
+	std::unordered_map<v3s16, std::vector<u16>> m_spatial_index;
+	// Cell that each object is currently listed in
+	std::unordered_map<u16, v3s16> m_object_cells;
+	// Player objects, which can be wanted at any distance
+	std::set<u16> m_player_ids;
 };
 } // namespace server
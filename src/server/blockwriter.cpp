@@ -0,0 +1,291 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "blockwriter.h"
+#include "database/database.h"
+#include "irrlicht_changes/printing.h"
+#include "log.h"
+#include "porting.h"
+#include "serialization.h"
+#include <sstream>
+#include <vector>
+
+// Maximum number of blocks written in one database transaction
+static const size_t MAX_BATCH_SIZE = 1024;
+
+BlockWriter::BlockWriter(MapDatabase *db, std::mutex &db_mutex,
+		int compression_level, size_t max_size, MetricsBackend *mb):
+	Thread("BlockWriter"),
+	m_db(db),
+	m_db_mutex(db_mutex),
+	m_compression_level(compression_level),
+	m_max_size(max_size)
+{
+	if (mb) {
+		m_queue_blocks_gauge = mb->addGauge(
+			"minetest_map_save_queue_blocks",
+			"Number of blocks waiting to be written to the map database");
+		m_queue_bytes_gauge = mb->addGauge(
+			"minetest_map_save_queue_bytes",
+			"Memory used by blocks waiting to be written (in bytes)");
+		m_write_time_counter = mb->addCounter(
+			"minetest_map_write_time",
+			"Time spent writing blocks to the map database (in microseconds)");
+		m_write_count_counter = mb->addCounter(
+			"minetest_map_written_blocks",
+			"Number of blocks written to the map database");
+	}
+
+	start();
+}
+
+BlockWriter::~BlockWriter()
+{
+	if (!flush()) {
+		errorstream << "BlockWriter: " << getQueuedCount()
+			<< " blocks could not be saved and are lost" << std::endl;
+	}
+
+	stop();
+	{
+		// Make sure the writer sees the stop request
+		std::lock_guard<std::mutex> lock(m_mutex);
+	}
+	m_queue_cv.notify_all();
+	wait();
+}
+
+void BlockWriter::push(v3s16 pos, std::string &&data)
+{
+	auto shared = std::make_shared<const std::string>(std::move(data));
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	// Let the writer catch up if it is too far behind. Failed blocks are
+	// not waited for, they might never get written.
+	m_done_cv.wait(lock, [this] {
+		return m_size < m_max_size || m_pending.size() == m_failed_count;
+	});
+
+	auto it = m_pending.find(pos);
+	if (it == m_pending.end()) {
+		m_pending.emplace(pos, Entry{shared, m_next_seq++, true});
+		m_order.push_back(pos);
+	} else {
+		// The older data does not need to be written anymore
+		Entry &entry = it->second;
+		m_size -= entry.data->size();
+		entry.data = shared;
+		entry.seq = m_next_seq++;
+		if (entry.failed) {
+			entry.failed = false;
+			m_failed_count--;
+		}
+		if (!entry.queued) {
+			entry.queued = true;
+			m_order.push_back(pos);
+		}
+	}
+	m_size += shared->size();
+	updateMetrics();
+
+	lock.unlock();
+	m_queue_cv.notify_one();
+}
+
+bool BlockWriter::get(v3s16 pos, std::string *data)
+{
+	std::shared_ptr<const std::string> raw;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_pending.find(pos);
+		if (it == m_pending.end())
+			return false;
+		raw = it->second.data;
+	}
+
+	encode(*raw, data);
+	return true;
+}
+
+bool BlockWriter::flush()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_failed_count > 0) {
+		requeueFailed();
+		m_queue_cv.notify_one();
+	}
+	// Everything left over has failed again
+	m_done_cv.wait(lock, [this] { return m_pending.size() == m_failed_count; });
+	return m_failed_count == 0;
+}
+
+void BlockWriter::discard(v3s16 pos)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	// A write in flight must not overwrite what the caller does next
+	m_done_cv.wait(lock, [&] {
+		auto it = m_pending.find(pos);
+		return it == m_pending.end() || !it->second.writing;
+	});
+
+	auto it = m_pending.find(pos);
+	if (it == m_pending.end())
+		return;
+	// A queued position stays in m_order, the writer skips it
+	Entry &entry = it->second;
+	if (entry.failed)
+		m_failed_count--;
+	m_size -= entry.data->size();
+	m_pending.erase(it);
+	updateMetrics();
+
+	lock.unlock();
+	m_done_cv.notify_all();
+}
+
+void BlockWriter::requeueFailed()
+{
+	for (auto &it : m_pending) {
+		Entry &entry = it.second;
+		if (!entry.failed)
+			continue;
+		entry.failed = false;
+		entry.queued = true;
+		m_order.push_back(it.first);
+	}
+	m_failed_count = 0;
+}
+
+size_t BlockWriter::getQueuedCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pending.size();
+}
+
+void BlockWriter::encode(const std::string &raw, std::string *data) const
+{
+	/*
+		[0] u8 serialization version
+		[1] data
+	*/
+	const u8 version = SER_FMT_VER_HIGHEST_WRITE;
+	std::ostringstream os(std::ios_base::binary);
+	os.write((const char *)&version, 1);
+	compress(raw, os, version, m_compression_level);
+	*data = os.str();
+}
+
+void BlockWriter::updateMetrics()
+{
+	if (m_queue_blocks_gauge)
+		m_queue_blocks_gauge->set(m_pending.size());
+	if (m_queue_bytes_gauge)
+		m_queue_bytes_gauge->set(m_size);
+}
+
+void *BlockWriter::run()
+{
+	std::vector<BatchItem> batch;
+	std::vector<std::string> encoded;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_queue_cv.wait(lock, [this] {
+				return !m_order.empty() || stopRequested();
+			});
+			// Everything is written once stop is requested and the queue is empty
+			if (m_order.empty())
+				break;
+
+			while (!m_order.empty() && batch.size() < MAX_BATCH_SIZE) {
+				v3s16 pos = m_order.front();
+				m_order.pop_front();
+				// Skip positions that were discarded or are already taken
+				auto it = m_pending.find(pos);
+				if (it == m_pending.end() || !it->second.queued)
+					continue;
+				Entry &entry = it->second;
+				entry.queued = false;
+				entry.writing = true;
+				batch.push_back({pos, entry.data, entry.seq});
+			}
+		}
+		if (batch.empty())
+			continue;
+
+		encoded.resize(batch.size());
+		for (size_t i = 0; i < batch.size(); i++)
+			encode(*batch[i].data, &encoded[i]);
+
+		// Whether each item of the batch was written
+		std::vector<bool> written(batch.size(), false);
+		const u64 start_time = porting::getTimeUs();
+		try {
+			std::lock_guard<std::mutex> lock(m_db_mutex);
+			m_db->beginSave();
+			for (size_t i = 0; i < batch.size(); i++) {
+				written[i] = m_db->saveBlock(batch[i].pos, encoded[i]);
+				if (!written[i]) {
+					errorstream << "BlockWriter: Failed to save block "
+						<< batch[i].pos << std::endl;
+				}
+			}
+			m_db->endSave();
+		} catch (std::exception &e) {
+			errorstream << "BlockWriter: Failed to write " << batch.size()
+				<< " blocks: " << e.what() << std::endl;
+			// The transaction did not go through
+			written.assign(batch.size(), false);
+		}
+		const u64 end_time = porting::getTimeUs();
+
+		if (m_write_time_counter)
+			m_write_time_counter->increment(end_time - start_time);
+		if (m_write_count_counter)
+			m_write_count_counter->increment(batch.size());
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (size_t i = 0; i < batch.size(); i++) {
+				auto it = m_pending.find(batch[i].pos);
+				if (it == m_pending.end())
+					continue;
+				it->second.writing = false;
+				// Keep the entry if newer data was pushed in the meantime
+				if (it->second.seq != batch[i].seq)
+					continue;
+				if (written[i]) {
+					m_size -= it->second.data->size();
+					m_pending.erase(it);
+				} else {
+					it->second.failed = true;
+					m_failed_count++;
+				}
+			}
+			updateMetrics();
+		}
+		m_done_cv.notify_all();
+
+		batch.clear();
+		encoded.clear();
+	}
+
+	return nullptr;
+}
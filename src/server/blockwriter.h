@@ -0,0 +1,125 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irr_v3d.h"
+#include "threading/thread.h"
+#include "util/metricsbackend.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class MapDatabase;
+
+/*
+	Writes MapBlocks to the map database on a thread of its own.
+
+	The server thread hands over the uncompressed serialization of modified
+	blocks, compression and the database writes (in batches, each wrapped in
+	beginSave()/endSave()) happen here.
+
+	Blocks that are queued but not written yet are returned by get(), so that
+	loading a block never sees an outdated copy from the database.
+	All other users of the database must hold the database mutex.
+
+	A block that fails to be written stays queued with its data and is tried
+	again on the next flush() or when it is pushed again, so a database error
+	does not lose it.
+*/
+class BlockWriter : public Thread
+{
+public:
+	// max_size: memory limit for queued data in bytes, push() waits when
+	//           it is exceeded
+	BlockWriter(MapDatabase *db, std::mutex &db_mutex, int compression_level,
+			size_t max_size, MetricsBackend *mb);
+	// Writes out everything that is still queued, including failed blocks
+	~BlockWriter();
+
+	// Queues data from MapBlock::serializeUncompressed() in the highest
+	// write version, replacing data queued earlier for the same block
+	void push(v3s16 pos, std::string &&data);
+
+	// If the block is queued, stores it in database format in `data`
+	bool get(v3s16 pos, std::string *data);
+
+	// Retries the blocks that failed before and waits until everything
+	// queued so far was written to the database.
+	// Returns false if some blocks could not be written; they are kept.
+	bool flush();
+
+	// Drops the queued data of a block. If the block is being written, waits
+	// for that write first, so that it cannot bring back a deleted block.
+	void discard(v3s16 pos);
+
+	size_t getQueuedCount();
+
+protected:
+	void *run() override;
+
+private:
+	struct Entry {
+		std::shared_ptr<const std::string> data;
+		u64 seq;
+		// Whether pos is in m_order (not yet taken by the writer)
+		bool queued;
+		// Whether writing the data failed (and it was not retried yet)
+		bool failed = false;
+		// Whether the writer is writing some data of the block right now
+		bool writing = false;
+	};
+
+	struct BatchItem {
+		v3s16 pos;
+		std::shared_ptr<const std::string> data;
+		u64 seq;
+	};
+
+	// Puts the failed blocks back into the queue
+	void requeueFailed();
+	// Compresses raw data to the format stored in the database
+	void encode(const std::string &raw, std::string *data) const;
+	void updateMetrics();
+
+	MapDatabase *m_db;
+	std::mutex &m_db_mutex;
+	const int m_compression_level;
+	const size_t m_max_size;
+
+	std::mutex m_mutex;
+	std::condition_variable m_queue_cv;
+	std::condition_variable m_done_cv;
+	// Queued and in-flight blocks
+	std::unordered_map<v3s16, Entry> m_pending;
+	// Blocks not yet taken by the writer, in push order.
+	// May contain positions that were discarded, they are skipped.
+	std::deque<v3s16> m_order;
+	size_t m_size = 0;
+	u64 m_next_seq = 0;
+	size_t m_failed_count = 0;
+
+	MetricGaugePtr m_queue_blocks_gauge;
+	MetricGaugePtr m_queue_bytes_gauge;
+	MetricCounterPtr m_write_time_counter;
+	MetricCounterPtr m_write_count_counter;
+};
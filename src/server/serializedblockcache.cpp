@@ -0,0 +1,121 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "serializedblockcache.h"
+#include "mapblock.h"
+#include "threading/mutex_auto_lock.h"
+
+SerializedBlockCache::SerializedBlockCache(size_t max_size, MetricsBackend *metrics):
+	m_max_size(max_size)
+{
+	if (!metrics)
+		return;
+
+	m_hit_counter = metrics->addCounter(
+			"minetest_core_block_cache_hits",
+			"Number of block sends served from the serialized block cache");
+	m_miss_counter = metrics->addCounter(
+			"minetest_core_block_cache_misses",
+			"Number of block sends that had to serialize the block");
+	m_size_gauge = metrics->addGauge(
+			"minetest_core_block_cache_bytes",
+			"Memory used by the serialized block cache (in bytes)");
+}
+
+bool SerializedBlockCache::get(MapBlock *block, u8 ver, std::string &data)
+{
+	MutexAutoLock lock(m_mutex);
+
+	auto it = m_index.find({block->getPos(), ver});
+	if (it == m_index.end()) {
+		if (m_miss_counter)
+			m_miss_counter->increment();
+		return false;
+	}
+
+	if (it->second->change_stamp != block->getChangeStamp()) {
+		// Block was modified or replaced since
+		erase(it->second);
+		if (m_miss_counter)
+			m_miss_counter->increment();
+		return false;
+	}
+
+	// Move to front
+	m_entries.splice(m_entries.begin(), m_entries, it->second);
+	if (m_hit_counter)
+		m_hit_counter->increment();
+	data = m_entries.front().data;
+	return true;
+}
+
+void SerializedBlockCache::insert(v3s16 pos, u8 ver, u64 change_stamp,
+		std::string &&data)
+{
+	MutexAutoLock lock(m_mutex);
+	Key key(pos, ver);
+
+	auto it = m_index.find(key);
+	if (it != m_index.end())
+		erase(it->second);
+
+	// Not worth evicting everything else for
+	if (data.size() > m_max_size / 2)
+		return;
+
+	m_size += data.size();
+	m_entries.push_front(Entry{key, change_stamp, std::move(data)});
+	m_index[key] = m_entries.begin();
+
+	while (m_size > m_max_size)
+		erase(std::prev(m_entries.end()));
+
+	if (m_size_gauge)
+		m_size_gauge->set(m_size);
+}
+
+void SerializedBlockCache::clear()
+{
+	MutexAutoLock lock(m_mutex);
+	m_entries.clear();
+	m_index.clear();
+	m_size = 0;
+
+	if (m_size_gauge)
+		m_size_gauge->set(0);
+}
+
+size_t SerializedBlockCache::getSize()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_size;
+}
+
+size_t SerializedBlockCache::getEntryCount()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_index.size();
+}
+
+void SerializedBlockCache::erase(std::list<Entry>::iterator it)
+{
+	m_size -= it->data.size();
+	m_index.erase(it->key);
+	m_entries.erase(it);
+}
@@ -0,0 +1,95 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irr_v3d.h"
+#include "util/basic_macros.h"
+#include "util/metricsbackend.h"
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class MapBlock;
+
+/*
+	Caches the network serialization (serialized + compressed) of MapBlocks,
+	so that blocks requested by many clients or repeatedly over time do not
+	have to be compressed again.
+
+	Entries are tagged with MapBlock::getChangeStamp() and become invalid as
+	soon as the block is modified. Memory usage is bounded, the least recently
+	used entries are evicted first.
+
+	get() must be called with the env lock held (it looks at the block),
+	insert() can be called from anywhere.
+*/
+class SerializedBlockCache
+{
+public:
+	// max_size: memory limit in bytes
+	// metrics: optional backend to export hit/miss/size counters to
+	SerializedBlockCache(size_t max_size, MetricsBackend *metrics = nullptr);
+
+	DISABLE_CLASS_COPY(SerializedBlockCache)
+
+	// Copies the cached data to `data` if there is an up-to-date entry.
+	bool get(MapBlock *block, u8 ver, std::string &data);
+
+	// Stores `data` as serialization of the block at `pos` in version `ver`.
+	// change_stamp: value of MapBlock::getChangeStamp() the data was made from
+	void insert(v3s16 pos, u8 ver, u64 change_stamp, std::string &&data);
+
+	void clear();
+
+	size_t getSize();
+	size_t getEntryCount();
+
+private:
+	typedef std::pair<v3s16, u8> Key;
+
+	struct KeyHash {
+		size_t operator()(const Key &k) const
+		{
+			return std::hash<v3s16>()(k.first) ^ k.second;
+		}
+	};
+
+	struct Entry {
+		Key key;
+		u64 change_stamp;
+		std::string data;
+	};
+
+	void erase(std::list<Entry>::iterator it);
+
+	std::mutex m_mutex;
+
+	// Front = most recently used
+	std::list<Entry> m_entries;
+	std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> m_index;
+
+	size_t m_size = 0;
+	const size_t m_max_size;
+
+	MetricCounterPtr m_hit_counter;
+	MetricCounterPtr m_miss_counter;
+	MetricGaugePtr m_size_gauge;
+};
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 #include "nodedef.h"
 #include "nodemetadata.h"
+#include "noise.h"
 #include "gamedef.h"
 #include "map.h"
 #include "porting.h"
@@ -37,6 +38,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/basic_macros.h"
 #include "util/pointedthing.h"
 #include "threading/mutex_auto_lock.h"
+#include "threading/thread_pool.h"
 #include "filesys.h"
 #include "gameparams.h"
 #include "database/database-dummy.h"
@@ -298,27 +300,32 @@ void LBMManager::applyLBMs(ServerEnvironment *env, MapBlock *block,
 	ActiveBlockList
 */
 
-void fillRadiusBlock(v3s16 p0, s16 r, std::set<v3s16> &list)
+static inline bool isInRadius(v3s16 p, v3s16 p0, s16 r)
+{
+	// limit to a sphere
+	return p.getDistanceFrom(p0) <= r;
+}
+
+template <typename F>
+static void forEachInRadius(v3s16 p0, s16 r, F &&f)
 {
 	v3s16 p;
 	for(p.X=p0.X-r; p.X<=p0.X+r; p.X++)
 		for(p.Y=p0.Y-r; p.Y<=p0.Y+r; p.Y++)
 			for(p.Z=p0.Z-r; p.Z<=p0.Z+r; p.Z++)
 			{
-				// limit to a sphere
-				if (p.getDistanceFrom(p0) <= r) {
-					// Set in list
-					list.insert(p);
-				}
+				if (isInRadius(p, p0, r))
+					f(p);
 			}
 }
 
-void fillViewConeBlock(v3s16 p0,
+// Appends the blocks in sight to list, sorted
+static void fillViewConeBlock(v3s16 p0,
 	const s16 r,
 	const v3f camera_pos,
 	const v3f camera_dir,
 	const float camera_fov,
-	std::set<v3s16> &list)
+	std::vector<v3s16> &list)
 {
 	v3s16 p;
 	const s16 r_nodes = r * BS * MAP_BLOCKSIZE;
@@ -326,7 +333,7 @@ void fillViewConeBlock(v3s16 p0,
 	for (p.Y = p0.Y - r; p.Y <= p0.Y+r; p.Y++)
 	for (p.Z = p0.Z - r; p.Z <= p0.Z+r; p.Z++) {
 		if (isBlockInSight(p, camera_pos, camera_dir, camera_fov, r_nodes)) {
-			list.insert(p);
+			list.push_back(p);
 		}
 	}
 }
@@ -334,19 +341,48 @@ void fillViewConeBlock(v3s16 p0,
 void ActiveBlockList::update(std::vector<PlayerSAO*> &active_players,
 	s16 active_block_range,
 	s16 active_object_range,
-	std::set<v3s16> &blocks_removed,
-	std::set<v3s16> &blocks_added)
+	std::vector<v3s16> &blocks_removed,
+	std::vector<v3s16> &blocks_added)
 {
+	m_changed.clear();
+
+	// Try blocks that could not be activated last time again
+	for (v3s16 p : m_removed)
+		m_changed.push_back(p);
+	m_removed.clear();
+
+	/*
+		Collect changes of forceloaded blocks
+	*/
+	if (m_forceloaded_refs != m_forceloaded_list) {
+		for (v3s16 p : m_forceloaded_refs) {
+			if (m_forceloaded_list.find(p) == m_forceloaded_list.end())
+				releaseRef(p, true);
+		}
+		for (v3s16 p : m_forceloaded_list) {
+			if (m_forceloaded_refs.find(p) == m_forceloaded_refs.end())
+				addRef(p, true);
+		}
+		m_forceloaded_refs = m_forceloaded_list;
+	}
+
 	/*
-		Create the new list
+		Collect changes of the areas around players
 	*/
-	std::set<v3s16> newlist = m_forceloaded_list;
-	m_abm_list = m_forceloaded_list;
-	for (const PlayerSAO *playersao : active_players) {
+	std::unordered_set<u16> seen_players;
+	std::vector<v3s16> new_cone;
+	for (PlayerSAO *playersao : active_players) {
+		seen_players.insert(playersao->getId());
+		PlayerArea &area = m_player_areas[playersao->getId()];
+
 		v3s16 pos = getNodeBlockPos(floatToInt(playersao->getBasePosition(), BS));
-		fillRadiusBlock(pos, active_block_range, m_abm_list);
-		fillRadiusBlock(pos, active_block_range, newlist);
+		if (pos != area.center || active_block_range != area.radius) {
+			moveSphere(area.center, area.radius, pos, active_block_range);
+			area.center = pos;
+			area.radius = active_block_range;
+		}
 
+		new_cone.clear();
 		s16 player_ao_range = std::min(active_object_range, playersao->getWantedRange());
 		// only do this if this would add blocks
 		if (player_ao_range > active_block_range) {
@@ -360,34 +396,122 @@ void ActiveBlockList::update(std::vector<PlayerSAO*> &active_players,
 				playersao->getEyePosition(),
 				camera_dir,
 				playersao->getFov(),
-				newlist);
+				new_cone);
+		}
+		if (new_cone != area.cone) {
+			changeCone(area.cone, new_cone);
+			area.cone.swap(new_cone);
 		}
 	}
 
-	/*
-		Find out which blocks on the old list are not on the new list
-	*/
-	// Go through old list
-	for (v3s16 p : m_list) {
-		// If not on new list, it's been removed
-		if (newlist.find(p) == newlist.end())
-			blocks_removed.insert(p);
+	// Players that are gone
+	for (auto it = m_player_areas.begin(); it != m_player_areas.end();) {
+		if (seen_players.find(it->first) != seen_players.end()) {
+			++it;
+			continue;
+		}
+		moveSphere(it->second.center, it->second.radius, v3s16(), -1);
+		changeCone(it->second.cone, {});
+		it = m_player_areas.erase(it);
 	}
 
 	/*
-		Find out which blocks on the new list are not on the old list
+		Update the lists for the blocks that changed
 	*/
-	// Go through new list
-	for (v3s16 p : newlist) {
-		// If not on old list, it's been added
-		if (m_list.find(p) == m_list.end())
-			blocks_added.insert(p);
+	for (v3s16 p : m_changed) {
+		auto it = m_refs.find(p);
+		if (it == m_refs.end()) {
+			if (m_list.erase(p))
+				blocks_removed.push_back(p);
+			m_abm_list.erase(p);
+			continue;
+		}
+
+		if (m_list.insert(p).second)
+			blocks_added.push_back(p);
+		if (it->second.abm > 0)
+			m_abm_list.insert(p);
+		else
+			m_abm_list.erase(p);
 	}
+	m_changed.clear();
+}
 
-	/*
-		Update m_list
-	*/
-	m_list = std::move(newlist);
+void ActiveBlockList::clear()
+{
+	m_list.clear();
+	m_abm_list.clear();
+	m_refs.clear();
+	m_player_areas.clear();
+	m_forceloaded_refs.clear();
+	m_removed.clear();
+}
+
+void ActiveBlockList::remove(v3s16 p)
+{
+	m_list.erase(p);
+	m_abm_list.erase(p);
+	if (m_refs.find(p) != m_refs.end())
+		m_removed.insert(p);
+}
+
+void ActiveBlockList::addRef(v3s16 p, bool abm)
+{
+	BlockRefs &refs = m_refs[p];
+	refs.all++;
+	if (abm)
+		refs.abm++;
+	m_changed.push_back(p);
+}
+
+void ActiveBlockList::releaseRef(v3s16 p, bool abm)
+{
+	auto it = m_refs.find(p);
+	assert(it != m_refs.end());
+	BlockRefs &refs = it->second;
+	refs.all--;
+	if (abm)
+		refs.abm--;
+	if (refs.all == 0)
+		m_refs.erase(it);
+	m_changed.push_back(p);
+}
+
+void ActiveBlockList::moveSphere(v3s16 old_center, s16 old_radius,
+	v3s16 new_center, s16 new_radius)
+{
+	// Only the blocks that are in one of the spheres but not in the other
+	if (old_radius >= 0) {
+		forEachInRadius(old_center, old_radius, [&] (v3s16 p) {
+			if (new_radius < 0 || !isInRadius(p, new_center, new_radius))
+				releaseRef(p, true);
+		});
+	}
+	if (new_radius >= 0) {
+		forEachInRadius(new_center, new_radius, [&] (v3s16 p) {
+			if (old_radius < 0 || !isInRadius(p, old_center, old_radius))
+				addRef(p, true);
+		});
+	}
+}
+
+void ActiveBlockList::changeCone(const std::vector<v3s16> &old_cone,
+	const std::vector<v3s16> &new_cone)
+{
+	// Both are sorted, walk them side by side
+	auto old_it = old_cone.begin();
+	auto new_it = new_cone.begin();
+	while (old_it != old_cone.end() || new_it != new_cone.end()) {
+		if (new_it == new_cone.end() ||
+				(old_it != old_cone.end() && *old_it < *new_it)) {
+			releaseRef(*old_it++, false);
+		} else if (old_it == old_cone.end() || *new_it < *old_it) {
+			addRef(*new_it++, false);
+		} else {
+			++old_it;
+			++new_it;
+		}
+	}
 }
 
 /*
@@ -427,6 +551,9 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 
 	m_active_object_gauge = mb->addGauge(
 		"minetest_env_active_objects", "Number of active objects");
+
+	m_abm_pool = std::make_unique<ThreadPool>("ABM",
+			ThreadPool::defaultThreadCount("abm_threads"));
 }
 
 void ServerEnvironment::init()
@@ -781,6 +908,55 @@ struct ActiveABM
 	s16 max_y;
 };
 
+// An ABM action to be called, found by ABMHandler::collectTriggers()
+struct ABMTrigger
+{
+	const ActiveABM *aabm;
+	v3s16 p0; // relative to the block
+	content_t content;
+};
+
+// State of one block while ABMHandler processes it
+struct ABMBlockTask
+{
+	MapBlock *block;
+	// The block and its neighbors, nullptr if not loaded
+	MapBlock *neighbors[27];
+	// Seed for the trigger chance rolls
+	u32 seed;
+	// Whether the node data had to be looked at
+	bool scanned;
+	// Whether the content index of the block was used
+	bool cached;
+	std::vector<ABMTrigger> triggers;
+
+	static inline int neighborIndex(v3s16 d)
+	{
+		return (d.X + 1) + (d.Y + 1) * 3 + (d.Z + 1) * 9;
+	}
+
+	// p: relative to the block, at most one node outside of it
+	content_t getNeighborContent(v3s16 p) const
+	{
+		v3s16 d(
+			p.X < 0 ? -1 : (p.X >= MAP_BLOCKSIZE ? 1 : 0),
+			p.Y < 0 ? -1 : (p.Y >= MAP_BLOCKSIZE ? 1 : 0),
+			p.Z < 0 ? -1 : (p.Z >= MAP_BLOCKSIZE ? 1 : 0));
+		MapBlock *nb = neighbors[neighborIndex(d)];
+		if (!nb)
+			return CONTENT_IGNORE;
+		return nb->getNodeNoCheck(p - d * MAP_BLOCKSIZE).getContent();
+	}
+};
+
+/*
+	Runs the ABMs on active blocks. Finding out which ABMs to trigger where
+	(content, y limits, chance and neighbor checks) only reads the map and is
+	done for a batch of blocks in parallel by collectTriggers(). The actions
+	themselves are then called on the main thread by runTriggers(), which
+	checks the trigger node and its required neighbors again, as earlier
+	actions may have changed them since.
+*/
 class ABMHandler
 {
 private:
@@ -883,36 +1059,50 @@ class ABMHandler
 		wider += wider_unknown_count * wider / wider_known_count;
 		return active_object_count;
 	}
-	void apply(MapBlock *block, int &blocks_scanned, int &abms_run, int &blocks_cached)
+	bool empty() const
 	{
+		return m_aabms.empty();
+	}
+
+	// Main thread: looks up the neighbors of the block, so that
+	// collectTriggers() does not need to access the map
+	void prepare(ABMBlockTask &task, MapBlock *block, u32 seed)
+	{
+		task.block = block;
+		task.seed = seed;
+		task.scanned = false;
+		task.cached = false;
+		task.triggers.clear();
 		if (m_aabms.empty())
 			return;
 
-		// Check the content type cache first
-		// to see whether there are any ABMs
-		// to be run at all for this block.
-		if (block->contents_cached) {
-			blocks_cached++;
-			bool run_abms = false;
-			for (content_t c : block->contents) {
-				if (c < m_aabms.size() && m_aabms[c]) {
-					run_abms = true;
-					break;
-				}
-			}
-			if (!run_abms)
-				return;
-		} else {
-			// Clear any caching
-			block->contents.clear();
+		ServerMap *map = &m_env->getServerMap();
+		v3s16 bp = block->getPos();
+		v3s16 d;
+		for (d.Z = -1; d.Z <= 1; d.Z++)
+		for (d.Y = -1; d.Y <= 1; d.Y++)
+		for (d.X = -1; d.X <= 1; d.X++) {
+			task.neighbors[ABMBlockTask::neighborIndex(d)] = d == v3s16(0, 0, 0) ?
+					block : map->getBlockNoCreateNoEx(bp + d);
 		}
-		blocks_scanned++;
+	}
 
-		ServerMap *map = &m_env->getServerMap();
+	// Worker threads: finds out which ABMs are to be triggered where.
+	// Only reads the block and its neighbors.
+	void collectTriggers(ABMBlockTask &task)
+	{
+		if (m_aabms.empty())
+			return;
 
-		u32 active_object_count_wider;
-		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
-		m_env->m_added_objects = 0;
+		// Check the content index first to see whether
+		// there are any ABMs to be run at all for this block.
+		MapBlock *block = task.block;
+		if (!hasTriggerContent(block, task.cached))
+			return;
+		task.scanned = true;
+
+		PcgRandom rng(task.seed);
+		const v3s16 pos_relative = block->getPosRelative();
 
 		v3s16 p0;
 		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
@@ -921,25 +1111,16 @@ class ABMHandler
 		{
 			MapNode n = block->getNodeNoCheck(p0);
 			content_t c = n.getContent();
-			// Cache content types as we go
-			if (!block->contents_cached && !block->do_not_cache_contents) {
-				block->contents.insert(c);
-				if (block->contents.size() > 64) {
-					// Too many different nodes... don't try to cache
-					block->do_not_cache_contents = true;
-					block->contents.clear();
-				}
-			}
 
 			if (c >= m_aabms.size() || !m_aabms[c])
 				continue;
 
-			v3s16 p = p0 + block->getPosRelative();
-			for (ActiveABM &aabm : *m_aabms[c]) {
+			v3s16 p = p0 + pos_relative;
+			for (const ActiveABM &aabm : *m_aabms[c]) {
 				if ((p.Y < aabm.min_y) || (p.Y > aabm.max_y))
 					continue;
 
-				if (myrand() % aabm.chance != 0)
+				if (rng.next() % aabm.chance != 0)
 					continue;
 
 				// Check neighbors
@@ -951,17 +1132,7 @@ class ABMHandler
 					{
 						if(p1 == p0)
 							continue;
-						content_t c;
-						if (block->isValidPosition(p1)) {
-							// if the neighbor is found on the same map block
-							// get it straight from there
-							const MapNode &n = block->getNodeNoCheck(p1);
-							c = n.getContent();
-						} else {
-							// otherwise consult the map
-							MapNode n = map->getNode(p1 + block->getPosRelative());
-							c = n.getContent();
-						}
+						content_t c = task.getNeighborContent(p1);
 						if (CONTAINS(aabm.required_neighbors, c))
 							goto neighbor_found;
 					}
@@ -970,28 +1141,104 @@ class ABMHandler
 				}
 				neighbor_found:
 
-				abms_run++;
-				// Call all the trigger variations
-				aabm.abm->trigger(m_env, p, n);
-				aabm.abm->trigger(m_env, p, n,
-					active_object_count, active_object_count_wider);
+				task.triggers.push_back({&aabm, p0, c});
+			}
+		}
+	}
+
+	// Main thread: calls the ABM actions collected for the block
+	void runTriggers(ABMBlockTask &task, int &abms_run)
+	{
+		if (task.triggers.empty())
+			return;
 
-				if (block->isOrphan())
-					return;
+		MapBlock *block = task.block;
+		ServerMap *map = &m_env->getServerMap();
 
-				// Count surrounding objects again if the abms added any
-				if(m_env->m_added_objects > 0) {
-					active_object_count = countObjects(block, map, active_object_count_wider);
-					m_env->m_added_objects = 0;
-				}
+		u32 active_object_count_wider;
+		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
+		m_env->m_added_objects = 0;
 
-				// Update and check node after possible modification
-				n = block->getNodeNoCheck(p0);
-				if (n.getContent() != c)
-					break;
+		for (const ABMTrigger &trigger : task.triggers) {
+			// Skip if an earlier action changed the node or removed the
+			// required neighbors, the triggers were collected before any
+			// action of the batch ran
+			MapNode n = block->getNodeNoCheck(trigger.p0);
+			if (n.getContent() != trigger.content)
+				continue;
+			if (trigger.aabm->check_required_neighbors &&
+					!hasRequiredNeighbor(*trigger.aabm, block, trigger.p0))
+				continue;
+
+			v3s16 p = trigger.p0 + block->getPosRelative();
+			ActiveBlockModifier *abm = trigger.aabm->abm;
+
+			abms_run++;
+			// Call all the trigger variations
+			abm->trigger(m_env, p, n);
+			abm->trigger(m_env, p, n,
+				active_object_count, active_object_count_wider);
+
+			if (block->isOrphan())
+				return;
+
+			// Count surrounding objects again if the abms added any
+			if(m_env->m_added_objects > 0) {
+				active_object_count = countObjects(block, map, active_object_count_wider);
+				m_env->m_added_objects = 0;
+			}
+		}
+	}
+
+private:
+	// Main thread: whether a node next to p0 in the block is one of the
+	// required neighbors of the ABM, with the map as it is now
+	bool hasRequiredNeighbor(const ActiveABM &aabm, MapBlock *block, v3s16 p0)
+	{
+		ServerMap *map = &m_env->getServerMap();
+		v3s16 p1;
+		for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
+		for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
+		for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
+		{
+			if(p1 == p0)
+				continue;
+			content_t c;
+			if (block->isValidPosition(p1)) {
+				// if the neighbor is found on the same map block
+				// get it straight from there
+				c = block->getNodeNoCheck(p1).getContent();
+			} else {
+				// otherwise consult the map
+				c = map->getNode(p1 + block->getPosRelative()).getContent();
+			}
+			if (CONTAINS(aabm.required_neighbors, c))
+				return true;
+		}
+		return false;
+	}
+
+	// Whether any ABM is triggered by content in the block, according to
+	// its content index. Also true if the block has no content index.
+	bool hasTriggerContent(MapBlock *block, bool &cached)
+	{
+		const MapBlock::ContentCounts *counts = block->getContentCounts();
+		if (!counts)
+			return true;
+		cached = true;
+
+		s16 min_y = block->getPosRelative().Y;
+		s16 max_y = min_y + MAP_BLOCKSIZE - 1;
+		for (const auto &it : *counts) {
+			content_t c = it.first;
+			if (c >= m_aabms.size() || !m_aabms[c])
+				continue;
+			for (const ActiveABM &aabm : *m_aabms[c]) {
+				if (aabm.max_y >= min_y && aabm.min_y <= max_y)
+					return true;
 			}
 		}
-		block->contents_cached = !block->do_not_cache_contents;
+		return false;
 	}
 };
 
@@ -1398,8 +1645,8 @@ void ServerEnvironment::step(float dtime)
 				g_settings->getS16("active_object_send_range_blocks");
 		static thread_local const s16 active_block_range =
 				g_settings->getS16("active_block_range");
-		std::set<v3s16> blocks_removed;
-		std::set<v3s16> blocks_added;
+		std::vector<v3s16> blocks_removed;
+		std::vector<v3s16> blocks_added;
 		m_active_blocks.update(players, active_block_range, active_object_range,
 			blocks_removed, blocks_added);
 
@@ -1499,31 +1746,62 @@ void ServerEnvironment::step(float dtime)
 		int i = 0;
 		// determine the time budget for ABMs
 		u32 max_time_ms = m_cache_abm_interval * 1000 * m_cache_abm_time_budget;
-		for (const v3s16 &p : output) {
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if (!block)
-				continue;
-
-			i++;
+		bool over_budget = false;
+		// Blocks are processed in batches so that the time budget is still
+		// checked often enough
+		const size_t batch_size = 16 * (m_abm_pool->getThreadCount() + 1);
+		std::vector<ABMBlockTask> tasks;
+		for (size_t start = 0; start < output.size() && !over_budget;
+				start += batch_size) {
+			tasks.clear();
+			size_t end = std::min(start + batch_size, output.size());
+			for (size_t j = start; j < end; j++) {
+				MapBlock *block = m_map->getBlockNoCreateNoEx(output[j]);
+				if (!block)
+					continue;
 
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
+				// Set current time as timestamp
+				block->setTimestampNoChangedFlag(m_game_time);
 
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block, blocks_scanned, abms_run, blocks_cached);
+				tasks.emplace_back();
+				abmhandler.prepare(tasks.back(), block, myrand());
+			}
 
-			u32 time_ms = timer.getTimerTime();
+			{
+				ScopeProfiler sp2(g_profiler, "SEnv: ABM collect triggers", SPT_AVG);
+				m_abm_pool->run(tasks.size(), [&] (size_t j) {
+					abmhandler.collectTriggers(tasks[j]);
+				});
+			}
 
-			if (time_ms > max_time_ms) {
-				warningstream << "active block modifiers took "
-					  << time_ms << "ms (processed " << i << " of "
-					  << output.size() << " active blocks)" << std::endl;
-				break;
+			/* Handle ActiveBlockModifiers */
+			for (ABMBlockTask &task : tasks) {
+				i++;
+				blocks_scanned += task.scanned;
+				blocks_cached += task.cached;
+
+				// Earlier actions may have removed the block
+				if (m_map->getBlockNoCreateNoEx(task.block->getPos()) == task.block)
+					abmhandler.runTriggers(task, abms_run);
+
+				u32 time_ms = timer.getTimerTime();
+
+				if (time_ms > max_time_ms) {
+					warningstream << "active block modifiers took "
+						  << time_ms << "ms (processed " << i << " of "
+						  << output.size() << " active blocks)" << std::endl;
+					over_budget = true;
+					break;
+				}
 			}
 		}
 		g_profiler->avg("ServerEnv: active blocks", m_active_blocks.m_abm_list.size());
 		g_profiler->avg("ServerEnv: active blocks cached", blocks_cached);
 		g_profiler->avg("ServerEnv: active blocks scanned for ABMs", blocks_scanned);
+		if (i > 0) {
+			g_profiler->avg("ServerEnv: active blocks skipped for ABMs [%]",
+					100.0f * (i - blocks_scanned) / i);
+		}
 		g_profiler->avg("ServerEnv: ABMs run", abms_run);
 
 		timer.stop(true);
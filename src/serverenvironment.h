@@ -28,6 +28,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/metricsbackend.h"
 #include <set>
 #include <random>
+#include <unordered_map>
+#include <unordered_set>
 
 class IGameDef;
 struct GameParams;
@@ -41,6 +43,7 @@ struct StaticObject;
 class ServerActiveObject;
 class Server;
 class ServerScripting;
+class ThreadPool;
 enum AccessDeniedCode : u8;
 typedef u16 session_t;
 
@@ -164,11 +167,17 @@ class LBMManager
 class ActiveBlockList
 {
 public:
+	/*
+		Brings the lists up to date with the current player positions and
+		forceloaded blocks. Only the blocks covered by the areas that changed
+		since the last call are looked at, so the cost depends on how much
+		the players moved and not on the number of active blocks.
+	*/
 	void update(std::vector<PlayerSAO*> &active_players,
 		s16 active_block_range,
 		s16 active_object_range,
-		std::set<v3s16> &blocks_removed,
-		std::set<v3s16> &blocks_added);
+		std::vector<v3s16> &blocks_removed,
+		std::vector<v3s16> &blocks_added);
 
 	bool contains(v3s16 p) const {
 		return (m_list.find(p) != m_list.end());
@@ -178,19 +187,50 @@ class ActiveBlockList
 		return m_list.size();
 	}
 
-	void clear() {
-		m_list.clear();
-	}
+	void clear();
 
-	void remove(v3s16 p) {
-		m_list.erase(p);
-		m_abm_list.erase(p);
-	}
+	// Removes a block that could not be activated. It is added
+	// again by the next update() if it is still in range.
+	void remove(v3s16 p);
 
-	std::set<v3s16> m_list;
-	std::set<v3s16> m_abm_list;
+	std::unordered_set<v3s16> m_list;
+	std::unordered_set<v3s16> m_abm_list;
 	// list of blocks that are always active, not modified by this class
 	std::set<v3s16> m_forceloaded_list;
+
+private:
+	// Blocks kept active by a player
+	struct PlayerArea {
+		v3s16 center;
+		// Radius of the sphere of blocks in m_abm_list, -1 if none
+		s16 radius = -1;
+		// Blocks in the view cone (sorted)
+		std::vector<v3s16> cone;
+	};
+
+	// Number of areas (of players, forceloading) a block is in
+	struct BlockRefs {
+		u32 all = 0;
+		// Areas that also put the block into m_abm_list
+		u32 abm = 0;
+	};
+
+	void addRef(v3s16 p, bool abm);
+	void releaseRef(v3s16 p, bool abm);
+	void moveSphere(v3s16 old_center, s16 old_radius,
+		v3s16 new_center, s16 new_radius);
+	void changeCone(const std::vector<v3s16> &old_cone,
+		const std::vector<v3s16> &new_cone);
+
+	std::unordered_map<v3s16, BlockRefs> m_refs;
+	// Indexed by the active object id of the player
+	std::unordered_map<u16, PlayerArea> m_player_areas;
+	// m_forceloaded_list as of the last update
+	std::set<v3s16> m_forceloaded_refs;
+	// Blocks that were removed with remove()
+	std::unordered_set<v3s16> m_removed;
+	// Blocks whose references have changed
+	std::vector<v3s16> m_changed;
 };
 
 /*
@@ -269,6 +309,12 @@ class ServerEnvironment final : public Environment
 		return m_ao_manager.getActiveObject(id);
 	}
 
+	// Called by ServerActiveObject::setBasePosition()
+	void updateActiveObjectPosition(ServerActiveObject *obj)
+	{
+		m_ao_manager.updateObjectPosition(obj);
+	}
+
 	/*
 		Add an active object to the environment.
 		Environment handles deletion of object.
@@ -492,6 +538,8 @@ class ServerEnvironment final : public Environment
 	u32 m_last_clear_objects_time = 0;
 	// Active block modifiers
 	std::vector<ABMWithState> m_abms;
+	// Threads that find out which ABMs to run
+	std::unique_ptr<ThreadPool> m_abm_pool;
 	LBMManager m_lbm_mgr;
 	// An interval for generally sending object positions and stuff
 	float m_recommended_send_interval = 0.1f;
@@ -0,0 +1,144 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "threading/thread_pool.h"
+#include "threading/mutex_auto_lock.h"
+#include "threading/thread.h"
+#include "debug.h"
+#include "log.h"
+#include "settings.h"
+#include "util/numeric.h"
+
+class ThreadPool::WorkerThread : public Thread
+{
+public:
+	WorkerThread(const std::string &name, ThreadPool *pool) :
+		Thread(name),
+		m_pool(pool)
+	{}
+
+protected:
+	void *run()
+	{
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		m_pool->workerLoop();
+
+		END_DEBUG_EXCEPTION_HANDLER
+
+		return nullptr;
+	}
+
+private:
+	ThreadPool *m_pool;
+};
+
+ThreadPool::ThreadPool(const std::string &name, unsigned int num_threads)
+{
+	for (unsigned int i = 0; i < num_threads; i++) {
+		m_workers.push_back(std::make_unique<WorkerThread>(
+				name + std::to_string(i), this));
+		m_workers.back()->start();
+	}
+}
+
+unsigned int ThreadPool::defaultThreadCount(const std::string &setting)
+{
+	int threads = rangelim(g_settings->getS32(setting), 0, 8);
+	if (threads == 0)
+		threads = MYMIN(4, Thread::getNumberOfProcessors() / 4);
+	// The calling thread does its share of the work too
+	return MYMAX(1, threads) - 1;
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		MutexAutoLock lock(m_mutex);
+		m_stop = true;
+	}
+	m_work_cv.notify_all();
+
+	for (auto &worker : m_workers)
+		worker->wait();
+}
+
+void ThreadPool::run(size_t count, const std::function<void(size_t)> &func)
+{
+	if (count == 0)
+		return;
+
+	// Not worth waking anyone up, or the workers are busy with another batch
+	if (m_workers.empty() || count == 1 || m_busy.exchange(true)) {
+		for (size_t i = 0; i < count; i++)
+			func(i);
+		return;
+	}
+
+	{
+		MutexAutoLock lock(m_mutex);
+		// A worker may still be leaving the previous batch
+		m_done_cv.wait(lock, [this] { return m_active == 0; });
+		m_func = &func;
+		m_count = count;
+		m_next = 0;
+		m_generation++;
+	}
+	m_work_cv.notify_all();
+
+	processItems();
+
+	MutexAutoLock lock(m_mutex);
+	m_done_cv.wait(lock, [this] { return m_active == 0; });
+	m_func = nullptr;
+	m_busy = false;
+}
+
+void ThreadPool::workerLoop()
+{
+	u64 generation = 0;
+	while (true) {
+		{
+			MutexAutoLock lock(m_mutex);
+			m_work_cv.wait(lock, [&] {
+				return m_stop || m_generation != generation;
+			});
+			if (m_stop)
+				return;
+			generation = m_generation;
+			m_active++;
+		}
+
+		processItems();
+
+		MutexAutoLock lock(m_mutex);
+		if (--m_active == 0)
+			m_done_cv.notify_all();
+	}
+}
+
+void ThreadPool::processItems()
+{
+	while (true) {
+		size_t i = m_next.fetch_add(1);
+		if (i >= m_count)
+			break;
+		(*m_func)(i);
+	}
+}
@@ -0,0 +1,89 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "irrlichttypes.h"
+#include "util/basic_macros.h"
+
+class Thread;
+
+/*
+	A fixed set of worker threads for processing batches of independent work
+	items in parallel.
+
+	The calling thread takes part in the work and run() only returns once the
+	whole batch is done, so the results can be used without further
+	synchronization.
+*/
+class ThreadPool
+{
+public:
+	// num_threads: number of worker threads in addition to the calling thread
+	ThreadPool(const std::string &name, unsigned int num_threads);
+	~ThreadPool();
+
+	DISABLE_CLASS_COPY(ThreadPool)
+
+	// Returns num_threads for a pool sized by the given setting (0 to 8,
+	// where 0 means 25% of the system cores, max 4). The calling thread
+	// counts as one of the threads.
+	static unsigned int defaultThreadCount(const std::string &setting);
+
+	unsigned int getThreadCount() const { return m_workers.size(); }
+
+	// Calls func(i) for every i in [0, count), spread over the workers and the
+	// calling thread. func must not throw.
+	// Only one batch is processed by the workers at a time. If the pool is
+	// already busy (another thread's batch, or run() is called from func), the
+	// calling thread processes all items itself.
+	void run(size_t count, const std::function<void(size_t)> &func);
+
+private:
+	class WorkerThread;
+
+	void workerLoop();
+	void processItems();
+
+	std::vector<std::unique_ptr<WorkerThread>> m_workers;
+
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv;
+	std::condition_variable m_done_cv;
+
+	// Set while a batch is being processed by the workers
+	std::atomic<bool> m_busy {false};
+
+	// Current batch, only modified while no worker is active
+	const std::function<void(size_t)> *m_func = nullptr;
+	size_t m_count = 0;
+	std::atomic<size_t> m_next {0};
+
+	// All below are protected by m_mutex
+	u64 m_generation = 0;
+	unsigned int m_active = 0;
+	bool m_stop = false;
+};
@@ -0,0 +1,119 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <algorithm>
+#include "serverenvironment.h"
+
+class TestActiveBlockList : public TestBase
+{
+public:
+	TestActiveBlockList() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestActiveBlockList"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testForceloaded();
+	void testRemove();
+};
+
+static TestActiveBlockList g_test_instance;
+
+void TestActiveBlockList::runTests(IGameDef *gamedef)
+{
+	TEST(testForceloaded);
+	TEST(testRemove);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void update(ActiveBlockList &list, std::vector<v3s16> &removed,
+		std::vector<v3s16> &added)
+{
+	std::vector<PlayerSAO *> players;
+	removed.clear();
+	added.clear();
+	list.update(players, 3, 6, removed, added);
+	std::sort(removed.begin(), removed.end());
+	std::sort(added.begin(), added.end());
+}
+
+void TestActiveBlockList::testForceloaded()
+{
+	ActiveBlockList list;
+	std::vector<v3s16> removed, added;
+
+	list.m_forceloaded_list.insert(v3s16(1, 2, 3));
+	list.m_forceloaded_list.insert(v3s16(-4, 5, 6));
+	update(list, removed, added);
+	UASSERT(removed.empty());
+	UASSERTEQ(size_t, added.size(), 2);
+	UASSERT(list.contains(v3s16(1, 2, 3)));
+	UASSERT(list.contains(v3s16(-4, 5, 6)));
+	UASSERTEQ(size_t, list.m_abm_list.size(), 2);
+
+	// Nothing changed, nothing to do
+	update(list, removed, added);
+	UASSERT(removed.empty());
+	UASSERT(added.empty());
+
+	list.m_forceloaded_list.erase(v3s16(1, 2, 3));
+	list.m_forceloaded_list.insert(v3s16(7, 8, 9));
+	update(list, removed, added);
+	UASSERT(removed == std::vector<v3s16>{v3s16(1, 2, 3)});
+	UASSERT(added == std::vector<v3s16>{v3s16(7, 8, 9)});
+	UASSERTEQ(size_t, list.size(), 2);
+	UASSERT(!list.contains(v3s16(1, 2, 3)));
+	UASSERT(list.m_abm_list.count(v3s16(7, 8, 9)));
+
+	list.m_forceloaded_list.clear();
+	update(list, removed, added);
+	UASSERTEQ(size_t, removed.size(), 2);
+	UASSERT(added.empty());
+	UASSERTEQ(size_t, list.size(), 0);
+	UASSERTEQ(size_t, list.m_abm_list.size(), 0);
+}
+
+void TestActiveBlockList::testRemove()
+{
+	ActiveBlockList list;
+	std::vector<v3s16> removed, added;
+
+	list.m_forceloaded_list.insert(v3s16(1, 1, 1));
+	update(list, removed, added);
+	UASSERT(list.contains(v3s16(1, 1, 1)));
+
+	// A block that failed to load is tried again on the next update
+	list.remove(v3s16(1, 1, 1));
+	UASSERT(!list.contains(v3s16(1, 1, 1)));
+	UASSERT(!list.m_abm_list.count(v3s16(1, 1, 1)));
+	update(list, removed, added);
+	UASSERT(removed.empty());
+	UASSERT(added == std::vector<v3s16>{v3s16(1, 1, 1)});
+	UASSERT(list.m_abm_list.count(v3s16(1, 1, 1)));
+
+	// ...unless it went out of range in the meantime
+	list.remove(v3s16(1, 1, 1));
+	list.m_forceloaded_list.clear();
+	update(list, removed, added);
+	UASSERT(removed.empty());
+	UASSERT(added.empty());
+	UASSERTEQ(size_t, list.size(), 0);
+}
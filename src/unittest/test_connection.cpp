@@ -370,9 +370,112 @@ void TestConnection::testConnectSendReceive()
 		UASSERT(peer_id == PEER_ID_SERVER);
 	}
 
+	/*
+		Send many small packets that get bundled into few datagrams
+	*/
+	{
+		server.SetPeerCoalescing(peer_id_client, true);
+		client.SetPeerCoalescing(PEER_ID_SERVER, true);
+
+		const u16 count = 100;
+		for (u16 i = 0; i < count; i++) {
+			NetworkPacket pkt(0x1234, 2);
+			pkt << i;
+			server.Send(peer_id_client, i % 2, &pkt, true);
+		}
+
+		// Packets are reliable, so they arrive per channel in order
+		u16 next[2] = {0, 1};
+		u16 received = 0;
+		u64 timems0 = porting::getTimeMs();
+		while (received < count && porting::getTimeMs() - timems0 < 5000) {
+			try {
+				NetworkPacket pkt;
+				client.Receive(&pkt);
+				UASSERTEQ(session_t, pkt.getPeerId(), PEER_ID_SERVER);
+				UASSERTEQ(u16, pkt.getCommand(), 0x1234);
+				u16 i;
+				pkt >> i;
+				UASSERTEQ(u16, i, next[i % 2]);
+				next[i % 2] += 2;
+				received++;
+			} catch (con::NoIncomingDataException &e) {
+				sleep_ms(10);
+			}
+		}
+		UASSERTEQ(u16, received, count);
+	}
+
 	// Check peer handlers
 	UASSERT(hand_client.count == 1);
 	UASSERT(hand_client.last_id == 1);
 	UASSERT(hand_server.count == 1);
 	UASSERT(hand_server.last_id == 2);
+
+	/*
+		Check on the wire that small packets are bundled: a raw socket
+		takes the place of a client and looks at the datagrams it gets
+	*/
+	{
+		UDPSocket raw(server_address.isIPv6());
+		raw.setTimeoutMs(100);
+
+		// An unreliable packet from a new peer, the server adds the peer
+		u8 hello[BASE_HEADER_SIZE + 3];
+		writeU32(&hello[0], proto_id);
+		writeU16(&hello[4], PEER_ID_INEXISTENT);
+		writeU8(&hello[6], 0);
+		writeU8(&hello[7], con::PACKET_TYPE_ORIGINAL);
+		writeU16(&hello[8], 0x4321);
+		raw.Send(server_address, hello, sizeof(hello));
+
+		session_t raw_peer_id = PEER_ID_INEXISTENT;
+		u64 timems0 = porting::getTimeMs();
+		while (raw_peer_id == PEER_ID_INEXISTENT &&
+				porting::getTimeMs() - timems0 < 5000) {
+			try {
+				NetworkPacket pkt;
+				server.Receive(&pkt);
+				if (pkt.getCommand() == 0x4321)
+					raw_peer_id = pkt.getPeerId();
+			} catch (con::NoIncomingDataException &e) {
+				sleep_ms(10);
+			}
+		}
+		UASSERT(raw_peer_id != PEER_ID_INEXISTENT);
+
+		server.SetPeerCoalescing(raw_peer_id, true);
+		const u16 count = 10;
+		for (u16 i = 0; i < count; i++) {
+			NetworkPacket pkt(0x1234, 2);
+			pkt << i;
+			server.Send(raw_peer_id, 0, &pkt, true);
+		}
+
+		// The server may also send control packets, look for the bundle
+		u32 most_bundled = 0;
+		u8 buf[1500];
+		timems0 = porting::getTimeMs();
+		while (most_bundled < 2 && porting::getTimeMs() - timems0 < 5000) {
+			Address sender;
+			int size = raw.Receive(sender, buf, sizeof(buf));
+			if (size <= BASE_HEADER_SIZE || buf[BASE_HEADER_SIZE] !=
+					con::PACKET_TYPE_COALESCED)
+				continue;
+			UASSERTEQ(u32, readU32(&buf[0]), proto_id);
+
+			u32 entries = 0;
+			int offset = BASE_HEADER_SIZE + COALESCED_HEADER_SIZE;
+			while (offset + COALESCED_ENTRY_HEADER_SIZE <= size) {
+				u16 entry_size = readU16(&buf[offset + 1]);
+				offset += COALESCED_ENTRY_HEADER_SIZE + entry_size;
+				entries++;
+			}
+			UASSERTEQ(int, offset, size);
+			most_bundled = MYMAX(most_bundled, entries);
+		}
+		UASSERT(most_bundled >= 2);
+
+		server.DisconnectPeer(raw_peer_id);
+	}
 }
@@ -21,8 +21,20 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <cstdio>
 #include <unordered_set>
 #include <unordered_map>
+#include "gamedef.h"
 #include "mapblock.h"
+#include "nodedef.h"
+#include "noise.h"
 #include "dummymap.h"
+#include "mapblockindex.h"
+#include "mapsector.h"
+#include "mapsnapshot.h"
+#include "server/serializedblockcache.h"
+#include "server/blockwriter.h"
+#include "database/database-dummy.h"
+#include "serialization.h"
+#include "threading/mutex_auto_lock.h"
+#include "util/serialize.h"
 
 class TestMap : public TestBase
 {
@@ -36,6 +48,14 @@ class TestMap : public TestBase
 	void testForEachNodeInArea(IGameDef *gamedef);
 	void testForEachNodeInAreaBlank(IGameDef *gamedef);
 	void testForEachNodeInAreaEmpty(IGameDef *gamedef);
+	void testSerializedBlockCache(IGameDef *gamedef);
+	void testContentCounts(IGameDef *gamedef);
+	void testBlockWriter(IGameDef *gamedef);
+	void testBlockWriterFailure(IGameDef *gamedef);
+	void testDeSerializeNoAllocation(IGameDef *gamedef);
+	void testBlockIndex();
+	void testMapBlockLookup(IGameDef *gamedef);
+	void testMapSnapshot(IGameDef *gamedef);
 };
 
 static TestMap g_test_instance;
@@ -46,6 +66,14 @@ void TestMap::runTests(IGameDef *gamedef)
 	TEST(testForEachNodeInArea, gamedef);
 	TEST(testForEachNodeInAreaBlank, gamedef);
 	TEST(testForEachNodeInAreaEmpty, gamedef);
+	TEST(testSerializedBlockCache, gamedef);
+	TEST(testContentCounts, gamedef);
+	TEST(testBlockWriter, gamedef);
+	TEST(testBlockWriterFailure, gamedef);
+	TEST(testDeSerializeNoAllocation, gamedef);
+	TEST(testBlockIndex);
+	TEST(testMapBlockLookup, gamedef);
+	TEST(testMapSnapshot, gamedef);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -169,3 +197,351 @@ void TestMap::testForEachNodeInAreaEmpty(IGameDef *gamedef)
 		return true;
 	});
 }
+
+void TestMap::testSerializedBlockCache(IGameDef *gamedef)
+{
+	MapBlock block(nullptr, v3s16(1, 2, 3), gamedef);
+	MapBlock other(nullptr, v3s16(1, 2, 3), gamedef);
+	UASSERT(block.getChangeStamp() != other.getChangeStamp());
+
+	SerializedBlockCache cache(100);
+	std::string data;
+	UASSERT(!cache.get(&block, 29, data));
+
+	cache.insert(block.getPos(), 29, block.getChangeStamp(), std::string(20, 'a'));
+	UASSERT(cache.get(&block, 29, data));
+	UASSERT(data == std::string(20, 'a'));
+	UASSERT(!cache.get(&block, 28, data));
+	UASSERTEQ(size_t, cache.getSize(), 20);
+	// same position, but a different block instance
+	UASSERT(!cache.get(&other, 29, data));
+	UASSERTEQ(size_t, cache.getEntryCount(), 0);
+
+	// modification invalidates
+	cache.insert(block.getPos(), 29, block.getChangeStamp(), std::string(20, 'b'));
+	block.setNode(v3s16(0, 0, 0), MapNode(CONTENT_AIR));
+	UASSERT(!cache.get(&block, 29, data));
+	UASSERTEQ(size_t, cache.getEntryCount(), 0);
+	UASSERTEQ(size_t, cache.getSize(), 0);
+
+	// eviction of the least recently used entry
+	MapBlock b1(nullptr, v3s16(0, 0, 1), gamedef);
+	MapBlock b2(nullptr, v3s16(0, 0, 2), gamedef);
+	MapBlock b3(nullptr, v3s16(0, 0, 3), gamedef);
+	cache.insert(b1.getPos(), 29, b1.getChangeStamp(), std::string(40, 'x'));
+	cache.insert(b2.getPos(), 29, b2.getChangeStamp(), std::string(40, 'y'));
+	UASSERT(cache.get(&b1, 29, data));
+	cache.insert(b3.getPos(), 29, b3.getChangeStamp(), std::string(40, 'z'));
+	UASSERT(cache.get(&b1, 29, data));
+	UASSERT(!cache.get(&b2, 29, data));
+	UASSERT(cache.get(&b3, 29, data));
+	UASSERTEQ(size_t, cache.getSize(), 80);
+
+	cache.clear();
+	UASSERTEQ(size_t, cache.getEntryCount(), 0);
+}
+
+static u16 getContentCount(const MapBlock::ContentCounts &counts, content_t c)
+{
+	for (const auto &it : counts) {
+		if (it.first == c)
+			return it.second;
+	}
+	return 0;
+}
+
+void TestMap::testContentCounts(IGameDef *gamedef)
+{
+	MapBlock block(nullptr, v3s16(0, 0, 0), gamedef);
+
+	// A fresh block is all ignore
+	const MapBlock::ContentCounts *counts = block.getContentCounts();
+	UASSERT(counts);
+	UASSERTEQ(size_t, counts->size(), 1);
+	UASSERTEQ(u16, getContentCount(*counts, CONTENT_IGNORE), MapBlock::nodecount);
+
+	// Incremental updates
+	block.setNode(v3s16(1, 2, 3), MapNode(CONTENT_AIR));
+	block.setNodeNoCheck(v3s16(4, 5, 6), MapNode(CONTENT_AIR));
+	block.setNodeNoCheck(v3s16(4, 5, 6), MapNode(CONTENT_AIR));
+	counts = block.getContentCounts();
+	UASSERT(counts);
+	UASSERTEQ(u16, getContentCount(*counts, CONTENT_AIR), 2);
+	UASSERTEQ(u16, getContentCount(*counts, CONTENT_IGNORE), MapBlock::nodecount - 2);
+
+	// Bulk changes cause a rebuild
+	MapNode *data = block.getData();
+	for (u32 i = 0; i < MapBlock::nodecount; i++)
+		data[i] = MapNode(CONTENT_AIR);
+	data[0] = MapNode(CONTENT_UNKNOWN);
+	counts = block.getContentCounts();
+	UASSERT(counts);
+	UASSERTEQ(size_t, counts->size(), 2);
+	UASSERTEQ(u16, getContentCount(*counts, CONTENT_AIR), MapBlock::nodecount - 1);
+	UASSERTEQ(u16, getContentCount(*counts, CONTENT_UNKNOWN), 1);
+
+	// Contents that disappear are removed
+	block.setNode(v3s16(0, 0, 0), MapNode(CONTENT_AIR));
+	counts = block.getContentCounts();
+	UASSERTEQ(size_t, counts->size(), 1);
+
+	// Too many different contents are not indexed
+	for (u16 i = 0; i < 200; i++)
+		block.setNodeNoCheck(v3s16(i % 16, i / 16, 0), MapNode(i + 256));
+	UASSERT(!block.getContentCounts());
+
+	block.reallocate();
+	counts = block.getContentCounts();
+	UASSERT(counts);
+	UASSERTEQ(size_t, counts->size(), 1);
+}
+
+void TestMap::testBlockWriter(IGameDef *gamedef)
+{
+	const v3s16 pos(1, 2, 3), pos2(-4, 5, 6);
+	MapBlock block(nullptr, pos, gamedef);
+	block.setNodeNoCheck(v3s16(1, 1, 1), MapNode(t_CONTENT_STONE));
+
+	auto serialize = [&] () {
+		std::ostringstream os(std::ios_base::binary);
+		block.serializeUncompressed(os, SER_FMT_VER_HIGHEST_WRITE, true);
+		return os.str();
+	};
+
+	// Reads back what ends up in the database
+	auto check = [&] (const std::string &stored) {
+		UASSERT(!stored.empty());
+		std::istringstream is(stored, std::ios_base::binary);
+		u8 version = readU8(is);
+		UASSERTEQ(int, version, SER_FMT_VER_HIGHEST_WRITE);
+		MapBlock loaded(nullptr, pos, gamedef);
+		loaded.deSerialize(is, version, true);
+		UASSERTEQ(content_t, loaded.getNodeNoCheck(v3s16(1, 1, 1)).getContent(),
+			t_CONTENT_STONE);
+	};
+
+	Database_Dummy db;
+	std::mutex db_mutex;
+	std::string data;
+	{
+		BlockWriter writer(&db, db_mutex, -1, 1024 * 1024, nullptr);
+		writer.push(pos, serialize());
+
+		// Either still queued or already written
+		if (writer.get(pos, &data)) {
+			check(data);
+		} else {
+			MutexAutoLock lock(db_mutex);
+			db.loadBlock(pos, &data);
+			check(data);
+		}
+
+		writer.flush();
+		UASSERT(!writer.get(pos, &data));
+		UASSERTEQ(size_t, writer.getQueuedCount(), 0);
+		db.loadBlock(pos, &data);
+		check(data);
+
+		// Destruction writes out the rest
+		writer.push(pos2, serialize());
+	}
+	data.clear();
+	db.loadBlock(pos2, &data);
+	check(data);
+}
+
+namespace {
+
+// Rejects all writes while fail is set
+class FailingDatabase : public Database_Dummy
+{
+public:
+	bool fail = true;
+
+	bool saveBlock(const v3s16 &pos, const std::string &data) override
+	{
+		return !fail && Database_Dummy::saveBlock(pos, data);
+	}
+};
+
+}
+
+void TestMap::testBlockWriterFailure(IGameDef *gamedef)
+{
+	const v3s16 pos(1, 2, 3), pos2(4, 5, 6);
+	FailingDatabase db;
+	std::mutex db_mutex;
+	std::string data;
+	{
+		BlockWriter writer(&db, db_mutex, -1, 1024 * 1024, nullptr);
+		writer.push(pos, std::string(100, 'a'));
+		writer.push(pos2, std::string(100, 'b'));
+
+		// Failed blocks are reported and kept
+		UASSERT(!writer.flush());
+		UASSERTEQ(size_t, writer.getQueuedCount(), 2);
+		UASSERT(writer.get(pos, &data));
+		{
+			MutexAutoLock lock(db_mutex);
+			data.clear();
+			db.loadBlock(pos, &data);
+		}
+		UASSERT(data.empty());
+
+		writer.discard(pos2);
+		UASSERTEQ(size_t, writer.getQueuedCount(), 1);
+
+		// and written by the next flush once the database works again
+		{
+			MutexAutoLock lock(db_mutex);
+			db.fail = false;
+		}
+		UASSERT(writer.flush());
+		UASSERTEQ(size_t, writer.getQueuedCount(), 0);
+	}
+	db.loadBlock(pos, &data);
+	UASSERT(!data.empty());
+	data.clear();
+	db.loadBlock(pos2, &data);
+	UASSERT(data.empty());
+}
+
+void TestMap::testDeSerializeNoAllocation(IGameDef *gamedef)
+{
+	const v3s16 pos(1, 2, 3);
+	MapBlock block(nullptr, pos, gamedef);
+	block.setNodeNoCheck(v3s16(1, 1, 1), MapNode(t_CONTENT_STONE));
+
+	std::ostringstream os(std::ios_base::binary);
+	block.serializeUncompressed(os, SER_FMT_VER_HIGHEST_WRITE, true);
+	std::string raw = os.str();
+
+	auto deserialize = [&] (const std::string &raw) {
+		std::ostringstream os(std::ios_base::binary);
+		compress(raw, os, SER_FMT_VER_HIGHEST_WRITE);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		MapBlock loaded(nullptr, pos, gamedef);
+		return loaded.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, true, false);
+	};
+
+	// All node names are known
+	UASSERT(deserialize(raw));
+
+	// Rename the node in the name-id mapping to one that has no id yet
+	size_t name_pos = raw.find("default:stone");
+	UASSERT(name_pos != std::string::npos);
+	raw.replace(name_pos, 13, "default:stonf");
+	UASSERT(!deserialize(raw));
+	content_t id;
+	UASSERT(!gamedef->ndef()->getId("default:stonf", id));
+}
+
+void TestMap::testBlockIndex()
+{
+	// The index never dereferences the blocks, so fake pointers will do
+	auto fake_block = [] (size_t i) {
+		return reinterpret_cast<MapBlock *>((i + 1) * 16);
+	};
+
+	MapBlockIndex index;
+	UASSERT(index.empty());
+	UASSERT(!index.find(v3s16(0, 0, 0)));
+	UASSERT(!index.erase(v3s16(0, 0, 0)));
+
+	std::vector<v3s16> positions;
+	std::unordered_set<v3s16> seen;
+	PseudoRandom pr(42);
+	while (positions.size() < 5000) {
+		// Cover negative coordinates and the extremes of the range
+		v3s16 p(pr.range(-2048, 2047), pr.range(-64, 63), pr.range(-2048, 2047));
+		if (positions.size() < 8)
+			p = v3s16(positions.size() & 1 ? -32768 : 32767, 0, positions.size());
+		if (seen.insert(p).second)
+			positions.push_back(p);
+	}
+
+	for (size_t i = 0; i < positions.size(); i++)
+		index.insert(positions[i], fake_block(i));
+	UASSERTEQ(size_t, index.size(), positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		UASSERT(index.find(positions[i]) == fake_block(i));
+
+	// Erase every other entry, the remaining ones must still be found
+	for (size_t i = 0; i < positions.size(); i += 2)
+		UASSERT(index.erase(positions[i]));
+	UASSERTEQ(size_t, index.size(), positions.size() / 2);
+	for (size_t i = 0; i < positions.size(); i++)
+		UASSERT(index.find(positions[i]) == (i % 2 ? fake_block(i) : nullptr));
+
+	// Erasing nearly everything also shrinks the table
+	for (size_t i = 1; i < positions.size() - 2; i += 2)
+		UASSERT(index.erase(positions[i]));
+	UASSERTEQ(size_t, index.size(), 1);
+	UASSERT(index.find(positions.back()) == fake_block(positions.size() - 1));
+
+	index.clear();
+	UASSERT(index.empty());
+	UASSERT(!index.find(positions.back()));
+}
+
+void TestMap::testMapBlockLookup(IGameDef *gamedef)
+{
+	DummyMap map(gamedef, {-2, -2, -2}, {1, 1, 1});
+
+	MapBlock *block = map.getBlockNoCreateNoEx(v3s16(1, -2, 0));
+	UASSERT(block);
+	UASSERT(block->getPos() == v3s16(1, -2, 0));
+	UASSERT(!map.getBlockNoCreateNoEx(v3s16(2, 0, 0)));
+
+	// The last result is cached, removing the block must invalidate it
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, -2, 0)) == block);
+	MapSector *sector = map.getSectorNoGenerate(v2s16(1, 0));
+	UASSERT(sector);
+	std::unique_ptr<MapBlock> detached = sector->detachBlock(block);
+	UASSERT(!map.getBlockNoCreateNoEx(v3s16(1, -2, 0)));
+
+	// Same for a cached miss
+	sector->insertBlock(std::move(detached));
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, -2, 0)) == block);
+
+	// A different map does not see the cached block
+	DummyMap map2(gamedef, {0, 0, 0}, {0, 0, 0});
+	UASSERT(map2.getBlockNoCreateNoEx(v3s16(0, 0, 0)));
+	UASSERT(!map2.getBlockNoCreateNoEx(v3s16(1, -2, 0)));
+}
+
+void TestMap::testMapSnapshot(IGameDef *gamedef)
+{
+	DummyMap map(gamedef, {-1, -1, -1}, {0, 0, 0});
+	const v3s16 p1(-3, 5, 7), p2(15, -16, 0);
+	map.setNode(p1, MapNode(t_CONTENT_STONE, 0, 3));
+	map.setNode(p2, MapNode(t_CONTENT_WATER));
+
+	// The snapshot reaches one block beyond the map in X
+	MapSnapshot snapshot(&map, {-1, -1, -1}, {1, 0, 0});
+	UASSERT(snapshot.getArea().MinEdge == v3s16(-16, -16, -16));
+	UASSERT(snapshot.getArea().MaxEdge == v3s16(31, 15, 15));
+	UASSERTEQ(u32, snapshot.getBlockCount(), 8);
+	UASSERT(snapshot.blockExists(v3s16(0, 0, 0)));
+	UASSERT(!snapshot.blockExists(v3s16(1, 0, 0)));
+
+	bool valid = false;
+	MapNode n = snapshot.getNode(p1, &valid);
+	UASSERT(valid);
+	UASSERTEQ(content_t, n.getContent(), t_CONTENT_STONE);
+	UASSERTEQ(int, n.param2, 3);
+	UASSERT(snapshot.getData()[snapshot.getArea().index(p2)] == MapNode(t_CONTENT_WATER));
+
+	// Missing blocks and positions outside of the area read as ignore
+	n = snapshot.getNode(v3s16(16, 0, 0), &valid);
+	UASSERT(!valid);
+	UASSERTEQ(content_t, n.getContent(), CONTENT_IGNORE);
+	UASSERTEQ(content_t, snapshot.getData()[snapshot.getArea().index(v3s16(16, 0, 0))].getContent(),
+		CONTENT_IGNORE);
+	snapshot.getNode(v3s16(0, 16, 0), &valid);
+	UASSERT(!valid);
+
+	// Later changes to the map are not visible
+	map.setNode(p1, MapNode(CONTENT_AIR));
+	UASSERTEQ(content_t, snapshot.getNode(p1).getContent(), t_CONTENT_STONE);
+}
@@ -0,0 +1,267 @@
+/*
+Minetest
+Copyright (C) 2023 Minetest core developers & community
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "cmake_config.h"
+
+#include "test.h"
+
+#include <cstdlib>
+#include <fstream>
+#include "database/database-dummy.h"
+#include "database/database-regions.h"
+#include "database/database-sqlite3.h"
+#if USE_POSTGRESQL
+#include "database/database-postgresql.h"
+#endif
+#include "filesys.h"
+
+class TestMapDatabase : public TestBase
+{
+public:
+	TestMapDatabase() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapDatabase"; }
+
+	void runTests(IGameDef *gamedef);
+	void runTestsForCurrentDB();
+
+	void testSaveLoad();
+	void testLoadBlocks();
+	void testLoadBlocksBinary();
+	void testDelete();
+	void testReopen();
+	void testCompaction();
+	void testRegionCompaction(const std::string &test_dir);
+
+private:
+	MapDatabase *map_db;
+};
+
+static TestMapDatabase g_test_instance;
+
+void TestMapDatabase::runTests(IGameDef *gamedef)
+{
+	const std::string test_dir = getTestTempDirectory();
+
+	rawstream << "-------- Dummy database" << std::endl;
+
+	map_db = new Database_Dummy();
+	runTestsForCurrentDB();
+	delete map_db;
+
+	rawstream << "-------- SQLite3 database" << std::endl;
+
+	fs::DeleteSingleFileOrEmptyDirectory(test_dir + DIR_DELIM + "map.sqlite");
+	map_db = new MapDatabaseSQLite3(test_dir);
+	runTestsForCurrentDB();
+	delete map_db;
+
+#ifndef _WIN32
+	rawstream << "-------- Regions database" << std::endl;
+
+	fs::RecursiveDelete(test_dir + DIR_DELIM + "map_regions");
+	map_db = new MapDatabaseRegions(test_dir);
+	runTestsForCurrentDB();
+	TEST(testRegionCompaction, test_dir);
+	delete map_db;
+
+	// Everything must have been written to the files
+	map_db = new MapDatabaseRegions(test_dir);
+	TEST(testReopen);
+	delete map_db;
+#endif
+
+#if USE_POSTGRESQL
+	const char *env_postgresql_connect_string = getenv("MINETEST_POSTGRESQL_CONNECT_STRING");
+	if (env_postgresql_connect_string) {
+		rawstream << "-------- PostgreSQL database" << std::endl;
+
+		map_db = new MapDatabasePostgreSQL(env_postgresql_connect_string);
+		runTestsForCurrentDB();
+		delete map_db;
+	}
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestMapDatabase::runTestsForCurrentDB()
+{
+	TEST(testSaveLoad);
+	TEST(testLoadBlocks);
+	TEST(testLoadBlocksBinary);
+	TEST(testDelete);
+	TEST(testCompaction);
+}
+
+static std::string block_data(const v3s16 &pos)
+{
+	// Contains a zero byte on purpose
+	return std::string("block\0", 6) + std::to_string(pos.X) + ","
+		+ std::to_string(pos.Y) + "," + std::to_string(pos.Z);
+}
+
+void TestMapDatabase::testSaveLoad()
+{
+	const v3s16 pos(-2047, 5, 2047);
+	std::string data;
+
+	map_db->beginSave();
+	UASSERT(map_db->saveBlock(pos, block_data(pos)));
+	map_db->endSave();
+
+	map_db->loadBlock(pos, &data);
+	UASSERT(data == block_data(pos));
+}
+
+void TestMapDatabase::testLoadBlocks()
+{
+	// More than one batch of the SQLite3 backend
+	std::vector<v3s16> positions;
+	map_db->beginSave();
+	for (s16 i = 0; i < 40; i++) {
+		v3s16 pos(i - 20, -i, 3 * i);
+		positions.push_back(pos);
+		// Leave out every third block
+		if (i % 3 != 0)
+			UASSERT(map_db->saveBlock(pos, block_data(pos)));
+	}
+	map_db->endSave();
+	// Duplicates are allowed too
+	positions.push_back(positions[1]);
+
+	std::vector<std::string> blocks;
+	map_db->loadBlocks(positions, &blocks);
+	UASSERTEQ(size_t, blocks.size(), positions.size());
+	for (size_t i = 0; i < positions.size(); i++) {
+		std::string single;
+		map_db->loadBlock(positions[i], &single);
+		UASSERT(blocks[i] == single);
+		if (i % 3 == 0 && i < 40)
+			UASSERT(blocks[i].empty());
+		else
+			UASSERT(blocks[i] == block_data(positions[i]));
+	}
+
+	map_db->loadBlocks({}, &blocks);
+	UASSERT(blocks.empty());
+}
+
+void TestMapDatabase::testLoadBlocksBinary()
+{
+	// Every byte value, and more blocks than fit into one byte of the
+	// position index the PostgreSQL backend gets back
+	std::string data;
+	for (int i = 0; i < 256; i++)
+		data.push_back((char)i);
+
+	std::vector<v3s16> positions;
+	map_db->beginSave();
+	for (s16 i = 0; i < 300; i++) {
+		v3s16 pos(i, 100, -i);
+		positions.push_back(pos);
+		UASSERT(map_db->saveBlock(pos, data + block_data(pos)));
+	}
+	map_db->endSave();
+
+	std::vector<std::string> blocks;
+	map_db->loadBlocks(positions, &blocks);
+	UASSERTEQ(size_t, blocks.size(), positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		UASSERT(blocks[i] == data + block_data(positions[i]));
+
+	for (const v3s16 &pos : positions)
+		UASSERT(map_db->deleteBlock(pos));
+}
+
+void TestMapDatabase::testDelete()
+{
+	const v3s16 pos(-2047, 5, 2047);
+	std::vector<std::string> blocks;
+
+	UASSERT(map_db->deleteBlock(pos));
+	map_db->loadBlocks({pos}, &blocks);
+	UASSERTEQ(size_t, blocks.size(), 1);
+	UASSERT(blocks[0].empty());
+}
+
+void TestMapDatabase::testReopen()
+{
+	std::vector<v3s16> positions;
+	map_db->listAllLoadableBlocks(positions);
+	// From testLoadBlocks() and testCompaction()
+	UASSERTEQ(size_t, positions.size(), 26 + 1);
+
+	std::string data;
+	const v3s16 pos(5, 5, 5);
+	map_db->loadBlock(pos, &data);
+	UASSERT(data == std::string(1000, 'c'));
+}
+
+void TestMapDatabase::testCompaction()
+{
+	// Overwriting the same block over and over again leaves lots of unused
+	// data behind in append-only backends
+	const v3s16 pos(5, 5, 5);
+	std::string data;
+	for (int i = 0; i < 3; i++) {
+		map_db->beginSave();
+		for (int j = 0; j < 1000; j++)
+			UASSERT(map_db->saveBlock(pos, std::string(1000 + j, 'a' + i)));
+		UASSERT(map_db->saveBlock(pos, std::string(1000, 'a' + i)));
+		map_db->endSave();
+
+		map_db->loadBlock(pos, &data);
+		UASSERT(data == std::string(1000, 'a' + i));
+	}
+}
+
+#ifndef _WIN32
+void TestMapDatabase::testRegionCompaction(const std::string &test_dir)
+{
+	const std::string path = test_dir + DIR_DELIM + "map_regions" + DIR_DELIM +
+		"r.0.0.0.mtr";
+	auto file_size = [&] () {
+		std::ifstream is(path, std::ios_base::binary | std::ios_base::ate);
+		UASSERT(is.good());
+		return (u64)is.tellg();
+	};
+
+	const v3s16 pos(5, 5, 5);
+	std::string data;
+	map_db->beginSave();
+	for (int j = 0; j < 500; j++)
+		UASSERT(map_db->saveBlock(pos, std::string(1000 + j, 'x')));
+	UASSERT(map_db->saveBlock(pos, std::string(1000, 'c')));
+	// Not enough garbage yet
+	const u64 size_before = file_size();
+	map_db->endSave();
+	UASSERTEQ(u64, file_size(), size_before);
+
+	map_db->beginSave();
+	for (int j = 0; j < 1000; j++)
+		UASSERT(map_db->saveBlock(pos, std::string(1000 + j, 'y')));
+	UASSERT(map_db->saveBlock(pos, std::string(1000, 'c')));
+	map_db->endSave();
+
+	// Only the index and the live blocks of the region are left
+	UASSERT(file_size() < size_before / 4);
+	map_db->loadBlock(pos, &data);
+	UASSERT(data == std::string(1000, 'c'));
+}
+#endif
@@ -20,8 +20,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "test.h"
 
 #include <cmath>
+#include <cstring>
+#include <vector>
 #include "exceptions.h"
 #include "noise.h"
+#include "threading/thread_pool.h"
 
 class TestNoise : public TestBase {
 public:
@@ -41,6 +44,9 @@ class TestNoise : public TestBase {
 	void testNoise3dPoint();
 	void testNoise3dBulk();
 	void testNoiseInvalidParams();
+	void testNoiseSimd2d();
+	void testNoiseSimd3d();
+	void testNoise3dThreadPool();
 
 	static const float expected_2d_results[10 * 10];
 	static const float expected_3d_results[10 * 10 * 10];
@@ -61,6 +67,9 @@ void TestNoise::runTests(IGameDef *gamedef)
 	TEST(testNoise3dPoint);
 	TEST(testNoise3dBulk);
 	TEST(testNoiseInvalidParams);
+	TEST(testNoiseSimd2d);
+	TEST(testNoiseSimd3d);
+	TEST(testNoise3dThreadPool);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -175,6 +184,95 @@ void TestNoise::testNoiseInvalidParams()
 	UASSERT(exception_thrown);
 }
 
+// Compares the results of all supported SIMD levels to the scalar code.
+// They must be bit-identical, otherwise map generation would depend on the CPU.
+template <typename F>
+static void compare_simd_levels(size_t bufsize, F get_map)
+{
+	NoiseSimdLevel supported = noise_simd_supported();
+	NoiseSimdLevel old_level = noise_simd_get();
+
+	UASSERT(noise_simd_set(NOISE_SIMD_NONE) == NOISE_SIMD_NONE);
+	std::vector<float> expected(bufsize);
+	get_map(expected.data());
+
+	std::vector<float> actual(bufsize);
+	for (int level = NOISE_SIMD_NONE + 1; level <= supported; level++) {
+		UASSERT(noise_simd_set((NoiseSimdLevel)level) == level);
+		get_map(actual.data());
+		for (size_t i = 0; i != bufsize; i++) {
+			UASSERT(actual[i] == expected[i]);
+		}
+	}
+
+	noise_simd_set(old_level);
+}
+
+void TestNoise::testNoiseSimd2d()
+{
+	// Odd sizes, so that the scalar tails of the vector loops are used too
+	const u32 sx = 37, sy = 11;
+	NoiseParams params[] = {
+		NoiseParams(20, 40, v3f(50, 50, 50), 9, 5, 0.6, 2.0),
+		NoiseParams(0, 1, v3f(13, 7, 13), 42, 3, 0.5, 2.0, NOISE_FLAG_EASED),
+		NoiseParams(-3, 2, v3f(100, 60, 100), 1, 4, 0.7, 2.5,
+			NOISE_FLAG_ABSVALUE),
+	};
+	std::vector<float> persistence(sx * sy);
+	for (size_t i = 0; i != persistence.size(); i++)
+		persistence[i] = 0.3f + (i % 7) * 0.1f;
+
+	for (const NoiseParams &np : params)
+	for (bool use_persistence : {false, true}) {
+		Noise noise(&np, 1337, sx, sy);
+		compare_simd_levels(sx * sy, [&] (float *out) {
+			float *map = noise.perlinMap2D(-123.4f, 567.8f,
+				use_persistence ? persistence.data() : nullptr);
+			memcpy(out, map, sx * sy * sizeof(float));
+		});
+	}
+}
+
+void TestNoise::testNoiseSimd3d()
+{
+	const u32 sx = 21, sy = 9, sz = 13;
+	NoiseParams params[] = {
+		NoiseParams(20, 40, v3f(50, 50, 50), 9, 5, 0.6, 2.0),
+		NoiseParams(0, 1, v3f(13, 7, 13), 42, 3, 0.5, 2.0, NOISE_FLAG_EASED),
+		NoiseParams(-3, 2, v3f(100, 60, 100), 1, 4, 0.7, 2.5,
+			NOISE_FLAG_ABSVALUE),
+	};
+	std::vector<float> persistence(sx * sy * sz);
+	for (size_t i = 0; i != persistence.size(); i++)
+		persistence[i] = 0.3f + (i % 7) * 0.1f;
+
+	for (const NoiseParams &np : params)
+	for (bool use_persistence : {false, true}) {
+		Noise noise(&np, 1337, sx, sy, sz);
+		compare_simd_levels(sx * sy * sz, [&] (float *out) {
+			float *map = noise.perlinMap3D(-123.4f, 567.8f, 9.1f,
+				use_persistence ? persistence.data() : nullptr);
+			memcpy(out, map, sx * sy * sz * sizeof(float));
+		});
+	}
+}
+
+void TestNoise::testNoise3dThreadPool()
+{
+	const u32 sx = 21, sy = 9, sz = 13;
+	NoiseParams np(0, 1, v3f(13, 7, 13), 42, 3, 0.5, 2.0, NOISE_FLAG_EASED);
+	ThreadPool pool("TestNoise", 3);
+
+	Noise noise(&np, 1337, sx, sy, sz);
+	std::vector<float> expected(sx * sy * sz);
+	memcpy(expected.data(), noise.perlinMap3D(-123.4f, 567.8f, 9.1f),
+		expected.size() * sizeof(float));
+
+	// Splitting the work up must not change the result at all
+	float *map = noise.perlinMap3D(-123.4f, 567.8f, 9.1f, nullptr, &pool);
+	UASSERT(memcmp(map, expected.data(), expected.size() * sizeof(float)) == 0);
+}
+
 const float TestNoise::expected_2d_results[10 * 10] = {
 	19.11726, 18.49626, 16.48476, 15.02135, 14.75713, 16.26008, 17.54822,
 	18.06860, 18.57016, 18.48407, 18.49649, 17.89160, 15.94162, 14.54901,
@@ -20,6 +20,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "test.h"
 
 #include "profiler.h"
+#include <sstream>
+#include <thread>
 
 class TestProfiler : public TestBase
 {
@@ -30,6 +32,8 @@ class TestProfiler : public TestBase
 	void runTests(IGameDef *gamedef);
 
 	void testProfilerAverage();
+	void testScopeProfiler();
+	void testTrace();
 };
 
 static TestProfiler g_test_instance;
@@ -37,6 +41,8 @@ static TestProfiler g_test_instance;
 void TestProfiler::runTests(IGameDef *gamedef)
 {
 	TEST(testProfilerAverage);
+	TEST(testScopeProfiler);
+	TEST(testTrace);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -71,3 +77,50 @@ void TestProfiler::testProfilerAverage()
 
 	UASSERT(p.getValue("Test2") == 123.57f);
 }
+
+void TestProfiler::testScopeProfiler()
+{
+	Profiler p;
+
+	ProfilerScopeId id = p.internScope("Scope", SPT_AVG);
+	UASSERTEQ(ProfilerScopeId, p.internScope("Scope", SPT_AVG), id);
+	UASSERT(p.internScope("Scope", SPT_ADD) != id);
+
+	// Scopes of several threads end up in the same value
+	auto work = [&] () {
+		for (int i = 0; i < 100; i++)
+			ScopeProfiler sp(&p, id);
+	};
+	std::thread t1(work), t2(work);
+	t1.join();
+	t2.join();
+	work();
+
+	UASSERT(p.getValue("Scope [ms]") >= 0.f);
+	UASSERTEQ(int, p.getAvgCount("Scope [ms]"), 300);
+
+	{
+		ScopeProfiler sp(&p, "Other", SPT_ADD);
+	}
+	p.clear();
+	UASSERTEQ(float, p.getValue("Scope [ms]"), 0.f);
+}
+
+void TestProfiler::testTrace()
+{
+	Profiler p;
+	p.setTraceEnabled(true);
+
+	{
+		ScopeProfiler outer(&p, "Outer", SPT_AVG);
+		ScopeProfiler inner(&p, "Inner \"quoted\"", SPT_AVG);
+	}
+
+	std::ostringstream os;
+	p.writeTrace(os);
+	std::string trace = os.str();
+	UASSERT(trace.find("\"traceEvents\"") != std::string::npos);
+	UASSERT(trace.find("\"name\":\"Outer\",\"ph\":\"X\"") != std::string::npos);
+	UASSERT(trace.find("\"name\":\"Inner \\\"quoted\\\"\"") != std::string::npos);
+	UASSERT(trace.find("\"depth\":1") != std::string::npos);
+}
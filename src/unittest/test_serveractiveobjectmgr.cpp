@@ -40,6 +40,8 @@ class TestServerActiveObjectMgr : public TestBase
 	void testRemoveObject();
 	void testGetObjectsInsideRadius();
 	void testGetAddedActiveObjectsAroundPos();
+	void testSpatialIndex();
+	void testStepModification();
 };
 
 static TestServerActiveObjectMgr g_test_instance;
@@ -51,6 +53,8 @@ void TestServerActiveObjectMgr::runTests(IGameDef *gamedef)
 	TEST(testRemoveObject)
 	TEST(testGetObjectsInsideRadius);
 	TEST(testGetAddedActiveObjectsAroundPos);
+	TEST(testSpatialIndex);
+	TEST(testStepModification);
 }
 
 void clearSAOMgr(server::ActiveObjectMgr *saomgr)
@@ -190,3 +194,119 @@ void TestServerActiveObjectMgr::testGetAddedActiveObjectsAroundPos()
 
 	clearSAOMgr(&saomgr);
 }
+
+void TestServerActiveObjectMgr::testSpatialIndex()
+{
+	server::ActiveObjectMgr saomgr;
+
+	// A grid of objects, spaced so that a small query only touches few cells
+	std::vector<ServerActiveObject *> objs;
+	for (s16 x = -5; x <= 5; x++)
+	for (s16 z = -5; z <= 5; z++) {
+		auto sao = new MockServerActiveObject(nullptr, v3f(x * 100, 0, z * 100));
+		UASSERT(saomgr.registerObject(sao));
+		objs.push_back(sao);
+	}
+
+	std::vector<ServerActiveObject *> result;
+	saomgr.getObjectsInsideRadius(v3f(), 50, result, nullptr);
+	UASSERTCMP(size_t, ==, result.size(), 1);
+	UASSERT(result[0]->getBasePosition() == v3f());
+
+	result.clear();
+	saomgr.getObjectsInsideRadius(v3f(), 150, result, nullptr);
+	UASSERTCMP(size_t, ==, result.size(), 9);
+	// Results come in registration order, no matter which way they were found
+	auto registration_index = [&] (ServerActiveObject *obj) {
+		return std::find(objs.begin(), objs.end(), obj) - objs.begin();
+	};
+	for (size_t i = 1; i < result.size(); i++)
+		UASSERT(registration_index(result[i - 1]) < registration_index(result[i]));
+
+	result.clear();
+	saomgr.getObjectsInArea(aabb3f(-10, -10, -10, 110, 10, 110), result, nullptr);
+	UASSERTCMP(size_t, ==, result.size(), 4);
+
+	// Move an object far away, the index must follow it
+	ServerActiveObject *moved = objs.front();
+	v3f old_pos = moved->getBasePosition();
+	moved->setBasePosition(v3f(3000, 3000, 3000));
+	saomgr.updateObjectPosition(moved);
+
+	result.clear();
+	saomgr.getObjectsInsideRadius(old_pos, 50, result, nullptr);
+	UASSERTCMP(size_t, ==, result.size(), 0);
+
+	result.clear();
+	saomgr.getObjectsInsideRadius(v3f(3000, 3000, 3000), 50, result, nullptr);
+	UASSERTCMP(size_t, ==, result.size(), 1);
+	UASSERT(result[0] == moved);
+
+	std::queue<u16> added;
+	std::set<u16> cur_objects;
+	saomgr.getAddedActiveObjectsAroundPos(v3f(3000, 3000, 3000), 50, 0,
+			cur_objects, added);
+	UASSERTCMP(size_t, ==, added.size(), 1);
+	UASSERTCMP(u16, ==, added.front(), moved->getId());
+
+	// Removed objects must vanish from the index
+	u16 id = moved->getId();
+	saomgr.removeObject(id);
+	result.clear();
+	saomgr.getObjectsInsideRadius(v3f(3000, 3000, 3000), 50, result, nullptr);
+	UASSERTCMP(size_t, ==, result.size(), 0);
+
+	clearSAOMgr(&saomgr);
+	result.clear();
+	saomgr.getObjectsInsideRadius(v3f(), 50, result, nullptr);
+	UASSERTCMP(size_t, ==, result.size(), 0);
+}
+
+void TestServerActiveObjectMgr::testStepModification()
+{
+	server::ActiveObjectMgr saomgr;
+	std::vector<u16> ids;
+	for (int i = 0; i < 40; i++) {
+		auto sao = new MockServerActiveObject();
+		UASSERT(saomgr.registerObject(sao));
+		ids.push_back(sao->getId());
+	}
+
+	// Remove every other object and add new ones while stepping
+	std::vector<u16> visited, added;
+	saomgr.step(0.0f, [&] (ServerActiveObject *obj) {
+		u16 id = obj->getId();
+		visited.push_back(id);
+		if (visited.size() > ids.size())
+			return;
+		size_t i = std::find(ids.begin(), ids.end(), id) - ids.begin();
+		if (i + 1 < ids.size() && i % 2 == 0)
+			saomgr.removeObject(ids[i + 1]);
+		auto sao = new MockServerActiveObject();
+		UASSERT(saomgr.registerObject(sao));
+		added.push_back(sao->getId());
+	});
+
+	// Removed objects were skipped, added ones visited after the others
+	std::vector<u16> expected;
+	for (size_t i = 0; i < ids.size(); i += 2)
+		expected.push_back(ids[i]);
+	expected.insert(expected.end(), added.begin(), added.end());
+	UASSERT(visited == expected);
+	UASSERTCMP(size_t, ==, saomgr.m_active_objects.size(), expected.size());
+
+	for (u16 id : expected)
+		UASSERT(saomgr.getActiveObject(id) && saomgr.getActiveObject(id)->getId() == id);
+	for (size_t i = 1; i < ids.size(); i += 2)
+		UASSERT(!saomgr.getActiveObject(ids[i]));
+
+	// Order stays the same after holes have been closed
+	visited.clear();
+	saomgr.step(0.0f, [&] (ServerActiveObject *obj) {
+		visited.push_back(obj->getId());
+	});
+	UASSERT(visited == expected);
+
+	clearSAOMgr(&saomgr);
+	UASSERTCMP(size_t, ==, saomgr.m_active_objects.size(), 0);
+}
@@ -37,6 +37,7 @@ class TestSocket : public TestBase {
 
 	void testIPv4Socket();
 	void testIPv6Socket();
+	void testBatchIO();
 
 	static const int port = 30003;
 };
@@ -46,6 +47,7 @@ static TestSocket g_test_instance;
 void TestSocket::runTests(IGameDef *gamedef)
 {
 	TEST(testIPv4Socket);
+	TEST(testBatchIO);
 
 	if (g_settings->getBool("enable_ipv6"))
 		TEST(testIPv6Socket);
@@ -147,3 +149,37 @@ void TestSocket::testIPv6Socket()
 				Address(&bytes, 0).getAddress6().s6_addr, 16) == 0);
 	}
 }
+
+void TestSocket::testBatchIO()
+{
+	UDPSocket socket(false);
+	socket.Bind(Address(0, 0, 0, 0, port));
+	socket.setTimeoutMs(100);
+
+	const Address destination(127, 0, 0, 1, port);
+	const int count = 5;
+	for (u8 i = 0; i < count; i++) {
+		u8 data[3] = { i, 42, i };
+		socket.QueueSend(destination, data, sizeof(data));
+	}
+	UASSERTEQ(u32, socket.FlushSend(), 0);
+
+	UDPSocket::ReceivedPacket packets[UDPSocket::MAX_BATCH_SIZE];
+	int received = 0;
+	while (received < count) {
+		int n = socket.ReceiveBatch(&packets[received],
+			UDPSocket::MAX_BATCH_SIZE - received, 256);
+		if (n == 0)
+			break;
+		// Data of earlier calls is invalidated, check it right away
+		for (int i = received; i < received + n; i++) {
+			UASSERTEQ(int, packets[i].size, 3);
+			UASSERTEQ(int, packets[i].data[0], i);
+			UASSERTEQ(int, packets[i].data[1], 42);
+			UASSERT(packets[i].sender.getAddress().s_addr ==
+				destination.getAddress().s_addr);
+		}
+		received += n;
+	}
+	UASSERTEQ(int, received, count);
+}
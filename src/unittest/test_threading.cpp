@@ -20,8 +20,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "test.h"
 
 #include <atomic>
+#include <thread>
 #include "threading/semaphore.h"
 #include "threading/thread.h"
+#include "threading/thread_pool.h"
 
 
 class TestThreading : public TestBase {
@@ -32,6 +34,7 @@ class TestThreading : public TestBase {
 
 	void testStartStopWait();
 	void testAtomicSemaphoreThread();
+	void testThreadPool();
 };
 
 static TestThreading g_test_instance;
@@ -40,6 +43,7 @@ void TestThreading::runTests(IGameDef *gamedef)
 {
 	TEST(testStartStopWait);
 	TEST(testAtomicSemaphoreThread);
+	TEST(testThreadPool);
 }
 
 class SimpleTestThread : public Thread {
@@ -156,3 +160,43 @@ void TestThreading::testAtomicSemaphoreThread()
 	UASSERT(val == num_threads * 0x10000);
 }
 
+
+
+void TestThreading::testThreadPool()
+{
+	ThreadPool pool("TestPool", 3);
+	UASSERTEQ(unsigned int, pool.getThreadCount(), 3);
+
+	std::vector<u32> results(1000, 0);
+	std::atomic<u32> calls(0);
+
+	// Run a few batches in a row to make sure the pool can be reused
+	for (u32 round = 1; round <= 10; round++) {
+		pool.run(results.size(), [&] (size_t i) {
+			results[i] += round;
+			calls++;
+		});
+	}
+
+	UASSERTEQ(u32, calls, 10 * results.size());
+	for (u32 r : results)
+		UASSERTEQ(u32, r, 55);
+
+	// empty and single item batches
+	pool.run(0, [&] (size_t i) { UASSERT(false); });
+	pool.run(1, [&] (size_t i) { calls++; });
+	UASSERTEQ(u32, calls, 10 * results.size() + 1);
+
+	// Nested batches and batches from several threads at once are processed
+	// by the calling thread while the workers are busy
+	std::atomic<u32> nested_calls(0);
+	auto nested = [&] () {
+		pool.run(20, [&] (size_t i) {
+			pool.run(10, [&] (size_t j) { nested_calls++; });
+		});
+	};
+	std::thread other(nested);
+	nested();
+	other.join();
+	UASSERTEQ(u32, nested_calls, 2 * 20 * 10);
+}
@@ -34,6 +34,7 @@ class TestVoxelAlgorithms : public TestBase {
 
 	void testVoxelLineIterator();
 	void testLighting(IGameDef *gamedef);
+	void testLightingVManipBorder(IGameDef *gamedef);
 };
 
 static TestVoxelAlgorithms g_test_instance;
@@ -42,6 +43,7 @@ void TestVoxelAlgorithms::runTests(IGameDef *gamedef)
 {
 	TEST(testVoxelLineIterator);
 	TEST(testLighting, gamedef);
+	TEST(testLightingVManipBorder, gamedef);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -169,3 +171,63 @@ void TestVoxelAlgorithms::testLighting(IGameDef *gamedef)
 		UASSERTEQ(int, n.getParam1(), 153);
 	}
 }
+
+void TestVoxelAlgorithms::testLightingVManipBorder(IGameDef *gamedef)
+{
+	v3s16 bpmin(-2, -2, -2), bpmax(1, 1, 1);
+	DummyMap map(gamedef, bpmin, bpmax);
+	const NodeDefManager *ndef = gamedef->ndef();
+
+	auto check_light = [&] (v3s16 p, int expected) {
+		MapNode n = map.getNode(p);
+		ContentLightingFlags f = ndef->getLightingFlags(n);
+		UASSERTEQ(int, n.getLight(LIGHTBANK_DAY, f), expected);
+		UASSERTEQ(int, n.getLight(LIGHTBANK_NIGHT, f), expected);
+	};
+
+	// Solid stone with a dark tunnel along the X axis
+	{
+		std::map<v3s16, MapBlock*> modified_blocks;
+		MMVManip vm(&map);
+		vm.initialEmerge(bpmin, bpmax, false);
+		s32 volume = vm.m_area.getVolume();
+		for (s32 i = 0; i < volume; i++)
+			vm.m_data[i] = MapNode(t_CONTENT_STONE);
+		for (s16 x = -20; x <= 20; x++)
+			vm.setNodeNoEmerge(v3s16(x, 0, 0), MapNode(CONTENT_AIR));
+		voxalgo::blit_back_with_light(&map, &vm, &modified_blocks);
+	}
+	check_light(v3s16(0, 0, 0), 0);
+
+	// Light spreads out of a manipulator that covers one block
+	auto set_in_block = [&] (v3s16 p, MapNode n) {
+		std::map<v3s16, MapBlock*> modified_blocks;
+		MMVManip vm(&map);
+		vm.initialEmerge(v3s16(0, 0, 0), v3s16(0, 0, 0), false);
+		vm.setNodeNoEmerge(p, n);
+		voxalgo::blit_back_with_light(&map, &vm, &modified_blocks);
+	};
+	set_in_block(v3s16(14, 0, 0), MapNode(t_CONTENT_TORCH));
+	check_light(v3s16(14, 0, 0), LIGHT_MAX - 1);
+	check_light(v3s16(10, 0, 0), LIGHT_MAX - 5);
+	check_light(v3s16(3, 0, 0), LIGHT_MAX - 12);
+	check_light(v3s16(17, 0, 0), LIGHT_MAX - 4);
+	check_light(v3s16(20, 0, 0), LIGHT_MAX - 7);
+
+	// And is removed outside of it
+	set_in_block(v3s16(14, 0, 0), MapNode(CONTENT_AIR));
+	check_light(v3s16(10, 0, 0), 0);
+	check_light(v3s16(17, 0, 0), 0);
+
+	// Light from outside spreads into it
+	{
+		std::map<v3s16, MapBlock*> modified_blocks;
+		map.addNodeAndUpdate(v3s16(-5, 0, 0), MapNode(t_CONTENT_TORCH), modified_blocks);
+	}
+	check_light(v3s16(3, 0, 0), LIGHT_MAX - 9);
+	set_in_block(v3s16(8, 0, 0), MapNode(CONTENT_AIR));
+	check_light(v3s16(0, 0, 0), LIGHT_MAX - 6);
+	check_light(v3s16(3, 0, 0), LIGHT_MAX - 9);
+	check_light(v3s16(7, 0, 0), LIGHT_MAX - 13);
+	check_light(v3s16(8, 0, 0), 0);
+}
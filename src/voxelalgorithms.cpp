@@ -937,6 +937,126 @@ const VoxelArea block_pad[] = {
 	VoxelArea(v3s16(0, 0, 0), v3s16(0, 15, 15))    //X-
 };
 
+//! The whole map block in relative node coordinates.
+const VoxelArea block_full(v3s16(0, 0, 0), v3s16(15, 15, 15));
+
+//! Some nodes of a map block.
+struct BlockArea {
+	MapBlock *block;
+	//! In relative node coordinates.
+	VoxelArea area;
+};
+
+/*!
+ * Spreads light inside a voxel manipulator, in both light banks, as if
+ * everything around it was dark.
+ * Works on flat arrays in the voxel manipulator's index order instead of
+ * on map blocks, so it is much faster than spread_light() for big areas.
+ * Before calling this, the sunlight must be filled in with
+ * fill_with_sunlight().
+ *
+ * \param written_blocks area of the voxel manipulator in block
+ * coordinates
+ * \param written written[i] is true if the block with index i in
+ * written_blocks will be copied to the map. Other blocks are treated as
+ * solid and are not modified.
+ */
+void spread_light_in_vmanip(MMVManip *vm, const NodeDefManager *ndef,
+	const VoxelArea &written_blocks, const std::vector<bool> &written)
+{
+	const VoxelArea &area = vm->m_area;
+	const v3s16 &extent = area.getExtent();
+	const s32 volume = area.getVolume();
+	// Index offset of the neighbor in each direction
+	const s32 ystride = extent.X;
+	const s32 zstride = extent.X * extent.Y;
+	const s32 index_step[6] = { 1, ystride, zstride, -zstride, -ystride, -1 };
+
+	// The lower six bits tell if the node is on the edge of the area
+	// in the given direction.
+	const u8 NODE_PROPAGATES = 1 << 6;
+	const u8 NODE_WRITTEN = 1 << 7;
+	std::vector<u8> node_flags(volume);
+	std::vector<u8> light[2] = { std::vector<u8>(volume), std::vector<u8>(volume) };
+	// Indices of the nodes to spread from, by light level
+	std::vector<s32> queue[2][LIGHT_SUN + 1];
+
+	// --- STEP 1: Find the light sources, in index order
+
+	s32 i = 0;
+	v3s16 p;
+	for (p.Z = area.MinEdge.Z; p.Z <= area.MaxEdge.Z; p.Z++)
+	for (p.Y = area.MinEdge.Y; p.Y <= area.MaxEdge.Y; p.Y++)
+	for (p.X = area.MinEdge.X; p.X <= area.MaxEdge.X; p.X++, i++) {
+		if (vm->m_flags[i] & VOXELFLAG_NO_DATA)
+			continue;
+		if (!written[written_blocks.index(getNodeBlockPos(p))])
+			continue;
+		const MapNode &n = vm->m_data[i];
+		ContentLightingFlags f = ndef->getLightingFlags(n);
+		u8 flags = NODE_WRITTEN;
+		if (f.light_propagates)
+			flags |= NODE_PROPAGATES;
+		flags |= (p.X == area.MaxEdge.X) << 0;
+		flags |= (p.Y == area.MaxEdge.Y) << 1;
+		flags |= (p.Z == area.MaxEdge.Z) << 2;
+		flags |= (p.Z == area.MinEdge.Z) << 3;
+		flags |= (p.Y == area.MinEdge.Y) << 4;
+		flags |= (p.X == area.MinEdge.X) << 5;
+		node_flags[i] = flags;
+		for (size_t b = 0; b < 2; b++) {
+			u8 l = f.has_light ? n.getLight(banks[b], f) : f.light_source;
+			light[b][i] = l;
+			if (l > 1)
+				queue[b][l].push_back(i);
+		}
+	}
+
+	// --- STEP 2: Spread, brightest first
+
+	for (size_t b = 0; b < 2; b++) {
+		u8 *bank_light = light[b].data();
+		for (u8 level = LIGHT_SUN; level > 1; level--) {
+			const u8 spreading_light = level - 1;
+			// Lights are only added to the next level's queue, so this
+			// one does not change while it is processed.
+			const std::vector<s32> &current = queue[b][level];
+			std::vector<s32> &next = queue[b][spreading_light];
+			for (s32 index : current) {
+				// Got brighter since it was queued
+				if (bank_light[index] != level)
+					continue;
+				const u8 flags = node_flags[index];
+				for (direction d = 0; d < 6; d++) {
+					if (flags & (1 << d))
+						continue;
+					s32 neighbor = index + index_step[d];
+					if ((node_flags[neighbor] & NODE_PROPAGATES) &&
+							bank_light[neighbor] < spreading_light) {
+						bank_light[neighbor] = spreading_light;
+						if (spreading_light > 1)
+							next.push_back(neighbor);
+					}
+				}
+			}
+			queue[b][level].clear();
+		}
+	}
+
+	// --- STEP 3: Store the light in the nodes
+
+	for (i = 0; i < volume; i++) {
+		if (!(node_flags[i] & NODE_WRITTEN))
+			continue;
+		MapNode &n = vm->m_data[i];
+		ContentLightingFlags f = ndef->getLightingFlags(n);
+		if (!f.has_light)
+			continue;
+		n.setLight(LIGHTBANK_DAY, light[0][i], f);
+		n.setLight(LIGHTBANK_NIGHT, light[1][i], f);
+	}
+}
+
 /*!
  * The common part of bulk light updates - it is always executed.
  * The procedure takes the nodes that should be unlit, and the
@@ -945,10 +1065,9 @@ const VoxelArea block_pad[] = {
  * The procedure handles the correction of all lighting except
  * direct sunlight spreading.
  *
- * \param minblock least coordinates of the changed area in block
- * coordinates
- * \param maxblock greatest coordinates of the changed area in block
- * coordinates
+ * \param source_areas the nodes in these areas are spread from after
+ * unlighting. Must cover all nodes whose light is not yet known to be
+ * spread to their neighbors.
  * \param unlight the first queue is for day light, the second is for
  * night light. Contains all nodes on the borders that need to be unlit.
  * \param relight the first queue is for day light, the second is for
@@ -957,8 +1076,9 @@ const VoxelArea block_pad[] = {
  * \param modified_blocks the procedure adds all modified blocks to
  * this map
  */
-void finish_bulk_light_update(Map *map, mapblock_v3 minblock,
-	mapblock_v3 maxblock, UnlightQueue unlight[2], ReLightQueue relight[2],
+void finish_bulk_light_update(Map *map,
+	const std::vector<BlockArea> &source_areas,
+	UnlightQueue unlight[2], ReLightQueue relight[2],
 	std::map<v3s16, MapBlock*> *modified_blocks)
 {
 	const NodeDefManager *ndef = map->getNodeDefManager();
@@ -973,20 +1093,16 @@ void finish_bulk_light_update(Map *map, mapblock_v3 minblock,
 
 	// --- STEP 2: Get all newly inserted light sources
 
-	// For each block:
-	v3s16 blockpos;
+	// For each area:
 	v3s16 relpos;
-	for (blockpos.X = minblock.X; blockpos.X <= maxblock.X; blockpos.X++)
-	for (blockpos.Y = minblock.Y; blockpos.Y <= maxblock.Y; blockpos.Y++)
-	for (blockpos.Z = minblock.Z; blockpos.Z <= maxblock.Z; blockpos.Z++) {
-		MapBlock *block = map->getBlockNoCreateNoEx(blockpos);
-		if (!block)
-			// Skip not existing blocks
-			continue;
-		// For each node in the block:
-		for (relpos.X = 0; relpos.X < MAP_BLOCKSIZE; relpos.X++)
-		for (relpos.Z = 0; relpos.Z < MAP_BLOCKSIZE; relpos.Z++)
-		for (relpos.Y = 0; relpos.Y < MAP_BLOCKSIZE; relpos.Y++) {
+	for (const BlockArea &source : source_areas) {
+		MapBlock *block = source.block;
+		const VoxelArea &a = source.area;
+		v3s16 blockpos = block->getPos();
+		// For each node in the area:
+		for (relpos.X = a.MinEdge.X; relpos.X <= a.MaxEdge.X; relpos.X++)
+		for (relpos.Z = a.MinEdge.Z; relpos.Z <= a.MaxEdge.Z; relpos.Z++)
+		for (relpos.Y = a.MinEdge.Y; relpos.Y <= a.MaxEdge.Y; relpos.Y++) {
 			MapNode node = block->getNodeNoCheck(relpos.X, relpos.Y, relpos.Z);
 			ContentLightingFlags f = ndef->getLightingFlags(node);
 
@@ -1000,7 +1116,7 @@ void finish_bulk_light_update(Map *map, mapblock_v3 minblock,
 					relight[b].push(light, relpos, blockpos, block, 6);
 			} // end of banks
 		} // end of nodes
-	} // end of blocks
+	} // end of areas
 
 	// --- STEP 3: do light spreading
 
@@ -1067,8 +1183,33 @@ void blit_back_with_light(Map *map, MMVManip *vm,
 		}
 	}
 
-	// --- STEP 2: Get nodes from borders to unlight
+	// --- STEP 2: Spread light inside the voxel manipulator
+
+	// The blocks that blitBackAll() will overwrite.
+	VoxelArea written_blocks(minblock, maxblock);
+	std::vector<bool> written(written_blocks.getVolume());
 	v3s16 blockpos;
+	for (blockpos.Z = minblock.Z; blockpos.Z <= maxblock.Z; blockpos.Z++)
+	for (blockpos.Y = minblock.Y; blockpos.Y <= maxblock.Y; blockpos.Y++)
+	for (blockpos.X = minblock.X; blockpos.X <= maxblock.X; blockpos.X++) {
+		s32 i = vm->m_area.index(blockpos * MAP_BLOCKSIZE);
+		written[written_blocks.index(blockpos)] =
+			!(vm->m_flags[i] & VOXELFLAG_NO_DATA) &&
+			map->getBlockNoCreateNoEx(blockpos);
+	}
+	auto is_written = [&] (v3s16 blockpos) -> bool {
+		return written_blocks.contains(blockpos) &&
+			written[written_blocks.index(blockpos)];
+	};
+
+	spread_light_in_vmanip(vm, ndef, written_blocks, written);
+
+	// --- STEP 3: Get nodes from borders to unlight
+
+	// Light is already correct between two written blocks, so only the
+	// other borders need to be updated on the map. These are also where
+	// the light spreads out of the voxel manipulator.
+	std::vector<BlockArea> source_areas;
 	v3s16 relpos;
 
 	// In case there are unloaded holes in the voxel manipulator
@@ -1081,9 +1222,18 @@ void blit_back_with_light(Map *map, MMVManip *vm,
 		if (!block)
 			// Skip not existing blocks.
 			continue;
+		bool block_written = is_written(blockpos);
+		if (!block_written)
+			source_areas.push_back({block, block_full});
 		v3s16 offset = block->getPosRelative();
 		// For each border of the block:
-		for (const VoxelArea &a : block_pad) {
+		for (direction d = 0; d < 6; d++) {
+			if (block_written) {
+				if (is_written(blockpos + neighbor_dirs[d]))
+					continue;
+				source_areas.push_back({block, block_pad[d]});
+			}
+			const VoxelArea &a = block_pad[d];
 			// For each node of the border:
 			for (relpos.X = a.MinEdge.X; relpos.X <= a.MaxEdge.X; relpos.X++)
 			for (relpos.Z = a.MinEdge.Z; relpos.Z <= a.MaxEdge.Z; relpos.Z++)
@@ -1114,13 +1264,13 @@ void blit_back_with_light(Map *map, MMVManip *vm,
 		} // end of borders
 	} // end of blocks
 
-	// --- STEP 3: All information extracted, overwrite
+	// --- STEP 4: All information extracted, overwrite
 
 	vm->blitBackAll(modified_blocks, true);
 
-	// --- STEP 4: Finish light update
+	// --- STEP 5: Finish light update
 
-	finish_bulk_light_update(map, minblock, maxblock, unlight, relight,
+	finish_bulk_light_update(map, source_areas, unlight, relight,
 		modified_blocks);
 }
 
@@ -1233,7 +1383,7 @@ void repair_block_light(Map *map, MapBlock *block,
 
 	// STEP 3: Remove and spread light
 
-	finish_bulk_light_update(map, blockpos, blockpos, unlight, relight,
+	finish_bulk_light_update(map, {{block, block_full}}, unlight, relight,
 		modified_blocks);
 }
 